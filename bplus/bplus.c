@@ -1,506 +1,7676 @@
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-#define ORDER 4
-#define MAX_KEYS (2 * ORDER - 1)
-#define MAX_CHILDREN (2 * ORDER)
-#define NODE_BUFFER_SIZE 4096
+#include <linux/memfd.h>
 
-struct bplus_node_disk {
-    char buf[NODE_BUFFER_SIZE];
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#ifdef BPLUS_HAVE_URING
+#include <liburing.h>
+#endif
+
+#include "../pthreads/taskpool.c"
+
+// every node occupies exactly one page on disk and in the buffer pool. build
+// with -DBPLUS_PAGE_SIZE=8192 or 16384 for bigger nodes.
+#ifndef BPLUS_PAGE_SIZE
+#define BPLUS_PAGE_SIZE 4096
+#endif
+
+#if BPLUS_PAGE_SIZE != 4096 && BPLUS_PAGE_SIZE != 8192 &&                      \
+    BPLUS_PAGE_SIZE != 16384
+#error "BPLUS_PAGE_SIZE must be 4096, 8192 or 16384"
+#endif
+
+#define BPLUS_PAGE_HEADER_SIZE 40
+
+// bumped whenever the layout of pages or the header changes
+#define BPLUS_FORMAT_VERSION 3
+// bytes shared by the slot directory and the heap
+#define BPLUS_NODE_CAPACITY (BPLUS_PAGE_SIZE - BPLUS_PAGE_HEADER_SIZE)
+
+// number of page frames the buffer pool keeps in memory by default
+#define BPLUS_DEFAULT_FRAMES 1024
+// a root-to-leaf path plus a split must always fit in the pool
+#define BPLUS_MIN_FRAMES 8
+#define BPLUS_INVALID_PAGE UINT32_MAX
 
-    uint16_t key_offsets[MAX_KEYS];
-    uint16_t key_lengths[MAX_KEYS];
-    uint16_t value_offsets[MAX_KEYS];
-    uint16_t value_lengths[MAX_KEYS];
+// compare the fixed-width key heads stored in each slot before falling back to
+// the full key in the heap. build with -DBPLUS_KEY_HEADS=0 to disable.
+#ifndef BPLUS_KEY_HEADS
+#define BPLUS_KEY_HEADS 1
+#endif
 
-    int num_keys;
-    uint16_t buffer_position;
-    int is_leaf;
+#ifdef BPLUS_DEBUG
+#define bplus_debug(...) printf(__VA_ARGS__)
+#else
+#define bplus_debug(...)                                                       \
+    do {                                                                       \
+    } while (0)
+#endif
 
-    uint32_t children[MAX_CHILDREN];
+struct bplus_slot {
+    uint16_t offset; // heap offset of the key, the value follows it
+    uint16_t key_len;
+    uint16_t val_len;
+    uint16_t flags;
+    uint32_t head; // first 4 key bytes, big endian
+};
+
+#define BPLUS_MAX_SLOTS (BPLUS_NODE_CAPACITY / sizeof(struct bplus_slot))
+
+// the slot's value is a bplus_overflow_ref to pages holding the real value
+#define BPLUS_SLOT_OVERFLOW 0x1
+
+// what a page holds, kept in its header
+#define BPLUS_PAGE_NODE 0
+#define BPLUS_PAGE_OVERFLOW 1
+
+// slotted page: the slot directory grows up from the start of buf and the
+// key/value heap grows down from its end, so the number of keys is bounded
+// only by space. internal nodes store each child page_id as the value of the
+// slot holding its separator (keys <= separator), and the child for keys
+// greater than every separator in last_child. leaves are chained to their
+// siblings through next and prev for range scans.
+struct bplus_node_disk {
+    uint32_t checksum; // crc32c of the rest of the page, set when written
+    uint16_t version;  // BPLUS_FORMAT_VERSION
+    uint16_t kind;     // BPLUS_PAGE_*
+    uint64_t lsn; // last logged change to an entry in this page
     uint32_t page_id;
+    uint32_t last_child;
+    uint32_t next; // right sibling leaf
+    uint32_t prev; // left sibling leaf
+    uint16_t num_keys;
+    uint16_t is_leaf;
+    uint16_t heap_start; // lowest heap offset in use
+    uint16_t dead_bytes; // heap bytes no slot points at, freed by compaction
+
+    union {
+        struct bplus_slot slots[BPLUS_MAX_SLOTS];
+        char buf[BPLUS_NODE_CAPACITY];
+    };
 };
 
+_Static_assert(
+    offsetof(struct bplus_node_disk, buf) == BPLUS_PAGE_HEADER_SIZE,
+    "page header size mismatch");
+_Static_assert(
+    sizeof(struct bplus_node_disk) == BPLUS_PAGE_SIZE,
+    "a node must fill exactly one page");
+
+// an entry larger than this could leave a split half without room for it.
+// keys are also stored as separators next to a 4 byte child page_id.
+#define BPLUS_MAX_ENTRY_SIZE                                                   \
+    (BPLUS_NODE_CAPACITY / 4 - (int)sizeof(struct bplus_slot))
+#define BPLUS_MAX_KEY_SIZE (BPLUS_MAX_ENTRY_SIZE - (int)sizeof(uint32_t))
+
+// values longer than this are moved out of the leaf into a chain of overflow
+// pages, so leaves keep a useful number of entries. build with
+// -DBPLUS_MAX_INLINE_VALUE=n to change it.
+#ifndef BPLUS_MAX_INLINE_VALUE
+#define BPLUS_MAX_INLINE_VALUE (BPLUS_NODE_CAPACITY / 8)
+#endif
+#define BPLUS_MAX_VALUE_SIZE (1 << 30)
+
+// stands in for a value in its leaf. overflow pages carry a chunk of the
+// value at the end of their heap and are chained through next, so a chain is
+// only ever reachable from the one leaf entry.
+struct bplus_overflow_ref {
+    uint32_t len; // of the whole value
+    uint32_t first_page;
+};
+
+// a value on its way into a leaf. when it is too large to keep inline it is
+// written to overflow pages first and the leaf stores ref. the log always
+// records the value itself.
+struct bplus_value {
+    char *data;
+    int len;
+    int overflow; // ref is stored in place of data
+    struct bplus_overflow_ref ref;
+};
+
+// in-memory view of a page. frame bookkeeping (pins, dirty bits) lives in the
+// buffer pool, so a node is only ever valid while it is pinned.
 struct bplus_node {
     struct bplus_node_disk disk;
+};
 
-    struct bplus_node *children[MAX_CHILDREN];
-    struct bplus_node *next;
-
-    int dirty;
+// where a key is or would go in a node
+struct bplus_insert_index {
+    int pos;
+    int found;
 };
 
+// the header gets the first page of the file to itself so every node page
+// stays page aligned. freed pages are chained through their next pointers,
+// most recently freed first.
 struct bplus_disk_header {
+    uint32_t checksum; // crc32c of the rest of the header
+    uint32_t version;  // BPLUS_FORMAT_VERSION
     uint32_t root_page_id;
+    uint32_t page_size;
+    uint32_t height;
+    uint32_t num_free;       // pages on the free list
+    uint64_t checkpoint_lsn; // log records up to here are in the page file
+    uint32_t free_head;      // first free page, if num_free isn't 0
+    uint32_t flags;          // BPLUS_HEADER_*
+    char key_order[16];      // name of the bplus_key_ops the tree sorts by
+};
+
+// pages are stored compressed, see bplus_extent_table
+#define BPLUS_HEADER_COMPRESSED 0x1
+
+// frames are shared between threads. page_id changes only while the pool
+// lock is held and the frame is claimed (pin_count -1), so anyone who pins a
+// frame sees a stable page_id. the page contents are guarded by latch.
+struct bplus_frame {
+    uint32_t page_id; // BPLUS_INVALID_PAGE when the frame is empty
+    int pin_count;    // -1 while the pool is loading or evicting the frame
+    int dirty;
+    int dirty_slot; // index in the pool's dirty set while dirty
+    int referenced; // CLOCK second-chance bit
+    pthread_rwlock_t latch;
+};
+
+// a page as it was before the first change to it after snapshot epoch was
+// taken. a snapshot reads the oldest version newer than itself, or the live
+// page if there is none.
+struct bplus_page_version {
+    uint64_t epoch;
+    uint64_t retired; // newest snapshot when it was unlinked from its chain
+    struct bplus_page_version *older;
+    struct bplus_node_disk disk;
+};
+
+// the versions kept of one page, newest first. writers push onto newest
+// with a CAS and snapshot readers walk the chain without a lock.
+struct bplus_version_chain {
+    struct bplus_page_version *newest;
+    uint64_t epoch; // of the last image pushed, only used under write latch
+};
+
+// a chain for every page the newest snapshot can see. a snapshot that sees
+// more pages gets a new table rather than a resized one, since readers of
+// older snapshots may still be looking at the old table.
+struct bplus_version_table {
+    uint32_t len;
+    struct bplus_version_table *replaced; // kept until every snapshot goes
+    struct bplus_version_chain chains[];
+};
+
+struct bplus_snapshot;
+
+struct bplus_buffer_pool_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t reads;
+    uint64_t writes;
+    // compressed files only
+    uint64_t compressed_pages; // pages written
+    uint64_t compressed_bytes; // bytes those pages took in the file
+    uint64_t compress_ns;
+    uint64_t decompress_ns;
+    uint64_t versions; // page images copied aside for snapshots
+    uint64_t recoveries; // shared pools cleaned up after a dead process
+};
+
+struct bplus_buffer_pool;
+struct bplus_extent_table;
+struct bplus_key_ops;
+
+// one page sized transfer between a buffer and the page file
+struct bplus_io_req {
+    uint32_t page_id;
+    void *buf;
+};
+
+// flags for bplus_io_ops.open
+#define BPLUS_IO_REGISTER_BUFFERS 0x1 // pin the frame memory in the kernel
+#define BPLUS_IO_FIXED_FILE 0x2       // register the page file descriptor
+
+// page I/O backend used by the buffer pool. read and write transfer a batch
+// of pages and return 0 only if every page moved in full.
+struct bplus_io_ops {
+    const char *name;
+    int (*open)(struct bplus_buffer_pool *pool, int flags);
+    int (*read)(
+        struct bplus_buffer_pool *pool, struct bplus_io_req *reqs, int n);
+    int (*write)(
+        struct bplus_buffer_pool *pool, struct bplus_io_req *reqs, int n);
+    void (*close)(struct bplus_buffer_pool *pool);
+};
+
+// one anonymous mapping the buffer pool carves all of its per-frame memory
+// out of, so a pool costs a single mmap and is torn down with one munmap.
+// with huge pages the page images need far fewer TLB entries.
+struct bplus_arena {
+    char *base;
+    size_t len;
+    size_t used;
+    int huge; // backed by reserved huge pages rather than transparent ones
 };
 
+#define BPLUS_HUGE_PAGE_SIZE (2 << 20)
+
 struct bplus_buffer_pool {
     int fd; // file descriptor
-    uint32_t next_page_id;
-    struct bplus_node *pages[1024];
+    uint32_t next_page_id; // allocated with atomic increments
+
+    // held for misses, eviction and flushing. hits only touch the table and
+    // the frame's pin count.
+    pthread_mutex_t lock;
+
+    const struct bplus_io_ops *io;
+    void *io_ctx; // backend private state
+
+    // nodes[i] holds the page described by frames[i]. both live in arena,
+    // along with table.
+    struct bplus_arena arena;
+    struct bplus_node *nodes;
+    struct bplus_frame *frames;
+    int num_frames;
     int num_cached;
+    int clock_hand;
+
+    // open addressing page_id -> frame index, -1 marks an empty slot.
+    // written under lock, read without it: a lookup that races with a
+    // removal can miss or land on a reused frame, so hits are validated
+    // after pinning and misses retried under the lock.
+    int32_t *table;
+    uint32_t table_mask;
+
+    // frames holding dirty pages, in no particular order, so a flush costs
+    // as much as there are dirty pages rather than frames. num_dirty is the
+    // size of the set and may be read without dirty_lock.
+    pthread_mutex_t dirty_lock;
+    int32_t *dirty_set;
+    int num_dirty;
+    // stack of pages freed by merges, the next one to reuse at the end.
+    // guarded by lock.
+    uint32_t *free_pages;
+    uint32_t num_free;
+    uint32_t free_cap;
+
+    // never write a dirty page back on eviction. set while a write-ahead log
+    // is attached, so the page file only changes at checkpoints.
+    int no_steal;
+
+    // set in read-only mmap mode: pages are used straight from the mapping
+    // and there are no frames, pins or dirty pages
+    char *map;
+    size_t map_len;
+
+    // set when the pool, this struct included, lives in memory shared with
+    // processes forked after it was created. such a pool is read-only, and
+    // only owner, the process that created it, tears it down.
+    int shared;
+    pid_t owner;
+
+    // set for compressed files. pages then move through the extent table
+    // with pread and pwrite rather than the io backend.
+    struct bplus_extent_table *extents;
+
+    // order of the keys in every node, fixed when the file is created
+    const struct bplus_key_ops *keys;
+
+    // images of pages as open snapshots see them, see bplus_tree_snapshot.
+    // snap_lock is only taken to take and release snapshots. writers and
+    // snapshot readers use versions without it, and snap_epoch is 0 while
+    // no snapshot is open.
+    pthread_mutex_t snap_lock;
+    uint64_t snap_epoch; // the newest open snapshot
+    uint64_t last_epoch; // handed to the last snapshot taken
+    struct bplus_version_table *versions; // NULL while no snapshot is open
+    struct bplus_page_version *retired;   // unlinked, readers may be on them
+    struct bplus_snapshot *snapshots;     // open snapshots, oldest first
+
+    struct bplus_buffer_pool_stats stats;
+};
+
+// access pattern hints for bplus_tree_open_readonly
+#define BPLUS_ACCESS_NORMAL 0
+#define BPLUS_ACCESS_RANDOM 1
+#define BPLUS_ACCESS_SEQUENTIAL 2
+
+// write-ahead log durability modes
+#define BPLUS_WAL_OFF 0
+#define BPLUS_WAL_SYNC_COMMIT 1   // every commit waits for fdatasync
+#define BPLUS_WAL_SYNC_INTERVAL 2 // a background thread syncs periodically
+#define BPLUS_WAL_SYNC_NONE 3     // written when the buffer fills, never synced
+
+// how keys are ordered. compare must be a total order over the keys a tree
+// holds. head packs a key into 32 bits so that comparing heads as integers
+// agrees with compare whenever the heads differ, and may be NULL. search
+// may replace the binary search over a node's slots and is optional too.
+// key_size limits keys to one length, 0 allows any. name, up to 15 bytes,
+// is recorded in the file so a tree can't be opened with another order.
+struct bplus_key_ops {
+    const char *name;
+    int key_size;
+    int (*compare)(const char *a, int a_len, const char *b, int b_len);
+    uint32_t (*head)(const char *key, int key_len);
+    struct bplus_insert_index (*search)(
+        const struct bplus_key_ops *keys,
+        struct bplus_node *node,
+        const char *key,
+        int key_len);
+};
+
+struct bplus_tree_options {
+    int num_frames; // buffer pool budget in pages, 0 for the default
+    const struct bplus_io_ops *io; // page I/O backend, NULL for pread/pwrite
+    int io_flags;                  // BPLUS_IO_* hints for the backend
+    int wal_mode;                  // BPLUS_WAL_*, off by default
+    int wal_interval_ms;           // sync period for BPLUS_WAL_SYNC_INTERVAL
+    int huge_pages;                // back the buffer pool with huge pages
+    int compress; // store pages compressed. only applies to new files
+    const struct bplus_key_ops *keys; // key order, NULL for bytewise
+    // keep the buffer pool in shared memory so processes forked after the
+    // open read through one cache. the tree must exist and is read-only.
+    int shared;
 };
 
+struct bplus_wal;
+
 struct bplus_tree {
     struct bplus_buffer_pool *pool;
-    struct bplus_node *root;
+    struct bplus_node *root; // stays pinned for the lifetime of the tree
     int height;
+    struct bplus_wal *wal; // NULL unless a write-ahead log is attached
+    // guards root and height. held exclusively only by an insert that may
+    // split the root, and always taken before the root's own latch.
+    pthread_rwlock_t root_latch;
+    // inserts hold it shared, flushes and checkpoints exclusively so they
+    // never see a half finished split
+    pthread_rwlock_t lock;
 };
 
-struct bplus_buffer_pool *bplus_buffer_pool_init(const char *path) {
-    struct bplus_buffer_pool *pool = malloc(sizeof(struct bplus_buffer_pool));
+// CRC32C (Castagnoli), used to detect torn or corrupt log records and pages.
+// x86 CPUs with SSE4.2 compute it in hardware, eight bytes per instruction.
+uint32_t bplus_crc32c_table[256];
+pthread_once_t bplus_crc32c_once = PTHREAD_ONCE_INIT;
 
-    int f = open(path, O_CREAT | O_RDWR, 0644);
-    if (f < 0) {
-        perror("open buffer pool file");
-        free(pool);
-        return NULL;
+uint32_t bplus_crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = bplus_crc32c_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
     }
+    return ~crc;
+}
 
-    struct stat st = {0};
-    fstat(f, &st);
+uint32_t (*bplus_crc32c_impl)(uint32_t, const void *, size_t) =
+    bplus_crc32c_sw;
 
-    pool->fd = f;
-    if (st.st_size != 0) {
-        pool->next_page_id = (st.st_size - sizeof(struct bplus_disk_header)) /
-                             sizeof(struct bplus_node_disk);
-    } else {
-        pool->next_page_id = 0;
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t
+bplus_crc32c_sse42(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t c = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
     }
-    pool->num_cached = 0;
+    for (; len > 0; len--, p++) {
+        c = _mm_crc32_u8(c, *p);
+    }
+    return ~(uint32_t)c;
+}
+#endif
 
-    return pool;
+void bplus_crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+        bplus_crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        bplus_crc32c_impl = bplus_crc32c_sse42;
+    }
+#endif
 }
 
-int bplus_buffer_pool_get_offset(uint32_t page_id) {
-    return (page_id * sizeof(struct bplus_node_disk)) +
-           sizeof(struct bplus_disk_header);
+uint32_t bplus_crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&bplus_crc32c_once, bplus_crc32c_init);
+    return bplus_crc32c_impl(crc, buf, len);
 }
 
-struct bplus_node *
-bplus_buffer_pool_load(struct bplus_buffer_pool *pool, uint32_t page_id) {
-    int offset = bplus_buffer_pool_get_offset(page_id);
+// stamp a page with its checksum and format version just before it is
+// written. the checksum covers everything after itself.
+void bplus_page_seal(struct bplus_node_disk *disk) {
+    // the gap between slots and heap is free space. zeroing it keeps stored
+    // pages deterministic, and compressed pages leave it out altogether.
+    int slots = disk->num_keys * sizeof(struct bplus_slot);
+    memset(&disk->buf[slots], 0, disk->heap_start - slots);
+    disk->version = BPLUS_FORMAT_VERSION;
+    disk->checksum = bplus_crc32c(
+        0, (char *)disk + sizeof(disk->checksum),
+        BPLUS_PAGE_SIZE - sizeof(disk->checksum));
+}
 
-    // check if this page_id is in the file
-    struct stat st = {0};
-    fstat(pool->fd, &st);
-    if (st.st_size < (offset + sizeof(struct bplus_node_disk))) {
-        return NULL;
+// reasons bplus_page_verify rejects a page
+#define BPLUS_PAGE_OK 0
+#define BPLUS_PAGE_BAD_CHECKSUM 1
+#define BPLUS_PAGE_BAD_VERSION 2
+#define BPLUS_PAGE_MISPLACED 3 // a valid page, but not the one asked for
+
+const char *bplus_page_errors[] = {
+    "ok",
+    "checksum mismatch",
+    "unknown format version",
+    "holds another page",
+};
+
+// check a page just read from page_id's place in the file
+int bplus_page_verify(const struct bplus_node_disk *disk, uint32_t page_id) {
+    uint32_t crc = bplus_crc32c(
+        0, (const char *)disk + sizeof(disk->checksum),
+        BPLUS_PAGE_SIZE - sizeof(disk->checksum));
+    if (crc != disk->checksum) {
+        return BPLUS_PAGE_BAD_CHECKSUM;
+    }
+    if (disk->version != BPLUS_FORMAT_VERSION) {
+        return BPLUS_PAGE_BAD_VERSION;
+    }
+    if (disk->page_id != page_id) {
+        return BPLUS_PAGE_MISPLACED;
     }
+    return BPLUS_PAGE_OK;
+}
 
-    lseek(pool->fd, offset, 0);
+// the header is checksummed the same way
+void bplus_disk_header_seal(struct bplus_disk_header *header) {
+    header->version = BPLUS_FORMAT_VERSION;
+    header->checksum = bplus_crc32c(
+        0, (char *)header + sizeof(header->checksum),
+        sizeof(*header) - sizeof(header->checksum));
+}
 
-    struct bplus_node *node = malloc(sizeof(struct bplus_node));
-    int r = read(pool->fd, &node->disk, sizeof(struct bplus_node_disk));
-    if (r < sizeof(struct bplus_node_disk)) {
-        printf("failed to read? what do I do...\n");
-        return NULL;
+int bplus_disk_header_verify(const struct bplus_disk_header *header) {
+    uint32_t crc = bplus_crc32c(
+        0, (const char *)header + sizeof(header->checksum),
+        sizeof(*header) - sizeof(header->checksum));
+    if (crc != header->checksum) {
+        return BPLUS_PAGE_BAD_CHECKSUM;
+    }
+    if (header->version != BPLUS_FORMAT_VERSION) {
+        return BPLUS_PAGE_BAD_VERSION;
     }
+    return BPLUS_PAGE_OK;
+}
+
+off_t bplus_buffer_pool_get_offset(uint32_t page_id) {
+    return ((off_t)page_id + 1) * BPLUS_PAGE_SIZE;
+}
 
-    node->next = NULL;
-    node->dirty = 0;
+// baseline backend: one blocking pread/pwrite per page
+int bplus_io_pread_open(struct bplus_buffer_pool *pool, int flags) {
+    return 0;
+}
 
-    for (int i = 0; i < MAX_CHILDREN; i++) {
-        node->children[i] = NULL;
+int bplus_io_pread_read(
+    struct bplus_buffer_pool *pool, struct bplus_io_req *reqs, int n) {
+    for (int i = 0; i < n; i++) {
+        off_t offset = bplus_buffer_pool_get_offset(reqs[i].page_id);
+        int r = pread(pool->fd, reqs[i].buf, BPLUS_PAGE_SIZE, offset);
+        if (r != BPLUS_PAGE_SIZE) {
+            printf(
+                "short read of page_id=%u (got %d bytes)\n", reqs[i].page_id,
+                r);
+            return -1;
+        }
     }
+    return 0;
+}
 
-    return node;
+int bplus_io_pread_write(
+    struct bplus_buffer_pool *pool, struct bplus_io_req *reqs, int n) {
+    for (int i = 0; i < n; i++) {
+        off_t offset = bplus_buffer_pool_get_offset(reqs[i].page_id);
+        int written = pwrite(pool->fd, reqs[i].buf, BPLUS_PAGE_SIZE, offset);
+        if (written != BPLUS_PAGE_SIZE) {
+            perror("writing node");
+            return -1;
+        }
+    }
+    return 0;
 }
 
-struct bplus_node *bplus_node_get_child(
-    struct bplus_buffer_pool *pool, struct bplus_node *node, int child_index) {
-    assert(!node->disk.is_leaf);
+void bplus_io_pread_close(struct bplus_buffer_pool *pool) {}
+
+const struct bplus_io_ops bplus_io_pread = {
+    .name = "pread",
+    .open = bplus_io_pread_open,
+    .read = bplus_io_pread_read,
+    .write = bplus_io_pread_write,
+    .close = bplus_io_pread_close,
+};
+
+#ifdef BPLUS_HAVE_URING
+// io_uring backend: a whole batch goes out in one submission. with
+// BPLUS_IO_REGISTER_BUFFERS the frame memory is registered once so frame
+// reads and writes skip the per-I/O page pinning, and BPLUS_IO_FIXED_FILE
+// skips the per-I/O file table lookup.
+#define BPLUS_URING_DEPTH 64
+
+struct bplus_uring {
+    struct io_uring ring;
+    int fixed_file;
+    int fixed_buffers;
+    // a submit failed and left entries in the ring that must never go out
+    int broken;
+};
 
-    if (node->children[child_index] != NULL) {
-        return node->children[child_index];
+int bplus_io_uring_open(struct bplus_buffer_pool *pool, int flags) {
+    struct bplus_uring *u = malloc(sizeof(struct bplus_uring));
+    if (u == NULL) {
+        perror("io_uring backend");
+        return -1;
     }
+    u->broken = 0;
 
-    if (node->disk.num_keys >= child_index) {
-        printf(
-            "loading child from disk: page_id=%d\n",
-            node->disk.children[child_index]);
-        struct bplus_node *child =
-            bplus_buffer_pool_load(pool, node->disk.children[child_index]);
-        node->children[child_index] = child;
-        return child;
+    int ret = io_uring_queue_init(BPLUS_URING_DEPTH, &u->ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring queue_init failed: %s\n", strerror(-ret));
+        free(u);
+        return -1;
     }
 
-    return NULL;
+    u->fixed_file = 0;
+    if ((flags & BPLUS_IO_FIXED_FILE) &&
+        io_uring_register_files(&u->ring, &pool->fd, 1) == 0) {
+        u->fixed_file = 1;
+    }
+
+    u->fixed_buffers = 0;
+    if (flags & BPLUS_IO_REGISTER_BUFFERS) {
+        struct iovec iov = {
+            .iov_base = pool->nodes,
+            .iov_len = pool->num_frames * sizeof(struct bplus_node),
+        };
+        if (io_uring_register_buffers(&u->ring, &iov, 1) == 0) {
+            u->fixed_buffers = 1;
+        }
+    }
+
+    pool->io_ctx = u;
+    return 0;
 }
 
-int bplus_buffer_pool_write(
-    struct bplus_buffer_pool *pool, struct bplus_node *node) {
+int bplus_io_uring_rw(
+    struct bplus_buffer_pool *pool,
+    struct bplus_io_req *reqs,
+    int n,
+    int write) {
+    struct bplus_uring *u = pool->io_ctx;
+    char *frames_start = (char *)pool->nodes;
+    char *frames_end = (char *)&pool->nodes[pool->num_frames];
+    int failed = 0;
+    if (u->broken) {
+        printf("io_uring ring unusable after an earlier submit error\n");
+        return -1;
+    }
+
+    for (int start = 0; start < n && !u->broken; start += BPLUS_URING_DEPTH) {
+        int count = n - start;
+        if (count > BPLUS_URING_DEPTH) {
+            count = BPLUS_URING_DEPTH;
+        }
+
+        for (int i = 0; i < count; i++) {
+            struct bplus_io_req *req = &reqs[start + i];
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+            if (sqe == NULL) {
+                // only what was queued goes out, the rest of the batch fails
+                printf(
+                    "io_uring queue full after %d of %d requests\n", start + i,
+                    n);
+                failed = 1;
+                n = start + i;
+                count = i;
+                break;
+            }
+            off_t offset = bplus_buffer_pool_get_offset(req->page_id);
+            int fd = u->fixed_file ? 0 : pool->fd;
+            int fixed = u->fixed_buffers && (char *)req->buf >= frames_start &&
+                        (char *)req->buf < frames_end;
+
+            if (fixed && write) {
+                io_uring_prep_write_fixed(
+                    sqe, fd, req->buf, BPLUS_PAGE_SIZE, offset, 0);
+            } else if (fixed) {
+                io_uring_prep_read_fixed(
+                    sqe, fd, req->buf, BPLUS_PAGE_SIZE, offset, 0);
+            } else if (write) {
+                io_uring_prep_write(sqe, fd, req->buf, BPLUS_PAGE_SIZE, offset);
+            } else {
+                io_uring_prep_read(sqe, fd, req->buf, BPLUS_PAGE_SIZE, offset);
+            }
+            if (u->fixed_file) {
+                io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+            }
+            io_uring_sqe_set_data(sqe, req);
+        }
+
+        // the kernel may take fewer entries than queued, so keep submitting
+        // and reaping until every one has completed. entries point into
+        // frames the pool reuses once this returns, so nothing may be left
+        // in flight, even on error.
+        int queued = count;
+        int in_flight = 0;
+        while (queued > 0 || in_flight > 0) {
+            if (queued > 0) {
+                int submitted = io_uring_submit(&u->ring);
+                if (submitted == -EAGAIN || submitted == -EBUSY ||
+                    submitted == -EINTR) {
+                    submitted = 0;
+                } else if (submitted < 0) {
+                    // what the kernel took is still reaped below, the rest
+                    // stays unsubmitted for good
+                    fprintf(
+                        stderr, "io_uring submit: %s\n", strerror(-submitted));
+                    u->broken = 1;
+                    failed = 1;
+                    queued = 0;
+                    submitted = 0;
+                }
+                queued -= submitted;
+                in_flight += submitted;
+                if (in_flight == 0) {
+                    sched_yield();
+                    continue;
+                }
+            }
+
+            struct io_uring_cqe *cqe;
+            int ret = io_uring_wait_cqe(&u->ring, &cqe);
+            if (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY) {
+                continue;
+            }
+            if (ret < 0) {
+                // the kernel may still write into frames about to be reused
+                fprintf(stderr, "io_uring wait_cqe: %s\n", strerror(-ret));
+                abort();
+            }
+            if (cqe->res != BPLUS_PAGE_SIZE) {
+                struct bplus_io_req *req = io_uring_cqe_get_data(cqe);
+                printf(
+                    "io_uring %s of page_id=%u returned %d\n",
+                    write ? "write" : "read", req->page_id, cqe->res);
+                failed = 1;
+            }
+            io_uring_cqe_seen(&u->ring, cqe);
+            in_flight--;
+        }
+    }
+
+    return failed ? -1 : 0;
+}
+
+int bplus_io_uring_read(
+    struct bplus_buffer_pool *pool, struct bplus_io_req *reqs, int n) {
+    return bplus_io_uring_rw(pool, reqs, n, 0);
+}
+
+int bplus_io_uring_write(
+    struct bplus_buffer_pool *pool, struct bplus_io_req *reqs, int n) {
+    return bplus_io_uring_rw(pool, reqs, n, 1);
+}
+
+void bplus_io_uring_close(struct bplus_buffer_pool *pool) {
+    struct bplus_uring *u = pool->io_ctx;
+    io_uring_queue_exit(&u->ring);
+    free(u);
+}
+
+const struct bplus_io_ops bplus_io_uring = {
+    .name = "io_uring",
+    .open = bplus_io_uring_open,
+    .read = bplus_io_uring_read,
+    .write = bplus_io_uring_write,
+    .close = bplus_io_uring_close,
+};
+#endif
+
+// the backend for pools that don't ask for one. build with
+// -DBPLUS_DEFAULT_IO=bplus_io_uring to run every tree through io_uring.
+#ifndef BPLUS_DEFAULT_IO
+#define BPLUS_DEFAULT_IO bplus_io_pread
+#endif
+
+// compressed page files. a page is stored as its live bytes only, the header
+// and slot directory followed by the heap without the free gap between them,
+// and that image goes through a small LZ77 codec in the style of LZ4. stored
+// pages vary in size, so an extent table kept in <path>-extents maps each
+// page_id to a run of 512 byte sectors in the page file. extents are a whole
+// number of sectors and are recycled through one free list per size.
+#define BPLUS_SECTOR_SIZE 512
+// a page that doesn't compress needs a sector more than a raw page, for the
+// extent head
+#define BPLUS_EXTENT_CLASSES (BPLUS_PAGE_SIZE / BPLUS_SECTOR_SIZE + 1)
+// the table is written back in blocks of this many entries
+#define BPLUS_EXTENT_BLOCK 512
+
+#define BPLUS_CODEC_RAW 0
+#define BPLUS_CODEC_LZ 1
+
+#define BPLUS_LZ_HASH_BITS 12
+#define BPLUS_LZ_MIN_MATCH 4
+
+// starts every extent
+struct bplus_extent_head {
+    uint16_t codec;    // BPLUS_CODEC_*
+    uint16_t live_len; // size of the page image before compression
+};
+
+struct bplus_extent_free {
+    uint32_t *sectors;
+    uint32_t num;
+    uint32_t cap;
+};
+
+struct bplus_extent_table {
+    int fd; // <path>-extents
+    pthread_mutex_t lock;
+    // per page: first sector << 16 | stored length, 0 if never written
+    uint64_t *entries;
+    uint32_t num_entries;
+    uint32_t cap;
+    uint8_t *dirty; // one flag per block of BPLUS_EXTENT_BLOCK entries
+    uint32_t end;   // first sector past every extent
+    // free extents of i + 1 sectors
+    struct bplus_extent_free free[BPLUS_EXTENT_CLASSES];
+    uint32_t dropped; // overlapping entries dropped when opened
+};
+
+uint64_t bplus_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// copy the bytes of a page that carry data into out. returns their length.
+int bplus_page_pack(const struct bplus_node_disk *disk, char *out) {
+    int front =
+        BPLUS_PAGE_HEADER_SIZE + disk->num_keys * sizeof(struct bplus_slot);
+    int heap = BPLUS_NODE_CAPACITY - disk->heap_start;
+    memcpy(out, disk, front);
+    memcpy(&out[front], &disk->buf[disk->heap_start], heap);
+    return front + heap;
+}
+
+// rebuild a page from its packed image, zeroing the gap as sealing does
+int bplus_page_unpack(
+    const char *live, int live_len, struct bplus_node_disk *disk) {
+    if (live_len < BPLUS_PAGE_HEADER_SIZE) {
+        return -1;
+    }
+    memcpy(disk, live, BPLUS_PAGE_HEADER_SIZE);
+    int slots = disk->num_keys * sizeof(struct bplus_slot);
+    int heap = BPLUS_NODE_CAPACITY - disk->heap_start;
+    if (heap < 0 || slots > disk->heap_start ||
+        BPLUS_PAGE_HEADER_SIZE + slots + heap != live_len) {
+        return -1;
+    }
+    memcpy(disk->buf, &live[BPLUS_PAGE_HEADER_SIZE], slots);
+    memset(&disk->buf[slots], 0, disk->heap_start - slots);
+    memcpy(
+        &disk->buf[disk->heap_start], &live[BPLUS_PAGE_HEADER_SIZE + slots],
+        heap);
+    return 0;
+}
+
+// lengths of 15 and more spill out of the token into bytes of 255 and a
+// remainder
+int bplus_lz_put_len(uint8_t *dst, int op, int len) {
+    for (; len >= 255; len -= 255) {
+        dst[op++] = 255;
+    }
+    dst[op++] = len;
+    return op;
+}
+
+int bplus_lz_get_len(const uint8_t *src, int len, int *ip) {
+    int n = 0;
+    uint8_t b;
+    do {
+        if (*ip >= len) {
+            return -1;
+        }
+        b = src[(*ip)++];
+        n += b;
+    } while (b == 255);
+    return n;
+}
+
+// one sequence: a token, literals, then a match unless it's the last.
+// returns the new output length or -1 if it doesn't fit in cap.
+int bplus_lz_emit(
+    uint8_t *dst,
+    int op,
+    int cap,
+    const char *lit,
+    int lit_len,
+    int offset,
+    int match_len) {
+    int worst = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    if (op + worst > cap) {
+        return -1;
+    }
+
+    int match_code = match_len > 0 ? match_len - BPLUS_LZ_MIN_MATCH : 0;
+    dst[op++] = (lit_len < 15 ? lit_len : 15) << 4 |
+                (match_code < 15 ? match_code : 15);
+    if (lit_len >= 15) {
+        op = bplus_lz_put_len(dst, op, lit_len - 15);
+    }
+    memcpy(&dst[op], lit, lit_len);
+    op += lit_len;
+    if (match_len > 0) {
+        dst[op++] = offset & 0xff;
+        dst[op++] = offset >> 8;
+        if (match_code >= 15) {
+            op = bplus_lz_put_len(dst, op, match_code - 15);
+        }
+    }
+    return op;
+}
+
+// compress len bytes of src into at most cap bytes of dst. returns the
+// compressed length, or 0 if it wouldn't fit. matches are found through a
+// hash of the next 4 bytes, remembering only the latest position for each.
+int bplus_lz_compress(const char *src, int len, char *dst, int cap) {
+    uint16_t table[1 << BPLUS_LZ_HASH_BITS]; // position + 1, 0 when empty
+    memset(table, 0, sizeof(table));
+    uint8_t *out = (uint8_t *)dst;
+
+    int ip = 0;
+    int anchor = 0;
+    int op = 0;
+    while (ip + BPLUS_LZ_MIN_MATCH <= len) {
+        uint32_t seq;
+        memcpy(&seq, &src[ip], sizeof(seq));
+        uint32_t h = (seq * 2654435761u) >> (32 - BPLUS_LZ_HASH_BITS);
+        int candidate = table[h] - 1;
+        table[h] = ip + 1;
+        if (candidate < 0 ||
+            memcmp(&src[candidate], &src[ip], BPLUS_LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        // extend the match a word at a time
+        int match = BPLUS_LZ_MIN_MATCH;
+        while (ip + match + 8 <= len) {
+            uint64_t a, b;
+            memcpy(&a, &src[candidate + match], sizeof(a));
+            memcpy(&b, &src[ip + match], sizeof(b));
+            if (a != b) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                match += __builtin_ctzll(a ^ b) / 8;
+#else
+                match += __builtin_clzll(a ^ b) / 8;
+#endif
+                break;
+            }
+            match += 8;
+        }
+        while (ip + match < len && src[candidate + match] == src[ip + match]) {
+            match++;
+        }
+        op = bplus_lz_emit(
+            out, op, cap, &src[anchor], ip - anchor, ip - candidate, match);
+        if (op < 0) {
+            return 0;
+        }
+        ip += match;
+        anchor = ip;
+    }
+
+    op = bplus_lz_emit(out, op, cap, &src[anchor], len - anchor, 0, 0);
+    return op < 0 ? 0 : op;
+}
+
+// returns the decompressed length, or -1 if src is malformed or would
+// overflow cap
+int bplus_lz_decompress(const char *src, int len, char *dst, int cap) {
+    const uint8_t *in = (const uint8_t *)src;
+    int ip = 0;
+    int op = 0;
+    while (ip < len) {
+        int token = in[ip++];
+        int lit_len = token >> 4;
+        if (lit_len == 15) {
+            int more = bplus_lz_get_len(in, len, &ip);
+            if (more < 0) {
+                return -1;
+            }
+            lit_len += more;
+        }
+        if (lit_len > len - ip || lit_len > cap - op) {
+            return -1;
+        }
+        memcpy(&dst[op], &in[ip], lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == len) {
+            break;
+        }
+
+        if (len - ip < 2) {
+            return -1;
+        }
+        int offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        int match = (token & 15) + BPLUS_LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            int more = bplus_lz_get_len(in, len, &ip);
+            if (more < 0) {
+                return -1;
+            }
+            match += more;
+        }
+        if (offset == 0 || offset > op || match > cap - op) {
+            return -1;
+        }
+        // the match may overlap the bytes it produces
+        if (offset >= match) {
+            memcpy(&dst[op], &dst[op - offset], match);
+        } else {
+            for (int i = 0; i < match; i++) {
+                dst[op + i] = dst[op - offset + i];
+            }
+        }
+        op += match;
+    }
+    return op;
+}
+
+char *bplus_extent_path(const char *path) {
+    size_t len = strlen(path);
+    char *extent_path = malloc(len + sizeof("-extents"));
+    memcpy(extent_path, path, len);
+    memcpy(extent_path + len, "-extents", sizeof("-extents"));
+    return extent_path;
+}
+
+void bplus_extent_release(
+    struct bplus_extent_table *t, uint32_t sector, int sectors) {
+    struct bplus_extent_free *f = &t->free[sectors - 1];
+    if (f->num == f->cap) {
+        f->cap = f->cap > 0 ? 2 * f->cap : 64;
+        f->sectors = realloc(f->sectors, f->cap * sizeof(uint32_t));
+    }
+    f->sectors[f->num++] = sector;
+}
+
+uint32_t bplus_extent_alloc(struct bplus_extent_table *t, int sectors) {
+    struct bplus_extent_free *f = &t->free[sectors - 1];
+    if (f->num > 0) {
+        return f->sectors[--f->num];
+    }
+    uint32_t sector = t->end;
+    t->end += sectors;
+    return sector;
+}
+
+int bplus_extent_sectors(uint64_t entry) {
+    return ((entry & 0xffff) + BPLUS_SECTOR_SIZE - 1) / BPLUS_SECTOR_SIZE;
+}
+
+int bplus_extent_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void bplus_extent_mark_dirty(struct bplus_extent_table *t, uint32_t page_id) {
+    t->dirty[page_id / BPLUS_EXTENT_BLOCK] = 1;
+}
+
+// the extents in use in file order, as sector << 32 | page_id
+uint64_t *bplus_extent_sorted(struct bplus_extent_table *t, uint32_t *n) {
+    uint64_t *order = malloc((t->num_entries + 1) * sizeof(uint64_t));
+    *n = 0;
+    for (uint32_t i = 0; i < t->num_entries; i++) {
+        if (t->entries[i] != 0) {
+            order[(*n)++] = (t->entries[i] >> 16) << 32 | i;
+        }
+    }
+    qsort(order, *n, sizeof(uint64_t), bplus_extent_compare);
+    return order;
+}
 
-    if (node->dirty) {
-        int offset = bplus_buffer_pool_get_offset(node->disk.page_id);
+// derive the free lists and the end of the file from the entries, as the
+// gaps between extents. a crash partway through a checkpoint can leave two
+// entries claiming the same sectors. both pages are rewritten when the log
+// is replayed, so they're dropped here. returns how many were dropped.
+uint32_t bplus_extent_table_rebuild(struct bplus_extent_table *t) {
+    uint32_t n;
+    uint64_t *order = bplus_extent_sorted(t, &n);
+
+    for (int c = 0; c < BPLUS_EXTENT_CLASSES; c++) {
+        t->free[c].num = 0;
+    }
+
+    uint32_t dropped = 0;
+    uint32_t next = BPLUS_PAGE_SIZE / BPLUS_SECTOR_SIZE;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t sector = order[i] >> 32;
+        uint32_t page_id = order[i] & 0xffffffff;
+        int sectors = bplus_extent_sectors(t->entries[page_id]);
+        if (sector < next || sectors > BPLUS_EXTENT_CLASSES) {
+            printf("extent of page %u overlaps another, dropped\n", page_id);
+            t->entries[page_id] = 0;
+            bplus_extent_mark_dirty(t, page_id);
+            dropped++;
+            continue;
+        }
+        for (uint32_t gap = sector - next; gap > 0;) {
+            int c = gap < BPLUS_EXTENT_CLASSES ? gap : BPLUS_EXTENT_CLASSES;
+            bplus_extent_release(t, next, c);
+            next += c;
+            gap -= c;
+        }
+        next = sector + sectors;
+    }
+    t->end = next;
+
+    free(order);
+    return dropped;
+}
+
+void bplus_extent_table_grow(struct bplus_extent_table *t, uint32_t num) {
+    if (num <= t->cap) {
+        return;
+    }
+    uint32_t cap = t->cap > 0 ? t->cap : BPLUS_EXTENT_BLOCK;
+    while (cap < num) {
+        cap *= 2;
+    }
+    t->entries = realloc(t->entries, cap * sizeof(uint64_t));
+    memset(&t->entries[t->cap], 0, (cap - t->cap) * sizeof(uint64_t));
+    t->dirty = realloc(t->dirty, cap / BPLUS_EXTENT_BLOCK);
+    memset(
+        &t->dirty[t->cap / BPLUS_EXTENT_BLOCK], 0,
+        (cap - t->cap) / BPLUS_EXTENT_BLOCK);
+    t->cap = cap;
+}
+
+// open the extent table of the page file at path. flags are passed on to
+// open(2); NULL if the table doesn't exist, so the file isn't compressed.
+struct bplus_extent_table *
+bplus_extent_table_open(const char *path, int flags) {
+    char *extent_path = bplus_extent_path(path);
+    int fd = open(extent_path, flags, 0644);
+    free(extent_path);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st = {0};
+    fstat(fd, &st);
+    struct bplus_extent_table *t = calloc(1, sizeof(*t));
+    t->fd = fd;
+    pthread_mutex_init(&t->lock, NULL);
+    t->num_entries = st.st_size / sizeof(uint64_t);
+    bplus_extent_table_grow(t, t->num_entries);
+
+    size_t len = t->num_entries * sizeof(uint64_t);
+    if (len > 0 && pread(fd, t->entries, len, 0) != (ssize_t)len) {
+        perror("read extent table");
+        t->num_entries = 0;
+    }
+    t->dropped = bplus_extent_table_rebuild(t);
+    return t;
+}
+
+// write back the blocks of entries that changed. called with t->lock held.
+int bplus_extent_table_write(struct bplus_extent_table *t) {
+    for (uint32_t b = 0; b * BPLUS_EXTENT_BLOCK < t->num_entries; b++) {
+        if (!t->dirty[b]) {
+            continue;
+        }
+        uint32_t first = b * BPLUS_EXTENT_BLOCK;
+        uint32_t count = t->num_entries - first;
+        if (count > BPLUS_EXTENT_BLOCK) {
+            count = BPLUS_EXTENT_BLOCK;
+        }
+        size_t len = count * sizeof(uint64_t);
+        if (pwrite(t->fd, &t->entries[first], len, first * sizeof(uint64_t)) !=
+            (ssize_t)len) {
+            perror("write extent table");
+            return -1;
+        }
+        t->dirty[b] = 0;
+    }
+    return 0;
+}
+
+void bplus_extent_table_close(struct bplus_extent_table *t) {
+    close(t->fd);
+    pthread_mutex_destroy(&t->lock);
+    for (int c = 0; c < BPLUS_EXTENT_CLASSES; c++) {
+        free(t->free[c].sectors);
+    }
+    free(t->entries);
+    free(t->dirty);
+    free(t);
+}
+
+// read page_id from its extent into buf. stats may be NULL.
+int bplus_extent_read(
+    struct bplus_extent_table *t,
+    int fd,
+    uint32_t page_id,
+    void *buf,
+    struct bplus_buffer_pool_stats *stats) {
+    pthread_mutex_lock(&t->lock);
+    uint64_t entry = page_id < t->num_entries ? t->entries[page_id] : 0;
+    pthread_mutex_unlock(&t->lock);
+
+    struct bplus_extent_head head;
+    char stored[sizeof(head) + BPLUS_PAGE_SIZE];
+    int len = entry & 0xffff;
+    if (entry == 0 || len < (int)sizeof(head) || len > (int)sizeof(stored)) {
+        printf("page_id=%u has no extent\n", page_id);
+        return -1;
+    }
+    off_t offset = (off_t)(entry >> 16) * BPLUS_SECTOR_SIZE;
+    int r = pread(fd, stored, len, offset);
+    if (r != len) {
+        printf("short read of page_id=%u (got %d bytes)\n", page_id, r);
+        return -1;
+    }
+
+    uint64_t start = bplus_now_ns();
+    memcpy(&head, stored, sizeof(head));
+    char live[BPLUS_PAGE_SIZE];
+    int live_len = -1;
+    if (head.codec == BPLUS_CODEC_LZ) {
+        live_len = bplus_lz_decompress(
+            &stored[sizeof(head)], len - sizeof(head), live, sizeof(live));
+    } else if (
+        head.codec == BPLUS_CODEC_RAW && len - sizeof(head) <= sizeof(live)) {
+        live_len = len - sizeof(head);
+        memcpy(live, &stored[sizeof(head)], live_len);
+    }
+    if (live_len != head.live_len || bplus_page_unpack(live, live_len, buf)) {
+        printf("page_id=%u: extent doesn't decode\n", page_id);
+        return -1;
+    }
+    if (stats != NULL) {
+        __atomic_fetch_add(
+            &stats->decompress_ns, bplus_now_ns() - start, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// pack, compress and place each page, then write back the table. a page
+// keeps its extent while its stored size stays within the same number of
+// sectors.
+int bplus_extent_write(
+    struct bplus_extent_table *t,
+    int fd,
+    struct bplus_io_req *reqs,
+    int n,
+    struct bplus_buffer_pool_stats *stats) {
+    char live[BPLUS_PAGE_SIZE];
+    struct bplus_extent_head head;
+    char stored[sizeof(head) + BPLUS_PAGE_SIZE];
+
+    for (int i = 0; i < n; i++) {
+        uint64_t start = bplus_now_ns();
+        head.live_len = bplus_page_pack(reqs[i].buf, live);
+        int len = bplus_lz_compress(
+            live, head.live_len, &stored[sizeof(head)], head.live_len - 1);
+        head.codec = BPLUS_CODEC_LZ;
+        if (len == 0) {
+            head.codec = BPLUS_CODEC_RAW;
+            len = head.live_len;
+            memcpy(&stored[sizeof(head)], live, len);
+        }
+        memcpy(stored, &head, sizeof(head));
+        len += sizeof(head);
+        uint64_t ns = bplus_now_ns() - start;
+
+        uint32_t page_id = reqs[i].page_id;
+        int sectors = (len + BPLUS_SECTOR_SIZE - 1) / BPLUS_SECTOR_SIZE;
+        pthread_mutex_lock(&t->lock);
+        bplus_extent_table_grow(t, page_id + 1);
+        if (page_id >= t->num_entries) {
+            t->num_entries = page_id + 1;
+        }
+        uint64_t old = t->entries[page_id];
+        uint32_t sector = old >> 16;
+        if (old == 0 || bplus_extent_sectors(old) != sectors) {
+            if (old != 0) {
+                bplus_extent_release(t, sector, bplus_extent_sectors(old));
+            }
+            sector = bplus_extent_alloc(t, sectors);
+        }
+        t->entries[page_id] = (uint64_t)sector << 16 | len;
+        bplus_extent_mark_dirty(t, page_id);
+        stats->compress_ns += ns;
+        stats->compressed_pages++;
+        stats->compressed_bytes += len;
+        pthread_mutex_unlock(&t->lock);
+
+        off_t offset = (off_t)sector * BPLUS_SECTOR_SIZE;
+        if (pwrite(fd, stored, len, offset) != len) {
+            perror("writing extent");
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&t->lock);
+    int ret = bplus_extent_table_write(t);
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+// move extents from the end of the file into the first earlier gap they
+// fit, so the file can be trimmed. the copies are made durable before the
+// table points at them, and nothing overwrites the originals until the
+// file is truncated. called with t->lock held. returns the number moved.
+int bplus_extent_repack(struct bplus_extent_table *t, int fd) {
+    uint32_t n;
+    uint64_t *order = bplus_extent_sorted(t, &n);
+    uint32_t *gap_sector = malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *gap_len = malloc((n + 1) * sizeof(uint32_t));
+    uint32_t num_gaps = 0;
+    uint32_t next = BPLUS_PAGE_SIZE / BPLUS_SECTOR_SIZE;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t sector = order[i] >> 32;
+        if (sector > next) {
+            gap_sector[num_gaps] = next;
+            gap_len[num_gaps++] = sector - next;
+        }
+        next = sector + bplus_extent_sectors(t->entries[order[i] & 0xffffffff]);
+    }
+
+    char stored[sizeof(struct bplus_extent_head) + BPLUS_PAGE_SIZE];
+    int moved = 0;
+    uint32_t first = 0; // gaps before this one are used up
+    for (uint32_t i = n; i-- > 0;) {
+        uint32_t sector = order[i] >> 32;
+        uint32_t page_id = order[i] & 0xffffffff;
+        uint64_t entry = t->entries[page_id];
+        int sectors = bplus_extent_sectors(entry);
+        while (first < num_gaps && gap_len[first] == 0) {
+            first++;
+        }
+        if (first == num_gaps || gap_sector[first] >= sector) {
+            break;
+        }
+
+        uint32_t g = first;
+        while (g < num_gaps && gap_sector[g] < sector &&
+               gap_len[g] < (uint32_t)sectors) {
+            g++;
+        }
+        if (g == num_gaps || gap_sector[g] >= sector) {
+            continue;
+        }
+
+        int len = entry & 0xffff;
+        if (pread(fd, stored, len, (off_t)sector * BPLUS_SECTOR_SIZE) != len ||
+            pwrite(fd, stored, len, (off_t)gap_sector[g] * BPLUS_SECTOR_SIZE) !=
+                len) {
+            perror("move extent");
+            moved = -1;
+            break;
+        }
+        t->entries[page_id] = (uint64_t)gap_sector[g] << 16 | len;
+        bplus_extent_mark_dirty(t, page_id);
+        gap_sector[g] += sectors;
+        gap_len[g] -= sectors;
+        moved++;
+    }
+
+    free(order);
+    free(gap_sector);
+    free(gap_len);
+    return moved;
+}
+
+// forget the extents of every page from num_pages on, pack the rest towards
+// the start of the file and trim it after the last one
+int bplus_extent_truncate(
+    struct bplus_extent_table *t, int fd, uint32_t num_pages) {
+    pthread_mutex_lock(&t->lock);
+    if (num_pages < t->num_entries) {
+        memset(
+            &t->entries[num_pages], 0,
+            (t->num_entries - num_pages) * sizeof(uint64_t));
+        t->num_entries = num_pages;
+    }
+
+    int ret = 0;
+    int moved = bplus_extent_repack(t, fd);
+    if (moved < 0 || (moved > 0 && fdatasync(fd) < 0)) {
+        ret = -1;
+    }
+    bplus_extent_table_rebuild(t);
+    if (ret == 0 &&
+        (bplus_extent_table_write(t) < 0 || fdatasync(t->fd) < 0 ||
+         ftruncate(t->fd, (off_t)num_pages * sizeof(uint64_t)) < 0 ||
+         ftruncate(fd, (off_t)t->end * BPLUS_SECTOR_SIZE) < 0)) {
+        perror("truncate compressed page file");
+        ret = -1;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+// page transfers for the buffer pool, through the extent table when the
+// file is compressed and the io backend otherwise
+int bplus_buffer_pool_read_pages(
+    struct bplus_buffer_pool *pool, struct bplus_io_req *reqs, int n) {
+    if (pool->extents == NULL) {
+        return pool->io->read(pool, reqs, n);
+    }
+    for (int i = 0; i < n; i++) {
+        if (bplus_extent_read(
+                pool->extents, pool->fd, reqs[i].page_id, reqs[i].buf,
+                &pool->stats) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int bplus_buffer_pool_write_pages(
+    struct bplus_buffer_pool *pool, struct bplus_io_req *reqs, int n) {
+    if (pool->extents == NULL) {
+        return pool->io->write(pool, reqs, n);
+    }
+    return bplus_extent_write(pool->extents, pool->fd, reqs, n, &pool->stats);
+}
+
+// make written pages durable, along with the extent table that finds them
+int bplus_buffer_pool_sync(struct bplus_buffer_pool *pool) {
+    if (pool->extents != NULL && fdatasync(pool->extents->fd) < 0) {
+        return -1;
+    }
+    return fdatasync(pool->fd);
+}
+
+// shrink the file to hold num_pages pages
+int bplus_buffer_pool_truncate(
+    struct bplus_buffer_pool *pool, uint32_t num_pages) {
+    if (pool->extents != NULL) {
+        return bplus_extent_truncate(pool->extents, pool->fd, num_pages);
+    }
+    if (ftruncate(pool->fd, bplus_buffer_pool_get_offset(num_pages)) < 0) {
+        perror("truncate page file");
+        return -1;
+    }
+    return 0;
+}
+
+// map len bytes private to this process, or shared through a memfd with
+// the processes it forks
+void *bplus_arena_map(size_t len, int huge, int shared) {
+    if (!shared) {
+        return mmap(
+            NULL, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | (huge ? MAP_HUGETLB : 0), -1, 0);
+    }
+    int fd = syscall(
+        SYS_memfd_create, "bplus pool",
+        MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0));
+    if (fd < 0) {
+        return MAP_FAILED;
+    }
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, len) == 0) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return p;
+}
+
+// map len bytes of zeroed memory. huge_pages asks for reserved huge pages
+// first, then falls back to normal pages the kernel may merge into
+// transparent huge pages. shared memory stays shared across fork, at the
+// same address in every process.
+int bplus_arena_init(
+    struct bplus_arena *arena, size_t len, int huge_pages, int shared) {
+    arena->used = 0;
+    arena->huge = 0;
+
+    if (huge_pages) {
+        size_t huge_len = (len + BPLUS_HUGE_PAGE_SIZE - 1) &
+                          ~(size_t)(BPLUS_HUGE_PAGE_SIZE - 1);
+        void *p = bplus_arena_map(huge_len, 1, shared);
+        if (p != MAP_FAILED) {
+            arena->base = p;
+            arena->len = huge_len;
+            arena->huge = 1;
+            return 0;
+        }
+    }
+
+    arena->len = (len + BPLUS_PAGE_SIZE - 1) & ~(size_t)(BPLUS_PAGE_SIZE - 1);
+    void *p = bplus_arena_map(arena->len, 0, shared);
+    if (p == MAP_FAILED) {
+        perror("map buffer pool arena");
+        return -1;
+    }
+    arena->base = p;
+    if (huge_pages) {
+        madvise(p, arena->len, MADV_HUGEPAGE);
+    }
+    return 0;
+}
+
+// carve size bytes aligned to align, a power of two, off the arena
+void *bplus_arena_alloc(struct bplus_arena *arena, size_t size, size_t align) {
+    arena->used = (arena->used + align - 1) & ~(align - 1);
+    void *p = arena->base + arena->used;
+    arena->used += size;
+    assert(arena->used <= arena->len);
+    return p;
+}
+
+void bplus_arena_destroy(struct bplus_arena *arena) {
+    if (arena->base != NULL) {
+        munmap(arena->base, arena->len);
+    }
+}
+
+// init a lock for the pool's threads, or for every process sharing the
+// pool. a process may die holding a shared pool's lock, so that one is
+// robust, see bplus_buffer_pool_lock.
+void bplus_buffer_pool_init_lock(pthread_mutex_t *lock, int shared) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (shared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// open the page file at path behind a pool of num_frames frames. a shared
+// pool, struct and all, lives in memory that processes forked afterwards
+// share, so they all read through one cache. it can only serve an existing
+// file and never writes it.
+struct bplus_buffer_pool *bplus_buffer_pool_init(
+    const char *path,
+    int num_frames,
+    const struct bplus_io_ops *io,
+    int io_flags,
+    int huge_pages,
+    int compress,
+    int shared) {
+    if (num_frames < BPLUS_MIN_FRAMES) {
+        num_frames = BPLUS_MIN_FRAMES;
+    }
+
+    // keep the table at most half full so probe sequences stay short
+    uint32_t table_size = 1;
+    while (table_size < 2 * (uint32_t)num_frames) {
+        table_size <<= 1;
+    }
+
+    // page images first so they start on a (huge) page boundary
+    struct bplus_arena arena;
+    size_t nodes_len = (size_t)num_frames * sizeof(struct bplus_node);
+    size_t frames_len = (size_t)num_frames * sizeof(struct bplus_frame);
+    size_t table_len = table_size * sizeof(int32_t);
+    size_t dirty_len = (size_t)num_frames * sizeof(int32_t);
+    size_t pool_len = shared ? sizeof(struct bplus_buffer_pool) + 64 : 0;
+    if (bplus_arena_init(
+            &arena, nodes_len + frames_len + table_len + dirty_len + pool_len,
+            huge_pages, shared) < 0) {
+        return NULL;
+    }
+
+    int f = shared ? open(path, O_RDONLY) : open(path, O_CREAT | O_RDWR, 0644);
+    if (f < 0) {
+        perror("open buffer pool file");
+        bplus_arena_destroy(&arena);
+        return NULL;
+    }
+
+    struct stat st = {0};
+    fstat(f, &st);
+    if (shared && st.st_size == 0) {
+        printf("%s has no tree to share\n", path);
+        close(f);
+        bplus_arena_destroy(&arena);
+        return NULL;
+    }
+
+    struct bplus_node *nodes =
+        bplus_arena_alloc(&arena, nodes_len, BPLUS_PAGE_SIZE);
+    struct bplus_frame *frames =
+        bplus_arena_alloc(&arena, frames_len, _Alignof(struct bplus_frame));
+    int32_t *table = bplus_arena_alloc(&arena, table_len, sizeof(int32_t));
+    int32_t *dirty_set =
+        bplus_arena_alloc(&arena, dirty_len, sizeof(int32_t));
+    struct bplus_buffer_pool *pool =
+        shared ? bplus_arena_alloc(&arena, sizeof(*pool), 64)
+               : malloc(sizeof(*pool));
+    pool->arena = arena;
+    pool->shared = shared;
+    pool->owner = getpid();
+
+    pool->fd = f;
+    // a file keeps the format it was created with. a table left behind by
+    // an earlier file at this path no longer applies.
+    pool->extents = NULL;
+    if (st.st_size == 0 && compress) {
+        pool->extents =
+            bplus_extent_table_open(path, O_CREAT | O_TRUNC | O_RDWR);
+    } else if (st.st_size == 0) {
+        char *extent_path = bplus_extent_path(path);
+        unlink(extent_path);
+        free(extent_path);
+    } else {
+        pool->extents =
+            bplus_extent_table_open(path, shared ? O_RDONLY : O_RDWR);
+    }
+
+    if (pool->extents != NULL) {
+        pool->next_page_id = pool->extents->num_entries;
+    } else if (st.st_size > BPLUS_PAGE_SIZE) {
+        pool->next_page_id = st.st_size / BPLUS_PAGE_SIZE - 1;
+    } else {
+        pool->next_page_id = 0;
+    }
+
+    pool->nodes = nodes;
+    pool->frames = frames;
+    pool->num_frames = num_frames;
+    pool->num_cached = 0;
+    pool->clock_hand = 0;
+
+    pthread_rwlockattr_t latch_attr;
+    pthread_rwlockattr_init(&latch_attr);
+    if (shared) {
+        pthread_rwlockattr_setpshared(&latch_attr, PTHREAD_PROCESS_SHARED);
+    }
+    for (int i = 0; i < num_frames; i++) {
+        pool->frames[i].page_id = BPLUS_INVALID_PAGE;
+        pool->frames[i].pin_count = 0;
+        pool->frames[i].dirty = 0;
+        pool->frames[i].referenced = 0;
+        pthread_rwlock_init(&pool->frames[i].latch, &latch_attr);
+    }
+    pthread_rwlockattr_destroy(&latch_attr);
+    bplus_buffer_pool_init_lock(&pool->lock, shared);
+
+    pool->table = table;
+    pool->table_mask = table_size - 1;
+    for (uint32_t i = 0; i < table_size; i++) {
+        pool->table[i] = -1;
+    }
+
+    memset(&pool->stats, 0, sizeof(pool->stats));
+    bplus_buffer_pool_init_lock(&pool->dirty_lock, shared);
+    pool->dirty_set = dirty_set;
+    pool->num_dirty = 0;
+    pool->free_pages = NULL;
+    pool->num_free = 0;
+    pool->free_cap = 0;
+    pool->no_steal = 0;
+    pool->map = NULL;
+    pool->map_len = 0;
+    pthread_mutex_init(&pool->snap_lock, NULL);
+    pool->snap_epoch = 0;
+    pool->last_epoch = 0;
+    pool->versions = NULL;
+    pool->retired = NULL;
+    pool->snapshots = NULL;
+
+    // a backend's state belongs to one process, pread has none
+    if (shared && io != NULL && io != &bplus_io_pread) {
+        printf("shared buffer pools read with pread, not %s\n", io->name);
+        io = NULL;
+    }
+    if (io == NULL) {
+        io = shared ? &bplus_io_pread : &BPLUS_DEFAULT_IO;
+    }
+    pool->io = io;
+    pool->io_ctx = NULL;
+    if (pool->io->open(pool, io_flags) < 0) {
+        printf("%s backend unavailable, using pread\n", pool->io->name);
+        pool->io = &bplus_io_pread;
+        pool->io->open(pool, io_flags);
+    }
+
+    return pool;
+}
+
+uint32_t
+bplus_page_table_hash(struct bplus_buffer_pool *pool, uint32_t page_id) {
+    return (page_id * 2654435761u) & pool->table_mask;
+}
+
+// map the whole page file read-only. nodes handed out by the pool point into
+// the mapping, so lookups neither copy pages nor allocate frames.
+struct bplus_buffer_pool *
+bplus_buffer_pool_open_mmap(const char *path, int access) {
+    int f = open(path, O_RDONLY);
+    if (f < 0) {
+        perror("open buffer pool file");
+        return NULL;
+    }
+
+    struct stat st = {0};
+    fstat(f, &st);
+    if (st.st_size <= BPLUS_PAGE_SIZE) {
+        printf("%s has no pages to map\n", path);
+        close(f);
+        return NULL;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, f, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap page file");
+        close(f);
+        return NULL;
+    }
+
+    int advice = MADV_NORMAL;
+    if (access == BPLUS_ACCESS_RANDOM) {
+        advice = MADV_RANDOM;
+    } else if (access == BPLUS_ACCESS_SEQUENTIAL) {
+        advice = MADV_SEQUENTIAL;
+    }
+    madvise(map, st.st_size, advice);
+
+    struct bplus_buffer_pool *pool =
+        calloc(1, sizeof(struct bplus_buffer_pool));
+    pool->fd = f;
+    pool->next_page_id = st.st_size / BPLUS_PAGE_SIZE - 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->snap_lock, NULL);
+    bplus_buffer_pool_init_lock(&pool->dirty_lock, 0);
+    pool->io = &bplus_io_pread;
+    pool->map = map;
+    pool->map_len = st.st_size;
+    return pool;
+}
+
+// mapped and shared pools never write the file
+int bplus_buffer_pool_readonly(struct bplus_buffer_pool *pool) {
+    return pool->map != NULL || pool->shared;
+}
+
+int32_t bplus_page_table_get(struct bplus_buffer_pool *pool, uint32_t slot) {
+    return __atomic_load_n(&pool->table[slot], __ATOMIC_ACQUIRE);
+}
+
+void bplus_page_table_set(
+    struct bplus_buffer_pool *pool, uint32_t slot, int32_t frame) {
+    __atomic_store_n(&pool->table[slot], frame, __ATOMIC_RELEASE);
+}
+
+// returns the frame holding page_id, or -1 if it is not cached. exact under
+// the pool lock, a hint without it.
+int bplus_page_table_find(struct bplus_buffer_pool *pool, uint32_t page_id) {
+    uint32_t slot = bplus_page_table_hash(pool, page_id);
+    int32_t frame;
+    while ((frame = bplus_page_table_get(pool, slot)) >= 0) {
+        uint32_t id = __atomic_load_n(
+            &pool->frames[frame].page_id, __ATOMIC_RELAXED);
+        if (id == page_id) {
+            return frame;
+        }
+        slot = (slot + 1) & pool->table_mask;
+    }
+    return -1;
+}
+
+void bplus_page_table_insert(struct bplus_buffer_pool *pool, int frame) {
+    uint32_t slot = bplus_page_table_hash(pool, pool->frames[frame].page_id);
+    while (pool->table[slot] >= 0) {
+        slot = (slot + 1) & pool->table_mask;
+    }
+    bplus_page_table_set(pool, slot, frame);
+}
+
+void bplus_page_table_remove(struct bplus_buffer_pool *pool, uint32_t page_id) {
+    uint32_t slot = bplus_page_table_hash(pool, page_id);
+    while (pool->table[slot] >= 0 &&
+           pool->frames[pool->table[slot]].page_id != page_id) {
+        slot = (slot + 1) & pool->table_mask;
+    }
+    if (pool->table[slot] < 0) {
+        return;
+    }
+
+    // backward shift deletion: pull later entries of the probe run into the
+    // hole so lookups never need tombstones
+    uint32_t hole = slot;
+    uint32_t next = (hole + 1) & pool->table_mask;
+    while (pool->table[next] >= 0) {
+        uint32_t home = bplus_page_table_hash(
+            pool, pool->frames[pool->table[next]].page_id);
+        if (((next - home) & pool->table_mask) >=
+            ((next - hole) & pool->table_mask)) {
+            bplus_page_table_set(pool, hole, pool->table[next]);
+            hole = next;
+        }
+        next = (next + 1) & pool->table_mask;
+    }
+    bplus_page_table_set(pool, hole, -1);
+}
+
+int bplus_buffer_pool_frame(
+    struct bplus_buffer_pool *pool, struct bplus_node *node) {
+    return node - pool->nodes;
+}
+
+// take a frame that was written back or dropped out of the dirty set. the
+// last frame in the set moves into its slot.
+void bplus_buffer_pool_clean(struct bplus_buffer_pool *pool, int frame) {
+    struct bplus_frame *f = &pool->frames[frame];
+    if (!f->dirty) {
+        return;
+    }
+    pthread_mutex_lock(&pool->dirty_lock);
+    int last = pool->dirty_set[pool->num_dirty - 1];
+    pool->dirty_set[f->dirty_slot] = last;
+    pool->frames[last].dirty_slot = f->dirty_slot;
+    __atomic_store_n(&pool->num_dirty, pool->num_dirty - 1, __ATOMIC_RELAXED);
+    f->dirty = 0;
+    pthread_mutex_unlock(&pool->dirty_lock);
+}
+
+int bplus_buffer_pool_write_frame(struct bplus_buffer_pool *pool, int frame) {
+    struct bplus_frame *f = &pool->frames[frame];
+    if (!f->dirty) {
+        return 0;
+    }
+
+    bplus_debug("writing frame %d (page_id=%u)\n", frame, f->page_id);
+
+    struct bplus_io_req req = {
+        .page_id = f->page_id,
+        .buf = &pool->nodes[frame].disk,
+    };
+    bplus_page_seal(req.buf);
+    if (bplus_buffer_pool_write_pages(pool, &req, 1) < 0) {
+        return -1;
+    }
+
+    bplus_buffer_pool_clean(pool, frame);
+    pool->stats.writes++;
+    return 0;
+}
+
+int bplus_buffer_pool_write(
+    struct bplus_buffer_pool *pool, struct bplus_node *node) {
+    return bplus_buffer_pool_write_frame(
+        pool, bplus_buffer_pool_frame(pool, node));
+}
+
+// find a frame for a new page, evicting an unpinned page with CLOCK if the
+// pool is full. the frame comes back claimed, with pin_count -1. returns -1
+// if every frame is pinned. called with the pool lock held.
+int bplus_buffer_pool_evict(struct bplus_buffer_pool *pool) {
+    if (pool->num_cached < pool->num_frames) {
+        pool->frames[pool->num_cached].pin_count = -1;
+        return pool->num_cached++;
+    }
+
+    // two sweeps clear every reference bit, so a third finding nothing means
+    // everything is pinned (or dirty, under no_steal)
+    for (int i = 0; i < 3 * pool->num_frames; i++) {
+        int frame = pool->clock_hand;
+        struct bplus_frame *f = &pool->frames[frame];
+        pool->clock_hand = (pool->clock_hand + 1) % pool->num_frames;
+
+        if (__atomic_load_n(&f->pin_count, __ATOMIC_RELAXED) != 0) {
+            continue;
+        }
+        if (__atomic_load_n(&f->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&f->referenced, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // claiming the frame makes concurrent lookups fail to pin it
+        int unpinned = 0;
+        if (!__atomic_compare_exchange_n(
+                &f->pin_count, &unpinned, -1, 0, __ATOMIC_ACQUIRE,
+                __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (f->dirty && pool->no_steal) {
+            __atomic_store_n(&f->pin_count, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (bplus_buffer_pool_write_frame(pool, frame) < 0) {
+            __atomic_store_n(&f->pin_count, 0, __ATOMIC_RELEASE);
+            return -1;
+        }
+
+        bplus_debug("evicting page_id=%u from frame %d\n", f->page_id, frame);
+        bplus_page_table_remove(pool, f->page_id);
+        __atomic_store_n(&f->page_id, BPLUS_INVALID_PAGE, __ATOMIC_RELAXED);
+        pool->stats.evictions++;
+        return frame;
+    }
+
+    printf(
+        "buffer pool exhausted: all %d frames pinned or dirty\n",
+        pool->num_frames);
+    return -1;
+}
+
+// claim a frame for page_id. the page contents are left for the caller to
+// fill in, and nobody else can pin the frame until bplus_buffer_pool_publish.
+// called with the pool lock held.
+struct bplus_node *bplus_buffer_pool_alloc_frame(
+    struct bplus_buffer_pool *pool, uint32_t page_id) {
+    int frame = bplus_buffer_pool_evict(pool);
+    if (frame < 0) {
+        return NULL;
+    }
+
+    struct bplus_frame *f = &pool->frames[frame];
+    __atomic_store_n(&f->page_id, page_id, __ATOMIC_RELAXED);
+    f->dirty = 0;
+    f->referenced = 1;
+    bplus_page_table_insert(pool, frame);
+
+    return &pool->nodes[frame];
+}
+
+// hand a claimed frame out, pinned once for the caller
+void bplus_buffer_pool_publish(
+    struct bplus_buffer_pool *pool, struct bplus_node *node) {
+    struct bplus_frame *f = &pool->frames[bplus_buffer_pool_frame(pool, node)];
+    __atomic_store_n(&f->pin_count, 1, __ATOMIC_RELEASE);
+}
+
+// give a claimed frame back after a failed load so it is reused first
+void bplus_buffer_pool_discard(
+    struct bplus_buffer_pool *pool, struct bplus_node *node) {
+    int frame = bplus_buffer_pool_frame(pool, node);
+    struct bplus_frame *f = &pool->frames[frame];
+    bplus_page_table_remove(pool, f->page_id);
+    __atomic_store_n(&f->page_id, BPLUS_INVALID_PAGE, __ATOMIC_RELAXED);
+    f->dirty = 0;
+    f->referenced = 0;
+    __atomic_store_n(&f->pin_count, 0, __ATOMIC_RELEASE);
+    pool->clock_hand = frame;
+}
+
+// pin frame if it still holds page_id. fails while the frame is claimed
+// or after it has been reused for another page.
+int bplus_buffer_pool_try_pin(
+    struct bplus_buffer_pool *pool, int frame, uint32_t page_id) {
+    struct bplus_frame *f = &pool->frames[frame];
+    int pins = __atomic_load_n(&f->pin_count, __ATOMIC_RELAXED);
+    do {
+        if (pins < 0) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(
+        &f->pin_count, &pins, pins + 1, 1, __ATOMIC_ACQUIRE,
+        __ATOMIC_RELAXED));
+
+    if (__atomic_load_n(&f->page_id, __ATOMIC_RELAXED) != page_id) {
+        __atomic_fetch_sub(&f->pin_count, 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+    if (!__atomic_load_n(&f->referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&f->referenced, 1, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+// read a page from disk into a free frame. the returned node is pinned.
+// called with the pool lock held.
+struct bplus_node *
+bplus_buffer_pool_load(struct bplus_buffer_pool *pool, uint32_t page_id) {
+    if (page_id >= __atomic_load_n(&pool->next_page_id, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    struct bplus_node *node = bplus_buffer_pool_alloc_frame(pool, page_id);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    struct bplus_io_req req = {
+        .page_id = page_id,
+        .buf = &node->disk,
+    };
+    if (bplus_buffer_pool_read_pages(pool, &req, 1) < 0) {
+        bplus_buffer_pool_discard(pool, node);
+        return NULL;
+    }
+    int err = bplus_page_verify(&node->disk, page_id);
+    if (err != BPLUS_PAGE_OK) {
+        printf("page %u: %s\n", page_id, bplus_page_errors[err]);
+        bplus_buffer_pool_discard(pool, node);
+        return NULL;
+    }
+
+    pool->stats.reads++;
+    bplus_buffer_pool_publish(pool, node);
+    return node;
+}
+
+// a process died holding a shared pool's lock, partway through a miss.
+// frames it had claimed hold nothing usable, and it may have left the page
+// table halfway through a removal, so the table is rebuilt from the frames.
+// pins it held are not known and stay, keeping those frames from eviction.
+// called with the pool lock held.
+void bplus_buffer_pool_recover(struct bplus_buffer_pool *pool) {
+    for (uint32_t slot = 0; slot <= pool->table_mask; slot++) {
+        bplus_page_table_set(pool, slot, -1);
+    }
+    for (int i = 0; i < pool->num_frames; i++) {
+        struct bplus_frame *f = &pool->frames[i];
+        if (__atomic_load_n(&f->pin_count, __ATOMIC_ACQUIRE) < 0) {
+            __atomic_store_n(&f->page_id, BPLUS_INVALID_PAGE, __ATOMIC_RELAXED);
+            f->referenced = 0;
+            __atomic_store_n(&f->pin_count, 0, __ATOMIC_RELEASE);
+        }
+        if (i < pool->num_cached && f->page_id != BPLUS_INVALID_PAGE) {
+            bplus_page_table_insert(pool, i);
+        }
+    }
+    pool->stats.recoveries++;
+}
+
+void bplus_buffer_pool_lock(struct bplus_buffer_pool *pool) {
+    if (pthread_mutex_lock(&pool->lock) == EOWNERDEAD) {
+        printf("a process died holding the buffer pool lock\n");
+        bplus_buffer_pool_recover(pool);
+        pthread_mutex_consistent(&pool->lock);
+    }
+}
+
+// look up page_id in the cache, loading it on a miss. the returned node is
+// pinned and must be released with bplus_buffer_pool_unpin.
+struct bplus_node *
+bplus_buffer_pool_fetch(struct bplus_buffer_pool *pool, uint32_t page_id) {
+    if (pool->map != NULL) {
+        if (page_id >= pool->next_page_id) {
+            return NULL;
+        }
+        pool->stats.hits++;
+        return (struct bplus_node *)(pool->map +
+                                     bplus_buffer_pool_get_offset(page_id));
+    }
+
+    int frame = bplus_page_table_find(pool, page_id);
+    if (frame >= 0 && bplus_buffer_pool_try_pin(pool, frame, page_id)) {
+        __atomic_fetch_add(&pool->stats.hits, 1, __ATOMIC_RELAXED);
+        return &pool->nodes[frame];
+    }
+
+    // the lookup can miss while another thread reshuffles the table, so
+    // look again under the lock before going to disk
+    bplus_buffer_pool_lock(pool);
+    struct bplus_node *node = NULL;
+    frame = bplus_page_table_find(pool, page_id);
+    if (frame >= 0 && bplus_buffer_pool_try_pin(pool, frame, page_id)) {
+        __atomic_fetch_add(&pool->stats.hits, 1, __ATOMIC_RELAXED);
+        node = &pool->nodes[frame];
+    } else {
+        pool->stats.misses++;
+        bplus_debug("loading page_id=%u from disk\n", page_id);
+        node = bplus_buffer_pool_load(pool, page_id);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return node;
+}
+
+// add a pin to a node the caller already has pinned
+void bplus_buffer_pool_pin(
+    struct bplus_buffer_pool *pool, struct bplus_node *node) {
+    if (pool->map != NULL) {
+        return;
+    }
+    struct bplus_frame *f = &pool->frames[bplus_buffer_pool_frame(pool, node)];
+    assert(__atomic_load_n(&f->pin_count, __ATOMIC_RELAXED) > 0);
+    __atomic_fetch_add(&f->pin_count, 1, __ATOMIC_RELAXED);
+}
+
+void bplus_buffer_pool_unpin(
+    struct bplus_buffer_pool *pool, struct bplus_node *node) {
+    if (pool->map != NULL) {
+        return;
+    }
+    struct bplus_frame *f = &pool->frames[bplus_buffer_pool_frame(pool, node)];
+    int pins = __atomic_fetch_sub(&f->pin_count, 1, __ATOMIC_RELEASE);
+    assert(pins > 0);
+    (void)pins;
+}
+
+// keep the image of a page about to change for the open snapshots, unless
+// it was already kept since the newest of them was taken. pages allocated
+// after every snapshot are invisible to them and never kept. the caller
+// holds the write latch, and the tree lock, so the table stays put.
+void bplus_snapshot_preserve(
+    struct bplus_buffer_pool *pool, struct bplus_node *node) {
+    uint64_t epoch = __atomic_load_n(&pool->snap_epoch, __ATOMIC_RELAXED);
+    struct bplus_version_table *t = pool->versions;
+    uint32_t page_id =
+        pool->frames[bplus_buffer_pool_frame(pool, node)].page_id;
+    if (epoch == 0 || t == NULL || page_id >= t->len ||
+        t->chains[page_id].epoch >= epoch) {
+        return;
+    }
+
+    struct bplus_version_chain *c = &t->chains[page_id];
+    struct bplus_page_version *v = malloc(sizeof(*v));
+    v->epoch = epoch;
+    memcpy(&v->disk, &node->disk, sizeof(v->disk));
+    // the latch keeps other writers off the chain, but a release may unlink
+    // all of it meanwhile
+    struct bplus_page_version *older =
+        __atomic_load_n(&c->newest, __ATOMIC_ACQUIRE);
+    do {
+        v->older = older;
+    } while (!__atomic_compare_exchange_n(
+        &c->newest, &older, v, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    c->epoch = epoch;
+    __atomic_fetch_add(&pool->stats.versions, 1, __ATOMIC_RELAXED);
+}
+
+// free every kept image and version table, once no snapshot is open and
+// no writer can be pushing
+void bplus_snapshot_free_versions(struct bplus_buffer_pool *pool) {
+    struct bplus_version_table *t = pool->versions;
+    for (uint32_t i = 0; t != NULL && i < t->len; i++) {
+        struct bplus_page_version *v = t->chains[i].newest;
+        while (v != NULL) {
+            struct bplus_page_version *older = v->older;
+            free(v);
+            v = older;
+        }
+    }
+    while (t != NULL) {
+        struct bplus_version_table *replaced = t->replaced;
+        free(t);
+        t = replaced;
+    }
+    while (pool->retired != NULL) {
+        struct bplus_page_version *older = pool->retired->older;
+        free(pool->retired);
+        pool->retired = older;
+    }
+    pool->versions = NULL;
+}
+
+// call before changing a page, with its write latch held. an open snapshot
+// gets the page's image first.
+void bplus_buffer_pool_mark_dirty(
+    struct bplus_buffer_pool *pool, struct bplus_node *node) {
+    assert(!bplus_buffer_pool_readonly(pool));
+    if (__atomic_load_n(&pool->snap_epoch, __ATOMIC_RELAXED) != 0) {
+        bplus_snapshot_preserve(pool, node);
+    }
+    int frame = bplus_buffer_pool_frame(pool, node);
+    struct bplus_frame *f = &pool->frames[frame];
+    if (!f->dirty) {
+        pthread_mutex_lock(&pool->dirty_lock);
+        f->dirty = 1;
+        f->dirty_slot = pool->num_dirty;
+        pool->dirty_set[pool->num_dirty] = frame;
+        __atomic_store_n(
+            &pool->num_dirty, pool->num_dirty + 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&pool->dirty_lock);
+    }
+}
+
+// node latches. readers take them shared and writers exclusive, always
+// parent before child and left sibling before right, so crabbing threads
+// can't deadlock. in mmap mode nothing is ever written and they are no-ops.
+#define BPLUS_LATCH_READ 0
+#define BPLUS_LATCH_WRITE 1
+
+void bplus_node_latch(
+    struct bplus_buffer_pool *pool, struct bplus_node *node, int mode) {
+    if (pool->map != NULL) {
+        return;
+    }
+    struct bplus_frame *f = &pool->frames[bplus_buffer_pool_frame(pool, node)];
+    if (mode == BPLUS_LATCH_WRITE) {
+        pthread_rwlock_wrlock(&f->latch);
+    } else {
+        pthread_rwlock_rdlock(&f->latch);
+    }
+}
+
+// returns 1 if the latch was free and is now held
+int bplus_node_try_latch(
+    struct bplus_buffer_pool *pool, struct bplus_node *node, int mode) {
+    if (pool->map != NULL) {
+        return 1;
+    }
+    struct bplus_frame *f = &pool->frames[bplus_buffer_pool_frame(pool, node)];
+    if (mode == BPLUS_LATCH_WRITE) {
+        return pthread_rwlock_trywrlock(&f->latch) == 0;
+    }
+    return pthread_rwlock_tryrdlock(&f->latch) == 0;
+}
+
+void bplus_node_unlatch(
+    struct bplus_buffer_pool *pool, struct bplus_node *node) {
+    if (pool->map != NULL) {
+        return;
+    }
+    pthread_rwlock_unlock(
+        &pool->frames[bplus_buffer_pool_frame(pool, node)].latch);
+}
+
+// drop both the latch and the pin on node
+void bplus_node_release(
+    struct bplus_buffer_pool *pool, struct bplus_node *node) {
+    bplus_node_unlatch(pool, node);
+    bplus_buffer_pool_unpin(pool, node);
+}
+
+// hint that page_id will be needed soon so the read overlaps with whatever
+// the caller does in the meantime
+void bplus_buffer_pool_prefetch(
+    struct bplus_buffer_pool *pool, uint32_t page_id) {
+    if (page_id >= __atomic_load_n(&pool->next_page_id, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (pool->map != NULL) {
+        madvise(
+            pool->map + bplus_buffer_pool_get_offset(page_id), BPLUS_PAGE_SIZE,
+            MADV_WILLNEED);
+        return;
+    }
+    if (bplus_page_table_find(pool, page_id) >= 0) {
+        return;
+    }
+    off_t offset = bplus_buffer_pool_get_offset(page_id);
+    off_t len = BPLUS_PAGE_SIZE;
+    if (pool->extents != NULL) {
+        pthread_mutex_lock(&pool->extents->lock);
+        uint64_t entry = page_id < pool->extents->num_entries
+                             ? pool->extents->entries[page_id]
+                             : 0;
+        pthread_mutex_unlock(&pool->extents->lock);
+        offset = (off_t)(entry >> 16) * BPLUS_SECTOR_SIZE;
+        len = entry & 0xffff;
+    }
+    posix_fadvise(pool->fd, offset, len, POSIX_FADV_WILLNEED);
+}
+
+// the worker pool for flushing, bulk loading and the like, started on first
+// use with a worker per CPU
+pthread_once_t bplus_tasks_once = PTHREAD_ONCE_INIT;
+struct taskpool *bplus_tasks_pool;
+
+void bplus_tasks_init(void) { bplus_tasks_pool = taskpool_create(NULL); }
+
+struct taskpool *bplus_tasks(void) {
+    pthread_once(&bplus_tasks_once, bplus_tasks_init);
+    return bplus_tasks_pool;
+}
+
+// dirty pages handed to each flush task, and the most one pwritev takes
+#define BPLUS_FLUSH_CHUNK 64
+
+int bplus_io_req_compare(const void *a, const void *b) {
+    uint32_t x = ((const struct bplus_io_req *)a)->page_id;
+    uint32_t y = ((const struct bplus_io_req *)b)->page_id;
+    return x < y ? -1 : x > y;
+}
+
+// write pages sorted by page_id, one pwritev per run of consecutive ones
+int bplus_buffer_pool_write_runs(
+    struct bplus_buffer_pool *pool, struct bplus_io_req *reqs, int n) {
+    struct iovec iov[BPLUS_FLUSH_CHUNK];
+    for (int i = 0, end; i < n; i = end) {
+        uint32_t first = reqs[i].page_id;
+        for (end = i + 1; end < n && end - i < BPLUS_FLUSH_CHUNK &&
+                          reqs[end].page_id == first + (end - i);
+             end++) {
+        }
+        for (int j = i; j < end; j++) {
+            iov[j - i].iov_base = reqs[j].buf;
+            iov[j - i].iov_len = BPLUS_PAGE_SIZE;
+        }
+        size_t len = (size_t)(end - i) * BPLUS_PAGE_SIZE;
+        off_t offset = bplus_buffer_pool_get_offset(first);
+        if (pwritev(pool->fd, iov, end - i, offset) != (ssize_t)len) {
+            perror("flush write");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct bplus_flush {
+    struct bplus_buffer_pool *pool;
+    struct bplus_io_req *reqs;
+    int write; // write each slice too, not just seal it
+    int failed;
+};
+
+void bplus_flush_range(void *ctx, int64_t lo, int64_t hi) {
+    struct bplus_flush *f = ctx;
+    for (int64_t i = lo; i < hi; i++) {
+        bplus_page_seal(f->reqs[i].buf);
+    }
+    if (f->write &&
+        bplus_buffer_pool_write_runs(f->pool, f->reqs + lo, hi - lo) < 0) {
+        __atomic_store_n(&f->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// write back every dirty page, in page_id order. pages are checksummed in
+// place, in parallel and without their latches, so the caller must hold the
+// tree lock exclusively to keep writers out. with plain pwrite, runs of
+// neighbouring pages go out as one pwritev each from several workers;
+// other backends get every page in one batch instead.
+int bplus_buffer_pool_flush(struct bplus_buffer_pool *pool) {
+    if (pool->map != NULL) {
+        return 0;
+    }
+
+    bplus_buffer_pool_lock(pool);
+
+    int n = pool->num_dirty;
+    struct bplus_io_req *reqs = malloc(n * sizeof(struct bplus_io_req));
+    for (int i = 0; i < n; i++) {
+        int frame = pool->dirty_set[i];
+        reqs[i].page_id = pool->frames[frame].page_id;
+        reqs[i].buf = &pool->nodes[frame].disk;
+    }
+    qsort(reqs, n, sizeof(struct bplus_io_req), bplus_io_req_compare);
+
+    struct bplus_flush f = {
+        .pool = pool,
+        .reqs = reqs,
+        .write = pool->io == &bplus_io_pread && pool->extents == NULL,
+    };
+    taskpool_for(bplus_tasks(), 0, n, BPLUS_FLUSH_CHUNK, bplus_flush_range, &f);
+    int ret = f.failed ? -1 : 0;
+    if (!f.write) {
+        ret = bplus_buffer_pool_write_pages(pool, reqs, n);
+    }
+    if (ret == 0) {
+        // only the pages written leave the set
+        for (int i = 0; i < n; i++) {
+            bplus_buffer_pool_clean(
+                pool, bplus_buffer_pool_frame(pool, reqs[i].buf));
+        }
+        pool->stats.writes += n;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(reqs);
+    return ret;
+}
+
+// bring every uncached page in page_ids into the pool with one batched read.
+// pages are left unpinned. returns the number of pages read or -1.
+int bplus_buffer_pool_load_many(
+    struct bplus_buffer_pool *pool, uint32_t *page_ids, int n) {
+    if (pool->map != NULL) {
+        return 0;
+    }
+
+    struct bplus_io_req *reqs = malloc(n * sizeof(struct bplus_io_req));
+    struct bplus_node **nodes = malloc(n * sizeof(struct bplus_node *));
+    int count = 0;
+
+    // compaction shrinks the file under the lock
+    bplus_buffer_pool_lock(pool);
+    uint32_t num_pages = __atomic_load_n(&pool->next_page_id, __ATOMIC_RELAXED);
+    for (int i = 0; i < n; i++) {
+        if (page_ids[i] >= num_pages ||
+            bplus_page_table_find(pool, page_ids[i]) >= 0) {
+            continue;
+        }
+
+        // frames stay claimed until the read completes so the batch can't
+        // evict its own pages
+        struct bplus_node *node =
+            bplus_buffer_pool_alloc_frame(pool, page_ids[i]);
+        if (node == NULL) {
+            break;
+        }
+        nodes[count] = node;
+        reqs[count].page_id = page_ids[i];
+        reqs[count].buf = &node->disk;
+        count++;
+    }
+
+    int ret = bplus_buffer_pool_read_pages(pool, reqs, count);
+    // a bad page is left out of the cache; fetch reports it if the caller
+    // goes on to need it
+    for (int i = 0; i < count; i++) {
+        if (ret < 0 || bplus_page_verify(&nodes[i]->disk, reqs[i].page_id) !=
+                           BPLUS_PAGE_OK) {
+            bplus_buffer_pool_discard(pool, nodes[i]);
+        } else {
+            bplus_buffer_pool_publish(pool, nodes[i]);
+            bplus_buffer_pool_unpin(pool, nodes[i]);
+        }
+    }
+    if (ret == 0) {
+        pool->stats.reads += count;
+        ret = count;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(reqs);
+    free(nodes);
+    return ret;
+}
+
+// rebuild the free list from the chain the header points at. a broken
+// chain leaves the rest of its pages unused until the tree is compacted.
+void bplus_buffer_pool_read_free_list(
+    struct bplus_buffer_pool *pool, uint32_t head, uint32_t count) {
+    pool->free_pages = malloc(count * sizeof(uint32_t));
+    pool->free_cap = count;
+
+    uint32_t n = 0;
+    for (uint32_t page_id = head; n < count; n++) {
+        uint32_t next = BPLUS_INVALID_PAGE;
+        int ok = page_id < pool->next_page_id;
+        struct bplus_node_disk page;
+        if (ok && pool->extents != NULL) {
+            ok = bplus_extent_read(
+                     pool->extents, pool->fd, page_id, &page, NULL) == 0;
+            next = page.next;
+        } else if (ok) {
+            off_t offset = bplus_buffer_pool_get_offset(page_id) +
+                           offsetof(struct bplus_node_disk, next);
+            ok = pread(pool->fd, &next, sizeof(next), offset) == sizeof(next);
+        }
+        if (!ok) {
+            printf(
+                "free list broken at page %u, losing %u pages\n", page_id,
+                count - n);
+            break;
+        }
+        pool->free_pages[n] = page_id;
+        page_id = next;
+    }
+
+    // the head of the chain is the top of the stack
+    for (uint32_t i = 0; i < n / 2; i++) {
+        uint32_t tmp = pool->free_pages[i];
+        pool->free_pages[i] = pool->free_pages[n - 1 - i];
+        pool->free_pages[n - 1 - i] = tmp;
+    }
+    pool->num_free = n;
+}
+
+// forget every page from num_pages on. nothing may point at them any more,
+// so dirty copies are dropped unwritten.
+void bplus_buffer_pool_drop_pages(
+    struct bplus_buffer_pool *pool, uint32_t num_pages) {
+    bplus_buffer_pool_lock(pool);
+    for (int i = 0; i < pool->num_cached; i++) {
+        struct bplus_frame *f = &pool->frames[i];
+        if (f->page_id == BPLUS_INVALID_PAGE || f->page_id < num_pages) {
+            continue;
+        }
+        // lookups racing through the page table can pin any frame for a
+        // moment before they notice it holds the wrong page
+        int unpinned = 0;
+        while (!__atomic_compare_exchange_n(
+            &f->pin_count, &unpinned, -1, 0, __ATOMIC_ACQUIRE,
+            __ATOMIC_RELAXED)) {
+            assert(unpinned > 0);
+            unpinned = 0;
+            sched_yield();
+        }
+        bplus_buffer_pool_clean(pool, i);
+        bplus_buffer_pool_discard(pool, &pool->nodes[i]);
+    }
+    __atomic_store_n(&pool->next_page_id, num_pages, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void bplus_buffer_pool_destroy(struct bplus_buffer_pool *pool) {
+    if (pool->map != NULL) {
+        munmap(pool->map, pool->map_len);
+    } else {
+        pool->io->close(pool);
+    }
+    if (pool->extents != NULL) {
+        bplus_extent_table_close(pool->extents);
+    }
+    close(pool->fd);
+    free(pool->free_pages);
+    bplus_snapshot_free_versions(pool);
+
+    // other processes may still be using a shared pool's latches, and the
+    // pool itself goes with the arena
+    if (pool->shared && pool->owner != getpid()) {
+        struct bplus_arena arena = pool->arena;
+        bplus_arena_destroy(&arena);
+        return;
+    }
+    for (int i = 0; pool->frames != NULL && i < pool->num_frames; i++) {
+        pthread_rwlock_destroy(&pool->frames[i].latch);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->snap_lock);
+    pthread_mutex_destroy(&pool->dirty_lock);
+    struct bplus_arena arena = pool->arena;
+    if (!pool->shared) {
+        free(pool);
+    }
+    bplus_arena_destroy(&arena);
+}
+
+// write-ahead log. inserts append a logical PUT record before touching the
+// tree. a checkpoint logs the image of every dirty page followed by a
+// CHECKPOINT record, and only then overwrites pages in place, so an
+// interrupted checkpoint is finished by replaying the images. the log is
+// truncated once the page file is synced.
+#define BPLUS_WAL_PUT 1
+#define BPLUS_WAL_PAGE 2
+#define BPLUS_WAL_CHECKPOINT 3
+#define BPLUS_WAL_DELETE 4
+
+// buffered bytes that force a write in BPLUS_WAL_SYNC_NONE mode
+#define BPLUS_WAL_BUFFER_SIZE (1 << 20)
+#define BPLUS_WAL_DEFAULT_INTERVAL_MS 10
+
+struct bplus_wal_record {
+    uint32_t crc; // crc32c of the rest of the record, payload included
+    uint32_t len; // record length including this header
+    uint64_t lsn;
+    uint32_t type;
+    // PUT, DELETE: key length, PAGE: page_id, CHECKPOINT: root page_id
+    uint32_t a;
+    uint32_t b; // PUT: value length, CHECKPOINT: tree height
+    uint32_t reserved;
+    // payload. PUT: key then value, DELETE: key, PAGE: the page image,
+    // CHECKPOINT: the header to write, holding the lsn of the last change
+    // the checkpoint covers
+};
+
+struct bplus_wal_stats {
+    uint64_t commits;
+    uint64_t syncs;
+};
+
+struct bplus_wal {
+    int fd;
+    int mode;
+    int interval_ms;
+
+    pthread_mutex_t lock;
+    pthread_cond_t synced;
+
+    // records appended but not yet written
+    char *buf;
+    size_t buf_len;
+    size_t buf_cap;
+
+    uint64_t next_lsn;    // lsn of the next record
+    uint64_t written_lsn; // every record up to here has been written
+    uint64_t durable_lsn; // and up to here synced
+    int syncing;          // a commit leader is writing the log
+    int failed;           // a log write failed, nothing is durable anymore
+
+    pthread_t flusher;
+    int stop;
+
+    struct bplus_wal_stats stats;
+};
+
+// append a record and return its lsn. the record is durable once
+// bplus_wal_commit returns for that lsn.
+uint64_t bplus_wal_append(
+    struct bplus_wal *wal,
+    uint32_t type,
+    uint32_t a,
+    uint32_t b,
+    const void *p1,
+    uint32_t p1_len,
+    const void *p2,
+    uint32_t p2_len) {
+    struct bplus_wal_record rec = {
+        .len = sizeof(rec) + p1_len + p2_len,
+        .type = type,
+        .a = a,
+        .b = b,
+    };
+
+    pthread_mutex_lock(&wal->lock);
+
+    rec.lsn = wal->next_lsn++;
+    rec.crc = bplus_crc32c(0, (char *)&rec + sizeof(rec.crc),
+                           sizeof(rec) - sizeof(rec.crc));
+    rec.crc = bplus_crc32c(rec.crc, p1, p1_len);
+    rec.crc = bplus_crc32c(rec.crc, p2, p2_len);
+
+    while (wal->buf_len + rec.len > wal->buf_cap) {
+        wal->buf_cap = wal->buf_cap ? wal->buf_cap * 2 : BPLUS_WAL_BUFFER_SIZE;
+        wal->buf = realloc(wal->buf, wal->buf_cap);
+    }
+    memcpy(&wal->buf[wal->buf_len], &rec, sizeof(rec));
+    memcpy(&wal->buf[wal->buf_len + sizeof(rec)], p1, p1_len);
+    if (p2_len > 0) {
+        memcpy(&wal->buf[wal->buf_len + sizeof(rec) + p1_len], p2, p2_len);
+    }
+    wal->buf_len += rec.len;
+
+    pthread_mutex_unlock(&wal->lock);
+    return rec.lsn;
+}
+
+// write everything appended so far, then fdatasync if do_sync is set.
+// concurrent callers queue behind a single leader, and whoever leads takes
+// every record buffered by then, so one sync covers many commits.
+// called with wal->lock held.
+int bplus_wal_sync_locked(struct bplus_wal *wal, uint64_t lsn, int do_sync) {
+    while ((do_sync ? wal->durable_lsn : wal->written_lsn) < lsn &&
+           !wal->failed) {
+        if (wal->syncing) {
+            pthread_cond_wait(&wal->synced, &wal->lock);
+            continue;
+        }
+
+        // become the leader for everything buffered so far
+        wal->syncing = 1;
+        char *buf = wal->buf;
+        size_t len = wal->buf_len;
+        uint64_t target = wal->next_lsn - 1;
+        wal->buf = malloc(wal->buf_cap);
+        wal->buf_len = 0;
+        pthread_mutex_unlock(&wal->lock);
+
+        int ok = 1;
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = write(wal->fd, buf + done, len - done);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("write wal");
+                ok = 0;
+                break;
+            }
+            done += n;
+        }
+        if (ok && do_sync && fdatasync(wal->fd) < 0) {
+            perror("fdatasync wal");
+            ok = 0;
+        }
+        free(buf);
+
+        pthread_mutex_lock(&wal->lock);
+        wal->syncing = 0;
+        if (ok) {
+            wal->written_lsn = target;
+            if (do_sync) {
+                wal->durable_lsn = target;
+                wal->stats.syncs++;
+            }
+        } else {
+            wal->failed = 1;
+        }
+        pthread_cond_broadcast(&wal->synced);
+    }
+    return wal->failed ? -1 : 0;
+}
+
+int bplus_wal_sync(struct bplus_wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    int ret = bplus_wal_sync_locked(wal, wal->next_lsn - 1, 1);
+    pthread_mutex_unlock(&wal->lock);
+    return ret;
+}
+
+// make the record at lsn durable according to the sync mode
+int bplus_wal_commit(struct bplus_wal *wal, uint64_t lsn) {
+    pthread_mutex_lock(&wal->lock);
+    wal->stats.commits++;
+
+    int ret = wal->failed ? -1 : 0;
+    if (wal->mode == BPLUS_WAL_SYNC_COMMIT) {
+        ret = bplus_wal_sync_locked(wal, lsn, 1);
+    } else if (wal->mode == BPLUS_WAL_SYNC_NONE &&
+               wal->buf_len >= BPLUS_WAL_BUFFER_SIZE) {
+        ret = bplus_wal_sync_locked(wal, lsn, 0);
+    }
+
+    pthread_mutex_unlock(&wal->lock);
+    return ret;
+}
+
+void *bplus_wal_flusher(void *data) {
+    struct bplus_wal *wal = data;
+
+    pthread_mutex_lock(&wal->lock);
+    while (!wal->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)wal->interval_ms * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&wal->synced, &wal->lock, &deadline);
+
+        if (wal->durable_lsn < wal->next_lsn - 1) {
+            bplus_wal_sync_locked(wal, wal->next_lsn - 1, 1);
+        }
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+// the log lives next to the tree file
+char *bplus_wal_path(const char *path) {
+    size_t len = strlen(path);
+    char *wal_path = malloc(len + sizeof("-wal"));
+    memcpy(wal_path, path, len);
+    memcpy(wal_path + len, "-wal", sizeof("-wal"));
+    return wal_path;
+}
+
+struct bplus_wal *bplus_wal_open(const char *path, int mode, int interval_ms) {
+    int fd = open(path, O_CREAT | O_RDWR | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("open wal");
+        return NULL;
+    }
+
+    struct bplus_wal *wal = calloc(1, sizeof(struct bplus_wal));
+    wal->fd = fd;
+    wal->mode = mode;
+    wal->interval_ms =
+        interval_ms > 0 ? interval_ms : BPLUS_WAL_DEFAULT_INTERVAL_MS;
+    wal->next_lsn = 1;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->synced, NULL);
+
+    if (mode == BPLUS_WAL_SYNC_INTERVAL) {
+        pthread_create(&wal->flusher, NULL, bplus_wal_flusher, wal);
+    }
+    return wal;
+}
+
+// drop every record. only safe once the page file holds all of them.
+int bplus_wal_truncate(struct bplus_wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    int ret = bplus_wal_sync_locked(wal, wal->next_lsn - 1, 0);
+    if (ret == 0 && (ftruncate(wal->fd, 0) < 0 || fdatasync(wal->fd) < 0)) {
+        perror("truncate wal");
+        ret = -1;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return ret;
+}
+
+// write out and sync anything still buffered, then release the log
+void bplus_wal_close(struct bplus_wal *wal) {
+    if (wal->mode == BPLUS_WAL_SYNC_INTERVAL) {
+        pthread_mutex_lock(&wal->lock);
+        wal->stop = 1;
+        pthread_cond_broadcast(&wal->synced);
+        pthread_mutex_unlock(&wal->lock);
+        pthread_join(wal->flusher, NULL);
+    }
+
+    bplus_wal_sync(wal);
+    close(wal->fd);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->synced);
+    free(wal->buf);
+    free(wal);
+}
+
+// read the whole log into memory and return the length of its valid prefix.
+// scanning stops at the first record that is truncated or fails its crc.
+// the returned buffer is always allocated and must be freed.
+size_t bplus_wal_read(struct bplus_wal *wal, char **out) {
+    struct stat st = {0};
+    fstat(wal->fd, &st);
+
+    char *buf = malloc(st.st_size + 1);
+    ssize_t len = pread(wal->fd, buf, st.st_size, 0);
+    if (len < 0) {
+        len = 0;
+    }
+
+    size_t pos = 0;
+    while (pos + sizeof(struct bplus_wal_record) <= (size_t)len) {
+        struct bplus_wal_record rec;
+        memcpy(&rec, &buf[pos], sizeof(rec));
+        if (rec.len < sizeof(rec) || pos + rec.len > (size_t)len) {
+            break;
+        }
+        uint32_t crc = bplus_crc32c(
+            0, &buf[pos + sizeof(rec.crc)], rec.len - sizeof(rec.crc));
+        if (crc != rec.crc) {
+            break;
+        }
+        pos += rec.len;
+    }
+
+    // cut the log back so new records follow the last good one
+    if (pos < (size_t)len) {
+        printf("wal: dropping %zu bytes of torn log tail\n", len - pos);
+        if (ftruncate(wal->fd, pos) < 0) {
+            perror("truncate wal");
+        }
+    }
+    *out = buf;
+    return pos;
+}
+
+// finish the last logged checkpoint, if any: write its page images in place
+// and install its header. runs before the tree is loaded.
+int bplus_wal_recover_pages(
+    struct bplus_buffer_pool *pool, const char *buf, size_t len) {
+    // only images followed by a complete CHECKPOINT record count
+    size_t end = 0;
+    for (size_t pos = 0; pos < len;) {
+        struct bplus_wal_record rec;
+        memcpy(&rec, &buf[pos], sizeof(rec));
+        pos += rec.len;
+        if (rec.type == BPLUS_WAL_CHECKPOINT) {
+            end = pos;
+        }
+    }
+
+    int ret = 0;
+    for (size_t pos = 0; pos < end && ret == 0;) {
+        struct bplus_wal_record rec;
+        memcpy(&rec, &buf[pos], sizeof(rec));
+        if (rec.type == BPLUS_WAL_PAGE) {
+            // images are logged before the flush seals them
+            struct bplus_node_disk page;
+            memcpy(&page, &buf[pos + sizeof(rec)], BPLUS_PAGE_SIZE);
+            bplus_page_seal(&page);
+            struct bplus_io_req req = {.page_id = rec.a, .buf = &page};
+            if (bplus_buffer_pool_write_pages(pool, &req, 1) < 0) {
+                printf("wal: couldn't restore page %u\n", rec.a);
+                ret = -1;
+            }
+            if (rec.a >= pool->next_page_id) {
+                pool->next_page_id = rec.a + 1;
+            }
+        }
+        pos += rec.len;
+    }
+
+    if (end > 0 && ret == 0) {
+        struct bplus_disk_header header;
+        memcpy(&header, &buf[end - sizeof(header)], sizeof(header));
+        if (pwrite(pool->fd, &header, sizeof(header), 0) != sizeof(header) ||
+            bplus_buffer_pool_sync(pool) < 0) {
+            perror("wal: restore header");
+            ret = -1;
+        }
+        printf("wal: finished checkpoint at lsn %llu\n",
+               (unsigned long long)header.checkpoint_lsn);
+    }
+    return ret;
+}
+
+char *bplus_node_key(struct bplus_node *node, int i) {
+    return &node->disk.buf[node->disk.slots[i].offset];
+}
+
+char *bplus_node_value(struct bplus_node *node, int i) {
+    struct bplus_slot *slot = &node->disk.slots[i];
+    return &node->disk.buf[slot->offset + slot->key_len];
+}
+
+// compare two keys bytewise, a shorter key sorts before its extensions
+int bplus_key_compare(const char *a, int a_len, const char *b, int b_len) {
+    int compare_len = a_len < b_len ? a_len : b_len;
+    int cmp = memcmp(a, b, compare_len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return a_len - b_len;
+}
+
+// pack the first 4 bytes of a key so that comparing heads as integers agrees
+// with memcmp order. short keys are zero padded, so equal heads are a tie.
+uint32_t bplus_key_head(const char *key, int key_len) {
+    uint32_t head = 0;
+    for (int i = 0; i < 4; i++) {
+        head <<= 8;
+        if (i < key_len) {
+            head |= (unsigned char)key[i];
+        }
+    }
+    return head;
+}
+
+const struct bplus_key_ops bplus_keys_bytes = {
+    .name = "bytes",
+    .compare = bplus_key_compare,
+    .head = bplus_key_head,
+};
+
+uint32_t bplus_keys_head(
+    const struct bplus_key_ops *keys, const char *key, int key_len) {
+    return keys->head != NULL ? keys->head(key, key_len) : 0;
+}
+
+int bplus_keys_compare(
+    const struct bplus_key_ops *keys,
+    const char *a,
+    int a_len,
+    const char *b,
+    int b_len) {
+    // the default order is common enough to skip the indirect call
+    if (keys == &bplus_keys_bytes) {
+        return bplus_key_compare(a, a_len, b, b_len);
+    }
+    return keys->compare(a, a_len, b, b_len);
+}
+
+// compare a search key against the key stored at index i
+int bplus_node_compare_key(
+    const struct bplus_key_ops *keys,
+    struct bplus_node *node,
+    int i,
+    const char *key,
+    int key_len,
+    uint32_t head) {
+    struct bplus_slot *slot = &node->disk.slots[i];
+#if BPLUS_KEY_HEADS
+    if (head != slot->head) {
+        return head < slot->head ? -1 : 1;
+    }
+#endif
+    return bplus_keys_compare(
+        keys, key, key_len, &node->disk.buf[slot->offset], slot->key_len);
+}
+
+// binary search for the first key >= the search key
+struct bplus_insert_index bplus_node_binary_search(
+    const struct bplus_key_ops *keys,
+    struct bplus_node *node,
+    const char *key,
+    int key_len) {
+
+    struct bplus_insert_index ret = {0};
+    uint32_t head = bplus_keys_head(keys, key, key_len);
+
+    int lo = 0;
+    int hi = node->disk.num_keys;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = bplus_node_compare_key(keys, node, mid, key, key_len, head);
+        if (cmp == 0) {
+            ret.found = 1;
+            ret.pos = mid;
+            return ret;
+        } else if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    ret.pos = lo;
+    return ret;
+}
+
+struct bplus_insert_index bplus_node_find_insert_index(
+    const struct bplus_key_ops *keys,
+    struct bplus_node *node,
+    int key_len,
+    const char *key) {
+    if (keys->search != NULL) {
+        return keys->search(keys, node, key, key_len);
+    }
+    return bplus_node_binary_search(keys, node, key, key_len);
+}
+
+// fixed width integer keys. "u64" stores them in native byte order and
+// compares them as numbers, "u64_be" stores them big endian, where memcmp
+// order already is numeric order. keys of any other length only turn up as
+// scan bounds, and sort before or after every 8 byte key by length.
+uint64_t bplus_u64_load(const char *p, int big_endian) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (big_endian) {
+        v = __builtin_bswap64(v);
+    }
+#else
+    (void)big_endian;
+#endif
+    return v;
+}
+
+int bplus_u64_compare(const char *a, int a_len, const char *b, int b_len) {
+    if (a_len != 8 || b_len != 8) {
+        return a_len - b_len;
+    }
+    uint64_t x = bplus_u64_load(a, 0);
+    uint64_t y = bplus_u64_load(b, 0);
+    return (x > y) - (x < y);
+}
+
+uint32_t bplus_u64_head(const char *key, int key_len) {
+    if (key_len != 8) {
+        return key_len < 8 ? 0 : UINT32_MAX;
+    }
+    return bplus_u64_load(key, 0) >> 32;
+}
+
+// the last few slots of a search are compared all at once: gathered into a
+// window padded with UINT64_MAX, the keys below the search key are exactly
+// the ones before its insert position
+#define BPLUS_U64_WINDOW 8
+
+int bplus_u64_count_below_sw(const uint64_t *window, uint64_t key) {
+    int n = 0;
+    for (int i = 0; i < BPLUS_U64_WINDOW; i++) {
+        n += window[i] < key;
+    }
+    return n;
+}
+
+int (*bplus_u64_count_below_impl)(const uint64_t *, uint64_t) =
+    bplus_u64_count_below_sw;
+pthread_once_t bplus_u64_once = PTHREAD_ONCE_INIT;
+
+#if defined(__x86_64__)
+// SSE4.2 only has a signed 64 bit compare, so both sides get their sign bit
+// flipped first. two keys per compare, four compares per window.
+__attribute__((target("sse4.2"))) int
+bplus_u64_count_below_sse42(const uint64_t *window, uint64_t key) {
+    __m128i bias = _mm_set1_epi64x((long long)0x8000000000000000ULL);
+    __m128i k = _mm_xor_si128(_mm_set1_epi64x((long long)key), bias);
+    int n = 0;
+    for (int i = 0; i < BPLUS_U64_WINDOW; i += 2) {
+        __m128i w = _mm_loadu_si128((const __m128i *)&window[i]);
+        __m128i lt = _mm_cmpgt_epi64(k, _mm_xor_si128(w, bias));
+        n += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(lt)));
+    }
+    return n;
+}
+#endif
+
+void bplus_u64_init(void) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        bplus_u64_count_below_impl = bplus_u64_count_below_sse42;
+    }
+#endif
+}
+
+int bplus_u64_count_below(const uint64_t *window, uint64_t key) {
+    pthread_once(&bplus_u64_once, bplus_u64_init);
+    return bplus_u64_count_below_impl(window, key);
+}
+
+struct bplus_insert_index bplus_u64_search_order(
+    const struct bplus_key_ops *keys,
+    struct bplus_node *node,
+    const char *key,
+    int key_len,
+    int big_endian) {
+    if (key_len != 8) {
+        return bplus_node_binary_search(keys, node, key, key_len);
+    }
+
+    struct bplus_insert_index ret = {0};
+    uint64_t k = bplus_u64_load(key, big_endian);
+    int lo = 0;
+    int hi = node->disk.num_keys;
+    while (hi - lo > BPLUS_U64_WINDOW) {
+        int mid = lo + (hi - lo) / 2;
+        uint64_t m = bplus_u64_load(bplus_node_key(node, mid), big_endian);
+        if (k == m) {
+            ret.found = 1;
+            ret.pos = mid;
+            return ret;
+        } else if (k < m) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    uint64_t window[BPLUS_U64_WINDOW];
+    for (int i = 0; i < BPLUS_U64_WINDOW; i++) {
+        window[i] = lo + i < hi ? bplus_u64_load(
+                                      bplus_node_key(node, lo + i), big_endian)
+                                : UINT64_MAX;
+    }
+    int below = bplus_u64_count_below(window, k);
+    ret.pos = lo + below;
+    ret.found = ret.pos < hi && window[below] == k;
+    return ret;
+}
+
+struct bplus_insert_index bplus_u64_search(
+    const struct bplus_key_ops *keys,
+    struct bplus_node *node,
+    const char *key,
+    int key_len) {
+    return bplus_u64_search_order(keys, node, key, key_len, 0);
+}
+
+struct bplus_insert_index bplus_u64_be_search(
+    const struct bplus_key_ops *keys,
+    struct bplus_node *node,
+    const char *key,
+    int key_len) {
+    return bplus_u64_search_order(keys, node, key, key_len, 1);
+}
+
+const struct bplus_key_ops bplus_keys_u64 = {
+    .name = "u64",
+    .key_size = 8,
+    .compare = bplus_u64_compare,
+    .head = bplus_u64_head,
+    .search = bplus_u64_search,
+};
+
+const struct bplus_key_ops bplus_keys_u64_be = {
+    .name = "u64_be",
+    .key_size = 8,
+    .compare = bplus_key_compare,
+    .head = bplus_key_head,
+    .search = bplus_u64_be_search,
+};
+
+// the built in orders, for opening a file by the name in its header
+const struct bplus_key_ops *bplus_key_ops_find(const char *name) {
+    const struct bplus_key_ops *builtin[] = {
+        &bplus_keys_bytes,
+        &bplus_keys_u64,
+        &bplus_keys_u64_be,
+    };
+    for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++) {
+        if (strncmp(builtin[i]->name, name, 16) == 0) {
+            return builtin[i];
+        }
+    }
+    return NULL;
+}
+
+// bytes left between the end of the slot directory and the start of the heap
+int bplus_node_free_space(struct bplus_node *node) {
+    return node->disk.heap_start -
+           node->disk.num_keys * (int)sizeof(struct bplus_slot);
+}
+
+// bytes taken by slots and live entries
+int bplus_node_used(struct bplus_node *node) {
+    return BPLUS_NODE_CAPACITY - bplus_node_free_space(node) -
+           node->disk.dead_bytes;
+}
+
+uint32_t bplus_node_child_id(struct bplus_node *node, int child_index) {
+    assert(!node->disk.is_leaf);
+
+    if (child_index == node->disk.num_keys) {
+        return node->disk.last_child;
+    }
+
+    uint32_t page_id;
+    memcpy(&page_id, bplus_node_value(node, child_index), sizeof(page_id));
+    return page_id;
+}
+
+void bplus_node_set_child_id(
+    struct bplus_node *node, int child_index, uint32_t page_id) {
+    assert(!node->disk.is_leaf);
+
+    if (child_index == node->disk.num_keys) {
+        node->disk.last_child = page_id;
+    } else {
+        memcpy(bplus_node_value(node, child_index), &page_id, sizeof(page_id));
+    }
+}
+
+struct bplus_node *bplus_node_get_child(
+    struct bplus_buffer_pool *pool, struct bplus_node *node, int child_index) {
+    assert(!node->disk.is_leaf);
+
+    if (child_index > node->disk.num_keys) {
+        return NULL;
+    }
+
+    return bplus_buffer_pool_fetch(
+        pool, bplus_node_child_id(node, child_index));
+}
+
+// the header describing the tree as it stands in memory
+struct bplus_disk_header
+bplus_tree_header(struct bplus_tree *tree, uint64_t checkpoint_lsn) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    struct bplus_disk_header header = {
+        .root_page_id = tree->root->disk.page_id,
+        .page_size = BPLUS_PAGE_SIZE,
+        .height = tree->height,
+        .num_free = pool->num_free,
+        .checkpoint_lsn = checkpoint_lsn,
+        .free_head = pool->num_free > 0 ? pool->free_pages[pool->num_free - 1]
+                                        : BPLUS_INVALID_PAGE,
+        .flags = pool->extents != NULL ? BPLUS_HEADER_COMPRESSED : 0,
+    };
+    strncpy(header.key_order, pool->keys->name, sizeof(header.key_order) - 1);
+    bplus_disk_header_seal(&header);
+    return header;
+}
+
+int bplus_tree_write_header(struct bplus_tree *tree, uint64_t checkpoint_lsn) {
+    struct bplus_disk_header header = bplus_tree_header(tree, checkpoint_lsn);
+    int written = pwrite(tree->pool->fd, &header, sizeof(header), 0);
+    return written == sizeof(header) ? 0 : -1;
+}
+
+// without a log: every dirty page, a sync, and only then the header, so a
+// header on disk never points at pages that aren't. the header is much
+// smaller than a sector and so is replaced whole, and synced in turn.
+// called with tree->lock held exclusively.
+int bplus_tree_write_back(struct bplus_tree *tree) {
+    if (bplus_buffer_pool_flush(tree->pool) < 0 ||
+        bplus_buffer_pool_sync(tree->pool) < 0 ||
+        bplus_tree_write_header(tree, 0) < 0) {
+        return -1;
+    }
+    return bplus_buffer_pool_sync(tree->pool);
+}
+
+// write every dirty page in place, with the log recording their images
+// first so a crash halfway through can be finished on the next open.
+// covered is the lsn of the last change reflected in the pages. the log is
+// emptied afterwards if truncate is set.
+int bplus_tree_checkpoint_upto(
+    struct bplus_tree *tree, uint64_t covered, int truncate) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    struct bplus_wal *wal = tree->wal;
+
+    bplus_buffer_pool_lock(pool);
+    for (int i = 0; i < pool->num_dirty; i++) {
+        int frame = pool->dirty_set[i];
+        bplus_wal_append(
+            wal, BPLUS_WAL_PAGE, pool->frames[frame].page_id, 0,
+            &pool->nodes[frame].disk, BPLUS_PAGE_SIZE, NULL, 0);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    struct bplus_disk_header header = bplus_tree_header(tree, covered);
+    bplus_wal_append(
+        wal, BPLUS_WAL_CHECKPOINT, tree->root->disk.page_id, tree->height,
+        &header, sizeof(header), NULL, 0);
+
+    if (bplus_wal_sync(wal) < 0 ||
+        bplus_tree_write_header(tree, covered) < 0 ||
+        bplus_buffer_pool_flush(pool) < 0 || bplus_buffer_pool_sync(pool) < 0) {
+        return -1;
+    }
+    return truncate ? bplus_wal_truncate(wal) : 0;
+}
+
+// called with tree->lock held exclusively
+int bplus_tree_checkpoint_locked(struct bplus_tree *tree) {
+    pthread_mutex_lock(&tree->wal->lock);
+    uint64_t covered = tree->wal->next_lsn - 1;
+    pthread_mutex_unlock(&tree->wal->lock);
+    return bplus_tree_checkpoint_upto(tree, covered, 1);
+}
+
+int bplus_tree_flush(struct bplus_tree *tree) {
+    if (bplus_buffer_pool_readonly(tree->pool)) {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&tree->lock);
+    int ret = tree->wal != NULL ? bplus_tree_checkpoint_locked(tree)
+                                : bplus_tree_write_back(tree);
+    pthread_rwlock_unlock(&tree->lock);
+    return ret;
+}
+
+void bplus_node_init(struct bplus_node *node, uint32_t page_id, int is_leaf) {
+    memset(&node->disk, 0, sizeof(node->disk));
+    node->disk.page_id = page_id;
+    node->disk.last_child = BPLUS_INVALID_PAGE;
+    node->disk.next = BPLUS_INVALID_PAGE;
+    node->disk.prev = BPLUS_INVALID_PAGE;
+    node->disk.num_keys = 0;
+    node->disk.is_leaf = is_leaf;
+    node->disk.heap_start = BPLUS_NODE_CAPACITY;
+}
+
+// allocate a page, reusing the most recently freed one before growing the
+// file. the returned node is pinned, write latched and dirty.
+struct bplus_node *
+bplus_node_create(struct bplus_buffer_pool *pool, int is_leaf) {
+    uint32_t page_id;
+    struct bplus_node *node = NULL;
+
+    bplus_buffer_pool_lock(pool);
+    int reused = pool->num_free > 0;
+    if (reused) {
+        page_id = pool->free_pages[--pool->num_free];
+        int frame = bplus_page_table_find(pool, page_id);
+        if (frame >= 0 && bplus_buffer_pool_try_pin(pool, frame, page_id)) {
+            node = &pool->nodes[frame];
+        }
+    } else {
+        page_id = __atomic_fetch_add(&pool->next_page_id, 1, __ATOMIC_RELAXED);
+    }
+
+    // the old contents of a free page don't matter, so it isn't read in,
+    // unless a snapshot taken before it was freed may still read them
+    if (node == NULL && reused &&
+        __atomic_load_n(&pool->snap_epoch, __ATOMIC_RELAXED) != 0) {
+        node = bplus_buffer_pool_load(pool, page_id);
+    }
+    if (node == NULL) {
+        node = bplus_buffer_pool_alloc_frame(pool, page_id);
+        if (node != NULL) {
+            bplus_buffer_pool_publish(pool, node);
+        } else if (reused) {
+            pool->num_free++;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    bplus_node_latch(pool, node, BPLUS_LATCH_WRITE);
+    bplus_buffer_pool_mark_dirty(pool, node);
+    bplus_node_init(node, page_id, is_leaf);
+
+    return node;
+}
+
+// overflow pages needed for a value of len bytes
+int bplus_overflow_pages(int len) {
+    return (len + BPLUS_NODE_CAPACITY - 1) / BPLUS_NODE_CAPACITY;
+}
+
+// whether an entry keeps its value in overflow pages rather than the leaf
+int bplus_entry_overflows(int key_len, int val_len) {
+    return val_len > BPLUS_MAX_INLINE_VALUE ||
+           key_len + val_len > BPLUS_MAX_ENTRY_SIZE;
+}
+
+// the bytes a leaf stores for v
+char *bplus_value_stored(struct bplus_value *v) {
+    return v->overflow ? (char *)&v->ref : v->data;
+}
+
+int bplus_value_stored_len(struct bplus_value *v) {
+    return v->overflow ? (int)sizeof(v->ref) : v->len;
+}
+
+// turn a freshly initialised page into a chunk of an overflow chain
+void bplus_overflow_fill(
+    struct bplus_node *node, const char *data, int len, uint32_t next) {
+    node->disk.kind = BPLUS_PAGE_OVERFLOW;
+    node->disk.next = next;
+    node->disk.heap_start = BPLUS_NODE_CAPACITY - len;
+    memcpy(&node->disk.buf[node->disk.heap_start], data, len);
+}
+
+// put a chain no leaf refers to any more on the free list. its pages already
+// link to each other through next the way free pages do on disk, so only the
+// last one has to be written, to link it to the page freed before.
+int bplus_overflow_free(
+    struct bplus_buffer_pool *pool, const struct bplus_overflow_ref *ref) {
+    uint32_t *ids = NULL;
+    int n = 0;
+    int cap = 0;
+    struct bplus_node *last = NULL;
+
+    for (uint32_t page_id = ref->first_page; page_id != BPLUS_INVALID_PAGE;) {
+        struct bplus_node *node = bplus_buffer_pool_fetch(pool, page_id);
+        if (node == NULL) {
+            printf("overflow chain broken at page %u, leaking it\n", page_id);
+            free(ids);
+            return -1;
+        }
+        if (n == cap) {
+            cap = cap > 0 ? 2 * cap : 64;
+            ids = realloc(ids, cap * sizeof(uint32_t));
+        }
+        ids[n++] = page_id;
+
+        bplus_node_latch(pool, node, BPLUS_LATCH_READ);
+        page_id = node->disk.next;
+        bplus_node_unlatch(pool, node);
+        if (page_id == BPLUS_INVALID_PAGE) {
+            last = node;
+        } else {
+            bplus_buffer_pool_unpin(pool, node);
+        }
+    }
+    if (last == NULL) {
+        return 0;
+    }
+
+    bplus_node_latch(pool, last, BPLUS_LATCH_WRITE);
+    bplus_buffer_pool_mark_dirty(pool, last);
+    bplus_buffer_pool_lock(pool);
+    while (pool->num_free + n > pool->free_cap) {
+        pool->free_cap = pool->free_cap > 0 ? 2 * pool->free_cap : 64;
+        pool->free_pages =
+            realloc(pool->free_pages, pool->free_cap * sizeof(uint32_t));
+    }
+    if (pool->num_free > 0) {
+        last->disk.next = pool->free_pages[pool->num_free - 1];
+    }
+    // the first page of the chain ends up on top
+    for (int i = n - 1; i >= 0; i--) {
+        pool->free_pages[pool->num_free++] = ids[i];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    bplus_node_release(pool, last);
+
+    free(ids);
+    return 0;
+}
+
+// copy val into a new chain of overflow pages and point ref at it. the
+// chain is private until a leaf refers to it, so only the page being linked
+// up is held at a time.
+int bplus_overflow_write(
+    struct bplus_buffer_pool *pool,
+    char *val,
+    int val_len,
+    struct bplus_overflow_ref *ref) {
+    struct bplus_node *prev = NULL;
+    ref->len = val_len;
+    ref->first_page = BPLUS_INVALID_PAGE;
+
+    for (int off = 0; off < val_len; off += BPLUS_NODE_CAPACITY) {
+        struct bplus_node *node = bplus_node_create(pool, 0);
+        if (node == NULL) {
+            if (prev != NULL) {
+                bplus_node_release(pool, prev);
+            }
+            bplus_overflow_free(pool, ref);
+            return -1;
+        }
+        int len = val_len - off;
+        if (len > BPLUS_NODE_CAPACITY) {
+            len = BPLUS_NODE_CAPACITY;
+        }
+        bplus_overflow_fill(node, &val[off], len, BPLUS_INVALID_PAGE);
+
+        if (prev == NULL) {
+            ref->first_page = node->disk.page_id;
+        } else {
+            prev->disk.next = node->disk.page_id;
+            bplus_node_release(pool, prev);
+        }
+        prev = node;
+    }
+    if (prev != NULL) {
+        bplus_node_release(pool, prev);
+    }
+    return 0;
+}
+
+// called with successive pieces of a value, in order. returning -1 stops the
+// stream, 0 asks for more.
+typedef int (*bplus_value_sink)(void *ctx, const char *data, int len);
+
+// feed the value of entry i of a latched leaf to sink. overflow pages are
+// latched hand over hand so compaction can't move one from under the read,
+// and each page's successor is prefetched while it is copied out.
+int bplus_node_stream_value(
+    struct bplus_buffer_pool *pool,
+    struct bplus_node *node,
+    int i,
+    bplus_value_sink sink,
+    void *ctx) {
+    struct bplus_slot *slot = &node->disk.slots[i];
+    if (!(slot->flags & BPLUS_SLOT_OVERFLOW)) {
+        return sink(ctx, bplus_node_value(node, i), slot->val_len);
+    }
+
+    struct bplus_overflow_ref ref;
+    memcpy(&ref, bplus_node_value(node, i), sizeof(ref));
+    uint32_t left = ref.len;
+    struct bplus_node *prev = NULL;
+    int ret = 0;
+    for (uint32_t page_id = ref.first_page;
+         page_id != BPLUS_INVALID_PAGE && ret == 0;) {
+        struct bplus_node *page = bplus_buffer_pool_fetch(pool, page_id);
+        if (page == NULL) {
+            ret = -1;
+            break;
+        }
+        bplus_node_latch(pool, page, BPLUS_LATCH_READ);
+        if (prev != NULL) {
+            bplus_node_release(pool, prev);
+        }
+        prev = page;
+
+        uint32_t len = BPLUS_NODE_CAPACITY - page->disk.heap_start;
+        if (page->disk.kind != BPLUS_PAGE_OVERFLOW || len > left) {
+            printf("page %u: not part of an overflow chain\n", page_id);
+            ret = -1;
+            break;
+        }
+        page_id = page->disk.next;
+        if (page_id != BPLUS_INVALID_PAGE) {
+            bplus_buffer_pool_prefetch(pool, page_id);
+        }
+        left -= len;
+        ret = sink(ctx, &page->disk.buf[page->disk.heap_start], len);
+    }
+    if (prev != NULL) {
+        bplus_node_release(pool, prev);
+    }
+    if (ret == 0 && left != 0) {
+        printf("overflow chain at page %u is short\n", ref.first_page);
+        ret = -1;
+    }
+    return ret;
+}
+
+// the length of entry i's value, wherever it is stored
+int bplus_node_value_len(struct bplus_node *node, int i) {
+    struct bplus_slot *slot = &node->disk.slots[i];
+    if (!(slot->flags & BPLUS_SLOT_OVERFLOW)) {
+        return slot->val_len;
+    }
+    struct bplus_overflow_ref ref;
+    memcpy(&ref, bplus_node_value(node, i), sizeof(ref));
+    return ref.len;
+}
+
+// the overflow chain entry i refers to, if it has one
+int bplus_node_overflow_ref(
+    struct bplus_node *node, int i, struct bplus_overflow_ref *ref) {
+    if (!(node->disk.slots[i].flags & BPLUS_SLOT_OVERFLOW)) {
+        return 0;
+    }
+    memcpy(ref, bplus_node_value(node, i), sizeof(*ref));
+    return 1;
+}
+
+int bplus_tree_replay(
+    struct bplus_tree *tree, const char *log, size_t len, uint64_t base);
+void bplus_tree_destroy(struct bplus_tree *tree);
+
+struct bplus_tree *bplus_tree_create_opts(
+    const char *path, const struct bplus_tree_options *opts) {
+    int num_frames = BPLUS_DEFAULT_FRAMES;
+    if (opts != NULL && opts->num_frames > 0) {
+        num_frames = opts->num_frames;
+    }
+
+    const struct bplus_io_ops *io = opts != NULL ? opts->io : NULL;
+    int io_flags = opts != NULL ? opts->io_flags : 0;
+    int huge_pages = opts != NULL ? opts->huge_pages : 0;
+    int wal_mode = opts != NULL ? opts->wal_mode : BPLUS_WAL_OFF;
+    int compress = opts != NULL ? opts->compress : 0;
+    int shared = opts != NULL ? opts->shared : 0;
+    if (shared && wal_mode != BPLUS_WAL_OFF) {
+        printf("a shared tree is read-only and can't keep a log\n");
+        return NULL;
+    }
+
+    struct bplus_buffer_pool *pool = bplus_buffer_pool_init(
+        path, num_frames, io, io_flags, huge_pages, compress, shared);
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->keys = &bplus_keys_bytes;
+    if (opts != NULL && opts->keys != NULL) {
+        pool->keys = opts->keys;
+    }
+
+    // finish any interrupted checkpoint before reading the header
+    struct bplus_wal *wal = NULL;
+    char *log = NULL;
+    size_t log_len = 0;
+    if (wal_mode != BPLUS_WAL_OFF) {
+        char *wal_path = bplus_wal_path(path);
+        wal = bplus_wal_open(wal_path, wal_mode, opts->wal_interval_ms);
+        free(wal_path);
+        if (wal == NULL) {
+            bplus_buffer_pool_destroy(pool);
+            return NULL;
+        }
+        log_len = bplus_wal_read(wal, &log);
+        if (bplus_wal_recover_pages(pool, log, log_len) < 0) {
+            free(log);
+            bplus_wal_close(wal);
+            bplus_buffer_pool_destroy(pool);
+            return NULL;
+        }
+        // pages may only reach the file through a checkpoint
+        pool->no_steal = 1;
+    }
+
+    // read header and load root node
+    struct bplus_disk_header header = {0};
+    struct bplus_node *disk_root = NULL;
+    if (pread(pool->fd, &header, sizeof(header), 0) == sizeof(header)) {
+        int err = bplus_disk_header_verify(&header);
+        if (err != BPLUS_PAGE_OK) {
+            printf("%s: header %s\n", path, bplus_page_errors[err]);
+        } else if (header.page_size != BPLUS_PAGE_SIZE) {
+            printf(
+                "%s uses %u byte pages, built for %d\n", path,
+                header.page_size, BPLUS_PAGE_SIZE);
+        } else if (
+            (header.flags & BPLUS_HEADER_COMPRESSED) && pool->extents == NULL) {
+            printf("%s is compressed but its extent table is missing\n", path);
+        } else if (
+            strncmp(header.key_order, pool->keys->name,
+                    sizeof(header.key_order)) != 0) {
+            printf(
+                "%s is ordered by %.16s keys, not %s\n", path,
+                header.key_order, pool->keys->name);
+        } else {
+            disk_root = bplus_buffer_pool_fetch(pool, header.root_page_id);
+        }
+        // never start a fresh tree over an existing file we can't read
+        if (disk_root == NULL) {
+            if (wal != NULL) {
+                free(log);
+                bplus_wal_close(wal);
+            }
+            bplus_buffer_pool_destroy(pool);
+            return NULL;
+        }
+        bplus_buffer_pool_read_free_list(
+            pool, header.free_head, header.num_free);
+    } else if (pool->shared) {
+        printf("%s has no tree to share\n", path);
+        bplus_buffer_pool_destroy(pool);
+        return NULL;
+    }
+
+    struct bplus_tree *tree = malloc(sizeof(struct bplus_tree));
+    tree->pool = pool;
+    tree->wal = wal;
+    pthread_rwlock_init(&tree->lock, NULL);
+    pthread_rwlock_init(&tree->root_latch, NULL);
+
+    if (disk_root != NULL) {
+        bplus_debug("root node %u was loaded from disk\n", header.root_page_id);
+        tree->root = disk_root;
+        tree->height = header.height;
+    } else {
+        tree->root = bplus_node_create(pool, 1);
+        tree->height = 1;
+        if (tree->root != NULL) {
+            bplus_node_unlatch(pool, tree->root);
+        }
+    }
+
+    if (wal != NULL) {
+        int ret =
+            bplus_tree_replay(tree, log, log_len, header.checkpoint_lsn);
+        free(log);
+        if (ret < 0) {
+            bplus_tree_destroy(tree);
+            return NULL;
+        }
+    }
+    return tree;
+}
+
+struct bplus_tree *bplus_tree_create(const char *path) {
+    return bplus_tree_create_opts(path, NULL);
+}
+
+// open an existing tree for lookups and scans only, served from an mmap of
+// the file. access is one of BPLUS_ACCESS_* and is passed on to madvise.
+// keys must match the order the tree was created with, NULL looks up a built
+// in order by the name in the header.
+struct bplus_tree *bplus_tree_open_readonly_keys(
+    const char *path, int access, const struct bplus_key_ops *keys) {
+    struct bplus_buffer_pool *pool = bplus_buffer_pool_open_mmap(path, access);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    struct bplus_disk_header header;
+    memcpy(&header, pool->map, sizeof(header));
+    int err = bplus_disk_header_verify(&header);
+    if (err != BPLUS_PAGE_OK) {
+        printf("%s: header %s\n", path, bplus_page_errors[err]);
+        bplus_buffer_pool_destroy(pool);
+        return NULL;
+    }
+    if (header.page_size != BPLUS_PAGE_SIZE) {
+        printf(
+            "%s uses %u byte pages, built for %d\n", path, header.page_size,
+            BPLUS_PAGE_SIZE);
+        bplus_buffer_pool_destroy(pool);
+        return NULL;
+    }
+    if (header.flags & BPLUS_HEADER_COMPRESSED) {
+        printf("%s is compressed and can't be mapped\n", path);
+        bplus_buffer_pool_destroy(pool);
+        return NULL;
+    }
+    if (keys == NULL) {
+        keys = bplus_key_ops_find(header.key_order);
+    }
+    if (keys == NULL ||
+        strncmp(header.key_order, keys->name, sizeof(header.key_order)) != 0) {
+        printf("%s: can't order %.16s keys\n", path, header.key_order);
+        bplus_buffer_pool_destroy(pool);
+        return NULL;
+    }
+    pool->keys = keys;
+
+    struct bplus_node *root =
+        bplus_buffer_pool_fetch(pool, header.root_page_id);
+    if (root == NULL) {
+        printf("%s: root page %u is missing\n", path, header.root_page_id);
+        bplus_buffer_pool_destroy(pool);
+        return NULL;
+    }
+
+    bplus_buffer_pool_read_free_list(pool, header.free_head, header.num_free);
+
+    struct bplus_tree *tree = malloc(sizeof(struct bplus_tree));
+    tree->pool = pool;
+    tree->root = root;
+    tree->height = header.height;
+    tree->wal = NULL;
+    pthread_rwlock_init(&tree->lock, NULL);
+    pthread_rwlock_init(&tree->root_latch, NULL);
+    return tree;
+}
+
+struct bplus_tree *bplus_tree_open_readonly(const char *path, int access) {
+    return bplus_tree_open_readonly_keys(path, access, NULL);
+}
+
+// check if a key and value can fit in our node, compacting it if need be
+int bplus_node_can_fit(struct bplus_node *node, int key_len, int val_len) {
+    int needed = key_len + val_len + (int)sizeof(struct bplus_slot);
+    return bplus_node_free_space(node) + node->disk.dead_bytes >= needed;
+}
+
+// rewrite the heap so it only holds live entries. split and overwritten
+// entries leave dead bytes behind that this reclaims.
+void bplus_node_compact(struct bplus_node *node) {
+    struct bplus_node_disk copy;
+    memcpy(&copy, &node->disk, sizeof(copy));
+
+    node->disk.heap_start = BPLUS_NODE_CAPACITY;
+    for (int i = 0; i < copy.num_keys; i++) {
+        struct bplus_slot *slot = &node->disk.slots[i];
+        int len = slot->key_len + slot->val_len;
+        node->disk.heap_start -= len;
+        memcpy(
+            &node->disk.buf[node->disk.heap_start], &copy.buf[slot->offset],
+            len);
+        slot->offset = node->disk.heap_start;
+    }
+    node->disk.dead_bytes = 0;
+}
+
+// drop count entries starting at i. their bytes stay in the heap as dead
+// space until the next compaction.
+void bplus_node_remove_range(struct bplus_node *node, int i, int count) {
+    for (int j = i; j < i + count; j++) {
+        struct bplus_slot *slot = &node->disk.slots[j];
+        node->disk.dead_bytes += slot->key_len + slot->val_len;
+    }
+    memmove(
+        &node->disk.slots[i], &node->disk.slots[i + count],
+        (node->disk.num_keys - i - count) * sizeof(struct bplus_slot));
+    node->disk.num_keys -= count;
+}
+
+void bplus_node_remove_at(struct bplus_node *node, int i) {
+    bplus_node_remove_range(node, i, 1);
+}
+
+// check if key can be stored at index, where it may already exist
+int bplus_node_can_put(
+    struct bplus_node *node,
+    struct bplus_insert_index index,
+    int key_len,
+    int val_len) {
+    if (!index.found) {
+        return bplus_node_can_fit(node, key_len, val_len);
+    }
+
+    // smaller values are overwritten in place, larger ones leave the old
+    // entry behind as dead space
+    struct bplus_slot *slot = &node->disk.slots[index.pos];
+    int avail = bplus_node_free_space(node) + node->disk.dead_bytes;
+    return val_len <= slot->val_len ||
+           avail + slot->key_len + slot->val_len >= key_len + val_len;
+}
+
+// the caller must have checked bplus_node_can_fit
+void bplus_node_insert_at(
+    const struct bplus_key_ops *keys,
+    struct bplus_node *node,
+    struct bplus_insert_index index,
+    int key_len,
+    char *key,
+    int val_len,
+    char *val) {
+    if (index.found) {
+        struct bplus_slot *slot = &node->disk.slots[index.pos];
+        if (val_len <= slot->val_len) {
+            // overwrite in place, the tail of the old value goes dead
+            memcpy(&node->disk.buf[slot->offset + key_len], val, val_len);
+            node->disk.dead_bytes += slot->val_len - val_len;
+            slot->val_len = val_len;
+            return;
+        }
+        // the new value doesn't fit over the old one, so re-add the entry
+        bplus_node_remove_at(node, index.pos);
+        index.found = 0;
+    }
+
+    int needed = key_len + val_len + (int)sizeof(struct bplus_slot);
+    if (bplus_node_free_space(node) < needed) {
+        bplus_node_compact(node);
+    }
+    assert(bplus_node_free_space(node) >= needed);
+
+    // shift slot directory
+    memmove(
+        &node->disk.slots[index.pos + 1], &node->disk.slots[index.pos],
+        (node->disk.num_keys - index.pos) * sizeof(struct bplus_slot));
+    node->disk.num_keys++;
+
+    // insert data to the heap, key first
+    node->disk.heap_start -= key_len + val_len;
+    memcpy(&node->disk.buf[node->disk.heap_start], key, key_len);
+    memcpy(&node->disk.buf[node->disk.heap_start + key_len], val, val_len);
+
+    // update metadata
+    struct bplus_slot *slot = &node->disk.slots[index.pos];
+    slot->offset = node->disk.heap_start;
+    slot->key_len = key_len;
+    slot->val_len = val_len;
+    slot->flags = 0;
+    slot->head = bplus_keys_head(keys, key, key_len);
+}
+
+// store v at index, flagging the slot when it holds an overflow reference
+void bplus_node_insert_value(
+    const struct bplus_key_ops *keys,
+    struct bplus_node *node,
+    struct bplus_insert_index index,
+    char *key,
+    int key_len,
+    struct bplus_value *v) {
+    bplus_node_insert_at(
+        keys, node, index, key_len, key, bplus_value_stored_len(v),
+        bplus_value_stored(v));
+    node->disk.slots[index.pos].flags = v->overflow ? BPLUS_SLOT_OVERFLOW : 0;
+}
+
+// copy entry i of src to index in dst, flags included
+void bplus_node_copy_entry(
+    const struct bplus_key_ops *keys,
+    struct bplus_node *dst,
+    struct bplus_insert_index index,
+    struct bplus_node *src,
+    int i) {
+    struct bplus_slot *slot = &src->disk.slots[i];
+    bplus_node_insert_at(
+        keys, dst, index, slot->key_len, bplus_node_key(src, i),
+        slot->val_len, bplus_node_value(src, i));
+    dst->disk.slots[index.pos].flags = slot->flags;
+}
+
+// pick the first index of the upper half so both halves hold about the same
+// number of bytes
+int bplus_node_split_point(struct bplus_node *node) {
+    int total = 0;
+    for (int i = 0; i < node->disk.num_keys; i++) {
+        struct bplus_slot *slot = &node->disk.slots[i];
+        total += sizeof(struct bplus_slot) + slot->key_len + slot->val_len;
+    }
+
+    int used = 0;
+    int split_point = 1;
+    for (int i = 0; i < node->disk.num_keys - 1; i++) {
+        struct bplus_slot *slot = &node->disk.slots[i];
+        used += sizeof(struct bplus_slot) + slot->key_len + slot->val_len;
+        split_point = i + 1;
+        if (used * 2 >= total) {
+            break;
+        }
+    }
+    return split_point;
+}
+
+// move the upper half of a full leaf into a new leaf, returned pinned and
+// write latched
+struct bplus_node *bplus_node_split_leaf(
+    struct bplus_buffer_pool *pool, struct bplus_node *full_node) {
+    assert(full_node->disk.is_leaf);
+    assert(full_node->disk.num_keys > 1);
+
+    // the old right sibling has to point back at the new node. latching
+    // left to right matches the order scans take.
+    struct bplus_node *next = NULL;
+    if (full_node->disk.next != BPLUS_INVALID_PAGE) {
+        next = bplus_buffer_pool_fetch(pool, full_node->disk.next);
+        if (next == NULL) {
+            return NULL;
+        }
+        bplus_node_latch(pool, next, BPLUS_LATCH_WRITE);
+    }
+
+    struct bplus_node *new_node = bplus_node_create(pool, 1);
+    if (new_node == NULL) {
+        if (next != NULL) {
+            bplus_node_release(pool, next);
+        }
+        return NULL;
+    }
+
+    bplus_buffer_pool_mark_dirty(pool, full_node);
+    new_node->disk.next = full_node->disk.next;
+    new_node->disk.prev = full_node->disk.page_id;
+    full_node->disk.next = new_node->disk.page_id;
+    if (next != NULL) {
+        bplus_buffer_pool_mark_dirty(pool, next);
+        next->disk.prev = new_node->disk.page_id;
+        bplus_node_release(pool, next);
+    }
+
+    int split_point = bplus_node_split_point(full_node);
+
+    for (int i = split_point; i < full_node->disk.num_keys; i++) {
+        // copy kv pairs to new node
+        struct bplus_insert_index index = {
+            .pos = i - split_point,
+            .found = 0,
+        };
+        bplus_node_copy_entry(pool->keys, new_node, index, full_node, i);
+    }
+
+    full_node->disk.num_keys = split_point;
+    bplus_node_compact(full_node);
+
+    bplus_debug(
+        "split page %u to create %u\n", full_node->disk.page_id,
+        new_node->disk.page_id);
+
+    return new_node;
+}
+
+// separator handed up to the parent when a node splits
+struct bplus_split {
+    struct bplus_node *right; // new right sibling, pinned and write latched
+    int key_len;
+    char key[BPLUS_MAX_KEY_SIZE];
+};
+
+// move the upper half of a full internal node into a new, latched node. the
+// middle key moves up into split instead of staying in either half.
+int bplus_node_split_internal(
+    struct bplus_buffer_pool *pool,
+    struct bplus_node *full_node,
+    struct bplus_split *split) {
+    assert(!full_node->disk.is_leaf);
+    assert(full_node->disk.num_keys > 2);
+
+    struct bplus_node *new_node = bplus_node_create(pool, 0);
+    if (new_node == NULL) {
+        return -1;
+    }
+
+    int mid = bplus_node_split_point(full_node);
+    if (mid >= full_node->disk.num_keys - 1) {
+        mid = full_node->disk.num_keys - 2;
+    }
+
+    for (int i = mid + 1; i < full_node->disk.num_keys; i++) {
+        struct bplus_insert_index index = {
+            .pos = i - mid - 1,
+            .found = 0,
+        };
+        bplus_node_copy_entry(pool->keys, new_node, index, full_node, i);
+    }
+    new_node->disk.last_child = full_node->disk.last_child;
+
+    split->right = new_node;
+    split->key_len = full_node->disk.slots[mid].key_len;
+    memcpy(split->key, bplus_node_key(full_node, mid), split->key_len);
+
+    // the middle key's child becomes the left half's last child
+    bplus_buffer_pool_mark_dirty(pool, full_node);
+    full_node->disk.last_child = bplus_node_child_id(full_node, mid);
+    full_node->disk.num_keys = mid;
+    bplus_node_compact(full_node);
+
+    bplus_debug(
+        "split internal page %u to create %u\n", full_node->disk.page_id,
+        new_node->disk.page_id);
+
+    return 0;
+}
+
+// register right_id as the new sibling of left_id, which must currently be a
+// child of node. keys <= separator keep going to the left child.
+void bplus_node_add_child(
+    struct bplus_buffer_pool *pool,
+    struct bplus_node *node,
+    uint32_t left_id,
+    char *key,
+    int key_len,
+    uint32_t right_id) {
+    assert(!node->disk.is_leaf);
+    assert(bplus_node_can_fit(node, key_len, sizeof(uint32_t)));
+
+    struct bplus_insert_index index =
+        bplus_node_find_insert_index(pool->keys, node, key_len, key);
+    assert(!index.found);
+    assert(bplus_node_child_id(node, index.pos) == left_id);
+
+    // the separator takes over the left child, the right half gets the slot
+    // the left child used to occupy
+    bplus_buffer_pool_mark_dirty(pool, node);
+    bplus_node_insert_at(
+        pool->keys, node, index, key_len, key, sizeof(left_id),
+        (char *)&left_id);
+    bplus_node_set_child_id(node, index.pos + 1, right_id);
+}
+
+// descend from the root to the leaf that covers key, or to the rightmost
+// leaf when key is NULL. internal nodes are read latched hand over hand and
+// the leaf comes back pinned and latched in leaf_mode.
+struct bplus_node *bplus_tree_find_leaf(
+    struct bplus_tree *tree, char *key, int key_len, int leaf_mode) {
+    struct bplus_buffer_pool *pool = tree->pool;
+
+    pthread_rwlock_rdlock(&tree->root_latch);
+    struct bplus_node *node = tree->root;
+    int depth = tree->height - 1; // levels below node
+    bplus_buffer_pool_pin(pool, node);
+    bplus_node_latch(pool, node, depth == 0 ? leaf_mode : BPLUS_LATCH_READ);
+    pthread_rwlock_unlock(&tree->root_latch);
+
+    while (depth > 0) {
+        int pos = node->disk.num_keys;
+        if (key != NULL) {
+            pos = bplus_node_find_insert_index(pool->keys, node, key_len, key)
+                      .pos;
+        }
+        struct bplus_node *child = bplus_node_get_child(pool, node, pos);
+        if (child == NULL) {
+            bplus_node_release(pool, node);
+            return NULL;
+        }
+        depth--;
+        bplus_node_latch(
+            pool, child, depth == 0 ? leaf_mode : BPLUS_LATCH_READ);
+        bplus_node_release(pool, node);
+        node = child;
+    }
+    return node;
+}
+
+// put an entry at index in a write latched leaf that has room for it. the
+// log record is appended under the latch so log order matches apply order.
+// an overflow chain held by the value being replaced is freed.
+int bplus_leaf_insert(
+    struct bplus_tree *tree,
+    struct bplus_node *leaf,
+    struct bplus_insert_index index,
+    char *key,
+    int key_len,
+    struct bplus_value *val,
+    uint64_t *lsn) {
+    bplus_buffer_pool_mark_dirty(tree->pool, leaf);
+    if (lsn != NULL) {
+        *lsn = bplus_wal_append(
+            tree->wal, BPLUS_WAL_PUT, key_len, val->len, key, key_len,
+            val->data, val->len);
+        leaf->disk.lsn = *lsn;
+    }
+
+    struct bplus_overflow_ref old;
+    int replaced =
+        index.found && bplus_node_overflow_ref(leaf, index.pos, &old);
+
+    bplus_debug("inserting %.*s at %d\n", key_len, key, index.pos);
+    bplus_node_insert_value(tree->pool->keys, leaf, index, key, key_len, val);
+    return replaced ? bplus_overflow_free(tree->pool, &old) : 0;
+}
+
+// most inserts fit in their leaf, so try with read latches on the way down
+// and only the leaf write latched. returns 1 if the leaf needs a split.
+int bplus_tree_insert_optimistic(
+    struct bplus_tree *tree,
+    char *key,
+    int key_len,
+    struct bplus_value *val,
+    uint64_t *lsn) {
+    struct bplus_node *leaf =
+        bplus_tree_find_leaf(tree, key, key_len, BPLUS_LATCH_WRITE);
+    if (leaf == NULL) {
+        return -1;
+    }
+
+    int ret = 1;
+    struct bplus_insert_index index =
+        bplus_node_find_insert_index(tree->pool->keys, leaf, key_len, key);
+    if (bplus_node_can_put(
+            leaf, index, key_len, bplus_value_stored_len(val))) {
+        ret = bplus_leaf_insert(tree, leaf, index, key, key_len, val, lsn);
+    }
+    bplus_node_release(tree->pool, leaf);
+    return ret;
+}
+
+// a node is safe when the insert can't make it split, so nothing above it
+// can change and its ancestors can be let go
+int bplus_node_is_safe(struct bplus_node *node, int key_len, int val_len) {
+    if (node->disk.is_leaf) {
+        return bplus_node_can_fit(node, key_len, val_len);
+    }
+    return bplus_node_can_fit(node, BPLUS_MAX_KEY_SIZE, sizeof(uint32_t));
+}
+
+// deeper than any tree the page file can address
+#define BPLUS_MAX_HEIGHT 32
+
+// write latched nodes from the root down to a leaf. nodes[base, n) are still
+// held, everything above base has been released.
+struct bplus_latch_path {
+    struct bplus_node *nodes[BPLUS_MAX_HEIGHT];
+    int n;
+    int base;
+    int root_latched; // tree->root_latch is held exclusively
+};
+
+void bplus_latch_path_release(
+    struct bplus_tree *tree, struct bplus_latch_path *path, int upto) {
+    if (path->root_latched) {
+        pthread_rwlock_unlock(&tree->root_latch);
+        path->root_latched = 0;
+    }
+    for (; path->base < upto; path->base++) {
+        bplus_node_release(tree->pool, path->nodes[path->base]);
+    }
+}
+
+// insert with write latches all the way down, keeping every node a split
+// could reach. the root latch is held until a safe node is found, so only
+// this insert can grow the tree.
+int bplus_tree_insert_pessimistic(
+    struct bplus_tree *tree,
+    char *key,
+    int key_len,
+    struct bplus_value *val,
+    uint64_t *lsn) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    struct bplus_latch_path path = {.root_latched = 1};
+    int val_len = bplus_value_stored_len(val);
+
+    pthread_rwlock_wrlock(&tree->root_latch);
+    struct bplus_node *node = tree->root;
+    bplus_buffer_pool_pin(pool, node);
+    bplus_node_latch(pool, node, BPLUS_LATCH_WRITE);
+    path.nodes[path.n++] = node;
+    if (bplus_node_is_safe(node, key_len, val_len)) {
+        bplus_latch_path_release(tree, &path, path.n - 1);
+    }
+
+    while (!node->disk.is_leaf) {
+        struct bplus_insert_index index =
+            bplus_node_find_insert_index(pool->keys, node, key_len, key);
+        struct bplus_node *child = bplus_node_get_child(pool, node, index.pos);
+        if (child == NULL) {
+            printf("error! couldn't load child\n");
+            bplus_latch_path_release(tree, &path, path.n);
+            return -1;
+        }
+        bplus_node_latch(pool, child, BPLUS_LATCH_WRITE);
+        assert(path.n < BPLUS_MAX_HEIGHT);
+        path.nodes[path.n++] = child;
+        if (bplus_node_is_safe(child, key_len, val_len)) {
+            bplus_latch_path_release(tree, &path, path.n - 1);
+        }
+        node = child;
+    }
+
+    // split the leaf if it is still full
+    struct bplus_split split = {.right = NULL};
+    struct bplus_node *target = node;
+    struct bplus_insert_index index =
+        bplus_node_find_insert_index(pool->keys, node, key_len, key);
+    if (!bplus_node_can_put(node, index, key_len, val_len)) {
+        struct bplus_node *new_node = bplus_node_split_leaf(pool, node);
+        if (new_node == NULL) {
+            bplus_latch_path_release(tree, &path, path.n);
+            return -1;
+        }
+
+        // the largest key left behind separates the two halves
+        int last = node->disk.num_keys - 1;
+        split.right = new_node;
+        split.key_len = node->disk.slots[last].key_len;
+        memcpy(split.key, bplus_node_key(node, last), split.key_len);
+
+        if (bplus_keys_compare(
+                pool->keys, key, key_len, split.key, split.key_len) > 0) {
+            target = new_node;
+        }
+        index = bplus_node_find_insert_index(pool->keys, target, key_len, key);
+    }
+    int ret = bplus_leaf_insert(tree, target, index, key, key_len, val, lsn);
+
+    // hand separators up the path, splitting parents that are full too. the
+    // loop stops at the first safe node, which absorbs the last split.
+    for (int i = path.n - 2; i >= path.base && split.right != NULL; i--) {
+        struct bplus_node *parent = path.nodes[i];
+        uint32_t child_id = path.nodes[i + 1]->disk.page_id;
+        struct bplus_split up = {.right = NULL};
+
+        target = parent;
+        if (!bplus_node_can_fit(parent, split.key_len, sizeof(uint32_t))) {
+            if (bplus_node_split_internal(pool, parent, &up) < 0) {
+                bplus_node_release(pool, split.right);
+                split.right = NULL;
+                ret = -1;
+                break;
+            }
+            int cmp = bplus_keys_compare(
+                pool->keys, split.key, split.key_len, up.key, up.key_len);
+            if (cmp > 0) {
+                target = up.right;
+            }
+        }
+
+        bplus_node_add_child(
+            pool, target, child_id, split.key, split.key_len,
+            split.right->disk.page_id);
+        bplus_node_release(pool, split.right);
+        split = up;
+    }
+
+    if (split.right != NULL) {
+        // the root itself split, which needs the root latch still held
+        assert(path.root_latched && path.base == 0);
+        struct bplus_node *new_root = bplus_node_create(pool, 0);
+        if (new_root == NULL) {
+            bplus_node_release(pool, split.right);
+            bplus_latch_path_release(tree, &path, path.n);
+            return -1;
+        }
+        new_root->disk.last_child = tree->root->disk.page_id;
+        bplus_node_add_child(
+            pool, new_root, tree->root->disk.page_id, split.key,
+            split.key_len, split.right->disk.page_id);
+        bplus_node_release(pool, split.right);
+
+        // the root stays pinned, swap the pin over to the new one
+        bplus_buffer_pool_unpin(pool, tree->root);
+        tree->root = new_root;
+        tree->height += 1;
+        bplus_node_unlatch(pool, new_root);
+    }
+
+    bplus_latch_path_release(tree, &path, path.n);
+    return ret;
+}
+
+// insert into the tree, appending a log record first when lsn is set
+int bplus_tree_apply_insert(
+    struct bplus_tree *tree,
+    char *key,
+    int key_len,
+    struct bplus_value *val,
+    uint64_t *lsn) {
+    int ret = bplus_tree_insert_optimistic(tree, key, key_len, val, lsn);
+    if (ret == 1) {
+        ret = bplus_tree_insert_pessimistic(tree, key, key_len, val, lsn);
+    }
+    return ret;
+}
+
+// with a WAL attached dirty pages can't be evicted, so checkpoint before a
+// change could run the pool out of frames. pages counts the overflow pages
+// the change writes on top of the few pages of the tree itself.
+int bplus_tree_wal_reserve(struct bplus_tree *tree, int pages) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    int limit = pool->num_frames / 2 - pages;
+    if (tree->wal == NULL ||
+        __atomic_load_n(&pool->num_dirty, __ATOMIC_RELAXED) <= limit) {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&tree->lock);
+    int ret = 0;
+    if (pool->num_dirty > limit) {
+        ret = bplus_tree_checkpoint_locked(tree);
+    }
+    pthread_rwlock_unlock(&tree->lock);
+    return ret;
+}
+
+// check that an entry can be stored in the tree, printing why not
+int bplus_tree_check_entry(struct bplus_tree *tree, int key_len, int val_len) {
+    int key_size = tree->pool->keys->key_size;
+    if (key_size > 0 && key_len != key_size) {
+        printf(
+            "%d byte key in a tree of %d byte %s keys\n", key_len, key_size,
+            tree->pool->keys->name);
+        return -1;
+    }
+    int overflows = bplus_entry_overflows(key_len, val_len);
+    int stored = overflows ? (int)sizeof(struct bplus_overflow_ref) : val_len;
+    if (key_len > BPLUS_MAX_KEY_SIZE || val_len < 0 ||
+        val_len > BPLUS_MAX_VALUE_SIZE ||
+        key_len + stored > BPLUS_MAX_ENTRY_SIZE) {
+        printf(
+            "%d byte key and %d byte value are too large\n", key_len,
+            val_len);
+        return -1;
+    }
+    // a no-steal pool has to hold the whole chain until the next checkpoint
+    if (overflows && tree->wal != NULL &&
+        bplus_overflow_pages(val_len) > tree->pool->num_frames / 2) {
+        printf(
+            "%d byte value needs more than half of the %d page buffer pool\n",
+            val_len, tree->pool->num_frames);
+        return -1;
+    }
+    return 0;
+}
+
+// bplus_tree_apply_insert for a value of any size, writing its overflow
+// pages first if it needs them. the caller holds tree->lock shared, or is
+// replaying the log.
+int bplus_tree_apply_put(
+    struct bplus_tree *tree,
+    char *key,
+    int key_len,
+    char *val,
+    int val_len,
+    uint64_t *lsn) {
+    struct bplus_value v = {
+        .data = val,
+        .len = val_len,
+        .overflow = bplus_entry_overflows(key_len, val_len),
+    };
+    if (v.overflow &&
+        bplus_overflow_write(tree->pool, val, val_len, &v.ref) < 0) {
+        return -1;
+    }
+    return bplus_tree_apply_insert(tree, key, key_len, &v, lsn);
+}
+
+// store val under key. both may hold any bytes, NULs included. returns -1
+// if the entry is too large to store or the key doesn't suit the tree's key
+// order. safe to call from any number of threads. with a WAL attached the
+// insert is durable, per the sync mode, once this returns.
+int bplus_tree_put(
+    struct bplus_tree *tree, char *key, int key_len, char *val, int val_len) {
+    if (bplus_buffer_pool_readonly(tree->pool)) {
+        printf("tree is open read-only\n");
+        return -1;
+    }
+    if (bplus_tree_check_entry(tree, key_len, val_len) < 0) {
+        return -1;
+    }
+
+    int pages = bplus_entry_overflows(key_len, val_len)
+                    ? bplus_overflow_pages(val_len)
+                    : 0;
+    if (bplus_tree_wal_reserve(tree, pages) < 0) {
+        return -1;
+    }
+
+    uint64_t lsn = 0;
+    pthread_rwlock_rdlock(&tree->lock);
+    int ret = bplus_tree_apply_put(
+        tree, key, key_len, val, val_len, tree->wal != NULL ? &lsn : NULL);
+    pthread_rwlock_unlock(&tree->lock);
+
+    // wait for the log outside the tree lock so other writers can pile onto
+    // the same sync
+    if (ret == 0 && tree->wal != NULL) {
+        ret = bplus_wal_commit(tree->wal, lsn);
+    }
+    return ret;
+}
+
+// bplus_tree_put for NUL terminated keys and values
+int bplus_tree_insert(struct bplus_tree *tree, char *key, char *val) {
+    return bplus_tree_put(tree, key, strlen(key), val, strlen(val));
+}
+
+// nodes emptier than this are merged with or refilled from a sibling. well
+// under the half a split leaves behind, so nodes don't flip between
+// splitting and merging.
+#define BPLUS_MIN_USED (BPLUS_NODE_CAPACITY / 4)
+
+// a node is safe for a delete when losing its largest possible entry still
+// leaves it above BPLUS_MIN_USED, so the delete can't reach its parent
+int bplus_node_is_safe_delete(struct bplus_node *node, int is_root) {
+    if (is_root) {
+        return node->disk.is_leaf || node->disk.num_keys >= 2;
+    }
+    int largest = node->disk.is_leaf ? BPLUS_MAX_ENTRY_SIZE
+                                     : BPLUS_MAX_KEY_SIZE + sizeof(uint32_t);
+    return bplus_node_used(node) - largest - (int)sizeof(struct bplus_slot) >=
+           BPLUS_MIN_USED;
+}
+
+// put a page emptied by a merge on the free list for bplus_node_create. it
+// is reset and linked to the page freed before it, which is how the list is
+// kept on disk. the caller still holds the latch, so whoever reuses the page
+// waits for the caller to let go of it.
+void bplus_node_free(struct bplus_buffer_pool *pool, struct bplus_node *node) {
+    bplus_buffer_pool_mark_dirty(pool, node);
+    bplus_node_init(node, node->disk.page_id, 0);
+
+    bplus_buffer_pool_lock(pool);
+    if (pool->num_free == pool->free_cap) {
+        pool->free_cap = pool->free_cap > 0 ? 2 * pool->free_cap : 64;
+        pool->free_pages =
+            realloc(pool->free_pages, pool->free_cap * sizeof(uint32_t));
+    }
+    if (pool->num_free > 0) {
+        node->disk.next = pool->free_pages[pool->num_free - 1];
+    }
+    pool->free_pages[pool->num_free++] = node->disk.page_id;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// replace the separator at pos, keeping the child it points at. returns -1
+// if the new key doesn't fit.
+int bplus_node_set_separator(
+    struct bplus_buffer_pool *pool,
+    struct bplus_node *node,
+    int pos,
+    char *key,
+    int key_len) {
+    int avail = bplus_node_free_space(node) + node->disk.dead_bytes +
+                node->disk.slots[pos].key_len;
+    if (avail < key_len) {
+        return -1;
+    }
+
+    bplus_buffer_pool_mark_dirty(pool, node);
+    uint32_t child_id = bplus_node_child_id(node, pos);
+    bplus_node_remove_at(node, pos);
+    struct bplus_insert_index index = {.pos = pos, .found = 0};
+    bplus_node_insert_at(
+        pool->keys, node, index, key_len, key, sizeof(child_id),
+        (char *)&child_id);
+    return 0;
+}
+
+// bytes an entry takes up in a node, slot included
+int bplus_node_entry_size(struct bplus_node *node, int i) {
+    struct bplus_slot *slot = &node->disk.slots[i];
+    return slot->key_len + slot->val_len + (int)sizeof(struct bplus_slot);
+}
+
+// fold right into left, its left sibling under parent at left_pos. the
+// separator between them goes away and right is freed.
+int bplus_node_merge(
+    struct bplus_buffer_pool *pool,
+    struct bplus_node *parent,
+    int left_pos,
+    struct bplus_node *left,
+    struct bplus_node *right) {
+    if (left->disk.is_leaf) {
+        // unlink right from the leaf chain
+        if (right->disk.next != BPLUS_INVALID_PAGE) {
+            struct bplus_node *next =
+                bplus_buffer_pool_fetch(pool, right->disk.next);
+            if (next == NULL) {
+                return -1;
+            }
+            bplus_node_latch(pool, next, BPLUS_LATCH_WRITE);
+            bplus_buffer_pool_mark_dirty(pool, next);
+            next->disk.prev = left->disk.page_id;
+            bplus_node_release(pool, next);
+        }
+        bplus_buffer_pool_mark_dirty(pool, left);
+        left->disk.next = right->disk.next;
+    } else {
+        // the separator comes down to lead to left's last child
+        bplus_buffer_pool_mark_dirty(pool, left);
+        uint32_t last = left->disk.last_child;
+        struct bplus_insert_index end = {.pos = left->disk.num_keys};
+        bplus_node_insert_at(
+            pool->keys, left, end, parent->disk.slots[left_pos].key_len,
+            bplus_node_key(parent, left_pos), sizeof(last), (char *)&last);
+        left->disk.last_child = right->disk.last_child;
+    }
+
+    for (int i = 0; i < right->disk.num_keys; i++) {
+        struct bplus_insert_index end = {.pos = left->disk.num_keys};
+        bplus_node_copy_entry(pool->keys, left, end, right, i);
+    }
+
+    // whatever pointed at right now leads to left
+    bplus_buffer_pool_mark_dirty(pool, parent);
+    bplus_node_set_child_id(parent, left_pos + 1, left->disk.page_id);
+    bplus_node_remove_at(parent, left_pos);
+
+    bplus_debug(
+        "merged page %u into %u\n", right->disk.page_id, left->disk.page_id);
+    bplus_node_free(pool, right);
+    return 0;
+}
+
+// even out two leaves by moving entries across, then move the separator
+// to the new boundary. does nothing if the parent has no room for it.
+void bplus_leaf_redistribute(
+    struct bplus_buffer_pool *pool,
+    struct bplus_node *parent,
+    int left_pos,
+    struct bplus_node *left,
+    struct bplus_node *right) {
+    int l = bplus_node_used(left);
+    int r = bplus_node_used(right);
+    int from_right = l < r;
+    struct bplus_node *src = from_right ? right : left;
+
+    // count the entries to move while each move narrows the gap
+    int move = 0;
+    while (move < src->disk.num_keys - 1) {
+        int i = from_right ? move : src->disk.num_keys - 1 - move;
+        int size = bplus_node_entry_size(src, i);
+        if (size >= (from_right ? r - l : l - r)) {
+            break;
+        }
+        l += from_right ? size : -size;
+        r += from_right ? -size : size;
+        move++;
+    }
+    if (move == 0) {
+        return;
+    }
+
+    // keys <= separator go left, so it becomes left's new largest key
+    int last = from_right ? move - 1 : left->disk.num_keys - 1 - move;
+    char sep[BPLUS_MAX_KEY_SIZE];
+    int sep_len = src->disk.slots[last].key_len;
+    memcpy(sep, bplus_node_key(src, last), sep_len);
+    if (bplus_node_set_separator(pool, parent, left_pos, sep, sep_len) < 0) {
+        return;
+    }
+
+    bplus_buffer_pool_mark_dirty(pool, left);
+    bplus_buffer_pool_mark_dirty(pool, right);
+    if (from_right) {
+        for (int i = 0; i < move; i++) {
+            struct bplus_insert_index end = {.pos = left->disk.num_keys};
+            bplus_node_copy_entry(pool->keys, left, end, right, i);
+        }
+        bplus_node_remove_range(right, 0, move);
+    } else {
+        int first = left->disk.num_keys - move;
+        for (int i = 0; i < move; i++) {
+            struct bplus_insert_index index = {.pos = i};
+            bplus_node_copy_entry(pool->keys, right, index, left, first + i);
+        }
+        bplus_node_remove_range(left, first, move);
+    }
+}
+
+// even out two internal nodes by rotating entries through the separator
+// in parent, one at a time, for as long as each rotation narrows the gap
+void bplus_internal_redistribute(
+    struct bplus_buffer_pool *pool,
+    struct bplus_node *parent,
+    int left_pos,
+    struct bplus_node *left,
+    struct bplus_node *right) {
+    char sep[BPLUS_MAX_KEY_SIZE];
+    char up[BPLUS_MAX_KEY_SIZE];
+
+    for (;;) {
+        int l = bplus_node_used(left);
+        int r = bplus_node_used(right);
+        int from_right = l < r;
+        struct bplus_node *src = from_right ? right : left;
+        struct bplus_node *dst = from_right ? left : right;
+        int src_pos = from_right ? 0 : src->disk.num_keys - 1;
+        if (src->disk.num_keys < 2) {
+            break;
+        }
+
+        // the separator moves down into dst and src's edge key moves up
+        int sep_len = parent->disk.slots[left_pos].key_len;
+        int up_len = src->disk.slots[src_pos].key_len;
+        int gain = sep_len + sizeof(uint32_t) + sizeof(struct bplus_slot);
+        int loss = bplus_node_entry_size(src, src_pos);
+        if ((from_right ? r - l : l - r) <= (gain > loss ? gain : loss) ||
+            !bplus_node_can_fit(dst, sep_len, sizeof(uint32_t))) {
+            break;
+        }
+        memcpy(sep, bplus_node_key(parent, left_pos), sep_len);
+        memcpy(up, bplus_node_key(src, src_pos), up_len);
+        if (bplus_node_set_separator(pool, parent, left_pos, up, up_len) <
+            0) {
+            break;
+        }
+
+        bplus_buffer_pool_mark_dirty(pool, left);
+        bplus_buffer_pool_mark_dirty(pool, right);
+        if (from_right) {
+            // right's first child becomes left's last
+            uint32_t child = left->disk.last_child;
+            struct bplus_insert_index end = {.pos = left->disk.num_keys};
+            bplus_node_insert_at(
+                pool->keys, left, end, sep_len, sep, sizeof(child),
+                (char *)&child);
+            left->disk.last_child = bplus_node_child_id(right, 0);
+            bplus_node_remove_at(right, 0);
+        } else {
+            // left's last child becomes right's first
+            uint32_t child = left->disk.last_child;
+            struct bplus_insert_index front = {.pos = 0};
+            bplus_node_insert_at(
+                pool->keys, right, front, sep_len, sep, sizeof(child),
+                (char *)&child);
+            left->disk.last_child = bplus_node_child_id(left, src_pos);
+            bplus_node_remove_at(left, src_pos);
+        }
+    }
+}
+
+// child sits at pos in parent and has dropped below BPLUS_MIN_USED. merge
+// it with a sibling if the two fit in one page, otherwise even them out.
+// parent and child are write latched.
+int bplus_node_rebalance(
+    struct bplus_buffer_pool *pool,
+    struct bplus_node *parent,
+    int pos,
+    struct bplus_node *child) {
+    if (parent->disk.num_keys == 0) {
+        return 0;
+    }
+
+    // pair the child with its right sibling, or its left one if it is the
+    // last child. latches go left to right, so a right-hand child is let go
+    // and relatched after its sibling.
+    struct bplus_node *left = child;
+    struct bplus_node *right;
+    int left_pos = pos;
+    if (pos < parent->disk.num_keys) {
+        right = bplus_node_get_child(pool, parent, pos + 1);
+        if (right == NULL) {
+            return -1;
+        }
+        bplus_node_latch(pool, right, BPLUS_LATCH_WRITE);
+    } else {
+        left_pos = pos - 1;
+        right = child;
+        bplus_node_unlatch(pool, child);
+        left = bplus_node_get_child(pool, parent, left_pos);
+        if (left != NULL) {
+            bplus_node_latch(pool, left, BPLUS_LATCH_WRITE);
+        }
+        bplus_node_latch(pool, child, BPLUS_LATCH_WRITE);
+        if (left == NULL) {
+            return -1;
+        }
+    }
+
+    int combined = bplus_node_used(left) + bplus_node_used(right);
+    if (!left->disk.is_leaf) {
+        combined += parent->disk.slots[left_pos].key_len + sizeof(uint32_t) +
+                    sizeof(struct bplus_slot);
+    }
+
+    int ret = 0;
+    if (combined <= BPLUS_NODE_CAPACITY) {
+        ret = bplus_node_merge(pool, parent, left_pos, left, right);
+    } else if (left->disk.is_leaf) {
+        bplus_leaf_redistribute(pool, parent, left_pos, left, right);
+    } else {
+        bplus_internal_redistribute(pool, parent, left_pos, left, right);
+    }
+
+    bplus_node_release(pool, left == child ? right : left);
+    return ret;
+}
+
+// remove key from a write latched leaf, logging it first, and free its
+// overflow pages. returns 1 if the key isn't there.
+int bplus_leaf_delete(
+    struct bplus_tree *tree,
+    struct bplus_node *leaf,
+    char *key,
+    int key_len,
+    uint64_t *lsn) {
+    struct bplus_insert_index index =
+        bplus_node_find_insert_index(tree->pool->keys, leaf, key_len, key);
+    if (!index.found) {
+        return 1;
+    }
+
+    bplus_buffer_pool_mark_dirty(tree->pool, leaf);
+    if (lsn != NULL) {
+        *lsn = bplus_wal_append(
+            tree->wal, BPLUS_WAL_DELETE, key_len, 0, key, key_len, NULL, 0);
+        leaf->disk.lsn = *lsn;
+    }
+    struct bplus_overflow_ref ref;
+    int overflow = bplus_node_overflow_ref(leaf, index.pos, &ref);
+    bplus_node_remove_at(leaf, index.pos);
+    return overflow ? bplus_overflow_free(tree->pool, &ref) : 0;
+}
+
+// delete from the leaf alone, as long as that can't make it underflow.
+// returns 2 if the leaf needs rebalancing.
+int bplus_tree_delete_optimistic(
+    struct bplus_tree *tree, char *key, int key_len, uint64_t *lsn) {
+    struct bplus_node *leaf =
+        bplus_tree_find_leaf(tree, key, key_len, BPLUS_LATCH_WRITE);
+    if (leaf == NULL) {
+        return -1;
+    }
+
+    // a leaf without siblings is the root, which may shrink to nothing
+    int ret = 2;
+    struct bplus_insert_index index =
+        bplus_node_find_insert_index(tree->pool->keys, leaf, key_len, key);
+    if (!index.found) {
+        ret = 1;
+    } else if (
+        (leaf->disk.prev == BPLUS_INVALID_PAGE &&
+         leaf->disk.next == BPLUS_INVALID_PAGE) ||
+        bplus_node_used(leaf) - bplus_node_entry_size(leaf, index.pos) >=
+            BPLUS_MIN_USED) {
+        ret = bplus_leaf_delete(tree, leaf, key, key_len, lsn);
+    }
+    bplus_node_release(tree->pool, leaf);
+    return ret;
+}
+
+// delete with write latches all the way down, keeping every node a merge
+// could reach, then rebalance underflowing nodes from the leaf up
+int bplus_tree_delete_pessimistic(
+    struct bplus_tree *tree, char *key, int key_len, uint64_t *lsn) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    struct bplus_latch_path path = {.root_latched = 1};
+    int child_pos[BPLUS_MAX_HEIGHT];
+
+    pthread_rwlock_wrlock(&tree->root_latch);
+    struct bplus_node *node = tree->root;
+    bplus_buffer_pool_pin(pool, node);
+    bplus_node_latch(pool, node, BPLUS_LATCH_WRITE);
+    path.nodes[path.n++] = node;
+    if (bplus_node_is_safe_delete(node, 1)) {
+        bplus_latch_path_release(tree, &path, path.n - 1);
+    }
+
+    while (!node->disk.is_leaf) {
+        int pos =
+            bplus_node_find_insert_index(pool->keys, node, key_len, key).pos;
+        struct bplus_node *child = bplus_node_get_child(pool, node, pos);
+        if (child == NULL) {
+            printf("error! couldn't load child\n");
+            bplus_latch_path_release(tree, &path, path.n);
+            return -1;
+        }
+        bplus_node_latch(pool, child, BPLUS_LATCH_WRITE);
+        assert(path.n < BPLUS_MAX_HEIGHT);
+        child_pos[path.n] = pos;
+        path.nodes[path.n++] = child;
+        if (bplus_node_is_safe_delete(child, 0)) {
+            bplus_latch_path_release(tree, &path, path.n - 1);
+        }
+        node = child;
+    }
+
+    int ret = bplus_leaf_delete(tree, node, key, key_len, lsn);
+    for (int i = path.n - 1; i > path.base && ret == 0; i--) {
+        if (bplus_node_used(path.nodes[i]) >= BPLUS_MIN_USED) {
+            break;
+        }
+        ret = bplus_node_rebalance(
+            pool, path.nodes[i - 1], child_pos[i], path.nodes[i]);
+    }
+
+    // an internal root left with a single child hands the tree over to it
+    struct bplus_node *root = path.nodes[0];
+    if (ret == 0 && path.root_latched && !root->disk.is_leaf &&
+        root->disk.num_keys == 0) {
+        struct bplus_node *child =
+            bplus_buffer_pool_fetch(pool, root->disk.last_child);
+        if (child == NULL) {
+            ret = -1;
+        } else {
+            // the tree's pin moves over to the new root
+            bplus_buffer_pool_unpin(pool, tree->root);
+            tree->root = child;
+            tree->height -= 1;
+            bplus_node_free(pool, root);
+        }
+    }
+
+    bplus_latch_path_release(tree, &path, path.n);
+    return ret;
+}
+
+// remove key from the tree, appending a log record first when lsn is set.
+// returns 1 if the key wasn't there.
+int bplus_tree_apply_delete(
+    struct bplus_tree *tree, char *key, int key_len, uint64_t *lsn) {
+    int ret = bplus_tree_delete_optimistic(tree, key, key_len, lsn);
+    if (ret == 2) {
+        ret = bplus_tree_delete_pessimistic(tree, key, key_len, lsn);
+    }
+    return ret;
+}
+
+// returns 0 if key was removed, 1 if it wasn't in the tree and -1 on error.
+// safe to call from any number of threads, like bplus_tree_put.
+int bplus_tree_remove(struct bplus_tree *tree, char *key, int key_len) {
+    if (bplus_buffer_pool_readonly(tree->pool)) {
+        printf("tree is open read-only\n");
+        return -1;
+    }
+
+    if (bplus_tree_wal_reserve(tree, 0) < 0) {
+        return -1;
+    }
+
+    uint64_t lsn = 0;
+    pthread_rwlock_rdlock(&tree->lock);
+    int ret = bplus_tree_apply_delete(
+        tree, key, key_len, tree->wal != NULL ? &lsn : NULL);
+    pthread_rwlock_unlock(&tree->lock);
+
+    if (ret == 0 && tree->wal != NULL) {
+        ret = bplus_wal_commit(tree->wal, lsn);
+    }
+    return ret;
+}
+
+// bplus_tree_remove for a NUL terminated key
+int bplus_tree_delete(struct bplus_tree *tree, char *key) {
+    return bplus_tree_remove(tree, key, strlen(key));
+}
+
+// where every page is while bplus_tree_compact moves them around. all the
+// arrays are indexed by page_id and kept up to date across swaps.
+struct bplus_compact {
+    struct bplus_tree *tree;
+    uint32_t num_pages;
+    uint32_t *order; // pages in the tree, breadth first
+    uint32_t num_live;
+    int32_t *order_pos; // index into order, -1 for pages not in the tree
+    uint32_t *parent;   // BPLUS_INVALID_PAGE for the root and unused pages.
+                        // the leaf or overflow page before, for overflow
+                        // pages
+    int32_t *free_pos;  // index into pool->free_pages, -1 if not free
+};
+
+// list the tree breadth first, which puts the leaves in key order after the
+// internal levels, then the overflow chains in the order of their keys
+int bplus_compact_init(struct bplus_compact *cp, struct bplus_tree *tree) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    uint32_t n = pool->next_page_id;
+    cp->tree = tree;
+    cp->num_pages = n;
+    cp->order = malloc(n * sizeof(uint32_t));
+    cp->order_pos = malloc(n * sizeof(int32_t));
+    cp->parent = malloc(n * sizeof(uint32_t));
+    cp->free_pos = malloc(n * sizeof(int32_t));
+    for (uint32_t i = 0; i < n; i++) {
+        cp->order_pos[i] = -1;
+        cp->parent[i] = BPLUS_INVALID_PAGE;
+        cp->free_pos[i] = -1;
+    }
+    for (uint32_t i = 0; i < pool->num_free; i++) {
+        cp->free_pos[pool->free_pages[i]] = i;
+    }
+
+    cp->order[0] = tree->root->disk.page_id;
+    cp->order_pos[cp->order[0]] = 0;
+    cp->num_live = 1;
+
+    // only internal levels need reading, their children name the leaves
+    uint32_t level = 0;
+    for (int depth = 1; depth < tree->height; depth++) {
+        uint32_t level_end = cp->num_live;
+        for (; level < level_end; level++) {
+            struct bplus_node *node =
+                bplus_buffer_pool_fetch(pool, cp->order[level]);
+            if (node == NULL) {
+                return -1;
+            }
+            for (int i = 0; i <= node->disk.num_keys; i++) {
+                uint32_t child = bplus_node_child_id(node, i);
+                if (child >= n || cp->order_pos[child] >= 0) {
+                    printf("compact: bad child %u of page %u\n", child,
+                           node->disk.page_id);
+                    bplus_buffer_pool_unpin(pool, node);
+                    return -1;
+                }
+                cp->parent[child] = node->disk.page_id;
+                cp->order_pos[child] = cp->num_live;
+                cp->order[cp->num_live++] = child;
+            }
+            bplus_buffer_pool_unpin(pool, node);
+        }
+    }
+
+    // level is now the first leaf
+    for (uint32_t leaves_end = cp->num_live; level < leaves_end; level++) {
+        struct bplus_node *leaf =
+            bplus_buffer_pool_fetch(pool, cp->order[level]);
+        if (leaf == NULL) {
+            return -1;
+        }
+        int ret = 0;
+        for (int i = 0; i < leaf->disk.num_keys && ret == 0; i++) {
+            struct bplus_overflow_ref ref;
+            if (!bplus_node_overflow_ref(leaf, i, &ref)) {
+                continue;
+            }
+            uint32_t parent = leaf->disk.page_id;
+            for (uint32_t page_id = ref.first_page;
+                 page_id != BPLUS_INVALID_PAGE;) {
+                struct bplus_node *page = NULL;
+                if (page_id < n && cp->order_pos[page_id] < 0) {
+                    page = bplus_buffer_pool_fetch(pool, page_id);
+                }
+                if (page == NULL) {
+                    printf(
+                        "compact: bad overflow page %u of page %u\n", page_id,
+                        leaf->disk.page_id);
+                    ret = -1;
+                    break;
+                }
+                cp->parent[page_id] = parent;
+                cp->order_pos[page_id] = cp->num_live;
+                cp->order[cp->num_live++] = page_id;
+                parent = page_id;
+                page_id = page->disk.next;
+                bplus_buffer_pool_unpin(pool, page);
+            }
+        }
+        bplus_buffer_pool_unpin(pool, leaf);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void bplus_compact_free(struct bplus_compact *cp) {
+    free(cp->order);
+    free(cp->order_pos);
+    free(cp->parent);
+    free(cp->free_pos);
+}
+
+uint32_t bplus_compact_map(uint32_t page_id, uint32_t a, uint32_t b) {
+    return page_id == a ? b : page_id == b ? a : page_id;
+}
+
+void bplus_compact_add(uint32_t *ids, int *n, uint32_t page_id) {
+    if (page_id == BPLUS_INVALID_PAGE) {
+        return;
+    }
+    for (int i = 0; i < *n; i++) {
+        if (ids[i] == page_id) {
+            return;
+        }
+    }
+    ids[(*n)++] = page_id;
+}
+
+// make node the parent of every page it refers to
+void bplus_compact_adopt(struct bplus_compact *cp, struct bplus_node *node) {
+    struct bplus_node_disk *disk = &node->disk;
+    if (disk->kind == BPLUS_PAGE_OVERFLOW) {
+        if (disk->next != BPLUS_INVALID_PAGE) {
+            cp->parent[disk->next] = disk->page_id;
+        }
+    } else if (disk->is_leaf) {
+        for (int i = 0; i < disk->num_keys; i++) {
+            struct bplus_overflow_ref ref;
+            if (bplus_node_overflow_ref(node, i, &ref)) {
+                cp->parent[ref.first_page] = disk->page_id;
+            }
+        }
+    } else {
+        for (int c = 0; c <= disk->num_keys; c++) {
+            cp->parent[bplus_node_child_id(node, c)] = disk->page_id;
+        }
+    }
+}
+
+// exchange the contents of pages a and b and repoint everything that
+// referred to either: parents, leaf siblings, overflow references, the free
+// page linking to b and the tree's root. only readers run alongside, so
+// pages can be looked at before they are latched.
+int bplus_compact_swap(struct bplus_compact *cp, uint32_t a, uint32_t b) {
+    struct bplus_tree *tree = cp->tree;
+    struct bplus_buffer_pool *pool = tree->pool;
+    uint32_t ids[9]; // a and b, two parents, four siblings, one free page
+    struct bplus_node *nodes[9];
+    int n = 0;
+
+    bplus_compact_add(ids, &n, a);
+    bplus_compact_add(ids, &n, b);
+    bplus_compact_add(ids, &n, cp->parent[a]);
+    bplus_compact_add(ids, &n, cp->parent[b]);
+    if (cp->free_pos[b] >= 0) {
+        uint32_t i = cp->free_pos[b] + 1;
+        if (i < pool->num_free) {
+            bplus_compact_add(ids, &n, pool->free_pages[i]);
+        }
+    }
+    int ret = 0;
+    int pinned = 0;
+    for (; pinned < n; pinned++) {
+        nodes[pinned] = bplus_buffer_pool_fetch(pool, ids[pinned]);
+        if (nodes[pinned] == NULL) {
+            ret = -1;
+            goto out;
+        }
+        // siblings of a or b get pinned in later rounds of this loop
+        struct bplus_node_disk *disk = &nodes[pinned]->disk;
+        if (pinned < 2 && cp->order_pos[ids[pinned]] >= 0 && disk->is_leaf) {
+            bplus_compact_add(ids, &n, disk->prev);
+            bplus_compact_add(ids, &n, disk->next);
+        }
+    }
+
+    // readers hold at most one latch while waiting for another, so wait for
+    // one page at a time and back off if any of the others is taken
+    uint32_t root_id = tree->root->disk.page_id;
+    int lock_root = root_id == a || root_id == b;
+    for (int wait = 0;;) {
+        if (lock_root) {
+            pthread_rwlock_wrlock(&tree->root_latch);
+        }
+        bplus_node_latch(pool, nodes[wait], BPLUS_LATCH_WRITE);
+        int busy = -1;
+        for (int i = 0; i < n && busy < 0; i++) {
+            if (i != wait &&
+                !bplus_node_try_latch(pool, nodes[i], BPLUS_LATCH_WRITE)) {
+                busy = i;
+            }
+        }
+        if (busy < 0) {
+            break;
+        }
+        for (int i = 0; i < busy; i++) {
+            if (i != wait) {
+                bplus_node_unlatch(pool, nodes[i]);
+            }
+        }
+        bplus_node_unlatch(pool, nodes[wait]);
+        if (lock_root) {
+            pthread_rwlock_unlock(&tree->root_latch);
+        }
+        wait = busy;
+    }
+
+    for (int i = 0; i < n; i++) {
+        bplus_buffer_pool_mark_dirty(pool, nodes[i]);
+    }
+    struct bplus_node *na = nodes[0];
+    struct bplus_node *nb = nodes[1];
+    struct bplus_node_disk tmp;
+    memcpy(&tmp, &na->disk, sizeof(tmp));
+    memcpy(&na->disk, &nb->disk, sizeof(tmp));
+    memcpy(&nb->disk, &tmp, sizeof(tmp));
+    na->disk.page_id = a;
+    nb->disk.page_id = b;
+
+    for (int i = 0; i < n; i++) {
+        struct bplus_node_disk *disk = &nodes[i]->disk;
+        disk->next = bplus_compact_map(disk->next, a, b);
+        disk->prev = bplus_compact_map(disk->prev, a, b);
+        // overflow pages only link through next
+        if (disk->kind == BPLUS_PAGE_NODE && disk->is_leaf) {
+            for (int c = 0; c < disk->num_keys; c++) {
+                struct bplus_overflow_ref ref;
+                if (bplus_node_overflow_ref(nodes[i], c, &ref)) {
+                    ref.first_page = bplus_compact_map(ref.first_page, a, b);
+                    memcpy(bplus_node_value(nodes[i], c), &ref, sizeof(ref));
+                }
+            }
+        } else if (disk->kind == BPLUS_PAGE_NODE) {
+            for (int c = 0; c <= disk->num_keys; c++) {
+                uint32_t child = bplus_node_child_id(nodes[i], c);
+                if (child != BPLUS_INVALID_PAGE) {
+                    bplus_node_set_child_id(
+                        nodes[i], c, bplus_compact_map(child, a, b));
+                }
+            }
+        }
+    }
+
+    if (lock_root) {
+        struct bplus_node *root = root_id == a ? nb : na;
+        bplus_buffer_pool_pin(pool, root);
+        bplus_buffer_pool_unpin(pool, tree->root);
+        tree->root = root;
+        pthread_rwlock_unlock(&tree->root_latch);
+    }
+
+    uint32_t parent_a = cp->parent[a];
+    cp->parent[a] = bplus_compact_map(cp->parent[b], a, b);
+    cp->parent[b] = bplus_compact_map(parent_a, a, b);
+
+    int32_t pos = cp->order_pos[a];
+    cp->order_pos[a] = cp->order_pos[b];
+    cp->order_pos[b] = pos;
+    pos = cp->free_pos[a];
+    cp->free_pos[a] = cp->free_pos[b];
+    cp->free_pos[b] = pos;
+    for (int k = 0; k < 2; k++) {
+        uint32_t page_id = k == 0 ? a : b;
+        struct bplus_node *node = nodes[k];
+        if (cp->order_pos[page_id] >= 0) {
+            cp->order[cp->order_pos[page_id]] = page_id;
+            bplus_compact_adopt(cp, node);
+        }
+        if (cp->free_pos[page_id] >= 0) {
+            pool->free_pages[cp->free_pos[page_id]] = page_id;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        bplus_node_unlatch(pool, nodes[i]);
+    }
+
+out:
+    for (int i = 0; i < pinned; i++) {
+        bplus_buffer_pool_unpin(pool, nodes[i]);
+    }
+    return ret;
+}
+
+// move the tree's pages to the front of the file in breadth first order,
+// so leaves end up physically sequential in key order, then cut off the
+// free pages. writers wait until it is done. lookups and scans carry on,
+// though a page can't move while a cursor sits on it.
+int bplus_tree_compact(struct bplus_tree *tree) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    if (bplus_buffer_pool_readonly(pool)) {
+        printf("tree is open read-only\n");
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&tree->lock);
+    if (__atomic_load_n(&pool->snap_epoch, __ATOMIC_RELAXED) != 0) {
+        printf("can't compact while a snapshot is open\n");
+        pthread_rwlock_unlock(&tree->lock);
+        return -1;
+    }
+    struct bplus_compact cp;
+    int ret = bplus_compact_init(&cp, tree);
+
+    for (uint32_t t = 0; t < cp.num_live && ret == 0; t++) {
+        // a no-steal pool fills up with moved pages, checkpoint as inserts do
+        if (tree->wal != NULL &&
+            __atomic_load_n(&pool->num_dirty, __ATOMIC_RELAXED) >
+                pool->num_frames / 2) {
+            ret = bplus_tree_checkpoint_locked(tree);
+        }
+        if (ret == 0 && cp.order[t] != t) {
+            ret = bplus_compact_swap(&cp, cp.order[t], t);
+        }
+    }
+
+    // everything past the tree is free now
+    if (ret == 0) {
+        pool->num_free = 0;
+        bplus_buffer_pool_drop_pages(pool, cp.num_live);
+        if (tree->wal != NULL) {
+            ret = bplus_tree_checkpoint_locked(tree);
+        } else if (bplus_tree_write_back(tree) < 0) {
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        ret = bplus_buffer_pool_truncate(pool, cp.num_live);
+    }
+
+    bplus_compact_free(&cp);
+    pthread_rwlock_unlock(&tree->lock);
+    return ret;
+}
+
+// redo every change in the log newer than the checkpoint the file reflects,
+// then checkpoint so the log starts out empty
+int bplus_tree_replay(
+    struct bplus_tree *tree, const char *log, size_t len, uint64_t base) {
+    struct bplus_wal *wal = tree->wal;
+    uint64_t applied = base;
+    int replayed = 0;
+
+    // new records must sort after everything already in the log
+    for (size_t pos = 0; pos < len;) {
+        struct bplus_wal_record rec;
+        memcpy(&rec, &log[pos], sizeof(rec));
+        if (rec.lsn >= wal->next_lsn) {
+            wal->next_lsn = rec.lsn + 1;
+        }
+        pos += rec.len;
+    }
+    if (base >= wal->next_lsn) {
+        wal->next_lsn = base + 1;
+    }
+
+    for (size_t pos = 0; pos < len;) {
+        struct bplus_wal_record rec;
+        memcpy(&rec, &log[pos], sizeof(rec));
+        const char *payload = &log[pos + sizeof(rec)];
+        pos += rec.len;
+        if ((rec.type != BPLUS_WAL_PUT && rec.type != BPLUS_WAL_DELETE) ||
+            rec.lsn <= base) {
+            continue;
+        }
+
+        // the log stays around until the end, so an intermediate checkpoint
+        // only claims the changes applied so far
+        int pages = rec.type == BPLUS_WAL_PUT &&
+                            bplus_entry_overflows(rec.a, rec.b)
+                        ? bplus_overflow_pages(rec.b)
+                        : 0;
+        if (tree->pool->num_dirty + pages > tree->pool->num_frames / 2 &&
+            bplus_tree_checkpoint_upto(tree, applied, 0) < 0) {
+            return -1;
+        }
+
+        // entries are applied straight out of the log
+        char *key = (char *)payload;
+        int ret;
+        if (rec.type == BPLUS_WAL_PUT) {
+            ret = bplus_tree_apply_put(
+                tree, key, rec.a, key + rec.a, rec.b, NULL);
+        } else {
+            ret = bplus_tree_apply_delete(tree, key, rec.a, NULL);
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        applied = rec.lsn;
+        replayed++;
+    }
+
+    if (replayed > 0) {
+        printf("wal: replayed %d changes\n", replayed);
+    }
+    if (len == 0) {
+        return 0;
+    }
+    pthread_rwlock_wrlock(&tree->lock);
+    int ret = bplus_tree_checkpoint_locked(tree);
+    pthread_rwlock_unlock(&tree->lock);
+    return ret;
+}
+
+// a bplus_value_sink filling a buffer known to be large enough
+int bplus_copy_sink(void *ctx, const char *data, int len) {
+    char **dst = ctx;
+    memcpy(*dst, data, len);
+    *dst += len;
+    return 0;
+}
+
+// copy the value for key out of a latched leaf and set *val_len to its
+// length. returns 0 if found, 1 if missing and -1 if buf is too small, in
+// which case *val_len still says how much room the value needs.
+int bplus_node_get(
+    struct bplus_buffer_pool *pool,
+    struct bplus_node *node,
+    char *key,
+    int key_len,
+    char *buf,
+    int buf_len,
+    int *val_len) {
+    assert(node->disk.is_leaf);
+    struct bplus_insert_index index =
+        bplus_node_find_insert_index(pool->keys, node, key_len, key);
+
+    if (!index.found) {
+        return 1;
+    }
+
+    *val_len = bplus_node_value_len(node, index.pos);
+    if (buf_len < *val_len) {
+        printf("buffer too small!\n");
+        return -1;
+    }
+    return bplus_node_stream_value(
+        pool, node, index.pos, bplus_copy_sink, &buf);
+}
+
+// look up key, copying its value to buf and its length to *val_len. the
+// value is not NUL terminated. returns 0 if found, 1 if missing and -1 on
+// error or if buf is too small.
+int bplus_tree_lookup(
+    struct bplus_tree *tree,
+    char *key,
+    int key_len,
+    char *buf,
+    int buf_len,
+    int *val_len) {
+    struct bplus_node *leaf =
+        bplus_tree_find_leaf(tree, key, key_len, BPLUS_LATCH_READ);
+    if (leaf == NULL) {
+        return -1;
+    }
+    int ret =
+        bplus_node_get(tree->pool, leaf, key, key_len, buf, buf_len, val_len);
+    bplus_node_release(tree->pool, leaf);
+    return ret;
+}
+
+// feed the value of key to sink piece by piece, a page at a time for values
+// in overflow pages, so it never has to fit in memory at once. the leaf
+// stays read latched until the value is done, so sink mustn't write to the
+// tree. returns 0 if found, 1 if missing and -1 on error or if sink stopped
+// the stream.
+int bplus_tree_stream(
+    struct bplus_tree *tree,
+    char *key,
+    int key_len,
+    bplus_value_sink sink,
+    void *ctx) {
+    struct bplus_node *leaf =
+        bplus_tree_find_leaf(tree, key, key_len, BPLUS_LATCH_READ);
+    if (leaf == NULL) {
+        return -1;
+    }
+    int ret = 1;
+    struct bplus_insert_index index =
+        bplus_node_find_insert_index(tree->pool->keys, leaf, key_len, key);
+    if (index.found) {
+        ret = bplus_node_stream_value(tree->pool, leaf, index.pos, sink, ctx);
+    }
+    bplus_node_release(tree->pool, leaf);
+    return ret;
+}
+
+// bplus_tree_lookup for a NUL terminated key, NUL terminating the value
+int bplus_tree_get(struct bplus_tree *tree, char *key, char *buf, int buf_len) {
+    int val_len;
+    int ret = bplus_tree_lookup(
+        tree, key, strlen(key), buf, buf_len - 1, &val_len);
+    if (ret == 0) {
+        buf[val_len] = '\0';
+    }
+    return ret;
+}
+
+// one key of a multi_get or multi_put batch. batches are sorted by key so
+// keys that share a leaf sit next to each other.
+struct bplus_batch_entry {
+    char *key;
+    int key_len;
+    int index; // position in the caller's arrays
+};
+
+// qsort takes no context, so the order to sort by is handed over here
+__thread const struct bplus_key_ops *bplus_batch_keys;
+
+int bplus_batch_compare(const void *a, const void *b) {
+    const struct bplus_batch_entry *x = a;
+    const struct bplus_batch_entry *y = b;
+    int cmp = bplus_keys_compare(
+        bplus_batch_keys, x->key, x->key_len, y->key, y->key_len);
+    return cmp != 0 ? cmp : x->index - y->index;
+}
+
+// key_lens may be NULL for NUL terminated keys
+struct bplus_batch_entry *bplus_batch_sort(
+    const struct bplus_key_ops *keys, char **key_ptrs, int *key_lens, int n) {
+    struct bplus_batch_entry *batch = malloc(n * sizeof(*batch));
+    for (int i = 0; i < n; i++) {
+        batch[i].key = key_ptrs[i];
+        batch[i].key_len =
+            key_lens != NULL ? key_lens[i] : (int)strlen(key_ptrs[i]);
+        batch[i].index = i;
+    }
+    bplus_batch_keys = keys;
+    qsort(batch, n, sizeof(*batch), bplus_batch_compare);
+    return batch;
+}
+
+// handles the entries [lo, hi) of a batch, which all belong in leaf
+typedef int (*bplus_batch_visit)(
+    struct bplus_tree *tree,
+    struct bplus_node *leaf,
+    struct bplus_batch_entry *batch,
+    int lo,
+    int hi,
+    void *ctx);
+
+// split batch[lo, hi) between the children of a latched internal node and
+// visit each child once, depth levels further down. children that aren't
+// cached are read in batches ahead of their visits.
+int bplus_node_batch_descend(
+    struct bplus_tree *tree,
+    struct bplus_node *node,
+    int depth,
+    struct bplus_batch_entry *batch,
+    int lo,
+    int hi,
+    int leaf_mode,
+    bplus_batch_visit visit,
+    void *ctx) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    uint32_t *children = malloc((hi - lo) * sizeof(uint32_t));
+    int *ends = malloc((hi - lo) * sizeof(int));
+    int groups = 0;
+
+    for (int i = lo; i < hi; groups++) {
+        int pos = bplus_node_find_insert_index(
+                      pool->keys, node, batch[i].key_len, batch[i].key)
+                      .pos;
+        int end = hi;
+        if (pos < node->disk.num_keys) {
+            char *sep = bplus_node_key(node, pos);
+            int sep_len = node->disk.slots[pos].key_len;
+            for (end = i + 1; end < hi; end++) {
+                if (bplus_keys_compare(
+                        pool->keys, batch[end].key, batch[end].key_len, sep,
+                        sep_len) > 0) {
+                    break;
+                }
+            }
+        }
+        children[groups] = bplus_node_child_id(node, pos);
+        ends[groups] = end;
+        i = end;
+    }
+
+    // read ahead a window at a time so a small pool doesn't evict children
+    // before their turn. a failed read shows up again in the fetch.
+    int window = pool->num_frames > 4 ? pool->num_frames / 4 : 1;
+    int ret = 0;
+    for (int g = 0, i = lo; g < groups && ret == 0; i = ends[g++]) {
+        if (g % window == 0) {
+            bplus_buffer_pool_load_many(
+                pool, &children[g], groups - g < window ? groups - g : window);
+        }
+        struct bplus_node *child = bplus_buffer_pool_fetch(pool, children[g]);
+        if (child == NULL) {
+            ret = -1;
+            break;
+        }
+        bplus_node_latch(
+            pool, child, depth == 1 ? leaf_mode : BPLUS_LATCH_READ);
+        if (depth == 1) {
+            ret = visit(tree, child, batch, i, ends[g], ctx);
+        } else {
+            ret = bplus_node_batch_descend(
+                tree, child, depth - 1, batch, i, ends[g], leaf_mode, visit,
+                ctx);
+        }
+        bplus_node_release(pool, child);
+    }
+
+    free(children);
+    free(ends);
+    return ret;
+}
+
+// visit every leaf holding keys of a sorted batch with one walk down the
+// tree. ancestors stay read latched while their subtrees are visited.
+int bplus_tree_batch(
+    struct bplus_tree *tree,
+    struct bplus_batch_entry *batch,
+    int n,
+    int leaf_mode,
+    bplus_batch_visit visit,
+    void *ctx) {
+    struct bplus_buffer_pool *pool = tree->pool;
+
+    pthread_rwlock_rdlock(&tree->root_latch);
+    struct bplus_node *root = tree->root;
+    int depth = tree->height - 1;
+    bplus_buffer_pool_pin(pool, root);
+    bplus_node_latch(pool, root, depth == 0 ? leaf_mode : BPLUS_LATCH_READ);
+    pthread_rwlock_unlock(&tree->root_latch);
+
+    int ret;
+    if (depth == 0) {
+        ret = visit(tree, root, batch, 0, n, ctx);
+    } else {
+        ret = bplus_node_batch_descend(
+            tree, root, depth, batch, 0, n, leaf_mode, visit, ctx);
+    }
+    bplus_node_release(pool, root);
+    return ret;
+}
+
+struct bplus_multi_get {
+    char **bufs;
+    int buf_len;
+    int *val_lens; // NULL to NUL terminate values instead
+    int *results;
+};
+
+int bplus_multi_get_visit(
+    struct bplus_tree *tree,
+    struct bplus_node *leaf,
+    struct bplus_batch_entry *batch,
+    int lo,
+    int hi,
+    void *ctx) {
+    struct bplus_multi_get *get = ctx;
+    for (int i = lo; i < hi; i++) {
+        int index = batch[i].index;
+        char *buf = get->bufs[index];
+        int val_len;
+        int ret = bplus_node_get(
+            tree->pool, leaf, batch[i].key, batch[i].key_len, buf,
+            get->val_lens != NULL ? get->buf_len : get->buf_len - 1,
+            &val_len);
+        if (ret == 0 && get->val_lens != NULL) {
+            get->val_lens[index] = val_len;
+        } else if (ret == 0) {
+            buf[val_len] = '\0';
+        }
+        get->results[index] = ret;
+    }
+    return 0;
+}
+
+// look up n keys at once. results[i] is set to what bplus_tree_lookup would
+// return for keys[i], and its value goes to bufs[i]. key_lens and val_lens
+// may be NULL, for NUL terminated keys and for NUL terminated values like
+// bplus_tree_get returns. the batch is sorted so each leaf is visited once
+// however many of the keys it holds. returns -1 if the tree couldn't be
+// read.
+int bplus_tree_multi_get(
+    struct bplus_tree *tree,
+    char **keys,
+    int *key_lens,
+    int n,
+    char **bufs,
+    int buf_len,
+    int *val_lens,
+    int *results) {
+    if (n == 0) {
+        return 0;
+    }
+
+    struct bplus_batch_entry *batch =
+        bplus_batch_sort(tree->pool->keys, keys, key_lens, n);
+    struct bplus_multi_get get = {
+        .bufs = bufs,
+        .buf_len = buf_len,
+        .val_lens = val_lens,
+        .results = results,
+    };
+    int ret = bplus_tree_batch(
+        tree, batch, n, BPLUS_LATCH_READ, bplus_multi_get_visit, &get);
+    free(batch);
+    return ret;
+}
+
+struct bplus_multi_put {
+    char **vals;
+    int *val_lens;
+    int *deferred; // indexes of entries that need a split
+    int num_deferred;
+    uint64_t *lsn;
+    uint64_t last_lsn;
+};
+
+int bplus_multi_put_visit(
+    struct bplus_tree *tree,
+    struct bplus_node *leaf,
+    struct bplus_batch_entry *batch,
+    int lo,
+    int hi,
+    void *ctx) {
+    struct bplus_multi_put *put = ctx;
+    for (int i = lo; i < hi; i++) {
+        struct bplus_value v = {
+            .data = put->vals[batch[i].index],
+            .len = put->val_lens[batch[i].index],
+            .overflow = bplus_entry_overflows(
+                batch[i].key_len, put->val_lens[batch[i].index]),
+        };
+        struct bplus_insert_index index = bplus_node_find_insert_index(
+            tree->pool->keys, leaf, batch[i].key_len, batch[i].key);
+        if (!bplus_node_can_put(
+                leaf, index, batch[i].key_len, bplus_value_stored_len(&v))) {
+            put->deferred[put->num_deferred++] = batch[i].index;
+            continue;
+        }
+        if ((v.overflow &&
+             bplus_overflow_write(tree->pool, v.data, v.len, &v.ref) < 0) ||
+            bplus_leaf_insert(
+                tree, leaf, index, batch[i].key, batch[i].key_len, &v,
+                put->lsn) < 0) {
+            return -1;
+        }
+        if (put->lsn != NULL) {
+            put->last_lsn = *put->lsn;
+        }
+    }
+    return 0;
+}
+
+// insert n entries at once. key_lens and val_lens may be NULL for NUL
+// terminated keys and values. the batch is sorted and written leaf by leaf
+// under a single walk down the tree, and entries that would split their
+// leaf are inserted one at a time afterwards. when a key repeats the last
+// value given for it wins. with a WAL attached the whole batch is committed
+// with one sync.
+int bplus_tree_multi_put(
+    struct bplus_tree *tree,
+    char **keys,
+    int *key_lens,
+    char **vals,
+    int *val_lens,
+    int n) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    if (bplus_buffer_pool_readonly(pool)) {
+        printf("tree is open read-only\n");
+        return -1;
+    }
+
+    int *lens = malloc(n * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        int key_len = key_lens != NULL ? key_lens[i] : (int)strlen(keys[i]);
+        lens[i] = val_lens != NULL ? val_lens[i] : (int)strlen(vals[i]);
+        if (bplus_tree_check_entry(tree, key_len, lens[i]) < 0) {
+            free(lens);
+            return -1;
+        }
+    }
+
+    // keep only the last of equal keys, which sort by position
+    struct bplus_batch_entry *batch =
+        bplus_batch_sort(pool->keys, keys, key_lens, n);
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (i + 1 < n &&
+            bplus_keys_compare(
+                pool->keys, batch[i].key, batch[i].key_len, batch[i + 1].key,
+                batch[i + 1].key_len) == 0) {
+            continue;
+        }
+        batch[m++] = batch[i];
+    }
+
+    uint64_t lsn = 0;
+    struct bplus_multi_put put = {
+        .vals = vals,
+        .val_lens = lens,
+        .deferred = malloc(m * sizeof(int)),
+        .lsn = tree->wal != NULL ? &lsn : NULL,
+    };
+
+    // a no-steal pool has to be checkpointed before it fills with dirty
+    // leaves, which can only happen between chunks. overflow pages count
+    // against a chunk as well.
+    int chunk = pool->num_frames / 8 > 0 ? pool->num_frames / 8 : 1;
+    int ret = 0;
+    for (int start = 0, end; start < m && ret == 0; start = end) {
+        int pages = 0;
+        for (end = start; end < m && end - start < chunk; end++) {
+            int len = lens[batch[end].index];
+            int more = bplus_entry_overflows(batch[end].key_len, len)
+                           ? bplus_overflow_pages(len)
+                           : 0;
+            if (end > start && pages + more > pool->num_frames / 4) {
+                break;
+            }
+            pages += more;
+        }
+        if (bplus_tree_wal_reserve(tree, pages) < 0) {
+            ret = -1;
+            break;
+        }
+
+        pthread_rwlock_rdlock(&tree->lock);
+        put.num_deferred = 0;
+        ret = bplus_tree_batch(
+            tree, batch + start, end - start, BPLUS_LATCH_WRITE,
+            bplus_multi_put_visit, &put);
+        for (int i = 0; i < put.num_deferred && ret == 0; i++) {
+            int index = put.deferred[i];
+            int key_len =
+                key_lens != NULL ? key_lens[index] : (int)strlen(keys[index]);
+            ret = bplus_tree_apply_put(
+                tree, keys[index], key_len, vals[index], lens[index],
+                put.lsn);
+            if (put.lsn != NULL) {
+                put.last_lsn = lsn;
+            }
+        }
+        pthread_rwlock_unlock(&tree->lock);
+    }
+
+    if (ret == 0 && tree->wal != NULL && put.last_lsn > 0) {
+        ret = bplus_wal_commit(tree->wal, put.last_lsn);
+    }
+    free(put.deferred);
+    free(lens);
+    free(batch);
+    return ret;
+}
+
+// pages the bulk loader stages before writing them out with one pwrite
+#define BPLUS_BULK_BATCH 64
+
+// iterator for bplus_tree_bulk_load. sets the next entry and returns 1, or
+// returns 0 once the input is exhausted.
+typedef int (*bplus_bulk_next)(
+    void *ctx, char **key, int *key_len, char **val, int *val_len);
+
+// stages freshly built pages and writes them in large sequential batches.
+// pages are numbered in the order they are handed out. overflow chains are
+// written straight away from their own buffer, so the leaf being filled
+// stays staged while its values' pages are numbered after it. a writer
+// with no fd keeps every page staged instead, growing as it goes.
+struct bplus_bulk_writer {
+    int fd;
+    const struct bplus_key_ops *keys;
+    uint32_t next_page_id;
+    int num_pages;
+    int cap;
+    struct bplus_node *pages;
+    struct bplus_node *overflow; // NULL until the first large value
+};
+
+// child pointers collected for the level being built: the page_id of each
+// node and the largest key in its subtree
+struct bplus_bulk_level {
+    int count;
+    int cap;
+    uint32_t *page_ids;
+    size_t *key_offsets;
+    int *key_lengths;
+
+    char *keys;
+    size_t keys_len;
+    size_t keys_cap;
+};
+
+// seal pages and write them out, one pwrite per run of consecutive page_ids
+int bplus_bulk_write_pages(int fd, struct bplus_node *pages, int n) {
+    for (int i = 0; i < n; i++) {
+        bplus_page_seal(&pages[i].disk);
+    }
+    for (int i = 0, end; i < n; i = end) {
+        uint32_t first = pages[i].disk.page_id;
+        for (end = i + 1;
+             end < n && pages[end].disk.page_id == first + (end - i); end++) {
+        }
+        size_t len = (size_t)(end - i) * BPLUS_PAGE_SIZE;
+        off_t offset = bplus_buffer_pool_get_offset(first);
+        if (pwrite(fd, &pages[i], len, offset) != (ssize_t)len) {
+            perror("bulk load write");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int bplus_bulk_writer_flush(struct bplus_bulk_writer *w) {
+    int ret = bplus_bulk_write_pages(w->fd, w->pages, w->num_pages);
+    w->num_pages = 0;
+    return ret;
+}
+
+// write val out as an overflow chain on pages numbered from here on
+int bplus_bulk_write_overflow(
+    struct bplus_bulk_writer *w,
+    char *val,
+    int val_len,
+    struct bplus_overflow_ref *ref) {
+    if (w->overflow == NULL) {
+        w->overflow = malloc(BPLUS_BULK_BATCH * sizeof(struct bplus_node));
+    }
+    ref->len = val_len;
+    ref->first_page = w->next_page_id;
+
+    int n = 0;
+    for (int off = 0; off < val_len; off += BPLUS_NODE_CAPACITY) {
+        int len = val_len - off;
+        if (len > BPLUS_NODE_CAPACITY) {
+            len = BPLUS_NODE_CAPACITY;
+        }
+        uint32_t page_id = w->next_page_id++;
+        uint32_t next = len < val_len - off ? page_id + 1 : BPLUS_INVALID_PAGE;
+        bplus_node_init(&w->overflow[n], page_id, 0);
+        bplus_overflow_fill(&w->overflow[n], &val[off], len, next);
+        if (++n == BPLUS_BULK_BATCH || next == BPLUS_INVALID_PAGE) {
+            if (bplus_bulk_write_pages(w->fd, w->overflow, n) < 0) {
+                return -1;
+            }
+            n = 0;
+        }
+    }
+    return 0;
+}
+
+// hand out the next page. earlier pages may be written out, so the caller
+// must be done with the previous page before asking for another.
+struct bplus_node *
+bplus_bulk_writer_page(struct bplus_bulk_writer *w, int is_leaf) {
+    if (w->num_pages == w->cap && w->fd < 0) {
+        int cap = w->cap ? w->cap * 2 : BPLUS_BULK_BATCH;
+        struct bplus_node *pages =
+            realloc(w->pages, cap * sizeof(struct bplus_node));
+        if (pages == NULL) {
+            perror("bulk load pages");
+            return NULL;
+        }
+        w->pages = pages;
+        w->cap = cap;
+    } else if (w->num_pages == w->cap && bplus_bulk_writer_flush(w) < 0) {
+        return NULL;
+    }
+
+    struct bplus_node *node = &w->pages[w->num_pages++];
+    bplus_node_init(node, w->next_page_id++, is_leaf);
+    return node;
+}
+
+void bplus_bulk_level_add(
+    struct bplus_bulk_level *level, uint32_t page_id, char *key, int key_len) {
+    if (level->count == level->cap) {
+        level->cap = level->cap ? level->cap * 2 : 256;
+        level->page_ids =
+            realloc(level->page_ids, level->cap * sizeof(uint32_t));
+        level->key_offsets =
+            realloc(level->key_offsets, level->cap * sizeof(size_t));
+        level->key_lengths =
+            realloc(level->key_lengths, level->cap * sizeof(int));
+    }
+    while (level->keys_len + key_len > level->keys_cap) {
+        level->keys_cap = level->keys_cap ? level->keys_cap * 2 : 4096;
+        level->keys = realloc(level->keys, level->keys_cap);
+    }
+
+    level->page_ids[level->count] = page_id;
+    level->key_offsets[level->count] = level->keys_len;
+    level->key_lengths[level->count] = key_len;
+    memcpy(&level->keys[level->keys_len], key, key_len);
+    level->keys_len += key_len;
+    level->count++;
+}
+
+void bplus_bulk_level_free(struct bplus_bulk_level *level) {
+    free(level->page_ids);
+    free(level->key_offsets);
+    free(level->key_lengths);
+    free(level->keys);
+    memset(level, 0, sizeof(*level));
+}
+
+// a node is full once adding the entry would push it past the fill target
+int bplus_bulk_node_full(struct bplus_node *node, int entry_len, int target) {
+    int used = BPLUS_NODE_CAPACITY - bplus_node_free_space(node);
+    int needed = entry_len + (int)sizeof(struct bplus_slot);
+    return node->disk.num_keys > 0 &&
+           (used + needed > target || bplus_node_free_space(node) < needed);
+}
+
+// build internal nodes on top of children lo to hi, recording the new
+// nodes in parents
+int bplus_bulk_build_level(
+    struct bplus_bulk_writer *w,
+    struct bplus_bulk_level *children,
+    int lo,
+    int hi,
+    struct bplus_bulk_level *parents,
+    int target) {
+    struct bplus_node *node = NULL;
+    int pending = -1; // child waiting to become a separator or last_child
+
+    for (int i = lo; i < hi; i++) {
+        if (node == NULL) {
+            node = bplus_bulk_writer_page(w, 0);
+            if (node == NULL) {
+                return -1;
+            }
+            pending = i;
+            continue;
+        }
+
+        int key_len = children->key_lengths[pending];
+        char *key = &children->keys[children->key_offsets[pending]];
+        if (bplus_bulk_node_full(node, key_len + sizeof(uint32_t), target)) {
+            // close this node, its last child bounds it from above
+            node->disk.last_child = children->page_ids[pending];
+            bplus_bulk_level_add(parents, node->disk.page_id, key, key_len);
+
+            node = bplus_bulk_writer_page(w, 0);
+            if (node == NULL) {
+                return -1;
+            }
+            pending = i;
+            continue;
+        }
+
+        struct bplus_insert_index index = {
+            .pos = node->disk.num_keys,
+            .found = 0,
+        };
+        bplus_node_insert_at(
+            w->keys, node, index, key_len, key, sizeof(uint32_t),
+            (char *)&children->page_ids[pending]);
+        pending = i;
+    }
+
+    if (node != NULL) {
+        node->disk.last_child = children->page_ids[pending];
+        bplus_bulk_level_add(
+            parents, node->disk.page_id,
+            &children->keys[children->key_offsets[pending]],
+            children->key_lengths[pending]);
+    }
+
+    return 0;
+}
+
+// children per slice when a wide internal level is built in parallel
+#define BPLUS_BULK_SLICE 512
+
+// one slice of an internal level, built in memory with page_ids from 0 and
+// renumbered once the slices before it are sized
+struct bplus_bulk_slice {
+    struct bplus_bulk_writer w;
+    struct bplus_bulk_level parents;
+    uint32_t base;
+};
+
+struct bplus_bulk_slices {
+    int fd;
+    struct bplus_bulk_level *children;
+    struct bplus_bulk_slice *slices;
+    int target;
+    int failed;
+};
+
+void bplus_bulk_slice_build(void *ctx, int64_t lo, int64_t hi) {
+    struct bplus_bulk_slices *ss = ctx;
+    for (int64_t i = lo; i < hi; i++) {
+        int first = i * BPLUS_BULK_SLICE;
+        int last = first + BPLUS_BULK_SLICE;
+        if (last > ss->children->count) {
+            last = ss->children->count;
+        }
+        if (bplus_bulk_build_level(
+                &ss->slices[i].w, ss->children, first, last,
+                &ss->slices[i].parents, ss->target) < 0) {
+            __atomic_store_n(&ss->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void bplus_bulk_slice_write(void *ctx, int64_t lo, int64_t hi) {
+    struct bplus_bulk_slices *ss = ctx;
+    for (int64_t i = lo; i < hi; i++) {
+        struct bplus_bulk_slice *slice = &ss->slices[i];
+        for (int j = 0; j < slice->w.num_pages; j++) {
+            slice->w.pages[j].disk.page_id += slice->base;
+        }
+        for (int j = 0; j < slice->parents.count; j++) {
+            slice->parents.page_ids[j] += slice->base;
+        }
+        if (bplus_bulk_write_pages(
+                ss->fd, slice->w.pages, slice->w.num_pages) < 0) {
+            __atomic_store_n(&ss->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// build the next level up. a wide level is cut into slices built and
+// written on the worker pool, each slice's nodes following the last's on
+// disk. the last node of a slice may be underfull.
+int bplus_bulk_build_level_parallel(
+    struct bplus_bulk_writer *w,
+    struct bplus_bulk_level *children,
+    struct bplus_bulk_level *parents,
+    int target) {
+    if (children->count < 2 * BPLUS_BULK_SLICE) {
+        return bplus_bulk_build_level(
+            w, children, 0, children->count, parents, target);
+    }
+    if (bplus_bulk_writer_flush(w) < 0) {
+        return -1;
+    }
+
+    int n = (children->count + BPLUS_BULK_SLICE - 1) / BPLUS_BULK_SLICE;
+    struct bplus_bulk_slices ss = {
+        .fd = w->fd,
+        .children = children,
+        .slices = calloc(n, sizeof(struct bplus_bulk_slice)),
+        .target = target,
+    };
+    for (int i = 0; i < n; i++) {
+        ss.slices[i].w.fd = -1;
+        ss.slices[i].w.keys = w->keys;
+    }
+    taskpool_for(bplus_tasks(), 0, n, 1, bplus_bulk_slice_build, &ss);
+    uint32_t next_page_id = w->next_page_id;
+    for (int i = 0; i < n; i++) {
+        ss.slices[i].base = next_page_id;
+        next_page_id += ss.slices[i].w.num_pages;
+    }
+    // nothing is written from a level that couldn't be built whole, and
+    // the writer only moves past the level once every slice is on disk
+    if (!ss.failed) {
+        taskpool_for(bplus_tasks(), 0, n, 1, bplus_bulk_slice_write, &ss);
+    }
+    if (!ss.failed) {
+        w->next_page_id = next_page_id;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct bplus_bulk_level *p = &ss.slices[i].parents;
+        for (int j = 0; j < p->count; j++) {
+            bplus_bulk_level_add(
+                parents, p->page_ids[j], &p->keys[p->key_offsets[j]],
+                p->key_lengths[j]);
+        }
+        bplus_bulk_level_free(p);
+        free(ss.slices[i].w.pages);
+    }
+    free(ss.slices);
+    return ss.failed ? -1 : 0;
+}
+
+// sync the directory holding path, so names created, renamed or removed in
+// it survive a crash
+int bplus_sync_dir(const char *path) {
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir) {
+        slash[1] = '\0';
+    } else if (slash != NULL) {
+        *slash = '\0';
+    }
+    int fd = open(slash != NULL ? dir : ".", O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0) {
+        perror("open directory");
+        return -1;
+    }
+    int ret = fsync(fd);
+    if (ret < 0) {
+        perror("sync directory");
+    }
+    close(fd);
+    return ret;
+}
+
+// a bulk load is built here and renamed over the tree once it's complete
+char *bplus_bulk_tmp_path(const char *path) {
+    size_t len = strlen(path);
+    char *tmp_path = malloc(len + sizeof(".tmp"));
+    memcpy(tmp_path, path, len);
+    memcpy(tmp_path + len, ".tmp", sizeof(".tmp"));
+    return tmp_path;
+}
+
+// make the fully written and synced file at tmp_path the tree at path.
+// a log or extent table left over from an earlier tree at path no longer
+// applies, and a log replayed over the new file would overwrite it, so they
+// are removed first. bulk loaded files are never compressed.
+int bplus_bulk_install(const char *tmp_path, const char *path) {
+    char *wal_path = bplus_wal_path(path);
+    unlink(wal_path);
+    free(wal_path);
+    char *extent_path = bplus_extent_path(path);
+    unlink(extent_path);
+    free(extent_path);
+    if (bplus_sync_dir(path) < 0) {
+        return -1;
+    }
+    if (rename(tmp_path, path) < 0) {
+        perror("install bulk load file");
+        return -1;
+    }
+    return bplus_sync_dir(path);
+}
+
+// build a new tree at path from entries that next returns in strictly
+// increasing key order. nodes are filled to fill_factor (0, 1] of a page and
+// written sequentially, leaves first and then each internal level bottom up.
+// the tree is built in a separate file and synced before it replaces any
+// existing file at path, so a load that fails leaves the old tree as it was.
+struct bplus_tree *bplus_tree_bulk_load(
+    const char *path,
+    const struct bplus_tree_options *opts,
+    bplus_bulk_next next,
+    void *ctx,
+    double fill_factor) {
+    if (fill_factor <= 0 || fill_factor > 1) {
+        fill_factor = 1;
+    }
+    int target = BPLUS_NODE_CAPACITY * fill_factor;
+
+    char *tmp_path = bplus_bulk_tmp_path(path);
+    int fd = open(tmp_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+        perror("open bulk load file");
+        free(tmp_path);
+        return NULL;
+    }
+
+    struct bplus_bulk_writer w = {
+        .fd = fd,
+        .keys = opts != NULL && opts->keys != NULL ? opts->keys
+                                                   : &bplus_keys_bytes,
+        .cap = BPLUS_BULK_BATCH,
+        .pages = malloc(BPLUS_BULK_BATCH * sizeof(struct bplus_node)),
+    };
+    struct bplus_bulk_level level = {0};
+    struct bplus_bulk_level parents = {0};
+    int height = 1;
+    int ret = -1;
+
+    // fill leaves left to right
+    struct bplus_node *leaf = bplus_bulk_writer_page(&w, 1);
+    char *key, *val;
+    int key_len, val_len;
+    char *prev_key = malloc(BPLUS_MAX_KEY_SIZE);
+    int prev_len = -1;
+    if (leaf == NULL) {
+        goto out;
+    }
+
+    while (next(ctx, &key, &key_len, &val, &val_len)) {
+        struct bplus_value v = {
+            .data = val,
+            .len = val_len,
+            .overflow = bplus_entry_overflows(key_len, val_len),
+        };
+        if (key_len > BPLUS_MAX_KEY_SIZE || val_len > BPLUS_MAX_VALUE_SIZE ||
+            key_len + bplus_value_stored_len(&v) > BPLUS_MAX_ENTRY_SIZE) {
+            printf("bulk load: entry for %.*s is too large\n", key_len, key);
+            goto out;
+        }
+        if (w.keys->key_size > 0 && key_len != w.keys->key_size) {
+            printf(
+                "bulk load: %d byte key in a tree of %d byte keys\n", key_len,
+                w.keys->key_size);
+            goto out;
+        }
+        if (prev_len >= 0 &&
+            bplus_keys_compare(w.keys, prev_key, prev_len, key, key_len) >= 0) {
+            printf("bulk load: input is not sorted at %.*s\n", key_len, key);
+            goto out;
+        }
+        memcpy(prev_key, key, key_len);
+        prev_len = key_len;
+
+        if (bplus_bulk_node_full(
+                leaf, key_len + bplus_value_stored_len(&v), target)) {
+            int last = leaf->disk.num_keys - 1;
+            bplus_bulk_level_add(
+                &level, leaf->disk.page_id, bplus_node_key(leaf, last),
+                leaf->disk.slots[last].key_len);
+
+            // leaves get consecutive page_ids, so the sibling is known
+            uint32_t prev = leaf->disk.page_id;
+            leaf->disk.next = w.next_page_id;
+            leaf = bplus_bulk_writer_page(&w, 1);
+            if (leaf == NULL) {
+                goto out;
+            }
+            leaf->disk.prev = prev;
+        }
+
+        if (v.overflow &&
+            bplus_bulk_write_overflow(&w, val, val_len, &v.ref) < 0) {
+            goto out;
+        }
+        struct bplus_insert_index index = {
+            .pos = leaf->disk.num_keys,
+            .found = 0,
+        };
+        bplus_node_insert_value(w.keys, leaf, index, key, key_len, &v);
+    }
+
+    int last = leaf->disk.num_keys - 1;
+    if (last >= 0) {
+        bplus_bulk_level_add(
+            &level, leaf->disk.page_id, bplus_node_key(leaf, last),
+            leaf->disk.slots[last].key_len);
+    } else {
+        bplus_bulk_level_add(&level, leaf->disk.page_id, "", 0);
+    }
+
+    // stack internal levels until a single root remains
+    while (level.count > 1) {
+        if (bplus_bulk_build_level_parallel(&w, &level, &parents, target) <
+            0) {
+            goto out;
+        }
+        bplus_bulk_level_free(&level);
+        level = parents;
+        memset(&parents, 0, sizeof(parents));
+        height++;
+    }
+
+    if (bplus_bulk_writer_flush(&w) < 0) {
+        goto out;
+    }
+    // every page is on disk before the header that points at them
+    if (fdatasync(fd) < 0) {
+        perror("sync bulk load file");
+        goto out;
+    }
+
+    struct bplus_disk_header header = {
+        .root_page_id = level.page_ids[0],
+        .page_size = BPLUS_PAGE_SIZE,
+        .height = height,
+        .free_head = BPLUS_INVALID_PAGE,
+    };
+    strncpy(header.key_order, w.keys->name, sizeof(header.key_order) - 1);
+    bplus_disk_header_seal(&header);
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror("bulk load header");
+        goto out;
+    }
+    if (fsync(fd) < 0) {
+        perror("sync bulk load file");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    if (close(fd) < 0 && ret == 0) {
+        perror("close bulk load file");
+        ret = -1;
+    }
+    free(prev_key);
+    free(w.pages);
+    free(w.overflow);
+    bplus_bulk_level_free(&level);
+    bplus_bulk_level_free(&parents);
+
+    if (ret == 0) {
+        ret = bplus_bulk_install(tmp_path, path);
+    }
+    if (ret < 0) {
+        unlink(tmp_path);
+        free(tmp_path);
+        return NULL;
+    }
+    free(tmp_path);
+    return bplus_tree_create_opts(path, opts);
+}
+
+// a consistent read-only view of the tree as it stood when the snapshot was
+// taken, for long scans and online backups. writers carry on meanwhile: the
+// first write to a page after a snapshot copies its old image aside, so
+// snapshot readers never wait for a page that has changed and only briefly
+// read latch the ones that haven't. images are freed once every snapshot
+// that could read them is released. compaction waits until then.
+struct bplus_snapshot {
+    struct bplus_tree *tree;
+    uint64_t epoch;
+    uint32_t num_pages;              // pages allocated when it was taken
+    struct bplus_disk_header header; // root, height and free list back then
+    struct bplus_snapshot *next;     // next newer open snapshot
+};
+
+// take a snapshot. waits only for the changes in flight to finish. release
+// every snapshot before destroying the tree.
+struct bplus_snapshot *bplus_tree_snapshot(struct bplus_tree *tree) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    if (pool->shared) {
+        // nothing changes under a shared tree, and the page images would
+        // be in one process's heap
+        printf("snapshots need a private buffer pool\n");
+        return NULL;
+    }
+    struct bplus_snapshot *snap = malloc(sizeof(*snap));
+    snap->tree = tree;
+    snap->next = NULL;
+
+    pthread_rwlock_wrlock(&tree->lock);
+    uint64_t covered = 0;
+    if (tree->wal != NULL) {
+        pthread_mutex_lock(&tree->wal->lock);
+        covered = tree->wal->next_lsn - 1;
+        pthread_mutex_unlock(&tree->wal->lock);
+    }
+    snap->header = bplus_tree_header(tree, covered);
+    snap->num_pages = pool->next_page_id;
+
+    // no writer runs under the tree lock, but readers of older snapshots
+    // may be in the current table, so a bigger one is published beside it
+    pthread_mutex_lock(&pool->snap_lock);
+    struct bplus_version_table *old = pool->versions;
+    if (old == NULL || snap->num_pages > old->len) {
+        struct bplus_version_table *t = calloc(
+            1, sizeof(*t) + snap->num_pages * sizeof(t->chains[0]));
+        t->len = snap->num_pages;
+        t->replaced = old;
+        if (old != NULL) {
+            memcpy(t->chains, old->chains, old->len * sizeof(t->chains[0]));
+        }
+        __atomic_store_n(&pool->versions, t, __ATOMIC_RELEASE);
+    }
+    snap->epoch = ++pool->last_epoch;
+    struct bplus_snapshot **tail = &pool->snapshots;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = snap;
+    __atomic_store_n(&pool->snap_epoch, snap->epoch, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->snap_lock);
+
+    pthread_rwlock_unlock(&tree->lock);
+    return snap;
+}
+
+// unlink the images of one page that only snapshots older than oldest could
+// read. a writer may push onto the chain meanwhile, so the head is cleared
+// with a CAS. the images go on the retired list rather than being freed,
+// since readers may still be stepping onto them.
+void bplus_snapshot_unlink_older(
+    struct bplus_buffer_pool *pool,
+    struct bplus_version_chain *c,
+    uint64_t oldest) {
+    struct bplus_page_version **link = &c->newest;
+    struct bplus_page_version *v = __atomic_load_n(link, __ATOMIC_ACQUIRE);
+    for (;;) {
+        while (v != NULL && v->epoch >= oldest) {
+            link = &v->older;
+            v = __atomic_load_n(link, __ATOMIC_ACQUIRE);
+        }
+        if (v == NULL) {
+            return;
+        }
+        if (link != &c->newest) {
+            __atomic_store_n(link, NULL, __ATOMIC_RELEASE);
+            break;
+        }
+        if (__atomic_compare_exchange_n(
+                link, &v, NULL, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        // a writer pushed a newer image, which has to stay
+    }
+
+    while (v != NULL) {
+        struct bplus_page_version *older = v->older;
+        v->retired = pool->last_epoch;
+        v->older = pool->retired;
+        pool->retired = v;
+        v = older;
+    }
+}
+
+// drop a snapshot and the page images no open snapshot can read any more.
+// an image is only read by snapshots no newer than it, so everything older
+// than the oldest snapshot left is unlinked. it is freed once the snapshots
+// open at the time are gone too, as their readers may have been walking it.
+void bplus_snapshot_release(struct bplus_snapshot *snap) {
+    struct bplus_tree *tree = snap->tree;
+    struct bplus_buffer_pool *pool = tree->pool;
+
+    pthread_mutex_lock(&pool->snap_lock);
+    struct bplus_snapshot **p = &pool->snapshots;
+    while (*p != snap) {
+        p = &(*p)->next;
+    }
+    *p = snap->next;
+    free(snap);
+
+    uint64_t oldest = UINT64_MAX;
+    uint64_t newest = 0;
+    if (pool->snapshots != NULL) {
+        oldest = pool->snapshots->epoch;
+    }
+    for (struct bplus_snapshot *s = pool->snapshots; s != NULL; s = s->next) {
+        newest = s->epoch;
+    }
+    __atomic_store_n(&pool->snap_epoch, newest, __ATOMIC_RELAXED);
+
+    if (pool->snapshots != NULL) {
+        struct bplus_version_table *t = pool->versions;
+        for (uint32_t i = 0; i < t->len; i++) {
+            bplus_snapshot_unlink_older(pool, &t->chains[i], oldest);
+        }
+        struct bplus_page_version **r = &pool->retired;
+        while (*r != NULL) {
+            if ((*r)->retired < oldest) {
+                struct bplus_page_version *next = (*r)->older;
+                free(*r);
+                *r = next;
+            } else {
+                r = &(*r)->older;
+            }
+        }
+        pthread_mutex_unlock(&pool->snap_lock);
+        return;
+    }
+    pthread_mutex_unlock(&pool->snap_lock);
+
+    // that was the last one. writers that saw it open may still be pushing,
+    // so wait them out under the tree lock, which is taken before snap_lock
+    pthread_rwlock_wrlock(&tree->lock);
+    pthread_mutex_lock(&pool->snap_lock);
+    if (pool->snapshots == NULL) {
+        bplus_snapshot_free_versions(pool);
+    }
+    pthread_mutex_unlock(&pool->snap_lock);
+    pthread_rwlock_unlock(&tree->lock);
+}
+
+// the image of page_id kept for snapshots of epoch, NULL if the page hasn't
+// changed since. it stays put until the snapshot is released. takes no
+// lock: images are pushed fully written and only freed after every
+// snapshot that could be reading them is released.
+struct bplus_page_version *bplus_snapshot_version(
+    struct bplus_buffer_pool *pool, uint32_t page_id, uint64_t epoch) {
+    struct bplus_page_version *found = NULL;
+    struct bplus_version_table *t =
+        __atomic_load_n(&pool->versions, __ATOMIC_ACQUIRE);
+    if (t != NULL && page_id < t->len) {
+        struct bplus_page_version *v =
+            __atomic_load_n(&t->chains[page_id].newest, __ATOMIC_ACQUIRE);
+        while (v != NULL && v->epoch >= epoch) {
+            found = v;
+            v = __atomic_load_n(&v->older, __ATOMIC_ACQUIRE);
+        }
+    }
+    return found;
+}
+
+// copy page_id as the snapshot sees it to out
+int bplus_snapshot_read_page(
+    struct bplus_snapshot *snap, uint32_t page_id, struct bplus_node *out) {
+    struct bplus_buffer_pool *pool = snap->tree->pool;
+    if (page_id >= snap->num_pages) {
+        printf("page %u is newer than the snapshot\n", page_id);
+        return -1;
+    }
+
+    struct bplus_page_version *v =
+        bplus_snapshot_version(pool, page_id, snap->epoch);
+    if (v != NULL) {
+        memcpy(&out->disk, &v->disk, sizeof(out->disk));
+        return 0;
+    }
+
+    // unchanged so far. look again under the latch in case a writer got to
+    // the page first.
+    struct bplus_node *node = bplus_buffer_pool_fetch(pool, page_id);
+    if (node == NULL) {
+        return -1;
+    }
+    bplus_node_latch(pool, node, BPLUS_LATCH_READ);
+    v = bplus_snapshot_version(pool, page_id, snap->epoch);
+    memcpy(&out->disk, v != NULL ? &v->disk : &node->disk, sizeof(out->disk));
+    bplus_node_release(pool, node);
+    return 0;
+}
+
+// descend the snapshot to the leaf that covers key, or to the rightmost leaf
+// when key is NULL. returns a private copy of the leaf for the caller to
+// free.
+struct bplus_node *
+bplus_snapshot_find_leaf(struct bplus_snapshot *snap, char *key, int key_len) {
+    const struct bplus_key_ops *keys = snap->tree->pool->keys;
+    struct bplus_node *node = malloc(sizeof(*node));
+    uint32_t page_id = snap->header.root_page_id;
+
+    for (int depth = snap->header.height - 1;; depth--) {
+        if (bplus_snapshot_read_page(snap, page_id, node) < 0) {
+            free(node);
+            return NULL;
+        }
+        if (depth == 0) {
+            return node;
+        }
+        int pos = node->disk.num_keys;
+        if (key != NULL) {
+            pos = bplus_node_find_insert_index(keys, node, key_len, key).pos;
+        }
+        page_id = bplus_node_child_id(node, pos);
+    }
+}
+
+// bplus_node_stream_value for a leaf copied out of the snapshot
+int bplus_snapshot_stream_value(
+    struct bplus_snapshot *snap,
+    struct bplus_node *node,
+    int i,
+    bplus_value_sink sink,
+    void *ctx) {
+    struct bplus_overflow_ref ref;
+    if (!bplus_node_overflow_ref(node, i, &ref)) {
+        return sink(
+            ctx, bplus_node_value(node, i), node->disk.slots[i].val_len);
+    }
+
+    struct bplus_node *page = malloc(sizeof(*page));
+    uint32_t left = ref.len;
+    int ret = 0;
+    for (uint32_t page_id = ref.first_page;
+         page_id != BPLUS_INVALID_PAGE && ret == 0;) {
+        if (bplus_snapshot_read_page(snap, page_id, page) < 0) {
+            ret = -1;
+            break;
+        }
+        uint32_t len = BPLUS_NODE_CAPACITY - page->disk.heap_start;
+        if (page->disk.kind != BPLUS_PAGE_OVERFLOW || len > left) {
+            printf("page %u: not part of an overflow chain\n", page_id);
+            ret = -1;
+            break;
+        }
+        page_id = page->disk.next;
+        left -= len;
+        ret = sink(ctx, &page->disk.buf[page->disk.heap_start], len);
+    }
+    free(page);
+    if (ret == 0 && left != 0) {
+        printf("overflow chain at page %u is short\n", ref.first_page);
+        ret = -1;
+    }
+    return ret;
+}
+
+// bplus_tree_lookup as of the snapshot
+int bplus_snapshot_lookup(
+    struct bplus_snapshot *snap,
+    char *key,
+    int key_len,
+    char *buf,
+    int buf_len,
+    int *val_len) {
+    struct bplus_node *leaf = bplus_snapshot_find_leaf(snap, key, key_len);
+    if (leaf == NULL) {
+        return -1;
+    }
+
+    int ret = 1;
+    struct bplus_insert_index index = bplus_node_find_insert_index(
+        snap->tree->pool->keys, leaf, key_len, key);
+    if (index.found) {
+        *val_len = bplus_node_value_len(leaf, index.pos);
+        if (buf_len < *val_len) {
+            printf("buffer too small!\n");
+            ret = -1;
+        } else {
+            ret = bplus_snapshot_stream_value(
+                snap, leaf, index.pos, bplus_copy_sink, &buf);
+        }
+    }
+    free(leaf);
+    return ret;
+}
+
+// write the tree as the snapshot sees it to a new uncompressed file at
+// path, which opens like any other. the live tree takes writes throughout.
+int bplus_snapshot_backup(struct bplus_snapshot *snap, const char *path) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+        perror("open backup file");
+        return -1;
+    }
+    char *wal_path = bplus_wal_path(path);
+    unlink(wal_path);
+    free(wal_path);
+    char *extent_path = bplus_extent_path(path);
+    unlink(extent_path);
+    free(extent_path);
+
+    struct bplus_node *pages =
+        malloc(BPLUS_BULK_BATCH * sizeof(struct bplus_node));
+    int ret = 0;
+    for (uint32_t first = 0; first < snap->num_pages && ret == 0;
+         first += BPLUS_BULK_BATCH) {
+        int n = 0;
+        for (uint32_t id = first;
+             id < snap->num_pages && n < BPLUS_BULK_BATCH && ret == 0; id++) {
+            ret = bplus_snapshot_read_page(snap, id, &pages[n++]);
+        }
+        if (ret == 0) {
+            ret = bplus_bulk_write_pages(fd, pages, n);
+        }
+    }
+    free(pages);
+
+    struct bplus_disk_header header = snap->header;
+    header.flags &= ~BPLUS_HEADER_COMPRESSED;
+    bplus_disk_header_seal(&header);
+    if (ret == 0 && pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror("backup header");
+        ret = -1;
+    }
+    if (ret == 0 && fsync(fd) < 0) {
+        perror("sync backup");
+        ret = -1;
+    }
+    close(fd);
+    return ret;
+}
+
+// a position in the leaf chain. the current leaf stays pinned and read
+// latched, so keys and values returned by the cursor point straight into the
+// page and are valid until the cursor moves or is closed. writers to that
+// leaf wait meanwhile, so don't insert from a thread holding an open cursor.
+// a cursor over a snapshot holds a private copy of its leaf instead, and
+// never holds up writers.
+struct bplus_cursor {
+    struct bplus_tree *tree;
+    struct bplus_snapshot *snap; // NULL for the live tree
+    struct bplus_node *leaf; // pinned and latched, NULL when not positioned
+    int pos;
+
+    // scan bounds [lo, hi), NULL for unbounded. the caller owns the memory.
+    char *lo;
+    int lo_len;
+    char *hi;
+    int hi_len;
+};
+
+void bplus_cursor_init(struct bplus_cursor *c, struct bplus_tree *tree) {
+    memset(c, 0, sizeof(*c));
+    c->tree = tree;
+}
+
+// scan the tree as the snapshot sees it
+void bplus_cursor_init_snapshot(
+    struct bplus_cursor *c, struct bplus_snapshot *snap) {
+    bplus_cursor_init(c, snap->tree);
+    c->snap = snap;
+}
+
+void bplus_cursor_close(struct bplus_cursor *c) {
+    if (c->snap != NULL) {
+        free(c->leaf);
+        c->leaf = NULL;
+    } else if (c->leaf != NULL) {
+        bplus_node_release(c->tree->pool, c->leaf);
+        c->leaf = NULL;
+    }
+}
+
+void bplus_cursor_set_bounds(
+    struct bplus_cursor *c, char *lo, int lo_len, char *hi, int hi_len) {
+    c->lo = lo;
+    c->lo_len = lo_len;
+    c->hi = hi;
+    c->hi_len = hi_len;
+}
+
+char *bplus_cursor_key(struct bplus_cursor *c, int *key_len) {
+    *key_len = c->leaf->disk.slots[c->pos].key_len;
+    return bplus_node_key(c->leaf, c->pos);
+}
+
+// values kept in overflow pages aren't in the leaf, for those this returns
+// NULL with *val_len set to their length. read them with
+// bplus_cursor_stream_value.
+char *bplus_cursor_value(struct bplus_cursor *c, int *val_len) {
+    *val_len = bplus_node_value_len(c->leaf, c->pos);
+    if (c->leaf->disk.slots[c->pos].flags & BPLUS_SLOT_OVERFLOW) {
+        return NULL;
+    }
+    return bplus_node_value(c->leaf, c->pos);
+}
+
+// feed the current value to sink, see bplus_tree_stream
+int bplus_cursor_stream_value(
+    struct bplus_cursor *c, bplus_value_sink sink, void *ctx) {
+    if (c->snap != NULL) {
+        return bplus_snapshot_stream_value(c->snap, c->leaf, c->pos, sink, ctx);
+    }
+    return bplus_node_stream_value(c->tree->pool, c->leaf, c->pos, sink, ctx);
+}
+
+// find the leaf holding the last key < key and read latch it, setting *pos
+// to that entry. read latches stay on the whole path down, so the search can
+// back up into the subtree left of where key would go. returns 1 if there
+// is such a key, 0 if not and -1 on error.
+int bplus_tree_find_leaf_before(
+    struct bplus_tree *tree,
+    char *key,
+    int key_len,
+    struct bplus_node **leaf,
+    int *pos) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    struct bplus_node *path[BPLUS_MAX_HEIGHT];
+    int child_pos[BPLUS_MAX_HEIGHT];
+    int n = 0;
+
+    pthread_rwlock_rdlock(&tree->root_latch);
+    struct bplus_node *node = tree->root;
+    bplus_buffer_pool_pin(pool, node);
+    bplus_node_latch(pool, node, BPLUS_LATCH_READ);
+    pthread_rwlock_unlock(&tree->root_latch);
+    path[n++] = node;
+
+    int ret = 1;
+    while (!node->disk.is_leaf) {
+        child_pos[n - 1] =
+            bplus_node_find_insert_index(pool->keys, node, key_len, key).pos;
+        node = bplus_node_get_child(pool, node, child_pos[n - 1]);
+        if (node == NULL) {
+            ret = -1;
+            goto out;
+        }
+        bplus_node_latch(pool, node, BPLUS_LATCH_READ);
+        assert(n < BPLUS_MAX_HEIGHT);
+        path[n++] = node;
+    }
+
+    int i = bplus_node_find_insert_index(pool->keys, node, key_len, key).pos;
+    if (i == 0) {
+        // nothing smaller in this leaf. back up to the nearest ancestor with
+        // a child left of the one taken and follow that child's right edge.
+        bplus_node_release(pool, path[--n]);
+        while (n > 0 && child_pos[n - 1] == 0) {
+            bplus_node_release(pool, path[--n]);
+        }
+        if (n == 0) {
+            return 0;
+        }
+
+        int c = child_pos[n - 1] - 1;
+        node = path[n - 1];
+        do {
+            node = bplus_node_get_child(pool, node, c);
+            if (node == NULL) {
+                ret = -1;
+                goto out;
+            }
+            bplus_node_latch(pool, node, BPLUS_LATCH_READ);
+            assert(n < BPLUS_MAX_HEIGHT);
+            path[n++] = node;
+            c = node->disk.num_keys;
+        } while (!node->disk.is_leaf);
+        i = node->disk.num_keys;
+    }
+
+    *leaf = node;
+    *pos = i - 1;
+    n--;
+
+out:
+    for (int d = 0; d < n; d++) {
+        bplus_node_release(pool, path[d]);
+    }
+    return ret;
+}
+
+// move the cursor onto the sibling leaf, prefetching the one after it so the
+// next hop doesn't wait on a read
+int bplus_cursor_step_leaf(struct bplus_cursor *c, int forward) {
+    struct bplus_buffer_pool *pool = c->tree->pool;
+    uint32_t page_id = forward ? c->leaf->disk.next : c->leaf->disk.prev;
+
+    if (page_id == BPLUS_INVALID_PAGE) {
+        bplus_cursor_close(c);
+        return 0;
+    }
+
+    // nothing moves in a snapshot, so its sibling pointers can be followed
+    // either way
+    if (c->snap != NULL) {
+        if (bplus_snapshot_read_page(c->snap, page_id, c->leaf) < 0) {
+            bplus_cursor_close(c);
+            return -1;
+        }
+        c->pos = forward ? 0 : c->leaf->disk.num_keys - 1;
+        return 1;
+    }
+
+    if (forward) {
+        // latch the next leaf before letting go of this one so no split can
+        // slip in between
+        struct bplus_node *next = bplus_buffer_pool_fetch(pool, page_id);
+        if (next != NULL) {
+            bplus_node_latch(pool, next, BPLUS_LATCH_READ);
+        }
+        bplus_cursor_close(c);
+        c->leaf = next;
+        c->pos = 0;
+    } else if (c->leaf->disk.num_keys > 0) {
+        // latches only go left to right, so let go of this leaf and search
+        // again from the root for whatever now comes before its first key.
+        // the prev pointer can be stale by the time it is latched.
+        char key[BPLUS_MAX_KEY_SIZE];
+        int key_len = c->leaf->disk.slots[0].key_len;
+        memcpy(key, bplus_node_key(c->leaf, 0), key_len);
+        bplus_cursor_close(c);
+
+        int ret = bplus_tree_find_leaf_before(
+            c->tree, key, key_len, &c->leaf, &c->pos);
+        if (ret <= 0) {
+            return ret;
+        }
+    } else {
+        // only a failed rebalance leaves an empty leaf behind. the page
+        // may have been freed and reused by the time it is latched.
+        uint32_t cur = c->leaf->disk.page_id;
+        struct bplus_node *prev = bplus_buffer_pool_fetch(pool, page_id);
+        bplus_cursor_close(c);
+        if (prev != NULL) {
+            bplus_node_latch(pool, prev, BPLUS_LATCH_READ);
+            if (!prev->disk.is_leaf || prev->disk.next != cur) {
+                bplus_node_release(pool, prev);
+                return -1;
+            }
+            c->leaf = prev;
+            c->pos = prev->disk.num_keys - 1;
+        }
+    }
+    if (c->leaf == NULL) {
+        return -1;
+    }
 
-        printf(
-            "writing node %p (page_id=%d) at offset %d\n", node,
-            node->disk.page_id, offset);
+    uint32_t after = forward ? c->leaf->disk.next : c->leaf->disk.prev;
+    if (after != BPLUS_INVALID_PAGE) {
+        bplus_buffer_pool_prefetch(pool, after);
+    }
+    return 1;
+}
 
-        int written = pwrite(pool->fd, &node->disk, sizeof(node->disk), offset);
-        if (written != sizeof(node->disk)) {
-            perror("writing node");
-            return -1;
-        }
+// check the current entry against the scan bounds, dropping the leaf once
+// the cursor has run past them
+int bplus_cursor_check_bounds(struct bplus_cursor *c) {
+    const struct bplus_key_ops *keys = c->tree->pool->keys;
+    int key_len;
+    char *key = bplus_cursor_key(c, &key_len);
 
-        node->dirty = 0;
+    if ((c->hi != NULL &&
+         bplus_keys_compare(keys, key, key_len, c->hi, c->hi_len) >= 0) ||
+        (c->lo != NULL &&
+         bplus_keys_compare(keys, key, key_len, c->lo, c->lo_len) < 0)) {
+        bplus_cursor_close(c);
+        return 0;
     }
+    return 1;
+}
 
-    for (int i = 0; i < MAX_CHILDREN; i++) {
-        if (node->children[i] != NULL) {
-            int ret = bplus_buffer_pool_write(pool, node->children[i]);
-            if (ret < 0) {
-                return ret;
-            }
+// skip over the ends of leaves (and empty leaves) in the direction of travel
+int bplus_cursor_settle(struct bplus_cursor *c, int forward) {
+    while (c->pos < 0 || c->pos >= c->leaf->disk.num_keys) {
+        int ret = bplus_cursor_step_leaf(c, forward);
+        if (ret <= 0) {
+            return ret;
         }
     }
-
-    return 0;
+    return bplus_cursor_check_bounds(c);
 }
 
-int bplus_tree_flush(struct bplus_tree *tree) {
-    struct bplus_disk_header header = {
-        .root_page_id = tree->root->disk.page_id,
-    };
-    int written = pwrite(tree->pool->fd, &header, sizeof(header), 0);
-    if (written != sizeof(header)) {
-        return -1;
+// the leaf covering key, read latched or copied out of the snapshot
+struct bplus_node *
+bplus_cursor_find_leaf(struct bplus_cursor *c, char *key, int key_len) {
+    if (c->snap != NULL) {
+        return bplus_snapshot_find_leaf(c->snap, key, key_len);
     }
-    return bplus_buffer_pool_write(tree->pool, tree->root);
+    return bplus_tree_find_leaf(c->tree, key, key_len, BPLUS_LATCH_READ);
 }
 
-struct bplus_node *
-bplus_node_create(struct bplus_buffer_pool *pool, int is_leaf) {
-    struct bplus_node *node = malloc(sizeof(struct bplus_node));
-    node->disk.num_keys = 0;
-    node->disk.is_leaf = is_leaf;
-    node->next = NULL;
-    node->disk.buffer_position = 0;
-    node->disk.page_id = pool->next_page_id;
-    node->dirty = 1;
-    pool->next_page_id++;
+// position the cursor on the first key >= key. returns 1 if it landed on an
+// entry inside the bounds, 0 if there is none and -1 on error.
+int bplus_cursor_seek(struct bplus_cursor *c, char *key, int key_len) {
+    const struct bplus_key_ops *keys = c->tree->pool->keys;
+    bplus_cursor_close(c);
 
-    for (int i = 0; i < MAX_CHILDREN; i++) {
-        node->children[i] = NULL;
+    if (c->lo != NULL &&
+        bplus_keys_compare(keys, key, key_len, c->lo, c->lo_len) < 0) {
+        key = c->lo;
+        key_len = c->lo_len;
     }
 
-    if (!is_leaf) {
-        // add child for keys greater than max split key
-        node->children[0] = bplus_node_create(pool, 1);
+    struct bplus_node *node = bplus_cursor_find_leaf(c, key, key_len);
+    if (node == NULL) {
+        return -1;
     }
 
-    return node;
+    c->leaf = node;
+    c->pos = bplus_node_find_insert_index(keys, node, key_len, key).pos;
+    return bplus_cursor_settle(c, 1);
 }
 
-struct bplus_tree *bplus_tree_create(const char *path) {
-    struct bplus_buffer_pool *pool = bplus_buffer_pool_init(path);
-    struct bplus_tree *tree = malloc(sizeof(struct bplus_tree));
-    tree->pool = pool;
+// position the cursor on the first key of the scan
+int bplus_cursor_first(struct bplus_cursor *c) {
+    if (c->lo != NULL) {
+        return bplus_cursor_seek(c, c->lo, c->lo_len);
+    }
+    return bplus_cursor_seek(c, "", 0);
+}
 
-    // read header and load root node
-    struct bplus_disk_header header = {0};
-    pread(pool->fd, &header, sizeof(header), 0);
+// position the cursor on the last key of the scan
+int bplus_cursor_last(struct bplus_cursor *c) {
+    bplus_cursor_close(c);
 
-    struct bplus_node *disk_root =
-        bplus_buffer_pool_load(pool, header.root_page_id);
-    if (disk_root != NULL) {
-        printf("root node %d was loaded from disk\n", header.root_page_id);
-        tree->root = disk_root;
-    } else {
-        tree->root = bplus_node_create(pool, 1);
+    // descend towards hi, or along the right edge when unbounded
+    struct bplus_node *node = bplus_cursor_find_leaf(c, c->hi, c->hi_len);
+    if (node == NULL) {
+        return -1;
     }
-    tree->height = 1;
-    return tree;
+
+    // the last key < hi sits just before the first key >= hi
+    c->leaf = node;
+    c->pos = node->disk.num_keys - 1;
+    if (c->hi != NULL) {
+        struct bplus_insert_index index = bplus_node_find_insert_index(
+            c->tree->pool->keys, node, c->hi_len, c->hi);
+        c->pos = index.pos - 1;
+    }
+    return bplus_cursor_settle(c, 0);
 }
 
-// check if a key and value can fit in our node
-int bplus_node_can_fit(struct bplus_node *node, int key_len, int val_len) {
-    if ((node->disk.buffer_position + key_len + val_len) >= NODE_BUFFER_SIZE) {
+// advance to the next entry. returns 1 while the cursor is on an entry inside
+// the bounds, 0 at the end of the scan and -1 on error.
+int bplus_cursor_next(struct bplus_cursor *c) {
+    if (c->leaf == NULL) {
         return 0;
-    } else if (node->disk.num_keys == MAX_KEYS) {
+    }
+    c->pos++;
+    return bplus_cursor_settle(c, 1);
+}
+
+// step back to the previous entry, see bplus_cursor_next
+int bplus_cursor_prev(struct bplus_cursor *c) {
+    if (c->leaf == NULL) {
         return 0;
     }
+    c->pos--;
+    return bplus_cursor_settle(c, 0);
+}
 
-    return 1;
+// follow the overflow chain of entry i of a leaf, marking its pages seen and
+// checking they add up to the value. returns the number of problems found.
+int bplus_node_check_overflow(
+    struct bplus_buffer_pool *pool,
+    struct bplus_node *node,
+    int i,
+    uint8_t *seen) {
+    struct bplus_overflow_ref ref;
+    if (node->disk.slots[i].val_len != sizeof(ref)) {
+        printf("page %u: key %d has a bad overflow reference\n",
+               node->disk.page_id, i);
+        return 1;
+    }
+    bplus_node_overflow_ref(node, i, &ref);
+
+    uint32_t total = 0;
+    for (uint32_t page_id = ref.first_page; page_id != BPLUS_INVALID_PAGE;) {
+        if (page_id >= pool->next_page_id || seen[page_id]) {
+            printf("page %u is reachable more than once\n", page_id);
+            return 1;
+        }
+        seen[page_id] = 1;
+        struct bplus_node *page = bplus_buffer_pool_fetch(pool, page_id);
+        if (page == NULL) {
+            printf(
+                "page %u: couldn't load overflow page %u\n",
+                node->disk.page_id, page_id);
+            return 1;
+        }
+        int kind = page->disk.kind;
+        total += BPLUS_NODE_CAPACITY - page->disk.heap_start;
+        page_id = page->disk.next;
+        bplus_buffer_pool_unpin(pool, page);
+        if (kind != BPLUS_PAGE_OVERFLOW) {
+            printf(
+                "page %u: key %d leads to a page that isn't overflow\n",
+                node->disk.page_id, i);
+            return 1;
+        }
+    }
+    if (total != ref.len) {
+        printf(
+            "page %u: key %d has %u of its %u bytes\n", node->disk.page_id, i,
+            total, ref.len);
+        return 1;
+    }
+    return 0;
 }
 
-struct bplus_insert_index {
-    int pos;
-    int found;
-};
+// walk the subtree checking key order, separator bounds and that every leaf
+// sits at the same depth. lo/hi bound the keys allowed in node as (lo, hi],
+// NULL for unbounded. returns the number of problems found.
+int bplus_node_check(
+    struct bplus_buffer_pool *pool,
+    struct bplus_node *node,
+    uint8_t *seen,
+    int depth,
+    int height,
+    char *lo,
+    int lo_len,
+    char *hi,
+    int hi_len) {
+    int errors = 0;
 
-struct bplus_insert_index
-bplus_node_find_insert_index(struct bplus_node *node, int key_len, char *key) {
+    uint32_t page_id = node->disk.page_id;
+    if (page_id >= pool->next_page_id || seen[page_id]) {
+        printf("page %u is reachable more than once\n", page_id);
+        return 1;
+    }
+    seen[page_id] = 1;
 
-    struct bplus_insert_index ret = {0};
+    int live = 0;
+    for (int i = 0; i < node->disk.num_keys; i++) {
+        live += node->disk.slots[i].key_len + node->disk.slots[i].val_len;
+    }
+    if (live + node->disk.dead_bytes !=
+        BPLUS_NODE_CAPACITY - node->disk.heap_start) {
+        printf(
+            "page %u: %d live and %d dead heap bytes, heap holds %d\n",
+            node->disk.page_id, live, node->disk.dead_bytes,
+            BPLUS_NODE_CAPACITY - node->disk.heap_start);
+        errors++;
+    }
 
-    // find position in metadata arrays
-    // TODO: make this a proper binary search
     for (int i = 0; i < node->disk.num_keys; i++) {
-        char *stored_key = &node->disk.buf[node->disk.key_offsets[i]];
+        char *key = bplus_node_key(node, i);
+        int key_len = node->disk.slots[i].key_len;
 
-        // compare length is shortest length of both keys
-        int compare_len = node->disk.key_lengths[i];
+        if (i > 0) {
+            char *prev = bplus_node_key(node, i - 1);
+            int prev_len = node->disk.slots[i - 1].key_len;
+            if (bplus_keys_compare(
+                    pool->keys, prev, prev_len, key, key_len) >= 0) {
+                printf(
+                    "page %u: keys %d and %d out of order\n",
+                    node->disk.page_id, i - 1, i);
+                errors++;
+            }
+        }
+        if ((lo != NULL &&
+             bplus_keys_compare(pool->keys, key, key_len, lo, lo_len) <= 0) ||
+            (hi != NULL &&
+             bplus_keys_compare(pool->keys, key, key_len, hi, hi_len) > 0)) {
+            printf(
+                "page %u: key %d outside parent bounds\n", node->disk.page_id,
+                i);
+            errors++;
+        }
+    }
 
-        if (key_len < compare_len) {
-            compare_len = key_len;
+    if (node->disk.is_leaf) {
+        if (depth != height) {
+            printf(
+                "page %u: leaf at depth %d, tree height is %d\n",
+                node->disk.page_id, depth, height);
+            errors++;
         }
+        for (int i = 0; i < node->disk.num_keys; i++) {
+            if (node->disk.slots[i].flags & BPLUS_SLOT_OVERFLOW) {
+                errors += bplus_node_check_overflow(pool, node, i, seen);
+            }
+        }
+        return errors;
+    }
 
-        // search forward until our key is less than their key
-        int cmp = memcmp(key, stored_key, compare_len);
-        if (cmp == 0 && key_len == node->disk.key_lengths[i]) {
-            ret.found = 1;
-            ret.pos = i;
-            return ret;
-        } else if (
-            cmp < 0 || (cmp == 0 && key_len != node->disk.key_lengths[i])) {
-            ret.pos = i;
-            return ret;
+    for (int i = 0; i <= node->disk.num_keys; i++) {
+        struct bplus_node *child = bplus_node_get_child(pool, node, i);
+        if (child == NULL) {
+            printf(
+                "page %u: couldn't load child %d\n", node->disk.page_id, i);
+            errors++;
+            continue;
+        }
+
+        char *child_lo = lo;
+        int child_lo_len = lo_len;
+        char *child_hi = hi;
+        int child_hi_len = hi_len;
+        if (i > 0) {
+            child_lo = bplus_node_key(node, i - 1);
+            child_lo_len = node->disk.slots[i - 1].key_len;
+        }
+        if (i < node->disk.num_keys) {
+            child_hi = bplus_node_key(node, i);
+            child_hi_len = node->disk.slots[i].key_len;
         }
+
+        errors += bplus_node_check(
+            pool, child, seen, depth + 1, height, child_lo, child_lo_len,
+            child_hi, child_hi_len);
+        bplus_buffer_pool_unpin(pool, child);
     }
 
-    ret.pos = node->disk.num_keys;
-    return ret;
+    return errors;
 }
 
-void bplus_node_insert_at(
-    struct bplus_node *node,
-    struct bplus_insert_index index,
-    int key_len,
-    char *key,
-    int val_len,
-    char *val) {
+// walks the tree without latches, so no inserts may run meanwhile. every
+// page must be either in the tree or on the free list, and only once.
+int bplus_tree_check(struct bplus_tree *tree) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    uint8_t *seen = calloc(pool->next_page_id + 1, 1);
+    int errors = bplus_node_check(
+        pool, tree->root, seen, 1, tree->height, NULL, 0, NULL, 0);
 
-    if (!index.found) {
-        // shift metadata arrays
-        for (int i = node->disk.num_keys; i > index.pos; i--) {
-            node->disk.key_offsets[i] = node->disk.key_offsets[i - 1];
-            node->disk.key_lengths[i] = node->disk.key_lengths[i - 1];
-            node->disk.value_offsets[i] = node->disk.value_offsets[i - 1];
-            node->disk.value_lengths[i] = node->disk.value_lengths[i - 1];
+    for (uint32_t i = 0; i < pool->num_free; i++) {
+        uint32_t page_id = pool->free_pages[i];
+        if (page_id >= pool->next_page_id || seen[page_id]) {
+            printf("free page %u is also in use\n", page_id);
+            errors++;
+            continue;
         }
+        seen[page_id] = 1;
+    }
 
-        node->disk.num_keys++;
+    uint32_t lost = 0;
+    for (uint32_t i = 0; i < pool->next_page_id; i++) {
+        lost += !seen[i];
+    }
+    if (lost > 0) {
+        printf("%u pages are neither in the tree nor free\n", lost);
+        errors++;
     }
 
-    // insert data to buffer
-    memcpy(&node->disk.buf[node->disk.buffer_position], key, key_len);
-    node->disk.key_offsets[index.pos] = node->disk.buffer_position;
-    node->disk.buffer_position += key_len;
+    free(seen);
+    return errors;
+}
 
-    memcpy(&node->disk.buf[node->disk.buffer_position], val, val_len);
-    node->disk.value_offsets[index.pos] = node->disk.buffer_position;
-    node->disk.buffer_position += val_len;
+// offline consistency check of a page file. the pages are scanned in
+// parallel in large sequential reads, each checked on its own and boiled down
+// to what the structural pass needs: a copy of each internal page and the
+// first and last key of each leaf. the structural pass then walks the tree in
+// memory, so it never seeks.
+#define BPLUS_FSCK_CHUNK 256
 
-    // update metadata
-    node->disk.key_lengths[index.pos] = key_len;
-    node->disk.value_lengths[index.pos] = val_len;
+enum {
+    BPLUS_FSCK_BAD = 0, // unreadable, already reported
+    BPLUS_FSCK_LEAF,
+    BPLUS_FSCK_INTERNAL,
+    BPLUS_FSCK_FREE,
+    BPLUS_FSCK_OVERFLOW,
+};
 
-    node->dirty = 1;
-}
+struct bplus_fsck_report {
+    uint32_t num_pages;
+    uint32_t num_leaves;
+    uint32_t num_internal;
+    uint32_t num_free;
+    uint32_t num_overflow; // pages holding values in use
+    uint64_t num_keys;
+    uint64_t bytes_read;
+};
 
-struct bplus_node *bplus_node_split_leaf(
-    struct bplus_buffer_pool *pool, struct bplus_node *full_node) {
-    assert(full_node->disk.is_leaf);
-    assert(full_node->disk.num_keys == MAX_KEYS);
+struct bplus_fsck_page {
+    uint8_t kind;
+    uint8_t seen;
+    uint16_t first_len;
+    uint16_t last_len;
+    uint16_t chunk_len; // overflow: bytes of the value it holds
+    uint32_t next;
+    uint32_t prev;
+    uint64_t lsn;
+    char *keys;              // leaf: first key followed by last key
+    struct bplus_node *node; // internal: copy of the page
+    int num_refs;
+    struct bplus_overflow_ref *refs; // leaf: its values in overflow pages
+};
 
-    struct bplus_node *new_node = bplus_node_create(pool, 1);
+struct bplus_fsck {
+    int fd;
+    const struct bplus_key_ops *keys;
+    struct bplus_extent_table *extents; // NULL unless compressed
+    uint32_t num_pages;
+    struct bplus_fsck_page *pages;
+    int errors;
+    uint64_t num_keys;
 
-    int split_point = (MAX_KEYS + 1) / 2;
+    int height;
+    uint32_t num_overflow;
+    uint32_t last_leaf; // previous leaf in key order during the walk
+};
 
-    for (int i = split_point; i < MAX_KEYS; i++) {
-        // copy kv pairs to new node
-        struct bplus_insert_index index = {
-            .pos = i - split_point,
-            .found = 0,
-        };
-        bplus_node_insert_at(
-            new_node, index, full_node->disk.key_lengths[i],
-            &full_node->disk.buf[full_node->disk.key_offsets[i]],
-            full_node->disk.value_lengths[i],
-            &full_node->disk.buf[full_node->disk.value_offsets[i]]);
-    }
+// check everything about a page that doesn't depend on other pages. returns
+// the number of problems found.
+int bplus_fsck_page_check(
+    const struct bplus_key_ops *keys,
+    struct bplus_node *node,
+    uint32_t num_pages) {
+    struct bplus_node_disk *disk = &node->disk;
+    uint32_t page_id = disk->page_id;
 
-    full_node->disk.num_keys = split_point;
+    if (disk->num_keys * sizeof(struct bplus_slot) > disk->heap_start ||
+        disk->heap_start > BPLUS_NODE_CAPACITY) {
+        printf(
+            "page %u: %u slots overlap a heap starting at %u\n", page_id,
+            disk->num_keys, disk->heap_start);
+        return 1;
+    }
 
-    new_node->next = full_node->next;
-    full_node->next = new_node;
+    int live = 0;
+    for (int i = 0; i < disk->num_keys; i++) {
+        struct bplus_slot *slot = &disk->slots[i];
+        int end = slot->offset + slot->key_len + slot->val_len;
+        if (slot->offset < disk->heap_start || end > BPLUS_NODE_CAPACITY) {
+            printf("page %u: slot %d points outside the heap\n", page_id, i);
+            return 1;
+        }
+        live += slot->key_len + slot->val_len;
+    }
 
-    printf("split node %p to create %p\n", full_node, new_node);
+    int errors = 0;
+    if (live + disk->dead_bytes != BPLUS_NODE_CAPACITY - disk->heap_start) {
+        printf(
+            "page %u: %d live and %d dead heap bytes, heap holds %d\n",
+            page_id, live, disk->dead_bytes,
+            BPLUS_NODE_CAPACITY - disk->heap_start);
+        errors++;
+    }
 
-    return new_node;
+    for (int i = 0; i < disk->num_keys; i++) {
+        struct bplus_slot *slot = &disk->slots[i];
+        char *key = bplus_node_key(node, i);
+        if (slot->head != bplus_keys_head(keys, key, slot->key_len)) {
+            printf("page %u: key %d has a stale head\n", page_id, i);
+            errors++;
+        }
+        if (i > 0 && bplus_keys_compare(
+                         keys, bplus_node_key(node, i - 1),
+                         disk->slots[i - 1].key_len, key,
+                         slot->key_len) >= 0) {
+            printf("page %u: keys %d and %d out of order\n", page_id, i - 1, i);
+            errors++;
+        }
+        if (!disk->is_leaf && (slot->val_len != sizeof(uint32_t) ||
+                               bplus_node_child_id(node, i) >= num_pages)) {
+            printf("page %u: child %d is not a page\n", page_id, i);
+            errors++;
+        }
+        if ((slot->flags & BPLUS_SLOT_OVERFLOW) &&
+            (!disk->is_leaf ||
+             slot->val_len != sizeof(struct bplus_overflow_ref))) {
+            printf("page %u: key %d has a bad overflow reference\n", page_id,
+                   i);
+            errors++;
+        }
+    }
+    if (!disk->is_leaf && disk->last_child >= num_pages) {
+        printf("page %u: last child is not a page\n", page_id);
+        errors++;
+    }
+    return errors;
 }
 
-void bplus_node_add_child(struct bplus_node *node, struct bplus_node *child) {
-    assert(!node->disk.is_leaf);
-    assert(child->disk.is_leaf);
-
-    char *child_key =
-        &child->disk.buf[child->disk.key_offsets[child->disk.num_keys - 1]];
-    int child_key_len = child->disk.key_lengths[child->disk.num_keys - 1];
+void bplus_fsck_summarize(
+    struct bplus_fsck *fsck, struct bplus_node *node, uint32_t page_id) {
+    struct bplus_fsck_page *page = &fsck->pages[page_id];
+    struct bplus_node_disk *disk = &node->disk;
 
-    if (!bplus_node_can_fit(node, child_key_len, 0)) {
-        printf("internal node full - not implemented!!!\n");
-        exit(1);
+    int err = bplus_page_verify(disk, page_id);
+    if (err != BPLUS_PAGE_OK) {
+        printf("page %u: %s\n", page_id, bplus_page_errors[err]);
+        __atomic_fetch_add(&fsck->errors, 1, __ATOMIC_RELAXED);
+        return;
     }
 
-    struct bplus_insert_index index =
-        bplus_node_find_insert_index(node, child_key_len, child_key);
-
-    // shift children
-    for (int i = node->disk.num_keys + 1; i > index.pos; i--) {
-        node->children[i] = node->children[i - 1];
+    page->next = disk->next;
+    page->prev = disk->prev;
+    page->lsn = disk->lsn;
+    if (disk->kind == BPLUS_PAGE_OVERFLOW) {
+        if (disk->num_keys != 0 || disk->heap_start >= BPLUS_NODE_CAPACITY) {
+            printf("page %u: overflow page holds no data\n", page_id);
+            __atomic_fetch_add(&fsck->errors, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        page->kind = BPLUS_FSCK_OVERFLOW;
+        page->chunk_len = BPLUS_NODE_CAPACITY - disk->heap_start;
+        return;
+    }
+    if (disk->kind != BPLUS_PAGE_NODE) {
+        printf("page %u: unknown kind %u\n", page_id, disk->kind);
+        __atomic_fetch_add(&fsck->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    // freed pages are reset to empty internal nodes without a last child
+    if (!disk->is_leaf && disk->last_child == BPLUS_INVALID_PAGE) {
+        page->kind = BPLUS_FSCK_FREE;
+        return;
     }
 
-    // insert key
-    bplus_node_insert_at(node, index, child_key_len, child_key, 0, "");
+    int errors = bplus_fsck_page_check(fsck->keys, node, fsck->num_pages);
+    if (errors > 0) {
+        __atomic_fetch_add(&fsck->errors, errors, __ATOMIC_RELAXED);
+        return;
+    }
 
-    // insert child
-    node->children[index.pos] = child;
+    if (!disk->is_leaf) {
+        page->kind = BPLUS_FSCK_INTERNAL;
+        page->node = malloc(sizeof(struct bplus_node));
+        memcpy(page->node, node, sizeof(struct bplus_node));
+        return;
+    }
 
-    // fix pointers
-    for (int i = 0; i <= node->disk.num_keys; i++) {
-        if (i == node->disk.num_keys) {
-            node->children[i]->next = NULL;
-        } else {
-            node->children[i]->next = node->children[i + 1];
+    page->kind = BPLUS_FSCK_LEAF;
+    __atomic_fetch_add(&fsck->num_keys, disk->num_keys, __ATOMIC_RELAXED);
+    for (int i = 0; i < disk->num_keys; i++) {
+        struct bplus_overflow_ref ref;
+        if (bplus_node_overflow_ref(node, i, &ref)) {
+            page->refs = realloc(
+                page->refs, (page->num_refs + 1) * sizeof(ref));
+            page->refs[page->num_refs++] = ref;
         }
-        node->disk.children[i] = node->children[i]->disk.page_id;
+    }
+    if (disk->num_keys > 0) {
+        int last = disk->num_keys - 1;
+        page->first_len = disk->slots[0].key_len;
+        page->last_len = disk->slots[last].key_len;
+        page->keys = malloc(page->first_len + page->last_len);
+        memcpy(page->keys, bplus_node_key(node, 0), page->first_len);
+        memcpy(
+            &page->keys[page->first_len], bplus_node_key(node, last),
+            page->last_len);
     }
 }
 
-struct bplus_node *bplus_node_insert(
-    struct bplus_buffer_pool *pool,
-    struct bplus_node *node,
-    char *key,
-    char *value) {
-    int key_len = strlen(key);
-    int val_len = strlen(value);
-
-    printf("insert (%s => %s) into node %p\n", key, value, node);
+void bplus_fsck_scan(void *ctx, int64_t lo, int64_t hi) {
+    struct bplus_fsck *fsck = ctx;
+    struct bplus_node *buf =
+        malloc(BPLUS_FSCK_CHUNK * sizeof(struct bplus_node));
 
-    if (node->disk.is_leaf) {
-        if (bplus_node_can_fit(node, key_len, val_len)) {
-            // normal insert
-            struct bplus_insert_index index =
-                bplus_node_find_insert_index(node, key_len, key);
-            printf("inserting %s at %d\n", key, index.pos);
-            bplus_node_insert_at(node, index, key_len, key, val_len, value);
-
-            // no new node
-            return NULL;
-        } else {
-            // split and insert
-            struct bplus_node *new_node = bplus_node_split_leaf(pool, node);
+    for (int64_t chunk = lo; chunk < hi; chunk++) {
+        uint32_t first = chunk * BPLUS_FSCK_CHUNK;
+        uint32_t count = fsck->num_pages - first;
+        if (count > BPLUS_FSCK_CHUNK) {
+            count = BPLUS_FSCK_CHUNK;
+        }
 
-            // compare this key to split key to decide which node to insert to
-            char *split_key =
-                &new_node->disk.buf[new_node->disk.key_offsets[0]];
-            int compare_len = new_node->disk.key_lengths[0];
-            if (key_len < compare_len) {
-                compare_len = key_len;
+        if (fsck->extents != NULL) {
+            for (uint32_t i = 0; i < count; i++) {
+                if (bplus_extent_read(
+                        fsck->extents, fsck->fd, first + i, &buf[i], NULL) <
+                    0) {
+                    __atomic_fetch_add(&fsck->errors, 1, __ATOMIC_RELAXED);
+                } else {
+                    bplus_fsck_summarize(fsck, &buf[i], first + i);
+                }
             }
+            continue;
+        }
 
-            // insert to the correct node
-            if (memcmp(key, split_key, compare_len) < 0) {
-                bplus_node_insert(pool, node, key, value);
-            } else {
-                bplus_node_insert(pool, new_node, key, value);
-            }
+        size_t len = (size_t)count * BPLUS_PAGE_SIZE;
+        off_t offset = bplus_buffer_pool_get_offset(first);
+        if (pread(fsck->fd, buf, len, offset) != (ssize_t)len) {
+            printf("pages %u-%u: short read\n", first, first + count - 1);
+            __atomic_fetch_add(&fsck->errors, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            bplus_fsck_summarize(fsck, &buf[i], first + i);
+        }
+    }
+
+    free(buf);
+}
+
+// keys are ordered within each page already, so comparing the first and last
+// key against (lo, hi] covers the whole page
+int bplus_fsck_bounds(
+    const struct bplus_key_ops *keys,
+    uint32_t page_id,
+    char *first,
+    int first_len,
+    char *last,
+    int last_len,
+    char *lo,
+    int lo_len,
+    char *hi,
+    int hi_len) {
+    if ((lo != NULL &&
+         bplus_keys_compare(keys, first, first_len, lo, lo_len) <= 0) ||
+        (hi != NULL &&
+         bplus_keys_compare(keys, last, last_len, hi, hi_len) > 0)) {
+        printf("page %u: keys outside parent bounds\n", page_id);
+        return 1;
+    }
+    return 0;
+}
 
-            return new_node;
+// follow an overflow chain from a leaf, the in-memory counterpart of
+// bplus_node_check_overflow
+int bplus_fsck_overflow(
+    struct bplus_fsck *fsck, uint32_t leaf_id, struct bplus_overflow_ref ref) {
+    uint32_t total = 0;
+    for (uint32_t page_id = ref.first_page; page_id != BPLUS_INVALID_PAGE;) {
+        if (page_id >= fsck->num_pages || fsck->pages[page_id].seen) {
+            printf(
+                "page %u: overflow chain hits page %u again\n", leaf_id,
+                page_id);
+            return 1;
         }
-    } else {
-        // internal node
-        // reuse bplus_node_find_insert_index to find split key of correct child
-        struct bplus_insert_index index =
-            bplus_node_find_insert_index(node, key_len, key);
+        struct bplus_fsck_page *page = &fsck->pages[page_id];
+        page->seen = 1;
+        if (page->kind == BPLUS_FSCK_BAD) {
+            return 0;
+        }
+        if (page->kind != BPLUS_FSCK_OVERFLOW) {
+            printf(
+                "page %u: overflow chain leads to page %u, which isn't one\n",
+                leaf_id, page_id);
+            return 1;
+        }
+        fsck->num_overflow++;
+        total += page->chunk_len;
+        page_id = page->next;
+    }
+    if (total != ref.len) {
+        printf(
+            "page %u: overflow chain at %u holds %u of %u bytes\n", leaf_id,
+            ref.first_page, total, ref.len);
+        return 1;
+    }
+    return 0;
+}
 
-        // insert to that child, test if it split
-        struct bplus_node *child = bplus_node_get_child(pool, node, index.pos);
-        if (child == NULL) {
-            printf("error! couldn't load child\n");
-            exit(1);
+// the in-memory counterpart of bplus_node_check
+int bplus_fsck_walk(
+    struct bplus_fsck *fsck,
+    uint32_t page_id,
+    int depth,
+    char *lo,
+    int lo_len,
+    char *hi,
+    int hi_len) {
+    struct bplus_fsck_page *page = &fsck->pages[page_id];
+    if (page->seen) {
+        printf("page %u is reachable more than once\n", page_id);
+        return 1;
+    }
+    page->seen = 1;
+
+    if (page->kind == BPLUS_FSCK_BAD) {
+        return 0;
+    }
+    if (page->kind == BPLUS_FSCK_FREE) {
+        printf("page %u is free but still in the tree\n", page_id);
+        return 1;
+    }
+    if (page->kind == BPLUS_FSCK_OVERFLOW) {
+        printf("page %u holds a value but is linked as a node\n", page_id);
+        return 1;
+    }
+
+    int errors = 0;
+    if (page->kind == BPLUS_FSCK_LEAF) {
+        if (depth != fsck->height) {
+            printf(
+                "page %u: leaf at depth %d, tree height is %d\n", page_id,
+                depth, fsck->height);
+            errors++;
+        }
+        if (page->keys != NULL) {
+            errors += bplus_fsck_bounds(
+                fsck->keys, page_id, page->keys, page->first_len,
+                &page->keys[page->first_len], page->last_len, lo, lo_len, hi,
+                hi_len);
         }
-        struct bplus_node *new_node =
-            bplus_node_insert(pool, child, key, value);
 
-        //     if it split, add new child to this internal node
-        if (new_node != NULL) {
-            bplus_node_add_child(node, new_node);
+        // leaves are reached in key order, so each must link to the last
+        if (page->prev != fsck->last_leaf ||
+            (fsck->last_leaf != BPLUS_INVALID_PAGE &&
+             fsck->pages[fsck->last_leaf].next != page_id)) {
+            printf(
+                "page %u: not linked to leaf %u before it\n", page_id,
+                fsck->last_leaf);
+            errors++;
         }
+        fsck->last_leaf = page_id;
+        for (int i = 0; i < page->num_refs; i++) {
+            errors += bplus_fsck_overflow(fsck, page_id, page->refs[i]);
+        }
+        return errors;
     }
 
-    return NULL;
+    struct bplus_node *node = page->node;
+    int n = node->disk.num_keys;
+    if (n > 0) {
+        errors += bplus_fsck_bounds(
+            fsck->keys, page_id, bplus_node_key(node, 0),
+            node->disk.slots[0].key_len, bplus_node_key(node, n - 1),
+            node->disk.slots[n - 1].key_len, lo, lo_len, hi, hi_len);
+    }
+    for (int i = 0; i <= n; i++) {
+        char *child_lo = lo;
+        int child_lo_len = lo_len;
+        char *child_hi = hi;
+        int child_hi_len = hi_len;
+        if (i > 0) {
+            child_lo = bplus_node_key(node, i - 1);
+            child_lo_len = node->disk.slots[i - 1].key_len;
+        }
+        if (i < n) {
+            child_hi = bplus_node_key(node, i);
+            child_hi_len = node->disk.slots[i].key_len;
+        }
+        errors += bplus_fsck_walk(
+            fsck, bplus_node_child_id(node, i), depth + 1, child_lo,
+            child_lo_len, child_hi, child_hi_len);
+    }
+    return errors;
 }
 
-void bplus_tree_insert(struct bplus_tree *tree, char *key, char *val) {
-    struct bplus_node *new_node =
-        bplus_node_insert(tree->pool, tree->root, key, val);
-    if (new_node != NULL) {
-        // increase tree height
-        struct bplus_node *new_root = bplus_node_create(tree->pool, 0);
-        bplus_node_add_child(new_root, tree->root);
-        bplus_node_add_child(new_root, new_node);
+// check the file at path with num_threads scanning pages. the tree must not
+// be open for writing. keys is the order the tree was created with, or NULL
+// for a built in order named in the header. returns the number of problems
+// found, or -1 if the file couldn't be read at all.
+int bplus_fsck(
+    const char *path,
+    const struct bplus_key_ops *keys,
+    int num_threads,
+    struct bplus_fsck_report *report) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("fsck: open");
+        return -1;
+    }
 
-        tree->root = new_root;
-        tree->height += 1;
+    struct stat st;
+    struct bplus_disk_header header;
+    if (fstat(fd, &st) < 0 ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror("fsck: read header");
+        close(fd);
+        return -1;
+    }
+    int err = bplus_disk_header_verify(&header);
+    if (err != BPLUS_PAGE_OK || header.page_size != BPLUS_PAGE_SIZE) {
+        printf(
+            "%s: header %s\n", path,
+            err != BPLUS_PAGE_OK ? bplus_page_errors[err]
+                                 : "has the wrong page size");
+        close(fd);
+        return -1;
+    }
+    if (keys == NULL) {
+        keys = bplus_key_ops_find(header.key_order);
+    }
+    if (keys == NULL ||
+        strncmp(header.key_order, keys->name, sizeof(header.key_order)) != 0) {
+        printf("%s: can't order %.16s keys\n", path, header.key_order);
+        close(fd);
+        return -1;
     }
-}
 
-int bplus_node_get(struct bplus_node *node, char *key, char *buf, int buf_len) {
-    struct bplus_insert_index index =
-        bplus_node_find_insert_index(node, strlen(key), key);
+    struct bplus_fsck fsck = {
+        .fd = fd,
+        .keys = keys,
+        .num_pages = st.st_size / BPLUS_PAGE_SIZE - 1,
+        .height = header.height,
+        .last_leaf = BPLUS_INVALID_PAGE,
+    };
+    if (header.flags & BPLUS_HEADER_COMPRESSED) {
+        fsck.extents = bplus_extent_table_open(path, O_RDONLY);
+        if (fsck.extents == NULL) {
+            printf("%s: extent table is missing\n", path);
+            close(fd);
+            return -1;
+        }
+        fsck.num_pages = fsck.extents->num_entries;
+        fsck.errors += fsck.extents->dropped;
+    } else if (st.st_size % BPLUS_PAGE_SIZE != 0) {
+        printf("%s: file ends partway through a page\n", path);
+        fsck.errors++;
+    }
+    fsck.pages = calloc(fsck.num_pages + 1, sizeof(struct bplus_fsck_page));
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-    if (!node->disk.is_leaf) {
-        return bplus_node_get(node->children[index.pos], key, buf, buf_len);
-    } else if (!index.found) {
-        return 1;
+    // a pool of its own, so the scan uses exactly the threads asked for
+    struct taskpool_options opts = {
+        .num_threads = num_threads < 1 ? 1 : num_threads,
+    };
+    struct taskpool *tasks = taskpool_create(&opts);
+    uint32_t num_chunks =
+        (fsck.num_pages + BPLUS_FSCK_CHUNK - 1) / BPLUS_FSCK_CHUNK;
+    taskpool_for(tasks, 0, num_chunks, 1, bplus_fsck_scan, &fsck);
+    taskpool_destroy(tasks);
+
+    // the free chain first, so a free page linked into the tree is caught
+    // by the walk. freed overflow chains keep their contents.
+    uint32_t page_id = header.free_head;
+    for (uint32_t i = 0; i < header.num_free; i++) {
+        if (page_id >= fsck.num_pages ||
+            (fsck.pages[page_id].kind != BPLUS_FSCK_FREE &&
+             fsck.pages[page_id].kind != BPLUS_FSCK_OVERFLOW)) {
+            printf(
+                "free list broken at page %u, %u pages unaccounted for\n",
+                page_id, header.num_free - i);
+            fsck.errors++;
+            break;
+        }
+        fsck.pages[page_id].seen = 1;
+        page_id = fsck.pages[page_id].next;
+    }
+
+    if (header.root_page_id >= fsck.num_pages) {
+        printf(
+            "root page %u is past the end of the file\n",
+            header.root_page_id);
+        fsck.errors++;
     } else {
-        int val_len = node->disk.value_lengths[index.pos];
-        if (buf_len < (val_len + 1)) {
-            printf("buffer too small!\n");
-            return -1;
+        fsck.errors += bplus_fsck_walk(
+            &fsck, header.root_page_id, 1, NULL, 0, NULL, 0);
+        if (fsck.last_leaf != BPLUS_INVALID_PAGE &&
+            fsck.pages[fsck.last_leaf].next != BPLUS_INVALID_PAGE) {
+            printf("page %u: last leaf has a right sibling\n", fsck.last_leaf);
+            fsck.errors++;
         }
+    }
 
-        char *val = &node->disk.buf[node->disk.value_offsets[index.pos]];
-        memcpy(buf, val, val_len);
-        buf[val_len] = '\0';
+    // pages reach the file only through a checkpoint, which records the lsn
+    // it covers, so no page may be newer than the header
+    uint32_t lost = 0;
+    struct bplus_fsck_report r = {
+        .num_pages = fsck.num_pages,
+        .num_free = header.num_free,
+        .num_overflow = fsck.num_overflow,
+        .num_keys = fsck.num_keys,
+        .bytes_read = st.st_size,
+    };
+    for (uint32_t i = 0; i < fsck.num_pages; i++) {
+        struct bplus_fsck_page *page = &fsck.pages[i];
+        lost += !page->seen;
+        r.num_leaves += page->kind == BPLUS_FSCK_LEAF;
+        r.num_internal += page->kind == BPLUS_FSCK_INTERNAL;
+        if (page->kind != BPLUS_FSCK_BAD &&
+            page->lsn > header.checkpoint_lsn) {
+            printf(
+                "page %u: lsn %llu is past the checkpoint at %llu\n", i,
+                (unsigned long long)page->lsn,
+                (unsigned long long)header.checkpoint_lsn);
+            fsck.errors++;
+        }
+        free(page->keys);
+        free(page->node);
+        free(page->refs);
+    }
+    if (lost > 0) {
+        printf("%u pages are neither in the tree nor free\n", lost);
+        fsck.errors++;
     }
 
-    return 0;
+    if (report != NULL) {
+        *report = r;
+    }
+    free(fsck.pages);
+    if (fsck.extents != NULL) {
+        bplus_extent_table_close(fsck.extents);
+    }
+    close(fd);
+    return fsck.errors;
 }
 
 void bplus_node_print_keys(
     struct bplus_buffer_pool *pool, struct bplus_node *node) {
     if (node->disk.is_leaf) {
-        printf("leaf node %p\n", node);
+        printf("leaf node %u\n", node->disk.page_id);
         for (int i = 0; i < node->disk.num_keys; i++) {
             printf(
-                "key: %.*s ", node->disk.key_lengths[i],
-                &node->disk.buf[node->disk.key_offsets[i]]);
+                "key: %.*s ", node->disk.slots[i].key_len,
+                bplus_node_key(node, i));
+            if (node->disk.slots[i].flags & BPLUS_SLOT_OVERFLOW) {
+                printf(
+                    "value: %d bytes in overflow pages\n",
+                    bplus_node_value_len(node, i));
+                continue;
+            }
             printf(
-                "value: %.*s\n", node->disk.value_lengths[i],
-                &node->disk.buf[node->disk.value_offsets[i]]);
+                "value: %.*s\n", node->disk.slots[i].val_len,
+                bplus_node_value(node, i));
         }
     } else {
-        printf("internal node %p split keys: ", node);
+        printf("internal node %u split keys: ", node->disk.page_id);
         for (int i = 0; i < node->disk.num_keys; i++) {
             printf(
-                "%d=%.*s ", i, node->disk.key_lengths[i],
-                &node->disk.buf[node->disk.key_offsets[i]]);
+                "%d=%.*s ", i, node->disk.slots[i].key_len,
+                bplus_node_key(node, i));
         }
         printf("\n");
         for (int i = 0; i <= node->disk.num_keys; i++) {
-            bplus_node_print_keys(pool, bplus_node_get_child(pool, node, i));
+            struct bplus_node *child = bplus_node_get_child(pool, node, i);
+            bplus_node_print_keys(pool, child);
+            bplus_buffer_pool_unpin(pool, child);
         }
     }
 }
@@ -509,4 +7679,16 @@ void bplus_tree_print_keys(struct bplus_tree *tree) {
     bplus_node_print_keys(tree->pool, tree->root);
 }
 
-void bplus_tree_destroy(struct bplus_tree *tree) { free(tree); }
+void bplus_tree_destroy(struct bplus_tree *tree) {
+    if (tree->wal != NULL) {
+        bplus_wal_close(tree->wal);
+    }
+    pthread_rwlock_destroy(&tree->lock);
+    pthread_rwlock_destroy(&tree->root_latch);
+    // a forked process shares its parent's pin on the root
+    if (!tree->pool->shared || tree->pool->owner == getpid()) {
+        bplus_buffer_pool_unpin(tree->pool, tree->root);
+    }
+    bplus_buffer_pool_destroy(tree->pool);
+    free(tree);
+}
@@ -0,0 +1,527 @@
+#include "bplus.c"
+#include "bplus_hist.c"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// YCSB style workloads against a bplus tree: a bulk loaded key space, then a
+// mix of point reads, updates, inserts and range scans from any number of
+// threads. reports throughput, latency percentiles per operation and buffer
+// pool traffic, as text or as JSON for scripts that track regressions.
+
+#define BENCH_READ 0
+#define BENCH_UPDATE 1
+#define BENCH_INSERT 2
+#define BENCH_SCAN 3
+#define BENCH_NUM_OPS 4
+
+const char *bench_op_names[BENCH_NUM_OPS] = {
+    "read", "update", "insert", "scan"};
+
+struct bench_workload {
+    const char *name;
+    const char *ycsb; // the matching YCSB core workload, if there is one
+    int mix[BENCH_NUM_OPS]; // percent of operations of each kind
+    int ordered; // keys in id order, so inserts append rather than scatter
+};
+
+const struct bench_workload bench_workloads[] = {
+    {"write-heavy", "a", {50, 50, 0, 0}, 0},
+    {"read-heavy", "b", {95, 5, 0, 0}, 0},
+    {"read-only", "c", {100, 0, 0, 0}, 0},
+    {"scan", "e", {0, 0, 5, 95}, 0},
+    {"insert", "", {0, 0, 100, 0}, 0},
+    {"seq-insert", "", {0, 0, 100, 0}, 1},
+};
+
+#define BENCH_NUM_WORKLOADS \
+    (int)(sizeof(bench_workloads) / sizeof(bench_workloads[0]))
+
+uint64_t scramble(uint64_t x) {
+    x ^= x >> 31;
+    x *= 0x7fb5d329728ea185ULL;
+    x ^= x >> 27;
+    x *= 0x81dadef4bc2dd44dULL;
+    x ^= x >> 33;
+    return x;
+}
+
+double elapsed(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+           (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// per thread generator, splitmix64
+uint64_t bench_rand(uint64_t *state) {
+    return scramble(*state += 0x9e3779b97f4a7c15ULL);
+}
+
+double bench_rand_unit(uint64_t *state) {
+    return (bench_rand(state) >> 11) * 0x1.0p-53;
+}
+
+// zipfian ranks over [0, n) as YCSB draws them (Gray et al., "Quickly
+// generating billion-record synthetic databases"). rank 0 is the hottest.
+struct bench_zipf {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+void bench_zipf_init(struct bench_zipf *z, uint64_t n, double theta) {
+    double zeta2 = 1 + pow(0.5, theta);
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+        z->zetan += 1 / pow(i, theta);
+    }
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+uint64_t bench_zipf_next(struct bench_zipf *z, uint64_t *state) {
+    double u = bench_rand_unit(state);
+    double uz = u * z->zetan;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, z->theta)) {
+        return 1;
+    }
+    uint64_t rank = z->n * pow(z->eta * u - z->eta + 1, z->alpha);
+    return rank < z->n ? rank : z->n - 1;
+}
+
+struct bench_config {
+    const struct bench_workload *workload;
+    const char *path;
+    uint64_t num_keys;
+    uint64_t num_ops;
+    int num_threads;
+    int num_frames;
+    int wal_mode;
+    int val_len;
+    int max_scan;
+    int zipfian;
+    double theta;
+    int json;
+};
+
+struct bench_state {
+    struct bench_config *cfg;
+    struct bplus_tree *tree;
+    struct bench_zipf zipf;
+    uint64_t next_id; // next key id to insert, taken atomically
+};
+
+struct bench_thread {
+    struct bench_state *state;
+    int id;
+    uint64_t num_ops;
+    uint64_t errors;
+    struct bench_hist hist[BENCH_NUM_OPS];
+};
+
+int bench_key(struct bench_config *cfg, uint64_t id, char *buf) {
+    uint64_t k = cfg->workload->ordered ? id : scramble(id);
+    return sprintf(buf, "user%016llx", (unsigned long long)k);
+}
+
+// an existing key id. zipfian ranks are scattered over the key space so the
+// hot keys don't all share a leaf.
+uint64_t bench_pick(struct bench_state *s, uint64_t *rng) {
+    uint64_t n = s->cfg->num_keys;
+    if (s->zipf.n > 0) {
+        return scramble(bench_zipf_next(&s->zipf, rng)) % n;
+    }
+    return bench_rand(rng) % n;
+}
+
+int bench_op(struct bench_thread *t, int op, uint64_t *rng, char *val) {
+    struct bench_state *s = t->state;
+    struct bench_config *cfg = s->cfg;
+    char key[32];
+    int key_len;
+
+    if (op == BENCH_READ) {
+        int val_len;
+        key_len = bench_key(cfg, bench_pick(s, rng), key);
+        return bplus_tree_lookup(
+            s->tree, key, key_len, val, cfg->val_len, &val_len);
+    }
+    if (op == BENCH_UPDATE) {
+        key_len = bench_key(cfg, bench_pick(s, rng), key);
+        return bplus_tree_put(s->tree, key, key_len, val, cfg->val_len);
+    }
+    if (op == BENCH_INSERT) {
+        uint64_t id = __atomic_fetch_add(&s->next_id, 1, __ATOMIC_RELAXED);
+        key_len = bench_key(cfg, id, key);
+        return bplus_tree_put(s->tree, key, key_len, val, cfg->val_len);
+    }
+
+    key_len = bench_key(cfg, bench_pick(s, rng), key);
+    int len = 1 + bench_rand(rng) % cfg->max_scan;
+    struct bplus_cursor c;
+    bplus_cursor_init(&c, s->tree);
+    int more = bplus_cursor_seek(&c, key, key_len);
+    for (int i = 1; i < len && more > 0; i++) {
+        more = bplus_cursor_next(&c);
+    }
+    bplus_cursor_close(&c);
+    return more < 0 ? -1 : 0;
+}
+
+void *bench_thread_run(void *data) {
+    struct bench_thread *t = data;
+    const int *mix = t->state->cfg->workload->mix;
+    uint64_t rng = scramble(t->id + 1);
+    char *val = malloc(t->state->cfg->val_len);
+    memset(val, 'v', t->state->cfg->val_len);
+
+    for (uint64_t i = 0; i < t->num_ops; i++) {
+        int roll = bench_rand(&rng) % 100;
+        int op = 0;
+        while (roll >= mix[op]) {
+            roll -= mix[op++];
+        }
+        uint64_t start = now_ns();
+        if (bench_op(t, op, &rng, val) < 0) {
+            t->errors++;
+        }
+        bench_hist_add(&t->hist[op], now_ns() - start);
+    }
+    free(val);
+    return NULL;
+}
+
+// bulk load input: ids in key order
+struct bench_load {
+    struct bench_config *cfg;
+    uint64_t *keys; // sorted key values, scrambled ids unless ordered
+    uint64_t next;
+    char key[32];
+    char *val;
+};
+
+int bench_load_next(
+    void *ctx, char **key, int *key_len, char **val, int *val_len) {
+    struct bench_load *l = ctx;
+    if (l->next == l->cfg->num_keys) {
+        return 0;
+    }
+    *key_len = sprintf(
+        l->key, "user%016llx", (unsigned long long)l->keys[l->next++]);
+    *key = l->key;
+    *val = l->val;
+    *val_len = l->cfg->val_len;
+    return 1;
+}
+
+int bench_compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+struct bplus_tree *bench_load_tree(struct bench_config *cfg) {
+    struct bench_load l = {
+        .cfg = cfg,
+        .keys = malloc((cfg->num_keys + 1) * sizeof(uint64_t)),
+        .val = malloc(cfg->val_len),
+    };
+    for (uint64_t i = 0; i < cfg->num_keys; i++) {
+        l.keys[i] = cfg->workload->ordered ? i : scramble(i);
+    }
+    if (!cfg->workload->ordered) {
+        qsort(l.keys, cfg->num_keys, sizeof(uint64_t), bench_compare_u64);
+    }
+    memset(l.val, 'v', cfg->val_len);
+
+    struct bplus_tree_options opts = {
+        .num_frames = cfg->num_frames,
+        .wal_mode = cfg->wal_mode,
+    };
+    struct bplus_tree *tree =
+        bplus_tree_bulk_load(cfg->path, &opts, bench_load_next, &l, 0.9);
+    free(l.keys);
+    free(l.val);
+    return tree;
+}
+
+void bench_usage(const char *prog) {
+    printf(
+        "usage: %s [-w workload] [-n keys] [-o ops] [-t threads] "
+        "[-f frames]\n"
+        "       [-v value bytes] [-d uniform|zipfian] [-z theta] "
+        "[-s max scan]\n"
+        "       [-W off|commit|interval|none] [-p path] [-j]\n"
+        "workloads:\n",
+        prog);
+    for (int i = 0; i < BENCH_NUM_WORKLOADS; i++) {
+        const struct bench_workload *w = &bench_workloads[i];
+        printf("  %-12s", w->name);
+        for (int op = 0; op < BENCH_NUM_OPS; op++) {
+            if (w->mix[op] > 0) {
+                printf(" %d%% %s", w->mix[op], bench_op_names[op]);
+            }
+        }
+        if (w->ordered) {
+            printf(" in key order");
+        }
+        if (w->ycsb[0] != '\0') {
+            printf(" (YCSB %s)", w->ycsb);
+        }
+        printf("\n");
+    }
+}
+
+int bench_parse(int argc, char **argv, struct bench_config *cfg) {
+    const char *wal_modes[] = {"off", "commit", "interval", "none"};
+    int opt;
+    while ((opt = getopt(argc, argv, "w:n:o:t:f:v:d:z:s:W:p:jh")) != -1) {
+        switch (opt) {
+        case 'w':
+            cfg->workload = NULL;
+            for (int i = 0; i < BENCH_NUM_WORKLOADS; i++) {
+                if (strcmp(optarg, bench_workloads[i].name) == 0 ||
+                    strcmp(optarg, bench_workloads[i].ycsb) == 0) {
+                    cfg->workload = &bench_workloads[i];
+                }
+            }
+            if (cfg->workload == NULL) {
+                printf("unknown workload %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'n':
+            cfg->num_keys = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            cfg->num_ops = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            cfg->num_threads = atoi(optarg);
+            break;
+        case 'f':
+            cfg->num_frames = atoi(optarg);
+            break;
+        case 'v':
+            cfg->val_len = atoi(optarg);
+            break;
+        case 'd':
+            if (strcmp(optarg, "uniform") != 0 &&
+                strcmp(optarg, "zipfian") != 0) {
+                printf("unknown distribution %s\n", optarg);
+                return -1;
+            }
+            cfg->zipfian = strcmp(optarg, "zipfian") == 0;
+            break;
+        case 'z':
+            cfg->theta = atof(optarg);
+            break;
+        case 's':
+            cfg->max_scan = atoi(optarg);
+            break;
+        case 'W':
+            cfg->wal_mode = -1;
+            for (int i = 0; i < 4; i++) {
+                if (strcmp(optarg, wal_modes[i]) == 0) {
+                    cfg->wal_mode = i;
+                }
+            }
+            if (cfg->wal_mode < 0) {
+                printf("unknown log mode %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'p':
+            cfg->path = optarg;
+            break;
+        case 'j':
+            cfg->json = 1;
+            break;
+        default:
+            return -1;
+        }
+    }
+    if (cfg->num_keys == 0 || cfg->num_threads < 1 || cfg->val_len < 1 ||
+        cfg->max_scan < 1 || cfg->theta <= 0 || cfg->theta >= 1) {
+        printf("keys, threads, value bytes and max scan must be positive, "
+               "theta in (0, 1)\n");
+        return -1;
+    }
+    return 0;
+}
+
+void bench_report_text(
+    struct bench_config *cfg,
+    double load_secs,
+    double run_secs,
+    struct bench_hist *hist,
+    struct bplus_buffer_pool_stats *st,
+    uint64_t errors) {
+    printf(
+        "workload %s (%s), %llu keys of %d byte values, %d frames, %d "
+        "threads\n",
+        cfg->workload->name, cfg->zipfian ? "zipfian" : "uniform",
+        (unsigned long long)cfg->num_keys, cfg->val_len, cfg->num_frames,
+        cfg->num_threads);
+    printf(
+        "load: %.3f s, %.0f keys/s\n", load_secs, cfg->num_keys / load_secs);
+    printf(
+        "run: %llu ops in %.3f s, %.0f ops/s, %llu errors\n",
+        (unsigned long long)cfg->num_ops, run_secs, cfg->num_ops / run_secs,
+        (unsigned long long)errors);
+    printf(
+        "%-8s %10s %10s %10s %10s %10s %10s  (us)\n", "op", "count", "mean",
+        "p50", "p99", "p999", "max");
+    for (int op = 0; op < BENCH_NUM_OPS; op++) {
+        struct bench_hist *h = &hist[op];
+        if (h->total == 0) {
+            continue;
+        }
+        printf(
+            "%-8s %10llu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+            bench_op_names[op], (unsigned long long)h->total,
+            (double)h->sum / h->total / 1e3,
+            bench_hist_percentile(h, 0.5) / 1e3,
+            bench_hist_percentile(h, 0.99) / 1e3,
+            bench_hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+    }
+    uint64_t lookups = st->hits + st->misses;
+    printf(
+        "pages: %llu read, %llu written, %llu evicted, cache hit rate "
+        "%.2f%%\n",
+        (unsigned long long)st->reads, (unsigned long long)st->writes,
+        (unsigned long long)st->evictions,
+        lookups > 0 ? 100.0 * st->hits / lookups : 100.0);
+}
+
+void bench_report_json(
+    struct bench_config *cfg,
+    double load_secs,
+    double run_secs,
+    struct bench_hist *hist,
+    struct bplus_buffer_pool_stats *st,
+    uint64_t errors) {
+    uint64_t lookups = st->hits + st->misses;
+    printf(
+        "{\"workload\": \"%s\", \"distribution\": \"%s\", \"keys\": %llu, "
+        "\"value_bytes\": %d, \"frames\": %d, \"threads\": %d, "
+        "\"load_seconds\": %.6f, \"ops\": %llu, \"seconds\": %.6f, "
+        "\"ops_per_sec\": %.1f, \"errors\": %llu, \"latency_us\": {",
+        cfg->workload->name, cfg->zipfian ? "zipfian" : "uniform",
+        (unsigned long long)cfg->num_keys, cfg->val_len, cfg->num_frames,
+        cfg->num_threads, load_secs, (unsigned long long)cfg->num_ops,
+        run_secs, cfg->num_ops / run_secs, (unsigned long long)errors);
+    const char *sep = "";
+    for (int op = 0; op < BENCH_NUM_OPS; op++) {
+        struct bench_hist *h = &hist[op];
+        if (h->total == 0) {
+            continue;
+        }
+        printf(
+            "%s\"%s\": {\"count\": %llu, \"mean\": %.3f, \"p50\": %.3f, "
+            "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}",
+            sep, bench_op_names[op], (unsigned long long)h->total,
+            (double)h->sum / h->total / 1e3,
+            bench_hist_percentile(h, 0.5) / 1e3,
+            bench_hist_percentile(h, 0.99) / 1e3,
+            bench_hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+        sep = ", ";
+    }
+    printf(
+        "}, \"pages_read\": %llu, \"pages_written\": %llu, "
+        "\"evictions\": %llu, \"cache_hit_rate\": %.4f}\n",
+        (unsigned long long)st->reads, (unsigned long long)st->writes,
+        (unsigned long long)st->evictions,
+        lookups > 0 ? (double)st->hits / lookups : 1.0);
+}
+
+int main(int argc, char **argv) {
+    struct bench_config cfg = {
+        .workload = &bench_workloads[1],
+        .path = "/tmp/bplus_bench",
+        .num_keys = 1000000,
+        .num_ops = 1000000,
+        .num_threads = 1,
+        .num_frames = BPLUS_DEFAULT_FRAMES,
+        .wal_mode = BPLUS_WAL_OFF,
+        .val_len = 100,
+        .max_scan = 100,
+        .zipfian = 1,
+        .theta = 0.99,
+    };
+    if (bench_parse(argc, argv, &cfg) < 0) {
+        bench_usage(argv[0]);
+        return 2;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct bench_state state = {
+        .cfg = &cfg,
+        .tree = bench_load_tree(&cfg),
+        .next_id = cfg.num_keys,
+    };
+    if (state.tree == NULL) {
+        return 1;
+    }
+    double load_secs = elapsed(&start);
+    if (cfg.zipfian) {
+        bench_zipf_init(&state.zipf, cfg.num_keys, cfg.theta);
+    }
+
+    // count only the run's page traffic
+    struct bplus_buffer_pool *pool = state.tree->pool;
+    memset(&pool->stats, 0, sizeof(pool->stats));
+
+    pthread_t threads[cfg.num_threads];
+    struct bench_thread *workers =
+        calloc(cfg.num_threads, sizeof(struct bench_thread));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < cfg.num_threads; i++) {
+        workers[i].state = &state;
+        workers[i].id = i;
+        workers[i].num_ops = cfg.num_ops / cfg.num_threads +
+                             (i < (int)(cfg.num_ops % cfg.num_threads));
+        pthread_create(&threads[i], NULL, bench_thread_run, &workers[i]);
+    }
+    struct bench_hist hist[BENCH_NUM_OPS] = {0};
+    uint64_t errors = 0;
+    for (int i = 0; i < cfg.num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        for (int op = 0; op < BENCH_NUM_OPS; op++) {
+            bench_hist_merge(&hist[op], &workers[i].hist[op]);
+        }
+        errors += workers[i].errors;
+    }
+    double run_secs = elapsed(&start);
+
+    struct bplus_buffer_pool_stats st = pool->stats;
+    if (cfg.json) {
+        bench_report_json(&cfg, load_secs, run_secs, hist, &st, errors);
+    } else {
+        bench_report_text(&cfg, load_secs, run_secs, hist, &st, errors);
+    }
+
+    free(workers);
+    bplus_tree_destroy(state.tree);
+    remove(cfg.path);
+    char *wal_path = bplus_wal_path(cfg.path);
+    remove(wal_path);
+    free(wal_path);
+    return errors > 0;
+}
@@ -0,0 +1,577 @@
+#include "bplus_hist.c"
+#include "bplus_proto.c"
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// load generator for bplus_server. each thread drives its own connection,
+// keeping up to a queue depth of requests in flight, and times every request
+// from when it is queued to when its reply has been read. values are derived
+// from their keys, so every value read back is checked.
+
+#define CLIENT_GET 0
+#define CLIENT_PUT 1
+#define CLIENT_MULTIGET 2
+#define CLIENT_SCAN 3
+#define CLIENT_NUM_OPS 4
+
+const char *client_op_names[CLIENT_NUM_OPS] = {
+    "get", "put", "multiget", "scan"};
+const int client_ops[CLIENT_NUM_OPS] = {
+    BPLUS_PROTO_GET, BPLUS_PROTO_PUT, BPLUS_PROTO_MULTIGET, BPLUS_PROTO_SCAN};
+
+#define CLIENT_KEY_LEN 20 // "user" and 16 hex digits
+
+struct client_config {
+    const char *socket_path;
+    uint64_t num_keys;
+    int num_threads;
+    int depth;
+    int val_len;
+    int secs;
+    int mix[CLIENT_NUM_OPS]; // percent of requests of each kind
+    int multiget_keys;
+    int scan_len;
+    int load;
+};
+
+// a request in flight. the keys it named are drawn again from seed to check
+// the reply.
+struct client_request {
+    uint64_t start_ns;
+    uint64_t seed;
+    int kind;
+};
+
+struct client_thread {
+    struct client_config *cfg;
+    int id;
+    int fd;
+    uint64_t rng;
+
+    char *out; // requests not yet written
+    int out_len;
+    int out_off;
+    int out_cap;
+    char *in; // replies not yet parsed
+    int in_len;
+    int in_cap;
+
+    struct client_request *ring; // in send order
+    int ring_head;
+    int in_flight;
+
+    struct bench_hist hists[CLIENT_NUM_OPS];
+    uint64_t missing;
+    uint64_t errors;
+    int loading; // PUT seed itself rather than a random key
+    uint64_t run_ns;
+};
+
+pthread_barrier_t client_barrier;
+
+uint64_t scramble(uint64_t x) {
+    x ^= x >> 31;
+    x *= 0x7fb5d329728ea185ULL;
+    x ^= x >> 27;
+    x *= 0x81dadef4bc2dd44dULL;
+    x ^= x >> 33;
+    return x;
+}
+
+uint64_t client_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t client_rand(uint64_t *state) {
+    *state += 0x9e3779b97f4a7c15ULL;
+    return scramble(*state);
+}
+
+void client_key(uint64_t id, char *key) {
+    char buf[CLIENT_KEY_LEN + 1];
+    snprintf(buf, sizeof(buf), "user%016llx", (unsigned long long)scramble(id));
+    memcpy(key, buf, CLIENT_KEY_LEN);
+}
+
+// the value stored under a key, a function of the key alone
+char client_value_byte(const char *key, int key_len, int i) {
+    uint64_t h = 1469598103934665603ULL;
+    for (int j = 0; j < key_len; j++) {
+        h = (h ^ (unsigned char)key[j]) * 1099511628211ULL;
+    }
+    return 'a' + (h + (uint64_t)i * 7) % 26;
+}
+
+int client_check_value(
+    struct client_config *cfg,
+    const char *key,
+    int key_len,
+    const char *val,
+    uint32_t val_len) {
+    if (val_len != (uint32_t)cfg->val_len) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < val_len; i++) {
+        if (val[i] != client_value_byte(key, key_len, i)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// room for n more bytes of requests
+char *client_reserve(struct client_thread *t, int n) {
+    if (t->out_len + n > t->out_cap) {
+        while (t->out_len + n > t->out_cap) {
+            t->out_cap = t->out_cap > 0 ? 2 * t->out_cap : 64 * 1024;
+        }
+        t->out = realloc(t->out, t->out_cap);
+    }
+    char *p = t->out + t->out_len;
+    t->out_len += n;
+    return p;
+}
+
+void client_header(struct client_thread *t, int op, uint32_t len, int count) {
+    struct bplus_proto_header h = {.len = len, .op = op, .count = count};
+    memcpy(client_reserve(t, sizeof(h)), &h, sizeof(h));
+}
+
+void client_put_u32(struct client_thread *t, uint32_t v) {
+    bplus_proto_put_u32(client_reserve(t, sizeof(v)), v);
+}
+
+void client_put_key(struct client_thread *t, uint64_t id) {
+    client_key(id, client_reserve(t, CLIENT_KEY_LEN));
+}
+
+// queue a request of the given kind, its keys drawn from seed
+void client_queue(struct client_thread *t, int kind, uint64_t seed) {
+    struct client_config *cfg = t->cfg;
+    uint64_t rng = seed;
+    switch (kind) {
+    case CLIENT_GET:
+        client_header(t, BPLUS_PROTO_GET, CLIENT_KEY_LEN, 0);
+        client_put_key(t, client_rand(&rng) % cfg->num_keys);
+        break;
+    case CLIENT_PUT: {
+        uint64_t id = t->loading ? seed : client_rand(&rng) % cfg->num_keys;
+        client_header(
+            t, BPLUS_PROTO_PUT, 4 + CLIENT_KEY_LEN + cfg->val_len, 0);
+        client_put_u32(t, CLIENT_KEY_LEN);
+        char *key = client_reserve(t, CLIENT_KEY_LEN);
+        client_key(id, key);
+        char *val = client_reserve(t, cfg->val_len);
+        // key may have moved with the buffer
+        key = val - CLIENT_KEY_LEN;
+        for (int i = 0; i < cfg->val_len; i++) {
+            val[i] = client_value_byte(key, CLIENT_KEY_LEN, i);
+        }
+        break;
+    }
+    case CLIENT_MULTIGET:
+        client_header(
+            t, BPLUS_PROTO_MULTIGET,
+            cfg->multiget_keys * (4 + CLIENT_KEY_LEN), cfg->multiget_keys);
+        for (int i = 0; i < cfg->multiget_keys; i++) {
+            client_put_u32(t, CLIENT_KEY_LEN);
+            client_put_key(t, client_rand(&rng) % cfg->num_keys);
+        }
+        break;
+    case CLIENT_SCAN:
+        client_header(t, BPLUS_PROTO_SCAN, 4 + CLIENT_KEY_LEN, cfg->scan_len);
+        client_put_u32(t, CLIENT_KEY_LEN);
+        client_put_key(t, client_rand(&rng) % cfg->num_keys);
+        break;
+    }
+
+    struct client_request *r =
+        &t->ring[(t->ring_head + t->in_flight) % cfg->depth];
+    r->start_ns = client_now();
+    r->seed = seed;
+    r->kind = kind;
+    t->in_flight++;
+}
+
+// check a reply against the request it answers. returns -1 if it's wrong.
+int client_check(
+    struct client_thread *t,
+    struct client_request *r,
+    struct bplus_proto_header *h,
+    char *body) {
+    struct client_config *cfg = t->cfg;
+    if (h->op != client_ops[r->kind] || h->status == BPLUS_PROTO_ERROR) {
+        return -1;
+    }
+    if (h->status == BPLUS_PROTO_NOT_FOUND) {
+        t->missing++;
+        return 0;
+    }
+
+    uint64_t rng = r->seed;
+    char key[CLIENT_KEY_LEN];
+    switch (r->kind) {
+    case CLIENT_GET:
+        client_key(client_rand(&rng) % cfg->num_keys, key);
+        return client_check_value(cfg, key, CLIENT_KEY_LEN, body, h->len);
+    case CLIENT_PUT:
+        return h->len == 0 ? 0 : -1;
+    case CLIENT_MULTIGET: {
+        uint32_t off = 0;
+        if (h->count != cfg->multiget_keys) {
+            return -1;
+        }
+        for (int i = 0; i < h->count; i++) {
+            client_key(client_rand(&rng) % cfg->num_keys, key);
+            if (h->len - off < 4) {
+                return -1;
+            }
+            uint32_t val_len = bplus_proto_get_u32(body + off);
+            off += 4;
+            if (val_len == BPLUS_PROTO_MISSING) {
+                t->missing++;
+                continue;
+            }
+            if (val_len > h->len - off ||
+                client_check_value(
+                    cfg, key, CLIENT_KEY_LEN, body + off, val_len) < 0) {
+                return -1;
+            }
+            off += val_len;
+        }
+        return off == h->len ? 0 : -1;
+    }
+    case CLIENT_SCAN: {
+        // keys in order from the first at or after the one asked for, each
+        // with its own value
+        client_key(client_rand(&rng) % cfg->num_keys, key);
+        char *prev = key;
+        int prev_len = CLIENT_KEY_LEN;
+        int inclusive = 1;
+        uint32_t off = 0;
+        for (int i = 0; i < h->count; i++) {
+            if (h->len - off < 4) {
+                return -1;
+            }
+            uint32_t key_len = bplus_proto_get_u32(body + off);
+            if (key_len > h->len - off - 4 || h->len - off - 4 - key_len < 4) {
+                return -1;
+            }
+            char *k = body + off + 4;
+            off += 4 + key_len;
+            uint32_t val_len = bplus_proto_get_u32(body + off);
+            off += 4;
+            if (val_len > h->len - off ||
+                client_check_value(cfg, k, key_len, body + off, val_len) < 0) {
+                return -1;
+            }
+            off += val_len;
+
+            int n = key_len < (uint32_t)prev_len ? key_len : prev_len;
+            int cmp = memcmp(k, prev, n);
+            cmp = cmp != 0 ? cmp : (int)key_len - prev_len;
+            if (cmp < 0 || (cmp == 0 && !inclusive)) {
+                return -1;
+            }
+            prev = k;
+            prev_len = key_len;
+            inclusive = 0;
+        }
+        return off == h->len && h->count <= cfg->scan_len ? 0 : -1;
+    }
+    }
+    return -1;
+}
+
+// write what the socket takes and read and check whatever replies have
+// arrived, waiting for at least one of the two
+int client_pump(struct client_thread *t) {
+    struct pollfd pfd = {
+        .fd = t->fd,
+        .events = POLLIN | (t->out_off < t->out_len ? POLLOUT : 0),
+    };
+    if (poll(&pfd, 1, -1) < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("poll");
+        return -1;
+    }
+    if (pfd.revents & (POLLERR | POLLNVAL)) {
+        printf("connection failed\n");
+        return -1;
+    }
+
+    if (pfd.revents & POLLOUT) {
+        ssize_t n =
+            write(t->fd, t->out + t->out_off, t->out_len - t->out_off);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            perror("write");
+            return -1;
+        }
+        t->out_off += n > 0 ? n : 0;
+        if (t->out_off == t->out_len) {
+            t->out_off = t->out_len = 0;
+        }
+    }
+
+    if (pfd.revents & (POLLIN | POLLHUP)) {
+        if (t->in_cap - t->in_len < 64 * 1024) {
+            t->in_cap = t->in_cap > 0 ? 2 * t->in_cap : 256 * 1024;
+            t->in = realloc(t->in, t->in_cap);
+        }
+        ssize_t n = read(t->fd, t->in + t->in_len, t->in_cap - t->in_len);
+        if (n == 0) {
+            printf("server hung up\n");
+            return -1;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            perror("read");
+            return -1;
+        }
+        t->in_len += n > 0 ? n : 0;
+
+        uint64_t now = client_now();
+        int off = 0;
+        struct bplus_proto_header h;
+        while (t->in_flight > 0 &&
+               bplus_proto_peek(t->in + off, t->in_len - off, &h)) {
+            struct client_request *r = &t->ring[t->ring_head];
+            if (client_check(t, r, &h, t->in + off + sizeof(h)) < 0) {
+                t->errors++;
+            }
+            bench_hist_add(&t->hists[r->kind], now - r->start_ns);
+            t->ring_head = (t->ring_head + 1) % t->cfg->depth;
+            t->in_flight--;
+            off += sizeof(h) + h.len;
+        }
+        memmove(t->in, t->in + off, t->in_len - off);
+        t->in_len -= off;
+    }
+    return 0;
+}
+
+int client_connect(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return -1;
+    }
+    return fd;
+}
+
+void *client_run(void *arg) {
+    struct client_thread *t = arg;
+    struct client_config *cfg = t->cfg;
+    t->ring = malloc(cfg->depth * sizeof(struct client_request));
+    t->rng = scramble(t->id + 1);
+
+    // this thread's share of the keys, PUT with the same pipelining
+    if (cfg->load) {
+        t->loading = 1;
+        uint64_t lo = cfg->num_keys * t->id / cfg->num_threads;
+        uint64_t hi = cfg->num_keys * (t->id + 1) / cfg->num_threads;
+        for (uint64_t id = lo; id < hi || t->in_flight > 0;) {
+            while (id < hi && t->in_flight < cfg->depth) {
+                client_queue(t, CLIENT_PUT, id++);
+            }
+            if (client_pump(t) < 0) {
+                t->errors++;
+                break;
+            }
+        }
+        memset(t->hists, 0, sizeof(t->hists));
+        t->loading = 0;
+    }
+    pthread_barrier_wait(&client_barrier);
+
+    uint64_t start = client_now();
+    uint64_t end = start + (uint64_t)cfg->secs * 1000000000;
+    int running = t->errors == 0;
+    for (;;) {
+        running = running && client_now() < end;
+        while (running && t->in_flight < cfg->depth) {
+            int pick = client_rand(&t->rng) % 100;
+            int kind = 0;
+            while (pick >= cfg->mix[kind]) {
+                pick -= cfg->mix[kind];
+                kind++;
+            }
+            client_queue(t, kind, client_rand(&t->rng));
+        }
+        if (t->in_flight == 0) {
+            break;
+        }
+        if (client_pump(t) < 0) {
+            t->errors++;
+            break;
+        }
+    }
+    t->run_ns = client_now() - start;
+
+    close(t->fd);
+    free(t->ring);
+    free(t->out);
+    free(t->in);
+    return NULL;
+}
+
+void client_usage(const char *prog) {
+    printf(
+        "usage: %s [-s socket] [-t threads] [-q depth] [-n keys] "
+        "[-v value bytes]\n"
+        "       [-T seconds] [-m get,put,multiget,scan percent] "
+        "[-k multiget keys]\n"
+        "       [-l scan length] [-L]\n"
+        "-L skips loading the keys, for a server that has them already\n",
+        prog);
+}
+
+int client_parse(int argc, char **argv, struct client_config *cfg) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:q:n:v:T:m:k:l:Lh")) != -1) {
+        switch (opt) {
+        case 's':
+            cfg->socket_path = optarg;
+            break;
+        case 't':
+            cfg->num_threads = atoi(optarg);
+            break;
+        case 'q':
+            cfg->depth = atoi(optarg);
+            break;
+        case 'n':
+            cfg->num_keys = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            cfg->val_len = atoi(optarg);
+            break;
+        case 'T':
+            cfg->secs = atoi(optarg);
+            break;
+        case 'm':
+            if (sscanf(
+                    optarg, "%d,%d,%d,%d", &cfg->mix[0], &cfg->mix[1],
+                    &cfg->mix[2], &cfg->mix[3]) != CLIENT_NUM_OPS ||
+                cfg->mix[0] + cfg->mix[1] + cfg->mix[2] + cfg->mix[3] != 100) {
+                printf("the mix is four percentages adding up to 100\n");
+                return -1;
+            }
+            break;
+        case 'k':
+            cfg->multiget_keys = atoi(optarg);
+            break;
+        case 'l':
+            cfg->scan_len = atoi(optarg);
+            break;
+        case 'L':
+            cfg->load = 0;
+            break;
+        default:
+            return -1;
+        }
+    }
+    for (int i = 0; i < CLIENT_NUM_OPS; i++) {
+        if (cfg->mix[i] < 0) {
+            return -1;
+        }
+    }
+    if (cfg->num_keys == 0 || cfg->num_threads < 1 || cfg->depth < 1 ||
+        cfg->val_len < 0 || cfg->secs < 1 || cfg->multiget_keys < 1 ||
+        cfg->multiget_keys > BPLUS_PROTO_MAX_KEYS || cfg->scan_len < 1 ||
+        cfg->scan_len > UINT16_MAX) {
+        printf("threads, depth, keys, seconds, multiget keys and scan length "
+               "must be positive\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct client_config cfg = {
+        .socket_path = "/tmp/bplus.sock",
+        .num_keys = 100000,
+        .num_threads = 4,
+        .depth = 16,
+        .val_len = 100,
+        .secs = 5,
+        .mix = {70, 20, 5, 5},
+        .multiget_keys = 16,
+        .scan_len = 50,
+        .load = 1,
+    };
+    if (client_parse(argc, argv, &cfg) < 0) {
+        client_usage(argv[0]);
+        return 2;
+    }
+
+    struct client_thread *threads =
+        calloc(cfg.num_threads, sizeof(struct client_thread));
+    pthread_t tids[cfg.num_threads];
+    pthread_barrier_init(&client_barrier, NULL, cfg.num_threads);
+    for (int i = 0; i < cfg.num_threads; i++) {
+        threads[i].cfg = &cfg;
+        threads[i].id = i;
+        threads[i].fd = client_connect(cfg.socket_path);
+        if (threads[i].fd < 0) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < cfg.num_threads; i++) {
+        pthread_create(&tids[i], NULL, client_run, &threads[i]);
+    }
+
+    struct bench_hist hists[CLIENT_NUM_OPS] = {0};
+    struct bench_hist all = {0};
+    uint64_t missing = 0, errors = 0, run_ns = 0;
+    for (int i = 0; i < cfg.num_threads; i++) {
+        pthread_join(tids[i], NULL);
+        for (int op = 0; op < CLIENT_NUM_OPS; op++) {
+            bench_hist_merge(&hists[op], &threads[i].hists[op]);
+            bench_hist_merge(&all, &threads[i].hists[op]);
+        }
+        missing += threads[i].missing;
+        errors += threads[i].errors;
+        if (threads[i].run_ns > run_ns) {
+            run_ns = threads[i].run_ns;
+        }
+    }
+    double secs = run_ns / 1e9;
+
+    printf(
+        "%d threads, depth %d, %llu keys, %d byte values\n", cfg.num_threads,
+        cfg.depth, (unsigned long long)cfg.num_keys, cfg.val_len);
+    printf(
+        "%-9s %10s %10s %9s %9s %9s %9s (us)\n", "op", "count", "ops/s",
+        "p50", "p99", "p999", "max");
+    for (int op = 0; op <= CLIENT_NUM_OPS; op++) {
+        struct bench_hist *h = op < CLIENT_NUM_OPS ? &hists[op] : &all;
+        if (h->total == 0) {
+            continue;
+        }
+        printf(
+            "%-9s %10llu %10.0f %9.1f %9.1f %9.1f %9.1f\n",
+            op < CLIENT_NUM_OPS ? client_op_names[op] : "all",
+            (unsigned long long)h->total, h->total / secs,
+            bench_hist_percentile(h, 0.5) / 1e3,
+            bench_hist_percentile(h, 0.99) / 1e3,
+            bench_hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+    }
+    printf(
+        "%llu keys missing, %llu bad replies\n", (unsigned long long)missing,
+        (unsigned long long)errors);
+    free(threads);
+    return errors > 0 ? 1 : 0;
+}
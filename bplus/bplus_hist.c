@@ -0,0 +1,69 @@
+#include <math.h>
+#include <stdint.h>
+
+// log-linear latency histogram in nanoseconds. values below 64 get a bucket
+// each, above that every power of two is split in 32, so a percentile is
+// off by at most 3%.
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_LINEAR (2 * HIST_SUB)
+#define HIST_BUCKETS (HIST_LINEAR + (64 - HIST_SUB_BITS - 1) * HIST_SUB)
+
+struct bench_hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+};
+
+int bench_hist_bucket(uint64_t v) {
+    if (v < HIST_LINEAR) {
+        return v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    int sub = (v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return HIST_LINEAR + (e - HIST_SUB_BITS - 1) * HIST_SUB + sub;
+}
+
+// the largest value that lands in bucket b
+uint64_t bench_hist_value(int b) {
+    if (b < HIST_LINEAR) {
+        return b;
+    }
+    int e = (b - HIST_LINEAR) / HIST_SUB + HIST_SUB_BITS + 1;
+    uint64_t sub = (b - HIST_LINEAR) % HIST_SUB;
+    return ((HIST_SUB + sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+void bench_hist_add(struct bench_hist *h, uint64_t v) {
+    h->counts[bench_hist_bucket(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+void bench_hist_merge(struct bench_hist *dst, struct bench_hist *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t bench_hist_percentile(struct bench_hist *h, double p) {
+    uint64_t rank = ceil(p * h->total);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank && seen > 0) {
+            uint64_t v = bench_hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,120 @@
+#include "bplus.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// compares the page I/O backends on dirty page writeback and cold page reads
+
+#define READ_BATCH 64
+
+uint64_t scramble(uint64_t x) {
+    x ^= x >> 31;
+    x *= 0x7fb5d329728ea185ULL;
+    x ^= x >> 27;
+    x *= 0x81dadef4bc2dd44dULL;
+    x ^= x >> 33;
+    return x;
+}
+
+double elapsed(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+           (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void report(const char *backend, const char *workload, int pages, double secs) {
+    double mb = (double)pages * BPLUS_PAGE_SIZE / (1024 * 1024);
+    printf(
+        "%-9s %-10s %8d pages %9.3f ms %9.1f MB/s %10.0f pages/s\n", backend,
+        workload, pages, secs * 1000, mb / secs, pages / secs);
+}
+
+int bench_backend(const struct bplus_io_ops *io, int io_flags, int num_keys) {
+    char *filename = "/tmp/bplus_io_bench";
+    remove(filename);
+
+    // a pool big enough to hold the whole tree so the flush sees every page
+    // dirty and nothing is written back early by eviction
+    struct bplus_tree_options opts = {
+        .num_frames = num_keys / 16 + BPLUS_MIN_FRAMES,
+        .io = io,
+        .io_flags = io_flags,
+    };
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+    if (tree == NULL) {
+        return 1;
+    }
+    const char *name = tree->pool->io->name;
+
+    char key[32];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)scramble(i));
+        bplus_tree_insert(tree, key, key);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (bplus_tree_flush(tree) < 0) {
+        printf("%s: flush failed\n", name);
+        return 1;
+    }
+    fdatasync(tree->pool->fd);
+    report(name, "flush", tree->pool->stats.writes, elapsed(&start));
+
+    uint32_t num_pages = tree->pool->next_page_id;
+    bplus_tree_destroy(tree);
+
+    // drop the file from the page cache so reads have to hit the device
+    int fd = open(filename, O_RDONLY);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+
+    tree = bplus_tree_create_opts(filename, &opts);
+
+    // every page in a random order, READ_BATCH pages per request
+    uint32_t *page_ids = malloc(num_pages * sizeof(uint32_t));
+    for (uint32_t i = 0; i < num_pages; i++) {
+        page_ids[i] = i;
+    }
+    for (uint32_t i = num_pages - 1; i > 0; i--) {
+        uint32_t j = scramble(i) % (i + 1);
+        uint32_t tmp = page_ids[i];
+        page_ids[i] = page_ids[j];
+        page_ids[j] = tmp;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int loaded = 0;
+    for (uint32_t i = 0; i < num_pages; i += READ_BATCH) {
+        int n = num_pages - i < READ_BATCH ? num_pages - i : READ_BATCH;
+        int ret = bplus_buffer_pool_load_many(tree->pool, &page_ids[i], n);
+        if (ret < 0) {
+            printf("%s: cold read failed\n", name);
+            return 1;
+        }
+        loaded += ret;
+    }
+    report(name, "cold-read", loaded, elapsed(&start));
+
+    free(page_ids);
+    bplus_tree_destroy(tree);
+    remove(filename);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int num_keys = 1000000;
+    if (argc > 1) {
+        num_keys = atoi(argv[1]);
+    }
+
+    int ret = bench_backend(&bplus_io_pread, 0, num_keys);
+#ifdef BPLUS_HAVE_URING
+    ret |= bench_backend(&bplus_io_uring, 0, num_keys);
+    ret |= bench_backend(
+        &bplus_io_uring, BPLUS_IO_REGISTER_BUFFERS | BPLUS_IO_FIXED_FILE,
+        num_keys);
+#endif
+    return ret;
+}
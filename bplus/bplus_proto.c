@@ -0,0 +1,61 @@
+#include <stdint.h>
+#include <string.h>
+
+// wire format shared by bplus_server and bplus_client. every message is an
+// 8 byte header and len bytes of body, integers in host byte order as the
+// transport is a local socket. a client may send any number of requests
+// without waiting for replies, which come back in request order.
+//
+//   GET       body: key
+//             reply: the value, or status BPLUS_PROTO_NOT_FOUND
+//   PUT       body: u32 key_len, key, value
+//             reply: empty
+//   MULTIGET  count keys, body: count * (u32 key_len, key)
+//             reply: count * (u32 val_len, value), with val_len
+//             BPLUS_PROTO_MISSING and no value for keys not found
+//   SCAN      count is the most entries wanted,
+//             body: u32 lo_len, lo, hi. empty lo or hi leave it unbounded.
+//             reply: count entries of (u32 key_len, key, u32 val_len,
+//             value) for keys in [lo, hi), in key order
+//
+// a reply echoes its request's op. a request that fails gets status
+// BPLUS_PROTO_ERROR and a message for a body. the server hangs up on
+// malformed headers.
+
+#define BPLUS_PROTO_GET 1
+#define BPLUS_PROTO_PUT 2
+#define BPLUS_PROTO_MULTIGET 3
+#define BPLUS_PROTO_SCAN 4
+
+#define BPLUS_PROTO_OK 0
+#define BPLUS_PROTO_NOT_FOUND 1
+#define BPLUS_PROTO_ERROR 2
+
+#define BPLUS_PROTO_MISSING UINT32_MAX
+#define BPLUS_PROTO_MAX_BODY (64 << 20)
+#define BPLUS_PROTO_MAX_KEYS 1024 // per MULTIGET
+
+struct bplus_proto_header {
+    uint32_t len;   // body bytes after the header
+    uint8_t op;     // BPLUS_PROTO_GET and co
+    uint8_t status; // in replies, 0 in requests
+    uint16_t count;
+};
+
+uint32_t bplus_proto_get_u32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+void bplus_proto_put_u32(char *p, uint32_t v) { memcpy(p, &v, sizeof(v)); }
+
+// copy out the header at the front of buf. returns 1 if the whole message
+// is there, 0 if more bytes are needed.
+int bplus_proto_peek(const char *buf, int len, struct bplus_proto_header *h) {
+    if (len < (int)sizeof(*h)) {
+        return 0;
+    }
+    memcpy(h, buf, sizeof(*h));
+    return len - (int)sizeof(*h) >= (int64_t)h->len;
+}
@@ -0,0 +1,829 @@
+#include "bplus.c"
+#include "../poll/evloop.c"
+#include "bplus_proto.c"
+#include <getopt.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// serves a tree over a unix socket with the protocol in bplus_proto.c, from
+// a single event loop thread. a readable connection has every whole request
+// it sent executed in order, and the replies to all of them go out together
+// in one writev.
+//
+// with -w the tree is opened read-only with its buffer pool in shared
+// memory, and that many pre-forked worker processes serve the socket, each
+// with an event loop of its own but all reading through the one cache. the
+// parent only supervises: a worker that crashes is reaped and replaced, and
+// finds the pages its predecessor loaded still cached.
+
+// replies are built in a list of chunks that never move, so a reply header
+// can be filled in once the body streamed in behind it is done, and the
+// list maps straight onto an iovec array
+#define SERVER_CHUNK_SIZE (64 * 1024)
+#define SERVER_IOV 64
+// stop executing a connection's requests while this much output is unsent
+#define SERVER_MAX_PENDING (4 << 20)
+#define SERVER_READ_SIZE (64 * 1024)
+
+struct server_chunk {
+    struct server_chunk *next;
+    int len;
+    int cap;
+    char data[];
+};
+
+struct server_conn {
+    int fd;
+    char *in; // received bytes not yet executed
+    int in_len;
+    int in_cap;
+    int eof;
+
+    struct server_chunk *out_head;
+    struct server_chunk *out_tail;
+    int out_off; // bytes of out_head already sent
+    size_t out_pending;
+    int want_write; // subscribed to write readiness
+};
+
+// values found by a MULTIGET, copied out in key order and sent in request
+// order
+struct server_multiget {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t offs[BPLUS_PROTO_MAX_KEYS];
+    int lens[BPLUS_PROTO_MAX_KEYS]; // -1 for missing keys
+};
+
+struct server {
+    const char *path;
+    const char *socket_path;
+    struct bplus_tree *tree;
+    struct evloop *loop;
+    int listen_fd;
+    struct server_conn **conns; // by fd
+    int conns_cap;
+    int num_conns;
+
+    struct server_multiget multiget;
+    char *keys[BPLUS_PROTO_MAX_KEYS];
+    int key_lens[BPLUS_PROTO_MAX_KEYS];
+
+    uint64_t requests;
+    uint64_t writevs;
+};
+
+struct evloop *server_loop;
+
+// in the supervisor, the pids of the workers by slot, 0 for none. in a
+// worker, its slot.
+pid_t *server_workers;
+int server_num_workers;
+int server_worker = -1;
+volatile sig_atomic_t server_stopping;
+
+// stop the loop, or have the supervisor pass the signal on
+void server_handle_signal(int s) {
+    server_stopping = 1;
+    if (server_loop != NULL) {
+        evloop_stop(server_loop);
+    }
+    for (int i = 0; i < server_num_workers; i++) {
+        if (server_workers[i] > 0) {
+            kill(server_workers[i], SIGTERM);
+        }
+    }
+}
+
+// room for n more bytes of output. chunks are never grown, anything larger
+// than a chunk gets one of its own.
+char *server_reserve(struct server_conn *c, int n) {
+    struct server_chunk *tail = c->out_tail;
+    if (tail == NULL || tail->cap - tail->len < n) {
+        int cap = n > SERVER_CHUNK_SIZE ? n : SERVER_CHUNK_SIZE;
+        struct server_chunk *chunk = malloc(sizeof(*chunk) + cap);
+        chunk->next = NULL;
+        chunk->len = 0;
+        chunk->cap = cap;
+        if (tail != NULL) {
+            tail->next = chunk;
+        } else {
+            c->out_head = chunk;
+        }
+        c->out_tail = tail = chunk;
+    }
+    char *p = tail->data + tail->len;
+    tail->len += n;
+    c->out_pending += n;
+    return p;
+}
+
+// append n bytes, topping up the current chunk before starting another
+void server_append(struct server_conn *c, const char *data, int n) {
+    struct server_chunk *tail = c->out_tail;
+    if (tail != NULL && tail->cap > tail->len) {
+        int room = tail->cap - tail->len;
+        int m = n < room ? n : room;
+        memcpy(server_reserve(c, m), data, m);
+        data += m;
+        n -= m;
+    }
+    if (n > 0) {
+        memcpy(server_reserve(c, n), data, n);
+    }
+}
+
+void server_append_u32(struct server_conn *c, uint32_t v) {
+    bplus_proto_put_u32(server_reserve(c, sizeof(uint32_t)), v);
+}
+
+int server_sink(void *ctx, const char *data, int len) {
+    server_append(ctx, data, len);
+    return 0;
+}
+
+// drop everything appended after len bytes of chunk
+void server_truncate(
+    struct server_conn *c, struct server_chunk *chunk, int len) {
+    struct server_chunk *next = chunk->next;
+    c->out_pending -= chunk->len - len;
+    chunk->len = len;
+    chunk->next = NULL;
+    c->out_tail = chunk;
+    while (next != NULL) {
+        struct server_chunk *after = next->next;
+        c->out_pending -= next->len;
+        free(next);
+        next = after;
+    }
+}
+
+// a reply is begun by reserving its header and ended by filling in how
+// much body was appended since. nothing is sent in between.
+struct server_reply {
+    char *header;
+    struct server_chunk *chunk; // holding the header
+    int chunk_len; // of chunk, up to the end of the header
+    size_t mark;
+    struct bplus_proto_header h;
+};
+
+void server_reply_begin(
+    struct server_conn *c, struct server_reply *r, int op) {
+    r->header = server_reserve(c, sizeof(struct bplus_proto_header));
+    r->chunk = c->out_tail;
+    r->chunk_len = c->out_tail->len;
+    r->mark = c->out_pending;
+    memset(&r->h, 0, sizeof(r->h));
+    r->h.op = op;
+}
+
+void server_reply_end(struct server_conn *c, struct server_reply *r) {
+    r->h.len = c->out_pending - r->mark;
+    memcpy(r->header, &r->h, sizeof(r->h));
+}
+
+// replace whatever body a reply has so far with an error message
+void server_reply_fail(
+    struct server_conn *c, struct server_reply *r, const char *msg) {
+    server_truncate(c, r->chunk, r->chunk_len);
+    r->h.status = BPLUS_PROTO_ERROR;
+    r->h.count = 0;
+    server_append(c, msg, strlen(msg));
+}
+
+void server_get(
+    struct server *s, struct server_conn *c, char *body, uint32_t len) {
+    struct server_reply r;
+    server_reply_begin(c, &r, BPLUS_PROTO_GET);
+    int ret = bplus_tree_stream(s->tree, body, len, server_sink, c);
+    if (ret < 0) {
+        server_reply_fail(c, &r, "lookup failed");
+    } else if (ret == 1) {
+        r.h.status = BPLUS_PROTO_NOT_FOUND;
+    }
+    server_reply_end(c, &r);
+}
+
+void server_put(
+    struct server *s, struct server_conn *c, char *body, uint32_t len) {
+    struct server_reply r;
+    server_reply_begin(c, &r, BPLUS_PROTO_PUT);
+    uint32_t key_len = len >= 4 ? bplus_proto_get_u32(body) : 0;
+    if (len < 4 || key_len > len - 4) {
+        server_reply_fail(c, &r, "malformed put");
+    } else if (
+        bplus_tree_put(
+            s->tree, body + 4, key_len, body + 4 + key_len,
+            len - 4 - key_len) < 0) {
+        server_reply_fail(c, &r, "put failed");
+    }
+    server_reply_end(c, &r);
+}
+
+int server_multiget_sink(void *ctx, const char *data, int len) {
+    struct server_multiget *mg = ctx;
+    if (mg->len + len > mg->cap) {
+        while (mg->len + len > mg->cap) {
+            mg->cap = mg->cap > 0 ? 2 * mg->cap : SERVER_CHUNK_SIZE;
+        }
+        mg->buf = realloc(mg->buf, mg->cap);
+    }
+    memcpy(mg->buf + mg->len, data, len);
+    mg->len += len;
+    return 0;
+}
+
+int server_multiget_visit(
+    struct bplus_tree *tree,
+    struct bplus_node *leaf,
+    struct bplus_batch_entry *batch,
+    int lo,
+    int hi,
+    void *ctx) {
+    struct server_multiget *mg = ctx;
+    for (int i = lo; i < hi; i++) {
+        int index = batch[i].index;
+        struct bplus_insert_index pos = bplus_node_find_insert_index(
+            tree->pool->keys, leaf, batch[i].key_len, batch[i].key);
+        mg->lens[index] = -1;
+        if (!pos.found) {
+            continue;
+        }
+        mg->offs[index] = mg->len;
+        if (bplus_node_stream_value(
+                tree->pool, leaf, pos.pos, server_multiget_sink, mg) < 0) {
+            return -1;
+        }
+        mg->lens[index] = mg->len - mg->offs[index];
+    }
+    return 0;
+}
+
+// all the keys are looked up with one walk down the tree, as in
+// bplus_tree_multi_get
+void server_multiget(
+    struct server *s,
+    struct server_conn *c,
+    char *body,
+    uint32_t len,
+    int n) {
+    struct server_reply r;
+    server_reply_begin(c, &r, BPLUS_PROTO_MULTIGET);
+    if (n > BPLUS_PROTO_MAX_KEYS) {
+        server_reply_fail(c, &r, "too many keys");
+        server_reply_end(c, &r);
+        return;
+    }
+
+    uint32_t off = 0;
+    for (int i = 0; i < n; i++) {
+        if (len - off < 4 || bplus_proto_get_u32(body + off) > len - off - 4) {
+            server_reply_fail(c, &r, "malformed multiget");
+            server_reply_end(c, &r);
+            return;
+        }
+        s->key_lens[i] = bplus_proto_get_u32(body + off);
+        s->keys[i] = body + off + 4;
+        off += 4 + s->key_lens[i];
+    }
+
+    struct server_multiget *mg = &s->multiget;
+    mg->len = 0;
+    int ret = 0;
+    if (n > 0) {
+        struct bplus_batch_entry *batch =
+            bplus_batch_sort(s->tree->pool->keys, s->keys, s->key_lens, n);
+        ret = bplus_tree_batch(
+            s->tree, batch, n, BPLUS_LATCH_READ, server_multiget_visit, mg);
+        free(batch);
+    }
+    if (ret < 0) {
+        server_reply_fail(c, &r, "lookup failed");
+        server_reply_end(c, &r);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (mg->lens[i] < 0) {
+            server_append_u32(c, BPLUS_PROTO_MISSING);
+            continue;
+        }
+        server_append_u32(c, mg->lens[i]);
+        server_append(c, mg->buf + mg->offs[i], mg->lens[i]);
+    }
+    r.h.count = n;
+    server_reply_end(c, &r);
+}
+
+void server_scan(
+    struct server *s,
+    struct server_conn *c,
+    char *body,
+    uint32_t len,
+    int limit) {
+    struct server_reply r;
+    server_reply_begin(c, &r, BPLUS_PROTO_SCAN);
+    uint32_t lo_len = len >= 4 ? bplus_proto_get_u32(body) : 0;
+    if (len < 4 || lo_len > len - 4) {
+        server_reply_fail(c, &r, "malformed scan");
+        server_reply_end(c, &r);
+        return;
+    }
+    char *lo = body + 4;
+    char *hi = lo + lo_len;
+    int hi_len = len - 4 - lo_len;
+
+    struct bplus_cursor cursor;
+    bplus_cursor_init(&cursor, s->tree);
+    bplus_cursor_set_bounds(
+        &cursor, lo_len > 0 ? lo : NULL, lo_len, hi_len > 0 ? hi : NULL,
+        hi_len);
+    int n = 0;
+    int ret = limit > 0 ? bplus_cursor_first(&cursor) : 0;
+    while (ret == 1) {
+        int key_len, val_len;
+        char *key = bplus_cursor_key(&cursor, &key_len);
+        char *val = bplus_cursor_value(&cursor, &val_len);
+        server_append_u32(c, key_len);
+        server_append(c, key, key_len);
+        server_append_u32(c, val_len);
+        if (val != NULL) {
+            server_append(c, val, val_len);
+        } else if (bplus_cursor_stream_value(&cursor, server_sink, c) < 0) {
+            ret = -1;
+            break;
+        }
+        if (++n == limit) {
+            break;
+        }
+        ret = bplus_cursor_next(&cursor);
+    }
+    bplus_cursor_close(&cursor);
+    if (ret < 0) {
+        server_reply_fail(c, &r, "scan failed");
+    } else {
+        r.h.count = n;
+    }
+    server_reply_end(c, &r);
+}
+
+void server_execute(
+    struct server *s,
+    struct server_conn *c,
+    struct bplus_proto_header *h,
+    char *body) {
+    switch (h->op) {
+    case BPLUS_PROTO_GET:
+        server_get(s, c, body, h->len);
+        break;
+    case BPLUS_PROTO_PUT:
+        server_put(s, c, body, h->len);
+        break;
+    case BPLUS_PROTO_MULTIGET:
+        server_multiget(s, c, body, h->len, h->count);
+        break;
+    case BPLUS_PROTO_SCAN:
+        server_scan(s, c, body, h->len, h->count);
+        break;
+    default: {
+        struct server_reply r;
+        server_reply_begin(c, &r, h->op);
+        server_reply_fail(c, &r, "unknown op");
+        server_reply_end(c, &r);
+    }
+    }
+    s->requests++;
+}
+
+// execute the whole requests buffered, until too much output is queued.
+// returns -1 if the peer sent something that isn't a request.
+int server_process(struct server *s, struct server_conn *c) {
+    int off = 0;
+    while (c->out_pending < SERVER_MAX_PENDING) {
+        struct bplus_proto_header h;
+        int avail = c->in_len - off;
+        int whole = bplus_proto_peek(c->in + off, avail, &h);
+        if (avail >= (int)sizeof(h) &&
+            (h.len > BPLUS_PROTO_MAX_BODY || h.status != 0)) {
+            printf("bad request header on fd %d\n", c->fd);
+            return -1;
+        }
+        if (!whole) {
+            break;
+        }
+        server_execute(s, c, &h, c->in + off + sizeof(h));
+        off += sizeof(h) + h.len;
+    }
+    if (off > 0) {
+        memmove(c->in, c->in + off, c->in_len - off);
+        c->in_len -= off;
+    }
+    return 0;
+}
+
+// send as much queued output as the socket takes, a batch of chunks per
+// writev, and subscribe to write readiness while any is left
+int server_flush(struct server *s, struct server_conn *c) {
+    while (c->out_head != NULL) {
+        struct iovec iov[SERVER_IOV];
+        int n = 0;
+        for (struct server_chunk *chunk = c->out_head;
+             chunk != NULL && n < SERVER_IOV; chunk = chunk->next) {
+            int skip = n == 0 ? c->out_off : 0;
+            iov[n].iov_base = chunk->data + skip;
+            iov[n].iov_len = chunk->len - skip;
+            n++;
+        }
+        ssize_t sent = writev(c->fd, iov, n);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        s->writevs++;
+        c->out_pending -= sent;
+        while (sent > 0) {
+            struct server_chunk *head = c->out_head;
+            int left = head->len - c->out_off;
+            if (sent < left) {
+                c->out_off += sent;
+                break;
+            }
+            sent -= left;
+            c->out_off = 0;
+            c->out_head = head->next;
+            if (c->out_head == NULL) {
+                c->out_tail = NULL;
+            }
+            free(head);
+        }
+    }
+
+    int want = c->out_head != NULL;
+    if (want != c->want_write) {
+        c->want_write = want;
+        evloop_mod(s->loop, c->fd, EVLOOP_READ | (want ? EVLOOP_WRITE : 0));
+    }
+    return 0;
+}
+
+void server_close(struct server *s, struct server_conn *c) {
+    evloop_del(s->loop, c->fd);
+    close(c->fd);
+    s->conns[c->fd] = NULL;
+    s->num_conns--;
+    while (c->out_head != NULL) {
+        struct server_chunk *next = c->out_head->next;
+        free(c->out_head);
+        c->out_head = next;
+    }
+    free(c->in);
+    free(c);
+}
+
+// alternate reading and executing until the socket runs dry or output
+// backs up, then send the replies. the loop is edge triggered, so reading
+// stops short of EAGAIN only while output is backed up, and the write
+// callback picks it up again. returns -1 when the connection is done.
+int server_pump(struct server *s, struct server_conn *c) {
+    for (;;) {
+        if (server_process(s, c) < 0) {
+            return -1;
+        }
+        if (c->out_pending >= SERVER_MAX_PENDING) {
+            if (server_flush(s, c) < 0) {
+                return -1;
+            }
+            if (c->out_pending >= SERVER_MAX_PENDING) {
+                return 0;
+            }
+            continue;
+        }
+        if (c->eof) {
+            break;
+        }
+
+        if (c->in_cap - c->in_len < SERVER_READ_SIZE) {
+            c->in_cap = c->in_cap > 0 ? 2 * c->in_cap : 2 * SERVER_READ_SIZE;
+            c->in = realloc(c->in, c->in_cap);
+        }
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if (n > 0) {
+            c->in_len += n;
+        } else if (n == 0) {
+            c->eof = 1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    if (server_flush(s, c) < 0) {
+        return -1;
+    }
+    return c->eof && c->out_head == NULL ? -1 : 0;
+}
+
+void server_on_conn(struct evloop *loop, int fd, int events, void *arg) {
+    struct server *s = arg;
+    struct server_conn *c = s->conns[fd];
+    if ((events & EVLOOP_WRITE) && server_flush(s, c) < 0) {
+        server_close(s, c);
+        return;
+    }
+    if (c->out_pending < SERVER_MAX_PENDING && server_pump(s, c) < 0) {
+        server_close(s, c);
+    }
+}
+
+void server_on_accept(struct evloop *loop, int fd, int events, void *arg) {
+    struct server *s = arg;
+    for (;;) {
+        int cfd = accept(fd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+        fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+
+        if (cfd >= s->conns_cap) {
+            int cap = s->conns_cap > 0 ? s->conns_cap : 64;
+            while (cap <= cfd) {
+                cap *= 2;
+            }
+            s->conns = realloc(s->conns, cap * sizeof(struct server_conn *));
+            memset(
+                &s->conns[s->conns_cap], 0,
+                (cap - s->conns_cap) * sizeof(struct server_conn *));
+            s->conns_cap = cap;
+        }
+        struct server_conn *c = calloc(1, sizeof(struct server_conn));
+        c->fd = cfd;
+        s->conns[cfd] = c;
+        s->num_conns++;
+        evloop_add(loop, cfd, EVLOOP_READ, server_on_conn, s);
+
+        // a worker takes one connection per wakeup, so the other workers
+        // woken by a burst of connects get their share. adding the socket
+        // again reports it once more if connects are still waiting.
+        if (server_worker >= 0) {
+            evloop_del(loop, fd);
+            evloop_add(loop, fd, EVLOOP_READ, server_on_accept, s);
+            return;
+        }
+    }
+}
+
+int server_listen(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// run an event loop on the listening socket until stopped
+int server_serve(struct server *s, const struct evloop_backend *backend) {
+    s->loop = server_loop = evloop_create(backend);
+    evloop_add(s->loop, s->listen_fd, EVLOOP_READ, server_on_accept, s);
+    if (server_worker >= 0) {
+        printf(
+            "worker %d: pid %d (%s)\n", server_worker, getpid(),
+            s->loop->backend->name);
+    } else {
+        printf(
+            "serving %s on %s (%s)\n", s->path, s->socket_path,
+            s->loop->backend->name);
+    }
+    fflush(stdout);
+    int ret = evloop_run(s->loop);
+
+    for (int fd = 0; fd < s->conns_cap; fd++) {
+        if (s->conns[fd] != NULL) {
+            server_close(s, s->conns[fd]);
+        }
+    }
+    evloop_del(s->loop, s->listen_fd);
+    if (server_worker >= 0) {
+        printf("worker %d: ", server_worker);
+    }
+    printf(
+        "served %llu requests with %llu writevs\n",
+        (unsigned long long)s->requests, (unsigned long long)s->writevs);
+    evloop_destroy(s->loop);
+    server_loop = NULL;
+    free(s->conns);
+    free(s->multiget.buf);
+    return ret;
+}
+
+// fork a worker into slot. it inherits the listening socket and the shared
+// buffer pool, and builds its own event loop.
+pid_t server_spawn(
+    struct server *s, const struct evloop_backend *backend, int slot) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 0;
+    }
+    if (pid == 0) {
+        server_num_workers = 0;
+        server_worker = slot;
+        int ret = server_serve(s, backend);
+        bplus_tree_destroy(s->tree);
+        exit(ret < 0 ? 1 : 0);
+    }
+    return pid;
+}
+
+// keep num_workers workers running until told to stop. one that exits
+// cleanly was stopped and is left be, any other is replaced. a worker that
+// dies within a second of starting is replaced a second later, so one that
+// crashes on startup doesn't spin.
+int server_supervise(
+    struct server *s, const struct evloop_backend *backend, int num_workers) {
+    uint64_t *started = calloc(num_workers, sizeof(uint64_t));
+    server_workers = calloc(num_workers, sizeof(pid_t));
+    int running = 0;
+    for (int i = 0; i < num_workers; i++) {
+        started[i] = evloop_now_ns();
+        server_workers[i] = server_spawn(s, backend, i);
+        running += server_workers[i] > 0;
+    }
+    server_num_workers = num_workers;
+
+    int ret = 0;
+    while (running > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("waitpid");
+            ret = -1;
+            break;
+        }
+        int slot = 0;
+        while (slot < num_workers && server_workers[slot] != pid) {
+            slot++;
+        }
+        if (slot == num_workers) {
+            continue;
+        }
+        server_workers[slot] = 0;
+        running--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            continue;
+        }
+
+        if (WIFSIGNALED(status)) {
+            printf(
+                "worker %d (pid %d) killed by signal %d\n", slot, pid,
+                WTERMSIG(status));
+        } else {
+            printf(
+                "worker %d (pid %d) exited with status %d\n", slot, pid,
+                WEXITSTATUS(status));
+        }
+        if (evloop_now_ns() - started[slot] < 1000000000 && !server_stopping) {
+            sleep(1);
+        }
+        if (server_stopping) {
+            continue;
+        }
+        started[slot] = evloop_now_ns();
+        server_workers[slot] = server_spawn(s, backend, slot);
+        running += server_workers[slot] > 0;
+    }
+
+    struct bplus_buffer_pool_stats *stats = &s->tree->pool->stats;
+    printf(
+        "workers shared %llu hits and %llu misses, %llu recoveries\n",
+        (unsigned long long)stats->hits, (unsigned long long)stats->misses,
+        (unsigned long long)stats->recoveries);
+    server_num_workers = 0;
+    free(server_workers);
+    free(started);
+    return ret;
+}
+
+void server_usage(const char *prog) {
+    printf(
+        "usage: %s [-s socket] [-f frames] [-W off|commit|interval|none] "
+        "[-b poll|epoll|io_uring] [-w workers] [path]\n",
+        prog);
+}
+
+int main(int argc, char **argv) {
+    const char *wal_modes[] = {"off", "commit", "interval", "none"};
+    const char *socket_path = "/tmp/bplus.sock";
+    const struct evloop_backend *backend = NULL;
+    struct bplus_tree_options opts = {.wal_mode = BPLUS_WAL_OFF};
+    int num_workers = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:f:W:b:w:h")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'f':
+            opts.num_frames = atoi(optarg);
+            break;
+        case 'W':
+            opts.wal_mode = -1;
+            for (int i = 0; i < 4; i++) {
+                if (strcmp(optarg, wal_modes[i]) == 0) {
+                    opts.wal_mode = i;
+                }
+            }
+            if (opts.wal_mode < 0) {
+                printf("unknown log mode %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'b':
+            backend = evloop_backend_find(optarg);
+            if (backend == NULL) {
+                printf("unknown backend %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            break;
+        default:
+            server_usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    const char *path = optind < argc ? argv[optind] : "/tmp/bplus_server";
+    if (num_workers > 0 && opts.wal_mode != BPLUS_WAL_OFF) {
+        printf("workers serve a read-only tree, without a log\n");
+        return 2;
+    }
+    opts.shared = num_workers > 0;
+
+    struct server s = {.path = path, .socket_path = socket_path};
+    s.tree = bplus_tree_create_opts(path, &opts);
+    if (s.tree == NULL) {
+        return 1;
+    }
+    s.listen_fd = server_listen(socket_path);
+    if (s.listen_fd < 0) {
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, server_handle_signal);
+    signal(SIGTERM, server_handle_signal);
+    int ret;
+    if (num_workers > 0) {
+        printf(
+            "serving %s on %s from %d workers\n", path, socket_path,
+            num_workers);
+        ret = server_supervise(&s, backend, num_workers);
+    } else {
+        ret = server_serve(&s, backend);
+    }
+    close(s.listen_fd);
+    unlink(socket_path);
+
+    if (bplus_tree_flush(s.tree) < 0) {
+        ret = -1;
+    }
+    bplus_tree_destroy(s.tree);
+    return ret < 0 ? 1 : 0;
+}
@@ -1,6 +1,8 @@
 #include "bplus.c"
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/wait.h>
 #include <time.h>
 
 void fill_random(char *buf, int len) {
@@ -10,8 +12,21 @@ void fill_random(char *buf, int len) {
     buf[len - 1] = '\0';
 }
 
-void test_set_and_get() {
-    struct bplus_tree *tree = bplus_tree_create("/tmp/bplus_set_and_get");
+// bijective mix so keys arrive in random order without duplicates
+uint64_t scramble(uint64_t x) {
+    x ^= x >> 31;
+    x *= 0x7fb5d329728ea185ULL;
+    x ^= x >> 27;
+    x *= 0x81dadef4bc2dd44dULL;
+    x ^= x >> 33;
+    return x;
+}
+
+int test_set_and_get() {
+    char *filename = "/tmp/bplus_set_and_get";
+    remove(filename);
+
+    struct bplus_tree *tree = bplus_tree_create(filename);
 
     bplus_tree_insert(tree, "foo", "bar");
 
@@ -22,19 +37,24 @@ void test_set_and_get() {
     }
     bplus_tree_destroy(tree);
 
-    tree = bplus_tree_create("/tmp/bplus_set_and_get");
+    tree = bplus_tree_create(filename);
 
     char *expect = "bar";
     char buf[32];
-    bplus_node_get(tree->root, "foo", &buf[0], 32);
+    bplus_tree_get(tree, "foo", &buf[0], 32);
     if (strcmp(buf, "bar") != 0) {
         printf("value doesn't match! %s != %s\n", buf, expect);
         exit(1);
     }
+
+    bplus_tree_destroy(tree);
+    remove(filename);
+    return 0;
 }
 
 int test_split_and_save(int key_size, int num_keys) {
     char *filename = "/tmp/bplus_split_and_save";
+    remove(filename);
 
     srand(time(NULL));
     struct bplus_tree *tree = bplus_tree_create(filename);
@@ -67,36 +87,2505 @@ int test_split_and_save(int key_size, int num_keys) {
 
     int ret = 0;
 
-    for (int i = 0; i <= tree->root->disk.num_keys; i++) {
-        struct bplus_node *node =
-            bplus_node_get_child(tree->pool, tree->root, i);
-        for (int j = 0; j < node->disk.num_keys; j++) {
-            memcpy(this_key, &node->disk.buf[node->disk.key_offsets[j]], 15);
-            this_key[15] = '\0';
+    struct bplus_cursor cursor;
+    bplus_cursor_init(&cursor, tree);
+    int found = 0;
+    for (int more = bplus_cursor_first(&cursor); more > 0;
+         more = bplus_cursor_next(&cursor)) {
+        int key_len;
+        char *key = bplus_cursor_key(&cursor, &key_len);
+        memcpy(this_key, key, 15);
+        this_key[15] = '\0';
 
-            if (last_key != NULL && strcmp(last_key, this_key) > 0) {
-                printf("keys out of order! %s > %s\n", last_key, this_key);
-                ret = 1;
-            }
+        if (last_key != NULL && strcmp(last_key, this_key) > 0) {
+            printf("keys out of order! %s > %s\n", last_key, this_key);
+            ret = 1;
+        }
+
+        if (last_key == NULL) {
+            last_key = malloc(16);
+        }
+
+        strcpy(last_key, this_key);
+        found++;
+    }
+    bplus_cursor_close(&cursor);
+
+    if (found != num_keys) {
+        printf("scanned %d keys, expected %d\n", found, num_keys);
+        ret = 1;
+    }
+
+    bplus_tree_destroy(tree);
+    remove(filename);
+    free(key_buf);
+    free(val_buf);
+    free(last_key);
+    free(this_key);
+
+    return ret;
+}
+
+int test_shared_prefixes() {
+    char *filename = "/tmp/bplus_shared_prefixes";
+    remove(filename);
+
+    // keys whose 4 byte heads collide or that are prefixes of each other
+    char *keys[] = {"abcdz", "a", "abcd", "abcde", "b", "ab", "abcdef", "abc"};
+    int num_keys = sizeof(keys) / sizeof(keys[0]);
+
+    struct bplus_tree *tree = bplus_tree_create(filename);
+    for (int i = 0; i < num_keys; i++) {
+        bplus_tree_insert(tree, keys[i], keys[i]);
+    }
 
-            if (last_key == NULL) {
-                last_key = malloc(16);
+    int ret = 0;
+    char buf[16];
+    for (int i = 0; i < num_keys; i++) {
+        if (bplus_tree_get(tree, keys[i], buf, sizeof(buf)) != 0 ||
+            strcmp(buf, keys[i]) != 0) {
+            printf("lookup of %s failed\n", keys[i]);
+            ret = 1;
+        }
+    }
+    if (bplus_tree_get(tree, "abcdd", buf, sizeof(buf)) != 1) {
+        printf("found a key that was never inserted\n");
+        ret = 1;
+    }
+
+    bplus_tree_destroy(tree);
+    remove(filename);
+    return ret;
+}
+
+// count the entries a scan over [lo, hi) visits in both directions
+int count_range(struct bplus_tree *tree, char *lo, char *hi, int *backward) {
+    struct bplus_cursor cursor;
+    bplus_cursor_init(&cursor, tree);
+    bplus_cursor_set_bounds(
+        &cursor, lo, lo ? strlen(lo) : 0, hi, hi ? strlen(hi) : 0);
+
+    int forward = 0;
+    for (int more = bplus_cursor_first(&cursor); more > 0;
+         more = bplus_cursor_next(&cursor)) {
+        forward++;
+    }
+
+    *backward = 0;
+    for (int more = bplus_cursor_last(&cursor); more > 0;
+         more = bplus_cursor_prev(&cursor)) {
+        (*backward)++;
+    }
+
+    bplus_cursor_close(&cursor);
+    return forward;
+}
+
+int test_range_scan(int num_keys) {
+    char *filename = "/tmp/bplus_range_scan";
+    remove(filename);
+
+    struct bplus_tree *tree = bplus_tree_create(filename);
+
+    // even numbers only, so bounds can fall between keys
+    char key[32];
+    for (int i = 0; i < num_keys; i++) {
+        int n = (scramble(i) % num_keys) * 2;
+        snprintf(key, sizeof(key), "key%08d", n);
+        bplus_tree_insert(tree, key, key);
+    }
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+    tree = bplus_tree_create(filename);
+
+    // count what made it in, duplicates collapse
+    int expected = 0;
+    struct bplus_cursor cursor;
+    bplus_cursor_init(&cursor, tree);
+    for (int more = bplus_cursor_first(&cursor); more > 0;
+         more = bplus_cursor_next(&cursor)) {
+        expected++;
+    }
+    bplus_cursor_close(&cursor);
+
+    struct {
+        char *lo;
+        char *hi;
+    } ranges[] = {
+        {NULL, NULL},
+        {"key00000100", "key00000200"},
+        {"key00000101", "key00000201"},
+        {"key", "key00000001"},
+        {"key99999999", NULL},
+        {NULL, "key00001000"},
+        {"key00000500", "key00000500"},
+    };
+
+    int ret = 0;
+    for (int r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        // count by point lookups over the even numbers in range
+        int want = 0;
+        char buf[32];
+        for (int n = 0; n < num_keys * 2; n += 2) {
+            snprintf(key, sizeof(key), "key%08d", n);
+            if ((ranges[r].lo && strcmp(key, ranges[r].lo) < 0) ||
+                (ranges[r].hi && strcmp(key, ranges[r].hi) >= 0)) {
+                continue;
             }
+            if (bplus_tree_get(tree, key, buf, sizeof(buf)) == 0) {
+                want++;
+            }
+        }
+        if (ranges[r].lo == NULL && ranges[r].hi == NULL && want != expected) {
+            printf("full scan saw %d keys, lookups found %d\n", expected, want);
+            ret = 1;
+        }
 
-            strcpy(last_key, this_key);
+        int backward;
+        int forward = count_range(tree, ranges[r].lo, ranges[r].hi, &backward);
+        if (forward != want || backward != want) {
+            printf(
+                "range %d: scanned %d forward and %d backward, expected %d\n",
+                r, forward, backward, want);
+            ret = 1;
         }
     }
 
     bplus_tree_destroy(tree);
     remove(filename);
+    return ret;
+}
+
+int test_readonly(int num_keys) {
+    char *filename = "/tmp/bplus_readonly";
+    remove(filename);
+
+    struct bplus_tree *tree = bplus_tree_create(filename);
+    char key[32];
+    char buf[32];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)scramble(i));
+        bplus_tree_insert(tree, key, key);
+    }
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+
+    tree = bplus_tree_open_readonly(filename, BPLUS_ACCESS_RANDOM);
+    if (tree == NULL) {
+        printf("couldn't open %s read-only\n", filename);
+        return 1;
+    }
 
+    int ret = 0;
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)scramble(i));
+        if (bplus_tree_get(tree, key, buf, sizeof(buf)) != 0 ||
+            strcmp(buf, key) != 0) {
+            printf("lost %s in read-only mode\n", key);
+            ret = 1;
+            break;
+        }
+    }
+
+    int backward;
+    int scanned = count_range(tree, NULL, NULL, &backward);
+    if (scanned != num_keys || backward != num_keys) {
+        printf(
+            "read-only scan saw %d keys forward, %d backward\n", scanned,
+            backward);
+        ret = 1;
+    }
+    if (bplus_tree_check(tree) != 0) {
+        ret = 1;
+    }
+    if (bplus_tree_insert(tree, "foo", "bar") == 0) {
+        printf("insert into a read-only tree succeeded\n");
+        ret = 1;
+    }
+
+    bplus_tree_destroy(tree);
+    remove(filename);
     return ret;
 }
 
-int main(int argc, char *argv[]) {
+// look up every key from a forked process through the shared pool
+int shared_reader(struct bplus_tree *tree, int num_keys) {
+    char key[32];
+    char buf[32];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)scramble(i));
+        if (bplus_tree_get(tree, key, buf, sizeof(buf)) != 0 ||
+            strcmp(buf, key) != 0) {
+            printf("worker %d lost %s\n", getpid(), key);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// die holding the pool lock with a frame claimed, as a crash partway
+// through a miss would
+int shared_crasher(struct bplus_tree *tree) {
+    struct bplus_buffer_pool *pool = tree->pool;
+    bplus_buffer_pool_lock(pool);
+    bplus_buffer_pool_alloc_frame(pool, pool->frames[0].page_id);
+    raise(SIGKILL);
+    return 1;
+}
+
+pid_t shared_fork(struct bplus_tree *tree, int num_keys, int crash) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(crash ? shared_crasher(tree) : shared_reader(tree, num_keys));
+    }
+    return pid;
+}
+
+int test_shared(int num_keys, int num_workers) {
+    char *filename = "/tmp/bplus_shared";
+    remove(filename);
+
+    struct bplus_tree *tree = bplus_tree_create(filename);
+    char key[32];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)scramble(i));
+        bplus_tree_insert(tree, key, key);
+    }
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+
+    struct bplus_tree_options opts = {.shared = 1};
+    tree = bplus_tree_create_opts(filename, &opts);
+    if (tree == NULL) {
+        printf("couldn't open %s shared\n", filename);
+        return 1;
+    }
+    struct bplus_buffer_pool *pool = tree->pool;
+
+    // a worker dies mid-miss, then its replacement and the others find the
+    // pool lock abandoned and clean up before warming the cache
+    int status;
+    waitpid(shared_fork(tree, num_keys, 1), &status, 0);
+    if (!WIFSIGNALED(status)) {
+        printf("crashing worker exited normally\n");
+        return 1;
+    }
+    int ret = 0;
+    pid_t *pids = malloc(num_workers * sizeof(pid_t));
+    for (int i = 0; i < num_workers; i++) {
+        pids[i] = shared_fork(tree, num_keys, 0);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("worker %d failed\n", pids[i]);
+            ret = 1;
+        }
+    }
+    free(pids);
+    if (pool->stats.recoveries != 1) {
+        printf(
+            "expected one recovery after a crash, saw %llu\n",
+            (unsigned long long)pool->stats.recoveries);
+        ret = 1;
+    }
+
+    // the workers' pages stayed cached, so a fresh one reads nothing
+    uint64_t misses = pool->stats.misses;
+    waitpid(shared_fork(tree, num_keys, 0), &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        ret = 1;
+    }
+    if (pool->stats.misses != misses || pool->stats.hits == 0) {
+        printf(
+            "warm worker missed %llu pages\n",
+            (unsigned long long)(pool->stats.misses - misses));
+        ret = 1;
+    }
+    if (shared_reader(tree, num_keys) != 0 || bplus_tree_check(tree) != 0) {
+        ret = 1;
+    }
+    if (bplus_tree_insert(tree, "foo", "bar") == 0) {
+        printf("insert into a shared tree succeeded\n");
+        ret = 1;
+    }
+
+    bplus_tree_destroy(tree);
+    remove(filename);
+    return ret;
+}
+
+int test_eviction(int key_size, int num_keys) {
+    char *filename = "/tmp/bplus_eviction";
+    remove(filename);
+
+    // fewer frames than pages so inserts and reads have to evict
+    struct bplus_tree_options opts = {.num_frames = BPLUS_MIN_FRAMES};
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+
+    char *key = malloc(key_size);
+    char *val = malloc(key_size);
+    char *buf = malloc(key_size);
+
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, key_size, "key%06d", i);
+        snprintf(val, key_size, "val%06d", i);
+        bplus_tree_insert(tree, key, val);
+    }
+
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+
+    tree = bplus_tree_create_opts(filename, &opts);
+
+    int ret = 0;
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, key_size, "key%06d", i);
+        snprintf(val, key_size, "val%06d", i);
+        if (bplus_tree_get(tree, key, buf, key_size) != 0 ||
+            strcmp(buf, val) != 0) {
+            printf("lost %s after eviction\n", key);
+            ret = 1;
+        }
+    }
+
+    if (tree->pool->num_cached > opts.num_frames) {
+        printf("pool grew to %d frames\n", tree->pool->num_cached);
+        ret = 1;
+    }
+    if (tree->pool->stats.evictions == 0) {
+        printf("expected evictions with %d frames\n", opts.num_frames);
+        ret = 1;
+    }
+
+    bplus_tree_destroy(tree);
+    remove(filename);
+    free(key);
+    free(val);
+    free(buf);
+
+    return ret;
+}
+
+// the dirty set holds exactly the dirty frames, each knowing its slot
+int check_dirty_set(struct bplus_buffer_pool *pool) {
+    int dirty = 0;
+    for (int i = 0; i < pool->num_cached; i++) {
+        dirty += pool->frames[i].dirty;
+    }
+    if (dirty != pool->num_dirty) {
+        printf(
+            "%d dirty frames but %d in the dirty set\n", dirty,
+            pool->num_dirty);
+        return 1;
+    }
+    for (int i = 0; i < pool->num_dirty; i++) {
+        struct bplus_frame *f = &pool->frames[pool->dirty_set[i]];
+        if (!f->dirty || f->dirty_slot != i) {
+            printf("dirty set slot %d is stale\n", i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// a flush writes the dirty pages and nothing else
+int test_flush(int num_keys) {
+    char *filename = "/tmp/bplus_flush";
+    remove(filename);
+
+    // fewer frames than pages, so inserts write dirty pages back as well
+    struct bplus_tree_options opts = {.num_frames = 256};
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+
+    char key[32], val[32], buf[32];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "key%08d", i);
+        snprintf(val, sizeof(val), "val%d", i);
+        bplus_tree_insert(tree, key, val);
+    }
+    int ret = check_dirty_set(tree->pool);
+    if (bplus_tree_flush(tree) < 0 || tree->pool->num_dirty != 0) {
+        printf("flush left %d pages dirty\n", tree->pool->num_dirty);
+        ret = 1;
+    }
+
+    // neighbouring keys share a few leaves out of many
+    uint64_t writes = tree->pool->stats.writes;
+    for (int i = num_keys / 2; i < num_keys / 2 + 100; i++) {
+        snprintf(key, sizeof(key), "key%08d", i);
+        snprintf(val, sizeof(val), "new%d", i);
+        bplus_tree_insert(tree, key, val);
+    }
+    int dirty = tree->pool->num_dirty;
+    ret |= check_dirty_set(tree->pool);
+    if (bplus_tree_flush(tree) < 0) {
+        printf("flush failed\n");
+        ret = 1;
+    }
+    writes = tree->pool->stats.writes - writes;
+    if (dirty == 0 || dirty > 8 || writes != (uint64_t)dirty) {
+        printf(
+            "updating 100 keys dirtied %d pages and flush wrote %llu\n",
+            dirty, (unsigned long long)writes);
+        ret = 1;
+    }
+    bplus_tree_destroy(tree);
+
+    tree = bplus_tree_create_opts(filename, &opts);
+    for (int i = 0; i < num_keys && ret == 0; i++) {
+        snprintf(key, sizeof(key), "key%08d", i);
+        int updated = i >= num_keys / 2 && i < num_keys / 2 + 100;
+        snprintf(val, sizeof(val), updated ? "new%d" : "val%d", i);
+        if (bplus_tree_get(tree, key, buf, sizeof(buf)) != 0 ||
+            strcmp(buf, val) != 0) {
+            printf("lost %s after flush\n", key);
+            ret = 1;
+        }
+    }
+    bplus_tree_destroy(tree);
+    remove(filename);
+    return ret;
+}
+
+int test_balanced(int num_keys) {
+    char *filename = "/tmp/bplus_balanced";
+    remove(filename);
+
+    struct bplus_tree *tree = bplus_tree_create(filename);
+
+    char key[32];
+    char val[32];
+    char buf[32];
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)scramble(i));
+        snprintf(val, sizeof(val), "%d", i);
+        if (bplus_tree_insert(tree, key, val) < 0) {
+            printf("insert %d failed\n", i);
+            return 1;
+        }
+    }
+    bplus_tree_flush(tree);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf(
+        "inserted %d keys in %.2fs (%.0f keys/s), height %d\n", num_keys, secs,
+        num_keys / secs, tree->height);
+
+    int height = tree->height;
+    bplus_tree_destroy(tree);
+
+    tree = bplus_tree_create(filename);
+
+    int ret = 0;
+    if (tree->height != height) {
+        printf("height %d after reload, expected %d\n", tree->height, height);
+        ret = 1;
+    }
+    if (bplus_tree_check(tree) != 0) {
+        printf("tree is not balanced or out of order\n");
+        ret = 1;
+    }
+
+    // spot check lookups across the whole key space
+    int step = num_keys / 1000 + 1;
+    for (int i = 0; i < num_keys; i += step) {
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)scramble(i));
+        snprintf(val, sizeof(val), "%d", i);
+        if (bplus_tree_get(tree, key, buf, sizeof(buf)) != 0 ||
+            strcmp(buf, val) != 0) {
+            printf("lost key %d\n", i);
+            ret = 1;
+        }
+    }
+
+    bplus_tree_destroy(tree);
+    remove(filename);
+    return ret;
+}
+
+// walk the whole tree both ways, checking order and that there are expect
+// keys
+int scan_count(struct bplus_tree *tree, int expect) {
+    int ret = 0;
+    struct bplus_cursor cursor;
+    bplus_cursor_init(&cursor, tree);
+
+    for (int forward = 1; forward >= 0; forward--) {
+        char last[32];
+        int last_len = -1;
+        int found = 0;
+        int more = forward ? bplus_cursor_first(&cursor)
+                           : bplus_cursor_last(&cursor);
+        for (; more > 0; more = forward ? bplus_cursor_next(&cursor)
+                                        : bplus_cursor_prev(&cursor)) {
+            int key_len;
+            char *key = bplus_cursor_key(&cursor, &key_len);
+            if (last_len >= 0) {
+                int cmp = bplus_key_compare(last, last_len, key, key_len);
+                if (forward ? cmp >= 0 : cmp <= 0) {
+                    printf(
+                        "%s scan out of order\n",
+                        forward ? "forward" : "backward");
+                    ret = 1;
+                }
+            }
+            memcpy(last, key, key_len);
+            last_len = key_len;
+            found++;
+        }
+        bplus_cursor_close(&cursor);
+
+        if (found != expect) {
+            printf(
+                "%s scan found %d keys, expected %d\n",
+                forward ? "forward" : "backward", found, expect);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+int test_delete(int num_keys) {
+    char *filename = "/tmp/bplus_delete";
+    remove(filename);
+
+    struct bplus_tree *tree = bplus_tree_create(filename);
+
+    char key[32], val[32], buf[32];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)scramble(i));
+        snprintf(val, sizeof(val), "%d", i);
+        bplus_tree_insert(tree, key, val);
+    }
+    int height = tree->height;
+
+    // take out every odd key, in the same random order they went in
+    int ret = 0;
+    for (int i = 1; i < num_keys; i += 2) {
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)scramble(i));
+        if (bplus_tree_delete(tree, key) != 0) {
+            printf("delete %d failed\n", i);
+            ret = 1;
+        }
+    }
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long)scramble(1));
+    if (bplus_tree_delete(tree, key) != 1) {
+        printf("deleted a missing key\n");
+        ret = 1;
+    }
+
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)scramble(i));
+        snprintf(val, sizeof(val), "%d", i);
+        int found = bplus_tree_get(tree, key, buf, sizeof(buf)) == 0;
+        if (i % 2 == 1 ? found : !found || strcmp(buf, val) != 0) {
+            printf("key %d is wrong after deleting half\n", i);
+            ret = 1;
+            break;
+        }
+    }
+    if (bplus_tree_check(tree) != 0) {
+        printf("tree is not balanced or out of order after deletes\n");
+        ret = 1;
+    }
+    ret |= scan_count(tree, num_keys / 2);
+
+    // the half that's left survives a reload
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+    tree = bplus_tree_create(filename);
+    ret |= scan_count(tree, num_keys / 2);
+
+    for (int i = 0; i < num_keys; i += 2) {
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)scramble(i));
+        if (bplus_tree_delete(tree, key) != 0) {
+            printf("delete %d failed\n", i);
+            ret = 1;
+        }
+    }
+    printf(
+        "deleted %d keys, height %d -> %d\n", num_keys, height, tree->height);
+    if (tree->height != 1 || tree->root->disk.num_keys != 0) {
+        printf("empty tree still has height %d\n", tree->height);
+        ret = 1;
+    }
+    ret |= scan_count(tree, 0);
+
+    bplus_tree_destroy(tree);
+    remove(filename);
+    return ret;
+}
+
+int test_hot_updates(int num_keys, int rounds) {
+    char *filename = "/tmp/bplus_hot_updates";
+    remove(filename);
+
+    struct bplus_tree *tree = bplus_tree_create(filename);
+
+    char key[32], val[64], buf[64];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "key%06d", i);
+        bplus_tree_insert(tree, key, "x");
+    }
+    uint32_t pages = tree->pool->next_page_id;
+
+    // values grow and shrink, so some updates fit in place and some don't
     int ret = 0;
-    // test_set_and_get();
-    ret = test_split_and_save(16, 16);
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < num_keys; i++) {
+            snprintf(key, sizeof(key), "key%06d", i);
+            snprintf(val, sizeof(val), "%0*d", 1 + (r * 7 + i) % 40, r);
+            bplus_tree_insert(tree, key, val);
+        }
+    }
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "key%06d", i);
+        snprintf(val, sizeof(val), "%0*d", 1 + ((rounds - 1) * 7 + i) % 40,
+                 rounds - 1);
+        if (bplus_tree_get(tree, key, buf, sizeof(buf)) != 0 ||
+            strcmp(buf, val) != 0) {
+            printf("key %d has a stale value\n", i);
+            ret = 1;
+            break;
+        }
+    }
+    if (bplus_tree_check(tree) != 0) {
+        printf("tree is not balanced or out of order after updates\n");
+        ret = 1;
+    }
+    ret |= scan_count(tree, num_keys);
+
+    // the first round of longer values can split leaves, after that the
+    // pages are reused
+    printf(
+        "%d updates: %u pages before, %u after\n", num_keys * rounds, pages,
+        tree->pool->next_page_id);
+    if (tree->pool->next_page_id > pages * 4) {
+        printf("updates keep growing the file\n");
+        ret = 1;
+    }
+
+    bplus_tree_destroy(tree);
+    remove(filename);
+    return ret;
+}
+
+struct sorted_input {
+    int next;
+    int count;
+    char key[32];
+    char val[32];
+};
+
+int sorted_input_next(
+    void *ctx, char **key, int *key_len, char **val, int *val_len) {
+    struct sorted_input *in = ctx;
+    if (in->next == in->count) {
+        return 0;
+    }
+
+    *key_len = snprintf(in->key, sizeof(in->key), "key%012d", in->next);
+    *val_len = snprintf(in->val, sizeof(in->val), "val%d", in->next);
+    *key = in->key;
+    *val = in->val;
+    in->next++;
+    return 1;
+}
+
+// sorted input that starts over at the first key halfway through
+int restarting_input_next(
+    void *ctx, char **key, int *key_len, char **val, int *val_len) {
+    struct sorted_input *in = ctx;
+    if (in->next == in->count / 2) {
+        in->next = 0;
+        in->count /= 2;
+    }
+    return sorted_input_next(ctx, key, key_len, val, val_len);
+}
+
+double elapsed(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+           (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int test_bulk_load(int num_keys) {
+    char *filename = "/tmp/bplus_bulk_load";
+    char *insert_filename = "/tmp/bplus_bulk_load_insert";
+    remove(insert_filename);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct sorted_input in = {.count = num_keys};
+    struct bplus_tree *tree =
+        bplus_tree_bulk_load(filename, NULL, sorted_input_next, &in, 0.9);
+    if (tree == NULL) {
+        printf("bulk load failed\n");
+        return 1;
+    }
+    double bulk_secs = elapsed(&start);
+
+    int ret = 0;
+    if (bplus_tree_check(tree) != 0) {
+        printf("bulk loaded tree is not balanced or out of order\n");
+        ret = 1;
+    }
+
+    char buf[32];
+    in.next = 0;
+    char *key, *val;
+    int key_len, val_len;
+    while (sorted_input_next(&in, &key, &key_len, &val, &val_len)) {
+        if (bplus_tree_get(tree, key, buf, sizeof(buf)) != 0 ||
+            strcmp(buf, val) != 0) {
+            printf("lost %s after bulk load\n", key);
+            ret = 1;
+            break;
+        }
+    }
+    int backward;
+    int scanned = count_range(tree, NULL, NULL, &backward);
+    if (scanned != num_keys || backward != num_keys) {
+        printf(
+            "bulk load scan saw %d keys forward, %d backward\n", scanned,
+            backward);
+        ret = 1;
+    }
+
+    uint32_t bulk_pages = tree->pool->next_page_id;
+    bplus_tree_destroy(tree);
+
+    // a load that fails partway leaves the tree already at the path alone
+    struct sorted_input bad = {.count = num_keys};
+    tree = bplus_tree_bulk_load(
+        filename, NULL, restarting_input_next, &bad, 0.9);
+    if (tree != NULL) {
+        printf("bulk load took unsorted input\n");
+        bplus_tree_destroy(tree);
+        return 1;
+    }
+    if (access("/tmp/bplus_bulk_load.tmp", F_OK) == 0) {
+        printf("failed bulk load left its file behind\n");
+        ret = 1;
+    }
+    tree = bplus_tree_create(filename);
+    if (tree == NULL) {
+        printf("failed bulk load broke the existing tree\n");
+        return 1;
+    }
+    scanned = count_range(tree, NULL, NULL, &backward);
+    if (scanned != num_keys || bplus_tree_check(tree) != 0) {
+        printf(
+            "existing tree has %d of %d keys after a failed bulk load\n",
+            scanned, num_keys);
+        ret = 1;
+    }
+    bplus_tree_destroy(tree);
+
+    // the same keys through the regular insert path for comparison
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    tree = bplus_tree_create(insert_filename);
+    in.next = 0;
+    while (sorted_input_next(&in, &key, &key_len, &val, &val_len)) {
+        bplus_tree_insert(tree, key, val);
+    }
+    bplus_tree_flush(tree);
+    double insert_secs = elapsed(&start);
+    uint32_t insert_pages = tree->pool->next_page_id;
+    bplus_tree_destroy(tree);
+
+    printf(
+        "bulk load %d keys: %.3fs, %u pages. inserts: %.3fs, %u pages\n",
+        num_keys, bulk_secs, bulk_pages, insert_secs, insert_pages);
+
+    remove(filename);
+    remove(insert_filename);
+    return ret;
+}
+
+int test_wal_recovery(int num_keys) {
+    char *filename = "/tmp/bplus_wal";
+    char *wal_filename = "/tmp/bplus_wal-wal";
+    remove(filename);
+    remove(wal_filename);
+
+    // a small no-steal pool forces checkpoints while inserting. keys go in
+    // out of order, 7919 being prime.
+    struct bplus_tree_options opts = {
+        .num_frames = 64,
+        .wal_mode = BPLUS_WAL_SYNC_NONE,
+    };
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+
+    char key[16], val[16], buf[16];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "key%06d", (i * 7919) % num_keys);
+        snprintf(val, sizeof(val), "val%06d", i);
+        bplus_tree_insert(tree, key, val);
+        if (i == num_keys / 2) {
+            bplus_tree_flush(tree);
+        }
+    }
+
+    // deletes are logged too
+    for (int k = 0; k < num_keys; k += 5) {
+        snprintf(key, sizeof(key), "key%06d", k);
+        bplus_tree_delete(tree, key);
+    }
+
+    // no flush: whatever came after the last checkpoint is only in the log
+    bplus_tree_destroy(tree);
+
+    // and the log ends in a half written record
+    FILE *f = fopen(wal_filename, "a");
+    fwrite("torn record", 1, 11, f);
+    fclose(f);
+
+    tree = bplus_tree_create_opts(filename, &opts);
+    int ret = 0;
+    for (int i = 0; i < num_keys; i++) {
+        int k = (i * 7919) % num_keys;
+        snprintf(key, sizeof(key), "key%06d", k);
+        snprintf(val, sizeof(val), "val%06d", i);
+        int found = bplus_tree_get(tree, key, buf, sizeof(buf)) == 0;
+        if (k % 5 == 0 ? found : !found || strcmp(buf, val) != 0) {
+            printf("%s is wrong after wal recovery\n", key);
+            ret = 1;
+            break;
+        }
+    }
+    if (bplus_tree_check(tree) != 0) {
+        printf("recovered tree is not balanced or out of order\n");
+        ret = 1;
+    }
+
+    // recovery checkpoints, leaving an empty log behind
+    struct stat st;
+    if (stat(wal_filename, &st) != 0 || st.st_size != 0) {
+        printf("wal holds %lld bytes after recovery\n", (long long)st.st_size);
+        ret = 1;
+    }
+
+    bplus_tree_destroy(tree);
+    remove(filename);
+    remove(wal_filename);
+    return ret;
+}
+
+struct wal_writer {
+    struct bplus_tree *tree;
+    int id;
+    int count;
+};
+
+void *wal_writer_run(void *data) {
+    struct wal_writer *w = data;
+    char key[32];
+    for (int i = 0; i < w->count; i++) {
+        snprintf(key, sizeof(key), "writer%02d-%06d", w->id, i);
+        bplus_tree_insert(w->tree, key, key);
+    }
+    return NULL;
+}
+
+int test_wal_group_commit(int num_threads, int per_thread) {
+    char *filename = "/tmp/bplus_wal_group";
+    char *wal_filename = "/tmp/bplus_wal_group-wal";
+    remove(filename);
+    remove(wal_filename);
+
+    struct bplus_tree_options opts = {.wal_mode = BPLUS_WAL_SYNC_COMMIT};
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t threads[num_threads];
+    struct wal_writer writers[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+        writers[i] = (struct wal_writer){tree, i, per_thread};
+        pthread_create(&threads[i], NULL, wal_writer_run, &writers[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double secs = elapsed(&start);
+
+    struct bplus_wal_stats stats = tree->wal->stats;
+    printf(
+        "wal group commit: %d threads, %llu commits, %llu syncs, %.3fs\n",
+        num_threads, (unsigned long long)stats.commits,
+        (unsigned long long)stats.syncs, secs);
+
+    int ret = 0;
+    if (stats.commits != (uint64_t)num_threads * per_thread) {
+        printf("expected %d commits\n", num_threads * per_thread);
+        ret = 1;
+    }
+    if (stats.syncs >= stats.commits) {
+        printf("commits were not grouped\n");
+        ret = 1;
+    }
+
+    bplus_tree_destroy(tree);
+    tree = bplus_tree_create_opts(filename, &opts);
+
+    char key[32], buf[32];
+    for (int i = 0; i < num_threads * per_thread && ret == 0; i++) {
+        snprintf(key, sizeof(key), "writer%02d-%06d", i % num_threads,
+                 i / num_threads);
+        if (bplus_tree_get(tree, key, buf, sizeof(buf)) != 0) {
+            printf("lost %s after group commit\n", key);
+            ret = 1;
+        }
+    }
+
+    bplus_tree_destroy(tree);
+    remove(filename);
+    remove(wal_filename);
+    return ret;
+}
+
+struct concurrent_worker {
+    struct bplus_tree *tree;
+    int id;
+    int count;       // keys to insert or look up
+    int num_writers; // readers run until this many writers are done
+    int *done;
+    int errors;
+    uint64_t ops;
+};
+
+// keys ending in 't' are temporary, every writer deletes its own again a
+// little later
+void concurrent_temp_key(char *key, int len, struct concurrent_worker *w,
+                         int i) {
+    snprintf(key, len, "key%08d-%02dt", (i * 7919) % w->count, w->id);
+}
+
+void *concurrent_writer(void *data) {
+    struct concurrent_worker *w = data;
+    char key[32];
+    for (int i = 0; i < w->count + 400; i++) {
+        if (i < w->count) {
+            snprintf(key, sizeof(key), "key%08d-%02d", (i * 7919) % w->count,
+                     w->id);
+            if (bplus_tree_insert(w->tree, key, key) != 0) {
+                w->errors++;
+            }
+        }
+        if (i < w->count && i % 4 == 0) {
+            concurrent_temp_key(key, sizeof(key), w, i);
+            if (bplus_tree_insert(w->tree, key, key) != 0) {
+                w->errors++;
+            }
+        }
+        if (i >= 400 && i % 4 == 0) {
+            concurrent_temp_key(key, sizeof(key), w, i - 400);
+            if (bplus_tree_delete(w->tree, key) != 0) {
+                w->errors++;
+            }
+        }
+    }
+    __atomic_fetch_add(w->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// scan back and forth while the writers run. keys must come out strictly
+// ordered, and every value matches its key.
+void *concurrent_reader(void *data) {
+    struct concurrent_worker *w = data;
+    char prev[32];
+    char buf[32];
+
+    while (__atomic_load_n(w->done, __ATOMIC_ACQUIRE) < w->num_writers) {
+        struct bplus_cursor c;
+        bplus_cursor_init(&c, w->tree);
+        int forward = w->ops % 2 == 0;
+        int ret = forward ? bplus_cursor_first(&c) : bplus_cursor_last(&c);
+        prev[0] = '\0';
+        for (int n = 0; ret == 1 && n < 2000; n++) {
+            int key_len, val_len;
+            char *key = bplus_cursor_key(&c, &key_len);
+            char *val = bplus_cursor_value(&c, &val_len);
+            memcpy(buf, key, key_len);
+            buf[key_len] = '\0';
+            if (key_len != val_len || memcmp(key, val, key_len) != 0 ||
+                (prev[0] != '\0' &&
+                 (forward ? strcmp(prev, buf) >= 0 : strcmp(prev, buf) <= 0))) {
+                printf("scan out of order at %s after %s\n", buf, prev);
+                w->errors++;
+                break;
+            }
+            strcpy(prev, buf);
+            ret = forward ? bplus_cursor_next(&c) : bplus_cursor_prev(&c);
+        }
+        bplus_cursor_close(&c);
+        if (ret < 0) {
+            w->errors++;
+        }
+
+        if (prev[0] != '\0' && prev[strlen(prev) - 1] != 't' &&
+            (bplus_tree_get(w->tree, prev, buf, sizeof(buf)) != 0 ||
+             strcmp(prev, buf) != 0)) {
+            printf("lost %s while writers ran\n", prev);
+            w->errors++;
+        }
+        w->ops++;
+    }
+    return NULL;
+}
+
+void *concurrent_lookups(void *data) {
+    struct concurrent_worker *w = data;
+    char key[32], buf[32];
+    for (int i = 0; i < w->count; i++) {
+        snprintf(key, sizeof(key), "key%08d-%02d",
+                 (int)(scramble(i + w->id * w->count) % w->count), 0);
+        if (bplus_tree_get(w->tree, key, buf, sizeof(buf)) != 0) {
+            w->errors++;
+        }
+    }
+    return NULL;
+}
+
+int test_concurrent(int num_threads, int per_thread) {
+    char *filename = "/tmp/bplus_concurrent";
+    remove(filename);
+
+    // a small pool keeps threads evicting and loading under each other
+    struct bplus_tree_options opts = {.num_frames = 64};
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+
+    pthread_t threads[2 * num_threads];
+    struct concurrent_worker workers[2 * num_threads];
+    int done = 0;
+    for (int i = 0; i < 2 * num_threads; i++) {
+        int writer = i < num_threads;
+        workers[i] = (struct concurrent_worker){
+            .tree = tree,
+            .id = i,
+            .count = per_thread,
+            .num_writers = num_threads,
+            .done = &done,
+        };
+        pthread_create(
+            &threads[i], NULL, writer ? concurrent_writer : concurrent_reader,
+            &workers[i]);
+    }
+
+    int ret = 0;
+    for (int i = 0; i < 2 * num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        if (workers[i].errors != 0) {
+            ret = 1;
+        }
+    }
+    if (ret != 0) {
+        printf("concurrent workers reported errors\n");
+    }
+
+    char key[32], buf[32];
+    for (int t = 0; t < num_threads && ret == 0; t++) {
+        for (int i = 0; i < per_thread; i++) {
+            snprintf(key, sizeof(key), "key%08d-%02d", i, t);
+            if (bplus_tree_get(tree, key, buf, sizeof(buf)) != 0) {
+                printf("lost %s after concurrent inserts\n", key);
+                ret = 1;
+                break;
+            }
+            strcat(key, "t");
+            if (bplus_tree_get(tree, key, buf, sizeof(buf)) == 0) {
+                printf("%s survived its delete\n", key);
+                ret = 1;
+                break;
+            }
+        }
+    }
+    if (bplus_tree_check(tree) != 0) {
+        printf("concurrently built tree is not balanced or out of order\n");
+        ret = 1;
+    }
+
+    // lookup throughput with one thread and with all of them. scaling needs
+    // as many cores as threads.
+    bplus_tree_flush(tree);
+    int thread_counts[] = {1, num_threads};
+    for (int k = 0; k < 2; k++) {
+        int n = thread_counts[k];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; i++) {
+            workers[i] = (struct concurrent_worker){
+                .tree = tree, .id = i, .count = per_thread};
+            pthread_create(&threads[i], NULL, concurrent_lookups, &workers[i]);
+        }
+        for (int i = 0; i < n; i++) {
+            pthread_join(threads[i], NULL);
+            ret |= workers[i].errors != 0;
+        }
+        double secs = elapsed(&start);
+        printf(
+            "%d lookup threads: %.0f lookups/s\n", n, n * per_thread / secs);
+    }
+
+    bplus_tree_destroy(tree);
+    remove(filename);
+    return ret;
+}
+
+int test_compact(int num_keys, int wal_mode) {
+    char *filename = "/tmp/bplus_compact";
+    char *wal_filename = "/tmp/bplus_compact-wal";
+    remove(filename);
+    remove(wal_filename);
+
+    struct bplus_tree_options opts = {
+        .num_frames = 64,
+        .wal_mode = wal_mode,
+    };
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+
+    char key[32], buf[32];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "key%08d-00", (i * 7919) % num_keys);
+        bplus_tree_insert(tree, key, key);
+    }
+
+    // drop three keys in four, which frees pages all over the file
+    for (int i = 0; i < num_keys; i++) {
+        int k = (i * 7919) % num_keys;
+        if (k % 4 != 0) {
+            snprintf(key, sizeof(key), "key%08d-00", k);
+            bplus_tree_delete(tree, key);
+        }
+    }
+    uint32_t pages = tree->pool->next_page_id;
+    uint32_t num_free = tree->pool->num_free;
+
+    // new keys go into freed pages rather than the end of the file
+    int ret = 0;
+    for (int k = 0; k < num_keys; k += 4) {
+        snprintf(key, sizeof(key), "key%08d-01", k);
+        bplus_tree_insert(tree, key, key);
+    }
+    printf(
+        "compact: %u pages, %u freed by deletes, %u free after inserts\n",
+        pages, num_free, tree->pool->num_free);
+    if (num_free == 0 || tree->pool->next_page_id != pages) {
+        printf("freed pages were not reused\n");
+        ret = 1;
+    }
+
+    // the free list survives a reload
+    num_free = tree->pool->num_free;
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+    tree = bplus_tree_create_opts(filename, &opts);
+    if (tree->pool->num_free != num_free) {
+        printf(
+            "%u free pages after reload, expected %u\n", tree->pool->num_free,
+            num_free);
+        ret = 1;
+    }
+    if (bplus_tree_check(tree) != 0) {
+        printf("tree is inconsistent before compaction\n");
+        ret = 1;
+    }
+
+    // scan and look up alongside the compaction
+    int done = 0;
+    struct concurrent_worker reader = {
+        .tree = tree,
+        .num_writers = 1,
+        .done = &done,
+    };
+    pthread_t thread;
+    pthread_create(&thread, NULL, concurrent_reader, &reader);
+
+    struct stat st;
+    stat(filename, &st);
+    off_t size = st.st_size;
+    if (bplus_tree_compact(tree) != 0) {
+        printf("compaction failed\n");
+        ret = 1;
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    if (reader.errors != 0) {
+        printf("reader failed during compaction\n");
+        ret = 1;
+    }
+
+    stat(filename, &st);
+    printf(
+        "compact: %lld -> %lld bytes, %d scans alongside\n", (long long)size,
+        (long long)st.st_size, (int)reader.ops);
+    if (st.st_size >= size || tree->pool->num_free != 0 ||
+        st.st_size != (off_t)(tree->pool->next_page_id + 1) * BPLUS_PAGE_SIZE) {
+        printf("compaction didn't shrink the file\n");
+        ret = 1;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        if (bplus_tree_check(tree) != 0) {
+            printf("tree is inconsistent after compaction\n");
+            ret = 1;
+        }
+
+        // leaves are laid out in key order
+        struct bplus_cursor c;
+        bplus_cursor_init(&c, tree);
+        uint32_t leaf = BPLUS_INVALID_PAGE;
+        int found = 0;
+        for (int more = bplus_cursor_first(&c); more > 0;
+             more = bplus_cursor_next(&c)) {
+            if (c.leaf->disk.page_id != leaf) {
+                if (leaf != BPLUS_INVALID_PAGE &&
+                    c.leaf->disk.page_id != leaf + 1) {
+                    printf(
+                        "leaf %u follows leaf %u\n", c.leaf->disk.page_id,
+                        leaf);
+                    ret = 1;
+                }
+                leaf = c.leaf->disk.page_id;
+            }
+            found++;
+        }
+        bplus_cursor_close(&c);
+
+        for (int k = 0; k < num_keys; k += 4) {
+            snprintf(key, sizeof(key), "key%08d-01", k);
+            if (bplus_tree_get(tree, key, buf, sizeof(buf)) != 0 ||
+                strcmp(buf, key) != 0) {
+                printf("lost %s in compaction\n", key);
+                ret = 1;
+                break;
+            }
+        }
+        if (found != 2 * ((num_keys + 3) / 4)) {
+            printf("%d keys after compaction\n", found);
+            ret = 1;
+        }
+
+        bplus_tree_destroy(tree);
+        tree = bplus_tree_create_opts(filename, &opts);
+    }
+
+    bplus_tree_destroy(tree);
+    remove(filename);
+    remove(wal_filename);
+    return ret;
+}
+
+// time num_keys lookups of random keys, one call per key or batch keys per
+// call, starting from a cold cache
+double time_lookups(
+    char *filename, int num_keys, int batch, int multi, uint64_t *reads) {
+    int fd = open(filename, O_RDONLY);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+
+    struct bplus_tree_options opts = {.num_frames = 64};
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+
+    char(*key_buf)[32] = malloc(batch * sizeof(*key_buf));
+    char(*val_buf)[32] = malloc(batch * sizeof(*val_buf));
+    char **keys = malloc(batch * sizeof(char *));
+    char **bufs = malloc(batch * sizeof(char *));
+    int *results = malloc(batch * sizeof(int));
+    for (int i = 0; i < batch; i++) {
+        keys[i] = key_buf[i];
+        bufs[i] = val_buf[i];
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int errors = 0;
+    for (int done = 0; done < num_keys; done += batch) {
+        for (int i = 0; i < batch; i++) {
+            snprintf(keys[i], 32, "key%08d",
+                     (int)(scramble(done + i) % num_keys));
+        }
+        if (multi) {
+            bplus_tree_multi_get(
+                tree, keys, NULL, batch, bufs, 32, NULL, results);
+        } else {
+            for (int i = 0; i < batch; i++) {
+                results[i] = bplus_tree_get(tree, keys[i], bufs[i], 32);
+            }
+        }
+        for (int i = 0; i < batch; i++) {
+            errors += results[i] != 0;
+        }
+    }
+    double secs = elapsed(&start);
+    if (errors != 0) {
+        printf("%d lookups failed\n", errors);
+        secs = -1;
+    }
+
+    *reads = tree->pool->stats.reads;
+    bplus_tree_destroy(tree);
+    free(key_buf);
+    free(val_buf);
+    free(keys);
+    free(bufs);
+    free(results);
+    return secs;
+}
+
+int test_multi(int num_keys, int batch) {
+    char *filename = "/tmp/bplus_multi";
+    char *wal_filename = "/tmp/bplus_multi-wal";
+    remove(filename);
+    remove(wal_filename);
+
+    struct bplus_tree_options opts = {
+        .num_frames = 256,
+        .wal_mode = BPLUS_WAL_SYNC_COMMIT,
+    };
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+
+    // one spare entry per batch repeats the first key, which then has to
+    // end up with the later value
+    char(*key_buf)[32] = malloc((batch + 1) * sizeof(*key_buf));
+    char(*val_buf)[32] = malloc((batch + 1) * sizeof(*val_buf));
+    char **keys = malloc((batch + 1) * sizeof(char *));
+    char **vals = malloc((batch + 1) * sizeof(char *));
+    int *results = malloc((batch + 1) * sizeof(int));
+    for (int i = 0; i <= batch; i++) {
+        keys[i] = key_buf[i];
+        vals[i] = val_buf[i];
+    }
+
+    int ret = 0;
+    for (int start = 0; start < num_keys; start += batch) {
+        int n = start + batch < num_keys ? batch : num_keys - start;
+        for (int i = 0; i < n; i++) {
+            int k = ((start + i) * 7919) % num_keys;
+            snprintf(keys[i], 32, "key%08d", k);
+            snprintf(vals[i], 32, "val%d", k);
+        }
+        strcpy(keys[n], keys[0]);
+        strcpy(vals[n], vals[0]);
+        strcpy(vals[0], "stale");
+        if (bplus_tree_multi_put(tree, keys, NULL, vals, NULL, n + 1) != 0) {
+            printf("multi_put failed\n");
+            ret = 1;
+            break;
+        }
+    }
+    struct bplus_wal_stats stats = tree->wal->stats;
+    printf(
+        "multi_put: %d keys, %llu commits, %llu syncs\n", num_keys,
+        (unsigned long long)stats.commits, (unsigned long long)stats.syncs);
+    if (stats.commits != (uint64_t)(num_keys + batch - 1) / batch) {
+        printf("expected one commit per batch\n");
+        ret = 1;
+    }
+    if (bplus_tree_check(tree) != 0) {
+        printf("tree is inconsistent after multi_put\n");
+        ret = 1;
+    }
+
+    // every other key in a batch is missing
+    for (int start = 0; start < num_keys && ret == 0; start += batch / 2) {
+        for (int i = 0; i < batch; i++) {
+            int k = start + i / 2;
+            snprintf(keys[i], 32, i % 2 == 0 ? "key%08d" : "nokey%08d", k);
+        }
+        if (bplus_tree_multi_get(
+                tree, keys, NULL, batch, vals, 32, NULL, results) < 0) {
+            printf("multi_get failed\n");
+            ret = 1;
+            break;
+        }
+        for (int i = 0; i < batch; i++) {
+            int k = start + i / 2;
+            char expect[32];
+            snprintf(expect, sizeof(expect), "val%d", k);
+            int want = i % 2 == 0 && k < num_keys ? 0 : 1;
+            if (results[i] != want ||
+                (want == 0 && strcmp(vals[i], expect) != 0)) {
+                printf("multi_get of %s is wrong\n", keys[i]);
+                ret = 1;
+                break;
+            }
+        }
+    }
+
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+    remove(wal_filename);
+
+    // batches win by sharing the walk down and reading each batch's
+    // missing leaves together
+    uint64_t single_reads, multi_reads;
+    double single = time_lookups(filename, num_keys, batch, 0, &single_reads);
+    double multi = time_lookups(filename, num_keys, batch, 1, &multi_reads);
+    printf(
+        "%d lookups in batches of %d: %.0f keys/s one by one, %.0f keys/s "
+        "batched, %llu vs %llu page reads\n",
+        num_keys, batch, num_keys / single, num_keys / multi,
+        (unsigned long long)single_reads, (unsigned long long)multi_reads);
+    if (single < 0 || multi < 0) {
+        ret = 1;
+    }
+
+    remove(filename);
+    free(key_buf);
+    free(val_buf);
+    free(keys);
+    free(vals);
+    free(results);
+    return ret;
+}
+
+// random lookups against a tree cached in a pool with or without huge pages
+int test_huge_pages(int num_keys, int num_lookups) {
+    char *filename = "/tmp/bplus_huge_pages";
+    int ret = 0;
+
+    for (int huge = 0; huge < 2; huge++) {
+        remove(filename);
+        struct bplus_tree_options opts = {
+            .num_frames = num_keys / 16,
+            .huge_pages = huge,
+        };
+        struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+
+        char key[32], buf[32];
+        for (int i = 0; i < num_keys; i++) {
+            snprintf(key, sizeof(key), "%016llx",
+                     (unsigned long long)scramble(i));
+            bplus_tree_insert(tree, key, key);
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_lookups; i++) {
+            snprintf(key, sizeof(key), "%016llx",
+                     (unsigned long long)scramble(i * 7919LL % num_keys));
+            if (bplus_tree_get(tree, key, buf, sizeof(buf)) != 0 ||
+                strcmp(key, buf) != 0) {
+                printf("lost %s\n", key);
+                ret = 1;
+                break;
+            }
+        }
+        double secs = elapsed(&start);
+
+        const char *backing = "normal pages";
+        if (tree->pool->arena.huge) {
+            backing = "reserved huge pages";
+        } else if (huge) {
+            backing = "transparent huge pages";
+        }
+        printf(
+            "%d frames on %s: %.0f lookups/s\n", tree->pool->num_frames,
+            backing, num_lookups / secs);
+        if (bplus_tree_check(tree) != 0) {
+            ret = 1;
+        }
+        bplus_tree_destroy(tree);
+    }
+
+    remove(filename);
+    return ret;
+}
+
+int test_checksums(int num_keys, int wal_mode) {
+    char *filename = "/tmp/bplus_checksums";
+    char *wal_filename = "/tmp/bplus_checksums-wal";
+    remove(filename);
+    remove(wal_filename);
+
+    // the standard crc32c check value, on whichever implementation was picked
+    // and on the portable one
+    int ret = 0;
+    if (bplus_crc32c(0, "123456789", 9) != 0xE3069283 ||
+        bplus_crc32c_sw(0, "123456789", 9) != 0xE3069283) {
+        printf("crc32c check value mismatch\n");
+        return 1;
+    }
+
+    struct bplus_tree_options opts = {
+        .num_frames = 64,
+        .wal_mode = wal_mode,
+    };
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+    char key[32], buf[32];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "key%08d", (i * 7919) % num_keys);
+        bplus_tree_insert(tree, key, key);
+    }
+    for (int k = 0; k < num_keys; k += 3) {
+        snprintf(key, sizeof(key), "key%08d", k);
+        bplus_tree_delete(tree, key);
+    }
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+
+    struct bplus_fsck_report r;
+    int errors = bplus_fsck(filename, NULL, 4, &r);
+    printf(
+        "fsck: %u pages, %u free, %llu keys, %d errors\n", r.num_pages,
+        r.num_free, (unsigned long long)r.num_keys, errors);
+    uint64_t expect = num_keys - (num_keys + 2) / 3;
+    if (errors != 0 || r.num_keys != expect) {
+        printf("fsck failed on a clean file\n");
+        ret = 1;
+    }
+
+    // flip one heap byte in the first leaf that holds keys
+    int fd = open(filename, O_RDWR);
+    struct bplus_node node;
+    char victim[32] = "";
+    for (uint32_t i = 0; i < r.num_pages; i++) {
+        off_t offset = bplus_buffer_pool_get_offset(i);
+        pread(fd, &node, sizeof(node), offset);
+        if (node.disk.is_leaf && node.disk.num_keys > 0) {
+            snprintf(
+                victim, sizeof(victim), "%.*s", node.disk.slots[0].key_len,
+                bplus_node_key(&node, 0));
+            node.disk.buf[BPLUS_NODE_CAPACITY - 1] ^= 0x20;
+            pwrite(fd, &node, sizeof(node), offset);
+            break;
+        }
+    }
+    close(fd);
+
+    if (bplus_fsck(filename, NULL, 4, NULL) == 0) {
+        printf("fsck missed a flipped byte\n");
+        ret = 1;
+    }
+    tree = bplus_tree_create_opts(filename, &opts);
+    if (bplus_tree_get(tree, victim, buf, sizeof(buf)) != -1) {
+        printf("read %s from a corrupt page\n", victim);
+        ret = 1;
+    }
+    bplus_tree_destroy(tree);
+
+    remove(filename);
+    remove(wal_filename);
+    return ret;
+}
+
+// write the same JSON documents to a raw and a compressed file, then read
+// the compressed one back through a small pool
+int test_compression(int num_keys, int wal_mode) {
+    char *filename = "/tmp/bplus_compression";
+    char *wal_filename = "/tmp/bplus_compression-wal";
+    char *extent_filename = "/tmp/bplus_compression-extents";
+    char key[32], doc[256], buf[256];
+    off_t sizes[2];
+    int ret = 0;
+
+    for (int compress = 0; compress < 2; compress++) {
+        remove(filename);
+        remove(wal_filename);
+        struct bplus_tree_options opts = {
+            .num_frames = 64,
+            .wal_mode = wal_mode,
+            .compress = compress,
+        };
+        struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+        for (int i = 0; i < num_keys; i++) {
+            int k = (i * 7919) % num_keys;
+            snprintf(key, sizeof(key), "user%08d", k);
+            snprintf(
+                doc, sizeof(doc),
+                "{\"id\":%d,\"name\":\"user %d\",\"email\":\"user%d@example."
+                "com\",\"active\":%s,\"roles\":[\"reader\",\"writer\"]}",
+                k, k, k, k % 3 ? "true" : "false");
+            bplus_tree_insert(tree, key, doc);
+        }
+        bplus_tree_flush(tree);
+        struct bplus_buffer_pool_stats stats = tree->pool->stats;
+        bplus_tree_destroy(tree);
+
+        struct stat st, ext = {0};
+        stat(filename, &st);
+        stat(extent_filename, &ext);
+        sizes[compress] = st.st_size + ext.st_size;
+        if (!compress) {
+            continue;
+        }
+        printf(
+            "compression: %llu pages at %.2fx, %.1f us to compress a page\n",
+            (unsigned long long)stats.compressed_pages,
+            (double)stats.compressed_pages * BPLUS_PAGE_SIZE /
+                stats.compressed_bytes,
+            stats.compress_ns / 1e3 / stats.compressed_pages);
+    }
+    printf(
+        "compression: %lld bytes raw, %lld compressed\n", (long long)sizes[0],
+        (long long)sizes[1]);
+    if (sizes[1] * 2 > sizes[0]) {
+        printf("compressed file is not even half the size\n");
+        ret = 1;
+    }
+
+    // the file stays compressed without asking again
+    struct bplus_tree_options opts = {
+        .num_frames = 64,
+        .wal_mode = wal_mode,
+    };
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+    for (int k = 0; k < num_keys && ret == 0; k++) {
+        snprintf(key, sizeof(key), "user%08d", k);
+        if (bplus_tree_get(tree, key, buf, sizeof(buf)) != 0 ||
+            strncmp(buf, "{\"id\":", 6) != 0 || atoi(&buf[6]) != k) {
+            printf("lost %s\n", key);
+            ret = 1;
+        }
+    }
+    struct bplus_buffer_pool_stats stats = tree->pool->stats;
+    printf(
+        "compression: %llu page reads, %.1f us to decompress a page\n",
+        (unsigned long long)stats.reads,
+        stats.decompress_ns / 1e3 / stats.reads);
+
+    // pages change size as they empty out, and compaction trims the file
+    for (int k = 0; k < num_keys; k++) {
+        if (k % 4 != 0) {
+            snprintf(key, sizeof(key), "user%08d", k);
+            bplus_tree_delete(tree, key);
+        }
+    }
+    if (bplus_tree_compact(tree) < 0 || bplus_tree_check(tree) != 0) {
+        printf("compaction of a compressed file failed\n");
+        ret = 1;
+    }
+    bplus_tree_destroy(tree);
+
+    struct stat st;
+    stat(filename, &st);
+    printf(
+        "compression: %lld bytes after compaction\n", (long long)st.st_size);
+    if (st.st_size >= sizes[1]) {
+        printf("compaction didn't shrink the compressed file\n");
+        ret = 1;
+    }
+    if (bplus_fsck(filename, NULL, 2, NULL) != 0) {
+        ret = 1;
+    }
+
+    remove(filename);
+    remove(wal_filename);
+    remove(extent_filename);
+    return ret;
+}
+
+// keys and values are plain bytes with explicit lengths, and an integer key
+// order compares 8 byte keys as numbers
+int test_u64_keys(int num_keys) {
+    char *filename = "/tmp/bplus_u64_keys";
+    remove(filename);
+    int ret = 0;
+
+    // NULs inside keys and values
+    struct bplus_tree *tree = bplus_tree_create(filename);
+    char key[16], val[32], buf[32];
+    int val_len;
+    memcpy(key, "a\0b", 3);
+    memcpy(val, "x\0\0y", 4);
+    bplus_tree_put(tree, key, 3, val, 4);
+    bplus_tree_put(tree, key, 2, "short", 5);
+    if (bplus_tree_lookup(tree, key, 3, buf, sizeof(buf), &val_len) != 0 ||
+        val_len != 4 || memcmp(buf, val, 4) != 0 ||
+        bplus_tree_lookup(tree, key, 2, buf, sizeof(buf), &val_len) != 0 ||
+        val_len != 5 ||
+        bplus_tree_lookup(tree, key, 1, buf, sizeof(buf), &val_len) != 1) {
+        printf("binary keys and values don't round trip\n");
+        ret = 1;
+    }
+    if (bplus_tree_remove(tree, key, 3) != 0 ||
+        bplus_tree_lookup(tree, key, 3, buf, sizeof(buf), &val_len) != 1 ||
+        bplus_tree_lookup(tree, key, 2, buf, sizeof(buf), &val_len) != 0) {
+        printf("removing a binary key went wrong\n");
+        ret = 1;
+    }
+    bplus_tree_destroy(tree);
+    remove(filename);
+
+    // numeric order, inserted out of order
+    struct bplus_tree_options opts = {.keys = &bplus_keys_u64};
+    tree = bplus_tree_create_opts(filename, &opts);
+    if (bplus_tree_put(tree, "abc", 3, "v", 1) == 0) {
+        printf("a 3 byte key went into a u64 tree\n");
+        ret = 1;
+    }
+    for (int i = 0; i < num_keys; i++) {
+        uint64_t k = (uint64_t)i * 7919 % num_keys * 3;
+        int n = snprintf(val, sizeof(val), "%llu", (unsigned long long)k);
+        bplus_tree_put(tree, (char *)&k, sizeof(k), val, n);
+    }
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+    tree = bplus_tree_create_opts(filename, &opts);
+
+    uint64_t prev = 0;
+    int count = 0;
+    struct bplus_cursor cursor;
+    bplus_cursor_init(&cursor, tree);
+    for (int more = bplus_cursor_first(&cursor); more > 0 && ret == 0;
+         more = bplus_cursor_next(&cursor)) {
+        int key_len;
+        uint64_t k;
+        memcpy(&k, bplus_cursor_key(&cursor, &key_len), sizeof(k));
+        if (key_len != sizeof(k) || (count > 0 && k <= prev) || k % 3 != 0) {
+            printf("u64 scan is out of order at %llu\n", (unsigned long long)k);
+            ret = 1;
+        }
+        prev = k;
+        count++;
+    }
+    bplus_cursor_close(&cursor);
+    for (uint64_t k = 0; k < (uint64_t)num_keys * 3 && ret == 0; k++) {
+        int want = k % 3 == 0 ? 0 : 1;
+        int got = bplus_tree_lookup(
+            tree, (char *)&k, sizeof(k), buf, sizeof(buf) - 1, &val_len);
+        if (got == 0) {
+            buf[val_len] = '\0';
+        }
+        if (got != want || (got == 0 && strtoull(buf, NULL, 10) != k)) {
+            printf("u64 lookup of %llu is wrong\n", (unsigned long long)k);
+            ret = 1;
+        }
+    }
+    if (bplus_tree_check(tree) != 0 ||
+        bplus_fsck(filename, NULL, 2, NULL) != 0) {
+        ret = 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_keys; i++) {
+        uint64_t k = (uint64_t)i * 7919 % num_keys * 3;
+        bplus_tree_lookup(tree, (char *)&k, sizeof(k), buf, 32, &val_len);
+    }
+    double u64_secs = elapsed(&start);
+    bplus_tree_destroy(tree);
+    printf("u64 keys: %d in order, %.0f lookups/s\n", count,
+           num_keys / u64_secs);
+
+    // the order is part of the file
+    if (bplus_tree_create(filename) != NULL) {
+        printf("opened a u64 tree with bytewise keys\n");
+        ret = 1;
+    }
+    tree = bplus_tree_open_readonly(filename, BPLUS_ACCESS_RANDOM);
+    uint64_t k = 3;
+    if (tree == NULL ||
+        bplus_tree_lookup(tree, (char *)&k, sizeof(k), buf, 32, &val_len) !=
+            0) {
+        printf("read-only open lost the key order\n");
+        ret = 1;
+    }
+    if (tree != NULL) {
+        bplus_tree_destroy(tree);
+    }
+
+    // the same numbers as decimal strings, for comparison
+    remove(filename);
+    tree = bplus_tree_create(filename);
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "%llu", i * 7919ULL % num_keys * 3);
+        bplus_tree_insert(tree, key, key);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "%llu", i * 7919ULL % num_keys * 3);
+        bplus_tree_get(tree, key, buf, sizeof(buf));
+    }
+    printf("bytes keys: %.0f lookups/s\n", num_keys / elapsed(&start));
+    bplus_tree_destroy(tree);
+
+    // the vector and scalar counts agree, including around the sign bit
+    uint64_t window[BPLUS_U64_WINDOW];
+    for (int i = 0; i < 1000 && ret == 0; i++) {
+        for (int j = 0; j < BPLUS_U64_WINDOW; j++) {
+            window[j] = scramble(i * BPLUS_U64_WINDOW + j) >> (i % 3 * 20);
+        }
+        uint64_t probe = scramble(~i) >> (i % 3 * 20);
+        if (bplus_u64_count_below(window, probe) !=
+            bplus_u64_count_below_sw(window, probe)) {
+            printf("u64 window counts disagree\n");
+            ret = 1;
+        }
+    }
+
+    remove(filename);
+    return ret;
+}
+
+// every 25th key gets a value of up to a megabyte or so, the rest small ones.
+// round changes the sizes so overwrites move values in and out of line.
+int overflow_len(int k, int round) {
+    if ((k + round) % 25 == 0) {
+        return (k % 5 + 1) * 250000 + k;
+    }
+    return 40 + (k + round) % 60;
+}
+
+char overflow_byte(int k, int round, int i) {
+    return (char)(k * 31 + round * 7 + i % 251);
+}
+
+void overflow_fill(char *buf, int k, int round) {
+    int len = overflow_len(k, round);
+    for (int i = 0; i < len; i++) {
+        buf[i] = overflow_byte(k, round, i);
+    }
+}
+
+// checks a streamed value against what overflow_fill wrote
+struct overflow_check {
+    int k;
+    int round;
+    int pos;
+    int pieces;
+};
+
+int overflow_check_sink(void *ctx, const char *data, int len) {
+    struct overflow_check *check = ctx;
+    for (int i = 0; i < len; i++) {
+        if (data[i] != overflow_byte(check->k, check->round, check->pos + i)) {
+            return -1;
+        }
+    }
+    check->pos += len;
+    check->pieces++;
+    return 0;
+}
+
+// look up every key both ways, expecting the values of round
+int overflow_verify(struct bplus_tree *tree, int num_keys, int round) {
+    char key[32];
+    char *buf = malloc(overflow_len(0, 0) * 8);
+    char *want = malloc(overflow_len(0, 0) * 8);
+    int ret = 0;
+    for (int k = 0; k < num_keys && ret == 0; k++) {
+        int key_len = snprintf(key, sizeof(key), "key%06d", k);
+        int len = overflow_len(k, round);
+        int val_len;
+        overflow_fill(want, k, round);
+        if (bplus_tree_lookup(
+                tree, key, key_len, buf, overflow_len(0, 0) * 8, &val_len) !=
+                0 ||
+            val_len != len || memcmp(buf, want, len) != 0) {
+            printf("overflow: wrong value for %s\n", key);
+            ret = 1;
+        }
+        struct overflow_check check = {.k = k, .round = round};
+        if (bplus_tree_stream(
+                tree, key, key_len, overflow_check_sink, &check) != 0 ||
+            check.pos != len) {
+            printf("overflow: streaming %s went wrong\n", key);
+            ret = 1;
+        }
+    }
+    free(buf);
+    free(want);
+    return ret;
+}
+
+struct overflow_input {
+    int next;
+    int count;
+    char key[32];
+    char *val;
+};
+
+int overflow_input_next(
+    void *ctx, char **key, int *key_len, char **val, int *val_len) {
+    struct overflow_input *in = ctx;
+    if (in->next == in->count) {
+        return 0;
+    }
+    if (in->val == NULL) {
+        in->val = malloc(overflow_len(0, 0) * 8);
+    }
+
+    *key_len = snprintf(in->key, sizeof(in->key), "key%06d", in->next);
+    *val_len = overflow_len(in->next, 0);
+    overflow_fill(in->val, in->next, 0);
+    *key = in->key;
+    *val = in->val;
+    in->next++;
+    return 1;
+}
+
+// values too large for a leaf live in chains of overflow pages, so leaves
+// stay full of keys however large the values around them get
+int test_overflow(int num_keys, int wal_mode) {
+    char *filename = "/tmp/bplus_overflow";
+    char *wal_filename = "/tmp/bplus_overflow-wal";
+    remove(filename);
+    remove(wal_filename);
+    char key[32];
+    char *val = malloc(BPLUS_PAGE_SIZE * 600);
+    int ret = 0;
+
+    struct bplus_tree_options opts = {
+        .num_frames = 1024,
+        .wal_mode = wal_mode,
+    };
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, &opts);
+    for (int i = 0; i < num_keys; i++) {
+        int k = i * 7919 % num_keys;
+        int key_len = snprintf(key, sizeof(key), "key%06d", k);
+        overflow_fill(val, k, 0);
+        if (bplus_tree_put(tree, key, key_len, val, overflow_len(k, 0)) != 0) {
+            printf("overflow: couldn't put %s\n", key);
+            ret = 1;
+            break;
+        }
+    }
+    ret |= overflow_verify(tree, num_keys, 0);
+
+    // a value too large for a no-steal pool is turned away up front
+    if (wal_mode != BPLUS_WAL_OFF &&
+        bplus_tree_put(tree, "huge", 4, val, BPLUS_PAGE_SIZE * 600) == 0) {
+        printf("overflow: a value larger than the pool went in\n");
+        ret = 1;
+    }
+
+    // cursors see the length of an overflow value but not its bytes
+    struct bplus_cursor cursor;
+    bplus_cursor_init(&cursor, tree);
+    int count = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int more = bplus_cursor_first(&cursor); more > 0 && ret == 0;
+         more = bplus_cursor_next(&cursor)) {
+        int val_len;
+        char *v = bplus_cursor_value(&cursor, &val_len);
+        if (val_len != overflow_len(count, 0) ||
+            (v == NULL) != (val_len > BPLUS_MAX_INLINE_VALUE)) {
+            printf("overflow: cursor is wrong at key %d\n", count);
+            ret = 1;
+        }
+        if (count == 25) {
+            struct overflow_check check = {.k = count};
+            if (bplus_cursor_stream_value(
+                    &cursor, overflow_check_sink, &check) != 0 ||
+                check.pos != val_len || check.pieces < 2) {
+                printf("overflow: cursor stream went wrong\n");
+                ret = 1;
+            }
+        }
+        count++;
+    }
+    bplus_cursor_close(&cursor);
+    double scan_secs = elapsed(&start);
+    if (count != num_keys) {
+        printf("overflow: scan saw %d of %d keys\n", count, num_keys);
+        ret = 1;
+    }
+
+    // overwrites move values in and out of line, deletes free their chains
+    for (int k = 0; k < num_keys; k++) {
+        int key_len = snprintf(key, sizeof(key), "key%06d", k);
+        overflow_fill(val, k, 1);
+        bplus_tree_put(tree, key, key_len, val, overflow_len(k, 1));
+    }
+    ret |= overflow_verify(tree, num_keys, 1);
+    uint32_t pages = tree->pool->next_page_id;
+    for (int round = 2; round < 4; round++) {
+        for (int k = 0; k < num_keys; k++) {
+            int key_len = snprintf(key, sizeof(key), "key%06d", k);
+            overflow_fill(val, k, round % 2);
+            bplus_tree_put(tree, key, key_len, val, overflow_len(k, round % 2));
+        }
+    }
+    if (tree->pool->next_page_id > pages + pages / 4) {
+        printf(
+            "overflow: rewriting the same values grew the file from %u to %u "
+            "pages\n",
+            pages, tree->pool->next_page_id);
+        ret = 1;
+    }
+    if (bplus_tree_check(tree) != 0) {
+        ret = 1;
+    }
+
+    // a clean reopen, which replays the log when there is one
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+    tree = bplus_tree_create_opts(filename, &opts);
+    ret |= overflow_verify(tree, num_keys, 1);
+    if (bplus_tree_check(tree) != 0) {
+        ret = 1;
+    }
+
+    for (int k = 0; k < num_keys; k++) {
+        if (overflow_len(k, 1) > BPLUS_MAX_INLINE_VALUE) {
+            int key_len = snprintf(key, sizeof(key), "key%06d", k);
+            bplus_tree_remove(tree, key, key_len);
+        }
+    }
+    if (bplus_tree_compact(tree) < 0 || bplus_tree_check(tree) != 0) {
+        printf("overflow: compaction failed\n");
+        ret = 1;
+    }
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+    struct bplus_fsck_report r = {0};
+    if (bplus_fsck(filename, NULL, 2, &r) != 0 || r.num_leaves == 0) {
+        printf("overflow: fsck failed after compaction\n");
+        free(val);
+        return 1;
+    }
+    struct stat st;
+    stat(filename, &st);
+    printf(
+        "overflow: scanned %d keys in %.1f ms, %d per leaf, %lld bytes after "
+        "compaction\n",
+        num_keys, scan_secs * 1e3, num_keys / (int)r.num_leaves,
+        (long long)st.st_size);
+    if (r.num_overflow != 0 || st.st_size > 256 * BPLUS_PAGE_SIZE) {
+        printf("overflow: compaction left %u overflow pages\n", r.num_overflow);
+        ret = 1;
+    }
+
+    // batches and bulk loads take large values too
+    remove(filename);
+    remove(wal_filename);
+    tree = bplus_tree_create_opts(filename, &opts);
+    char *keys[50], *vals[50];
+    int key_lens[50], val_lens[50];
+    for (int k = 0; k < 50; k++) {
+        keys[k] = malloc(16);
+        key_lens[k] = snprintf(keys[k], 16, "key%06d", k);
+        val_lens[k] = overflow_len(k, 0);
+        vals[k] = malloc(val_lens[k]);
+        overflow_fill(vals[k], k, 0);
+    }
+    if (bplus_tree_multi_put(tree, keys, key_lens, vals, val_lens, 50) != 0) {
+        printf("overflow: multi_put failed\n");
+        ret = 1;
+    }
+    ret |= overflow_verify(tree, 50, 0);
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+    for (int k = 0; k < 50; k++) {
+        free(keys[k]);
+        free(vals[k]);
+    }
+
+    remove(wal_filename);
+    struct overflow_input in = {.count = num_keys};
+    tree = bplus_tree_bulk_load(filename, &opts, overflow_input_next, &in, 1);
+    if (tree == NULL) {
+        printf("overflow: bulk load failed\n");
+        ret = 1;
+    } else {
+        ret |= overflow_verify(tree, num_keys, 0);
+        if (bplus_tree_check(tree) != 0) {
+            ret = 1;
+        }
+        bplus_tree_flush(tree);
+        bplus_tree_destroy(tree);
+        if (bplus_fsck(filename, NULL, 2, NULL) != 0) {
+            ret = 1;
+        }
+    }
+    free(in.val);
+
+    free(val);
+    remove(filename);
+    remove(wal_filename);
+    return ret;
+}
+
+struct snapshot_writer {
+    struct bplus_tree *tree;
+    int id;
+    int num_writers;
+    int num_keys;
+};
+
+// rewrite the writer's share of the keys with round 1 values, dropping every
+// seventh and adding keys in between so pages split, merge and get reused
+void *snapshot_writer_run(void *data) {
+    struct snapshot_writer *w = data;
+    char key[32];
+    char *val = malloc(overflow_len(0, 0) * 8);
+    for (int k = w->id; k < w->num_keys; k += w->num_writers) {
+        int key_len = snprintf(key, sizeof(key), "key%06d", k);
+        if (k % 7 == 0) {
+            bplus_tree_remove(w->tree, key, key_len);
+        } else {
+            overflow_fill(val, k, 1);
+            bplus_tree_put(w->tree, key, key_len, val, overflow_len(k, 1));
+        }
+        key_len = snprintf(key, sizeof(key), "key%06d+", k);
+        bplus_tree_put(w->tree, key, key_len, "new", 3);
+    }
+    free(val);
+    return NULL;
+}
+
+// check that snap holds exactly the round 0 keys and values, scanning both
+// ways and looking keys up
+int snapshot_verify(struct bplus_snapshot *snap, int num_keys) {
+    char key[32];
+    char *buf = malloc(overflow_len(0, 0) * 8);
+    char *want = malloc(overflow_len(0, 0) * 8);
+    int ret = 0;
+
+    struct bplus_cursor c;
+    bplus_cursor_init_snapshot(&c, snap);
+    int k = 0;
+    int more;
+    for (more = bplus_cursor_first(&c); more > 0 && ret == 0;
+         more = bplus_cursor_next(&c), k++) {
+        int key_len, val_len;
+        char *ckey = bplus_cursor_key(&c, &key_len);
+        char *val = bplus_cursor_value(&c, &val_len);
+        snprintf(key, sizeof(key), "key%06d", k);
+        overflow_fill(want, k, 0);
+        struct overflow_check check = {.k = k};
+        if (key_len != (int)strlen(key) || memcmp(ckey, key, key_len) != 0 ||
+            val_len != overflow_len(k, 0)) {
+            ret = 1;
+        } else if (val != NULL) {
+            ret = memcmp(val, want, val_len) != 0;
+        } else if (
+            bplus_cursor_stream_value(&c, overflow_check_sink, &check) != 0 ||
+            check.pos != val_len) {
+            ret = 1;
+        }
+    }
+    if (ret != 0 || more < 0 || k != num_keys) {
+        printf("snapshot: scan went wrong at key %d\n", k);
+        ret = 1;
+    }
+
+    for (more = bplus_cursor_last(&c); more > 0 && ret == 0;
+         more = bplus_cursor_prev(&c)) {
+        k--;
+    }
+    bplus_cursor_close(&c);
+    if (ret == 0 && (more < 0 || k != 0)) {
+        printf("snapshot: backward scan missed %d keys\n", k);
+        ret = 1;
+    }
+
+    for (k = num_keys - 1; k >= 0 && ret == 0; k -= 3) {
+        int key_len = snprintf(key, sizeof(key), "key%06d", k);
+        int val_len;
+        overflow_fill(want, k, 0);
+        if (bplus_snapshot_lookup(
+                snap, key, key_len, buf, overflow_len(0, 0) * 8, &val_len) !=
+                0 ||
+            val_len != overflow_len(k, 0) || memcmp(buf, want, val_len) != 0) {
+            printf("snapshot: wrong value for %s\n", key);
+            ret = 1;
+        }
+    }
+    free(buf);
+    free(want);
+    return ret;
+}
+
+int snapshot_count(struct bplus_cursor *c) {
+    int n = 0;
+    int more;
+    for (more = bplus_cursor_first(c); more > 0; more = bplus_cursor_next(c)) {
+        n++;
+    }
+    bplus_cursor_close(c);
+    return more < 0 ? -1 : n;
+}
+
+// a fresh tree at filename holding the round 0 keys and values
+struct bplus_tree *snapshot_tree(
+    char *filename, struct bplus_tree_options *opts, int num_keys) {
+    char key[32];
+    char *val = malloc(overflow_len(0, 0) * 8);
+    remove(filename);
+    remove("/tmp/bplus_snapshot-wal");
+    struct bplus_tree *tree = bplus_tree_create_opts(filename, opts);
+    for (int k = 0; k < num_keys; k++) {
+        int key_len = snprintf(key, sizeof(key), "key%06d", k);
+        overflow_fill(val, k, 0);
+        bplus_tree_put(tree, key, key_len, val, overflow_len(k, 0));
+    }
+    bplus_tree_flush(tree);
+    free(val);
+    return tree;
+}
+
+// run the writers over the tree and return how long they took. scan, if
+// set, is verified alongside them.
+double snapshot_rewrite(
+    struct bplus_tree *tree,
+    int num_writers,
+    int num_keys,
+    struct bplus_snapshot *scan,
+    double *scan_secs,
+    int *ret) {
+    pthread_t threads[num_writers];
+    struct snapshot_writer writers[num_writers];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_writers; i++) {
+        writers[i] = (struct snapshot_writer){tree, i, num_writers, num_keys};
+        pthread_create(&threads[i], NULL, snapshot_writer_run, &writers[i]);
+    }
+    if (scan != NULL) {
+        *ret |= snapshot_verify(scan, num_keys);
+        *scan_secs = elapsed(&start);
+    }
+    for (int i = 0; i < num_writers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return elapsed(&start);
+}
+
+// snapshots keep seeing the tree as it was while writers rewrite it, and
+// back it up without stopping them
+int test_snapshot(int num_keys, int num_writers, int wal_mode) {
+    char *filename = "/tmp/bplus_snapshot";
+    char *backup_filename = "/tmp/bplus_snapshot_backup";
+    char key[32];
+    char *val = malloc(overflow_len(0, 0) * 8);
+    int ret = 0;
+
+    // the log needs room for every writer's chains between checkpoints
+    struct bplus_tree_options opts = {
+        .num_frames = 4096,
+        .wal_mode = wal_mode,
+    };
+
+    // what an open snapshot costs the writers, with nothing reading it
+    double secs;
+    struct bplus_tree *tree = snapshot_tree(filename, &opts, num_keys);
+    double plain_secs =
+        snapshot_rewrite(tree, num_writers, num_keys, NULL, &secs, &ret);
+    bplus_tree_destroy(tree);
+    tree = snapshot_tree(filename, &opts, num_keys);
+    struct bplus_snapshot *snap = bplus_tree_snapshot(tree);
+    double snap_secs =
+        snapshot_rewrite(tree, num_writers, num_keys, NULL, &secs, &ret);
+    ret |= snapshot_verify(snap, num_keys);
+    bplus_snapshot_release(snap);
+    bplus_tree_destroy(tree);
+    printf(
+        "snapshot: %d writers rewrote %d keys at %.0f keys/s, %.0f keys/s "
+        "with a snapshot open\n",
+        num_writers, num_keys, num_keys / plain_secs, num_keys / snap_secs);
+
+    tree = snapshot_tree(filename, &opts, num_keys);
+    snap = bplus_tree_snapshot(tree);
+    snapshot_rewrite(tree, num_writers, num_keys, snap, &secs, &ret);
+    ret |= snapshot_verify(snap, num_keys);
+
+    // the live tree moved on
+    int val_len;
+    if (bplus_tree_lookup(tree, "key000007", 9, val, 64, &val_len) != 1 ||
+        bplus_tree_lookup(tree, "key000008+", 10, val, 64, &val_len) != 0) {
+        printf("snapshot: writes didn't reach the live tree\n");
+        ret = 1;
+    }
+    if (bplus_tree_compact(tree) == 0) {
+        printf("snapshot: compacted under an open snapshot\n");
+        ret = 1;
+    }
+
+    // a second snapshot sees the writes, the first still doesn't
+    struct bplus_cursor c;
+    bplus_cursor_init(&c, tree);
+    int live = snapshot_count(&c);
+    struct bplus_snapshot *snap2 = bplus_tree_snapshot(tree);
+    for (int k = 0; k < num_keys; k += 3) {
+        int key_len = snprintf(key, sizeof(key), "key%06d+", k);
+        bplus_tree_remove(tree, key, key_len);
+    }
+    bplus_cursor_init_snapshot(&c, snap2);
+    if (snapshot_count(&c) != live) {
+        printf("snapshot: second snapshot doesn't hold %d keys\n", live);
+        ret = 1;
+    }
+    ret |= snapshot_verify(snap, num_keys);
+
+    if (bplus_snapshot_backup(snap, backup_filename) != 0) {
+        ret = 1;
+    }
+    bplus_snapshot_release(snap);
+    bplus_cursor_init_snapshot(&c, snap2);
+    if (snapshot_count(&c) != live) {
+        printf("snapshot: releasing the first snapshot broke the second\n");
+        ret = 1;
+    }
+    bplus_snapshot_release(snap2);
+    printf(
+        "snapshot: scanned %d keys in %.1f ms alongside %d writers, %llu "
+        "pages copied aside\n",
+        num_keys, secs * 1e3, num_writers,
+        (unsigned long long)tree->pool->stats.versions);
+    if (tree->pool->versions != NULL || tree->pool->stats.versions == 0) {
+        printf("snapshot: page images weren't kept or weren't freed\n");
+        ret = 1;
+    }
+    if (bplus_tree_check(tree) != 0 || bplus_tree_compact(tree) != 0) {
+        ret = 1;
+    }
+    bplus_tree_flush(tree);
+    bplus_tree_destroy(tree);
+
+    // the backup is the tree as the first snapshot saw it
+    if (bplus_fsck(backup_filename, NULL, 2, NULL) != 0) {
+        ret = 1;
+    }
+    tree = bplus_tree_create_opts(backup_filename, &opts);
+    if (tree == NULL) {
+        printf("snapshot: backup doesn't open\n");
+        ret = 1;
+    } else {
+        snap = bplus_tree_snapshot(tree);
+        ret |= snapshot_verify(snap, num_keys);
+        bplus_snapshot_release(snap);
+        bplus_tree_destroy(tree);
+    }
+
+    free(val);
+    remove(filename);
+    remove("/tmp/bplus_snapshot-wal");
+    remove(backup_filename);
+    remove("/tmp/bplus_snapshot_backup-wal");
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    int ret = 0;
+    ret = test_set_and_get();
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_split_and_save(16, 1000);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_shared_prefixes();
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_range_scan(20000);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_readonly(20000);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_shared(20000, 4);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_eviction(16, 3000);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_flush(50000);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // pass a key count to run the balance check at scale, e.g. 10000000
+    int balanced_keys = 200000;
+    if (argc > 1) {
+        balanced_keys = atoi(argv[1]);
+    }
+    ret = test_balanced(balanced_keys);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_bulk_load(balanced_keys);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_delete(balanced_keys);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_hot_updates(2000, 50);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_wal_recovery(5000);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_wal_group_commit(8, 200);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_concurrent(4, 20000);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_compact(20000, BPLUS_WAL_OFF);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_compact(20000, BPLUS_WAL_SYNC_NONE);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_checksums(20000, BPLUS_WAL_OFF);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_checksums(20000, BPLUS_WAL_SYNC_NONE);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_compression(20000, BPLUS_WAL_OFF);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_compression(20000, BPLUS_WAL_SYNC_NONE);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_u64_keys(100000);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_overflow(2000, BPLUS_WAL_OFF);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_overflow(2000, BPLUS_WAL_SYNC_NONE);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_snapshot(5000, 4, BPLUS_WAL_OFF);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_snapshot(5000, 4, BPLUS_WAL_SYNC_NONE);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_multi(100000, 256);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_huge_pages(balanced_keys, 1000000);
     if (ret != 0) {
         return ret;
     }
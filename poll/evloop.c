@@ -0,0 +1,754 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef EVLOOP_HAVE_URING
+#include <liburing.h>
+#endif
+
+// a single threaded event loop: callbacks on fd readiness and on timers,
+// over a pluggable readiness backend. poll is the portable baseline, epoll
+// runs edge triggered, and io_uring keeps one multishot poll armed per fd.
+//
+// the edge triggered backends only report an fd again once new data
+// arrives, so fds should be non-blocking and callbacks must read (or write)
+// until EAGAIN. close an fd only after evloop_del.
+
+#define EVLOOP_READ 0x1
+#define EVLOOP_WRITE 0x2
+#define EVLOOP_HUP 0x4 // hangup or error, reported whether asked for or not
+
+// most ready fds one wait hands over
+#define EVLOOP_BATCH 256
+
+struct evloop;
+struct evloop_timer;
+
+typedef void (*evloop_fd_cb)(
+    struct evloop *loop, int fd, int events, void *arg);
+typedef void (*evloop_timer_cb)(
+    struct evloop *loop, struct evloop_timer *timer, void *arg);
+
+// a watched fd, indexed by fd number. gen changes with every add and mod so
+// an event queued for an earlier watch on the same fd number is dropped.
+struct evloop_watch {
+    evloop_fd_cb cb;
+    void *arg;
+    int events;
+    int active;
+    uint32_t gen;
+    int pos; // backend private
+};
+
+// one ready fd, queued by the backend and dispatched after the wait
+struct evloop_event {
+    int fd;
+    uint32_t gen;
+    int events;
+};
+
+// readiness backend. wait blocks for up to timeout_ms (-1 for no limit),
+// queues what is ready with evloop_push and returns -1 only on errors other
+// than an interrupted wait.
+struct evloop_backend {
+    const char *name;
+    int (*init)(struct evloop *loop);
+    int (*add)(struct evloop *loop, int fd, struct evloop_watch *w);
+    int (*mod)(struct evloop *loop, int fd, struct evloop_watch *w);
+    int (*del)(struct evloop *loop, int fd, struct evloop_watch *w);
+    int (*wait)(struct evloop *loop, int timeout_ms);
+    void (*close)(struct evloop *loop);
+};
+
+// timers live on a hierarchical wheel of millisecond ticks, in the style of
+// Varghese and Lauck. level 0 has a slot per tick for the next 64 ticks,
+// each level above covers 64 times the span of the one below, and timers
+// cascade down a level whenever the wheel below wraps. starting, stopping
+// and firing a timer are all O(1).
+#define EVLOOP_WHEEL_BITS 6
+#define EVLOOP_WHEEL_SIZE (1 << EVLOOP_WHEEL_BITS)
+#define EVLOOP_WHEEL_MASK (EVLOOP_WHEEL_SIZE - 1)
+#define EVLOOP_WHEEL_LEVELS 4
+// timers further out than this are parked at the edge and cascaded again
+#define EVLOOP_WHEEL_SPAN (1ULL << (EVLOOP_WHEEL_BITS * EVLOOP_WHEEL_LEVELS))
+
+struct evloop_timer {
+    evloop_timer_cb cb;
+    void *arg;
+    uint64_t expires; // tick to fire on
+    int pending;
+    struct evloop_timer *next;  // in its wheel slot
+    struct evloop_timer **pprev; // whatever points at this timer
+    int level;
+    int slot;
+};
+
+struct evloop_stats {
+    uint64_t waits;
+    uint64_t events; // fd callbacks run
+    uint64_t timers; // timer callbacks run
+};
+
+struct evloop {
+    const struct evloop_backend *backend;
+    void *ctx; // backend private state
+
+    struct evloop_watch *watches;
+    int num_watches; // length of watches, not the number in use
+    int num_active;
+
+    struct evloop_event *ready;
+    int num_ready;
+    int ready_cap;
+
+    struct evloop_timer *wheel[EVLOOP_WHEEL_LEVELS][EVLOOP_WHEEL_SIZE];
+    uint64_t occupied[EVLOOP_WHEEL_LEVELS]; // bit per non-empty slot
+    uint64_t tick; // the wheel has fired everything up to here
+    uint64_t start_ns;
+    int num_timers;
+
+    volatile int stopped;
+    struct evloop_stats stats;
+};
+
+uint64_t evloop_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// milliseconds since the loop was created, the wheel's clock
+uint64_t evloop_now(struct evloop *loop) {
+    return (evloop_now_ns() - loop->start_ns) / 1000000;
+}
+
+int evloop_events_to_poll(int events) {
+    return ((events & EVLOOP_READ) ? POLLIN : 0) |
+           ((events & EVLOOP_WRITE) ? POLLOUT : 0);
+}
+
+int evloop_events_from_poll(int revents) {
+    return ((revents & POLLIN) ? EVLOOP_READ : 0) |
+           ((revents & POLLOUT) ? EVLOOP_WRITE : 0) |
+           ((revents & (POLLHUP | POLLERR | POLLNVAL)) ? EVLOOP_HUP : 0);
+}
+
+// queue a ready fd for dispatch, called by backends from wait
+void evloop_push(struct evloop *loop, int fd, uint32_t gen, int events) {
+    if (loop->num_ready == loop->ready_cap) {
+        loop->ready_cap = loop->ready_cap > 0 ? 2 * loop->ready_cap : 64;
+        loop->ready = realloc(
+            loop->ready, loop->ready_cap * sizeof(struct evloop_event));
+    }
+    loop->ready[loop->num_ready++] = (struct evloop_event){fd, gen, events};
+}
+
+// poll backend: one pollfd per watch, kept dense by moving the last one
+// into a removed one's place. the whole set is passed to every wait.
+struct evloop_poll {
+    struct pollfd *fds;
+    int num;
+    int cap;
+};
+
+int evloop_poll_init(struct evloop *loop) {
+    loop->ctx = calloc(1, sizeof(struct evloop_poll));
+    return 0;
+}
+
+int evloop_poll_add(struct evloop *loop, int fd, struct evloop_watch *w) {
+    struct evloop_poll *p = loop->ctx;
+    if (p->num == p->cap) {
+        p->cap = p->cap > 0 ? 2 * p->cap : 64;
+        p->fds = realloc(p->fds, p->cap * sizeof(struct pollfd));
+    }
+    w->pos = p->num++;
+    p->fds[w->pos] = (struct pollfd){
+        .fd = fd,
+        .events = evloop_events_to_poll(w->events),
+    };
+    return 0;
+}
+
+int evloop_poll_mod(struct evloop *loop, int fd, struct evloop_watch *w) {
+    struct evloop_poll *p = loop->ctx;
+    p->fds[w->pos].events = evloop_events_to_poll(w->events);
+    return 0;
+}
+
+int evloop_poll_del(struct evloop *loop, int fd, struct evloop_watch *w) {
+    struct evloop_poll *p = loop->ctx;
+    struct pollfd last = p->fds[--p->num];
+    if (w->pos != p->num) {
+        p->fds[w->pos] = last;
+        loop->watches[last.fd].pos = w->pos;
+    }
+    return 0;
+}
+
+int evloop_poll_wait(struct evloop *loop, int timeout_ms) {
+    struct evloop_poll *p = loop->ctx;
+    int ready = poll(p->fds, p->num, timeout_ms);
+    if (ready < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("poll");
+        return -1;
+    }
+    for (int i = 0; i < p->num && ready > 0; i++) {
+        if (p->fds[i].revents != 0) {
+            int fd = p->fds[i].fd;
+            evloop_push(
+                loop, fd, loop->watches[fd].gen,
+                evloop_events_from_poll(p->fds[i].revents));
+            ready--;
+        }
+    }
+    return 0;
+}
+
+void evloop_poll_close(struct evloop *loop) {
+    struct evloop_poll *p = loop->ctx;
+    free(p->fds);
+    free(p);
+}
+
+const struct evloop_backend evloop_poll = {
+    .name = "poll",
+    .init = evloop_poll_init,
+    .add = evloop_poll_add,
+    .mod = evloop_poll_mod,
+    .del = evloop_poll_del,
+    .wait = evloop_poll_wait,
+    .close = evloop_poll_close,
+};
+
+// epoll backend, edge triggered. the kernel keeps the interest set, so a
+// wait costs the number of ready fds rather than the number watched. each
+// registration carries the watch's fd and gen.
+struct evloop_epoll {
+    int epfd;
+    struct epoll_event events[EVLOOP_BATCH];
+};
+
+int evloop_epoll_init(struct evloop *loop) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    struct evloop_epoll *e = malloc(sizeof(struct evloop_epoll));
+    e->epfd = epfd;
+    loop->ctx = e;
+    return 0;
+}
+
+int evloop_epoll_ctl(
+    struct evloop *loop, int op, int fd, uint32_t gen, int events) {
+    struct evloop_epoll *e = loop->ctx;
+    struct epoll_event ev = {
+        .events = EPOLLET | EPOLLRDHUP |
+                  ((events & EVLOOP_READ) ? EPOLLIN : 0) |
+                  ((events & EVLOOP_WRITE) ? EPOLLOUT : 0),
+        .data.u64 = (uint64_t)gen << 32 | (uint32_t)fd,
+    };
+    if (epoll_ctl(e->epfd, op, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+int evloop_epoll_add(struct evloop *loop, int fd, struct evloop_watch *w) {
+    return evloop_epoll_ctl(loop, EPOLL_CTL_ADD, fd, w->gen, w->events);
+}
+
+int evloop_epoll_mod(struct evloop *loop, int fd, struct evloop_watch *w) {
+    return evloop_epoll_ctl(loop, EPOLL_CTL_MOD, fd, w->gen, w->events);
+}
+
+int evloop_epoll_del(struct evloop *loop, int fd, struct evloop_watch *w) {
+    return evloop_epoll_ctl(loop, EPOLL_CTL_DEL, fd, w->gen, w->events);
+}
+
+int evloop_epoll_wait(struct evloop *loop, int timeout_ms) {
+    struct evloop_epoll *e = loop->ctx;
+    int n = epoll_wait(e->epfd, e->events, EVLOOP_BATCH, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("epoll_wait");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        uint32_t flags = e->events[i].events;
+        uint64_t data = e->events[i].data.u64;
+        int events = ((flags & EPOLLIN) ? EVLOOP_READ : 0) |
+                     ((flags & EPOLLOUT) ? EVLOOP_WRITE : 0) |
+                     ((flags & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+                          ? EVLOOP_HUP
+                          : 0);
+        evloop_push(loop, (int)(uint32_t)data, data >> 32, events);
+    }
+    return 0;
+}
+
+void evloop_epoll_close(struct evloop *loop) {
+    struct evloop_epoll *e = loop->ctx;
+    close(e->epfd);
+    free(e);
+}
+
+const struct evloop_backend evloop_epoll = {
+    .name = "epoll",
+    .init = evloop_epoll_init,
+    .add = evloop_epoll_add,
+    .mod = evloop_epoll_mod,
+    .del = evloop_epoll_del,
+    .wait = evloop_epoll_wait,
+    .close = evloop_epoll_close,
+};
+
+#ifdef EVLOOP_HAVE_URING
+// io_uring backend: a multishot poll per fd posts a completion every time
+// the fd becomes ready, without being re-armed. adds, changes and removals
+// only queue submissions, which go to the kernel together with the next
+// wait, and a wait reaps up to EVLOOP_BATCH completions in one go.
+// user_data carries the watch's fd and gen, removals carry
+// EVLOOP_URING_IGNORE.
+#define EVLOOP_URING_DEPTH 1024
+#define EVLOOP_URING_IGNORE UINT64_MAX
+
+struct evloop_uring {
+    struct io_uring ring;
+};
+
+uint64_t evloop_uring_data(int fd, uint32_t gen) {
+    return (uint64_t)gen << 32 | (uint32_t)fd;
+}
+
+// a free submission slot, flushing the queue to the kernel if it is full
+struct io_uring_sqe *evloop_uring_sqe(struct evloop_uring *u) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+    if (sqe == NULL) {
+        io_uring_submit(&u->ring);
+        sqe = io_uring_get_sqe(&u->ring);
+    }
+    return sqe;
+}
+
+int evloop_uring_init(struct evloop *loop) {
+    struct evloop_uring *u = malloc(sizeof(struct evloop_uring));
+    int ret = io_uring_queue_init(EVLOOP_URING_DEPTH, &u->ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring queue_init failed: %s\n", strerror(-ret));
+        free(u);
+        return -1;
+    }
+    loop->ctx = u;
+    return 0;
+}
+
+int evloop_uring_arm(struct evloop *loop, int fd, struct evloop_watch *w) {
+    struct io_uring_sqe *sqe = evloop_uring_sqe(loop->ctx);
+    if (sqe == NULL) {
+        printf("io_uring submission queue is full\n");
+        return -1;
+    }
+    io_uring_prep_poll_multishot(sqe, fd, evloop_events_to_poll(w->events));
+    io_uring_sqe_set_data64(sqe, evloop_uring_data(fd, w->gen));
+    return 0;
+}
+
+// cancel the poll armed for fd under gen
+int evloop_uring_cancel(struct evloop *loop, int fd, uint32_t gen) {
+    struct io_uring_sqe *sqe = evloop_uring_sqe(loop->ctx);
+    if (sqe == NULL) {
+        printf("io_uring submission queue is full\n");
+        return -1;
+    }
+    io_uring_prep_poll_remove(sqe, evloop_uring_data(fd, gen));
+    io_uring_sqe_set_data64(sqe, EVLOOP_URING_IGNORE);
+    return 0;
+}
+
+int evloop_uring_add(struct evloop *loop, int fd, struct evloop_watch *w) {
+    return evloop_uring_arm(loop, fd, w);
+}
+
+// the old poll goes and a new one with the new gen takes its place. any
+// completion still in flight for the old one is dropped by its gen.
+int evloop_uring_mod(struct evloop *loop, int fd, struct evloop_watch *w) {
+    if (evloop_uring_cancel(loop, fd, w->gen - 1) < 0) {
+        return -1;
+    }
+    return evloop_uring_arm(loop, fd, w);
+}
+
+int evloop_uring_del(struct evloop *loop, int fd, struct evloop_watch *w) {
+    return evloop_uring_cancel(loop, fd, w->gen);
+}
+
+int evloop_uring_wait(struct evloop *loop, int timeout_ms) {
+    struct evloop_uring *u = loop->ctx;
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000LL,
+    };
+    struct io_uring_cqe *cqe;
+    int ret = io_uring_submit_and_wait_timeout(
+        &u->ring, &cqe, 1, timeout_ms >= 0 ? &ts : NULL, NULL);
+    if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+        fprintf(stderr, "io_uring wait: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    struct io_uring_cqe *cqes[EVLOOP_BATCH];
+    unsigned n = io_uring_peek_batch_cqe(&u->ring, cqes, EVLOOP_BATCH);
+    for (unsigned i = 0; i < n; i++) {
+        uint64_t data = io_uring_cqe_get_data64(cqes[i]);
+        int res = cqes[i]->res;
+        if (data == EVLOOP_URING_IGNORE || res == -ECANCELED) {
+            continue;
+        }
+        int fd = (int)(uint32_t)data;
+        uint32_t gen = data >> 32;
+        struct evloop_watch *w =
+            fd < loop->num_watches ? &loop->watches[fd] : NULL;
+        int current = w != NULL && w->active && w->gen == gen;
+
+        // the kernel ends a multishot poll on overflow or error. put a new
+        // one in its place if the watch is still there.
+        if (!(cqes[i]->flags & IORING_CQE_F_MORE) && current && res >= 0) {
+            evloop_uring_arm(loop, fd, w);
+        }
+        evloop_push(
+            loop, fd, gen, res < 0 ? EVLOOP_HUP : evloop_events_from_poll(res));
+    }
+    io_uring_cq_advance(&u->ring, n);
+    return 0;
+}
+
+void evloop_uring_close(struct evloop *loop) {
+    struct evloop_uring *u = loop->ctx;
+    io_uring_queue_exit(&u->ring);
+    free(u);
+}
+
+const struct evloop_backend evloop_uring = {
+    .name = "io_uring",
+    .init = evloop_uring_init,
+    .add = evloop_uring_add,
+    .mod = evloop_uring_mod,
+    .del = evloop_uring_del,
+    .wait = evloop_uring_wait,
+    .close = evloop_uring_close,
+};
+#endif
+
+// every backend built in, NULL terminated
+const struct evloop_backend *evloop_backends[] = {
+    &evloop_poll,
+    &evloop_epoll,
+#ifdef EVLOOP_HAVE_URING
+    &evloop_uring,
+#endif
+    NULL,
+};
+
+const struct evloop_backend *evloop_backend_find(const char *name) {
+    for (int i = 0; evloop_backends[i] != NULL; i++) {
+        if (strcmp(evloop_backends[i]->name, name) == 0) {
+            return evloop_backends[i];
+        }
+    }
+    return NULL;
+}
+
+// create a loop on backend, falling back to poll if it can't start. NULL
+// picks epoll.
+struct evloop *evloop_create(const struct evloop_backend *backend) {
+    struct evloop *loop = calloc(1, sizeof(struct evloop));
+    loop->backend = backend != NULL ? backend : &evloop_epoll;
+    loop->start_ns = evloop_now_ns();
+    if (loop->backend->init(loop) < 0) {
+        printf("%s backend unavailable, using poll\n", loop->backend->name);
+        loop->backend = &evloop_poll;
+        loop->backend->init(loop);
+    }
+    return loop;
+}
+
+void evloop_destroy(struct evloop *loop) {
+    loop->backend->close(loop);
+    free(loop->watches);
+    free(loop->ready);
+    free(loop);
+}
+
+// call cb(loop, fd, events, arg) whenever fd is ready for any of events
+int evloop_add(
+    struct evloop *loop, int fd, int events, evloop_fd_cb cb, void *arg) {
+    if (fd < 0) {
+        return -1;
+    }
+    if (fd >= loop->num_watches) {
+        int n = loop->num_watches > 0 ? loop->num_watches : 64;
+        while (n <= fd) {
+            n *= 2;
+        }
+        loop->watches =
+            realloc(loop->watches, n * sizeof(struct evloop_watch));
+        memset(
+            &loop->watches[loop->num_watches], 0,
+            (n - loop->num_watches) * sizeof(struct evloop_watch));
+        loop->num_watches = n;
+    }
+
+    struct evloop_watch *w = &loop->watches[fd];
+    if (w->active) {
+        printf("fd %d is already watched\n", fd);
+        return -1;
+    }
+    w->cb = cb;
+    w->arg = arg;
+    w->events = events;
+    w->gen++;
+    if (loop->backend->add(loop, fd, w) < 0) {
+        return -1;
+    }
+    w->active = 1;
+    loop->num_active++;
+    return 0;
+}
+
+// change the readiness a watched fd is reported for
+int evloop_mod(struct evloop *loop, int fd, int events) {
+    if (fd < 0 || fd >= loop->num_watches || !loop->watches[fd].active) {
+        return -1;
+    }
+    struct evloop_watch *w = &loop->watches[fd];
+    if (w->events == events) {
+        return 0;
+    }
+    w->events = events;
+    w->gen++;
+    return loop->backend->mod(loop, fd, w);
+}
+
+// stop watching fd. events already queued for it are dropped.
+int evloop_del(struct evloop *loop, int fd) {
+    if (fd < 0 || fd >= loop->num_watches || !loop->watches[fd].active) {
+        return -1;
+    }
+    struct evloop_watch *w = &loop->watches[fd];
+    w->active = 0;
+    loop->num_active--;
+    return loop->backend->del(loop, fd, w);
+}
+
+void evloop_timer_init(
+    struct evloop_timer *t, evloop_timer_cb cb, void *arg) {
+    memset(t, 0, sizeof(*t));
+    t->cb = cb;
+    t->arg = arg;
+}
+
+// put a timer in the slot for its expiry, relative to the current tick
+void evloop_timer_link(struct evloop *loop, struct evloop_timer *t) {
+    uint64_t expires = t->expires;
+    if (expires < loop->tick) {
+        expires = loop->tick;
+    }
+    if (expires - loop->tick >= EVLOOP_WHEEL_SPAN) {
+        expires = loop->tick + EVLOOP_WHEEL_SPAN - 1;
+    }
+
+    uint64_t delta = expires - loop->tick;
+    int level = 0;
+    while (delta >= 1ULL << (EVLOOP_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    int slot = (expires >> (EVLOOP_WHEEL_BITS * level)) & EVLOOP_WHEEL_MASK;
+
+    struct evloop_timer **head = &loop->wheel[level][slot];
+    t->next = *head;
+    if (*head != NULL) {
+        (*head)->pprev = &t->next;
+    }
+    *head = t;
+    t->pprev = head;
+    t->level = level;
+    t->slot = slot;
+    loop->occupied[level] |= 1ULL << slot;
+}
+
+void evloop_timer_unlink(struct evloop *loop, struct evloop_timer *t) {
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    if (loop->wheel[t->level][t->slot] == NULL) {
+        loop->occupied[t->level] &= ~(1ULL << t->slot);
+    }
+}
+
+// fire t once, ms milliseconds from now. restarting a pending timer moves
+// it. callbacks may start timers, including their own.
+void evloop_timer_start(
+    struct evloop *loop, struct evloop_timer *t, uint64_t ms) {
+    if (t->pending) {
+        evloop_timer_unlink(loop, t);
+    } else {
+        t->pending = 1;
+        loop->num_timers++;
+    }
+    // never on the tick the wheel is already past
+    uint64_t now = evloop_now(loop);
+    t->expires = (now > loop->tick ? now : loop->tick) + (ms > 0 ? ms : 1);
+    evloop_timer_link(loop, t);
+}
+
+void evloop_timer_stop(struct evloop *loop, struct evloop_timer *t) {
+    if (t->pending) {
+        evloop_timer_unlink(loop, t);
+        t->pending = 0;
+        loop->num_timers--;
+    }
+}
+
+// move the timers of a slot down to where they now belong
+void evloop_timer_cascade(struct evloop *loop, int level, int slot) {
+    struct evloop_timer *t = loop->wheel[level][slot];
+    loop->wheel[level][slot] = NULL;
+    loop->occupied[level] &= ~(1ULL << slot);
+    while (t != NULL) {
+        struct evloop_timer *next = t->next;
+        evloop_timer_link(loop, t);
+        t = next;
+    }
+}
+
+// tick the wheel forward to now, firing whatever comes due on the way
+void evloop_timer_advance(struct evloop *loop, uint64_t now) {
+    while (loop->tick < now) {
+        if (loop->num_timers == 0) {
+            loop->tick = now;
+            return;
+        }
+        uint64_t tick = ++loop->tick;
+        // higher levels first, so a timer can cascade all the way down to
+        // the slot about to fire
+        for (int level = EVLOOP_WHEEL_LEVELS - 1; level > 0; level--) {
+            uint64_t below = (1ULL << (EVLOOP_WHEEL_BITS * level)) - 1;
+            if ((tick & below) == 0) {
+                evloop_timer_cascade(
+                    loop, level,
+                    (tick >> (EVLOOP_WHEEL_BITS * level)) & EVLOOP_WHEEL_MASK);
+            }
+        }
+
+        struct evloop_timer *t;
+        int slot = tick & EVLOOP_WHEEL_MASK;
+        while ((t = loop->wheel[0][slot]) != NULL) {
+            evloop_timer_unlink(loop, t);
+            t->pending = 0;
+            loop->num_timers--;
+            loop->stats.timers++;
+            t->cb(loop, t, t->arg);
+        }
+    }
+}
+
+// milliseconds the loop may sleep before the wheel has work, -1 if it has
+// none. a cascade counts as work.
+int evloop_timer_timeout(struct evloop *loop) {
+    if (loop->num_timers == 0) {
+        return -1;
+    }
+
+    // the nearest occupied level 0 slot after the current tick
+    uint64_t ticks = EVLOOP_WHEEL_SPAN;
+    uint64_t bits = loop->occupied[0];
+    if (bits != 0) {
+        int from = (loop->tick + 1) & EVLOOP_WHEEL_MASK;
+        bits = from == 0 ? bits : (bits >> from) | (bits << (64 - from));
+        ticks = __builtin_ctzll(bits) + 1;
+    }
+    for (int level = 1; level < EVLOOP_WHEEL_LEVELS; level++) {
+        if (loop->occupied[level] != 0) {
+            uint64_t wrap =
+                EVLOOP_WHEEL_SIZE - (loop->tick & EVLOOP_WHEEL_MASK);
+            ticks = wrap < ticks ? wrap : ticks;
+            break;
+        }
+    }
+
+    uint64_t due = loop->tick + ticks;
+    uint64_t now = evloop_now(loop);
+    return due > now ? (int)(due - now) : 0;
+}
+
+// fire due timers, wait up to max_wait_ms (-1 for as long as nothing is
+// due) for fds to become ready and run their callbacks. returns the number
+// of fd callbacks run or -1.
+int evloop_run_once(struct evloop *loop, int max_wait_ms) {
+    evloop_timer_advance(loop, evloop_now(loop));
+
+    int timeout = evloop_timer_timeout(loop);
+    if (max_wait_ms >= 0 && (timeout < 0 || timeout > max_wait_ms)) {
+        timeout = max_wait_ms;
+    }
+    if (loop->stopped) {
+        timeout = 0;
+    }
+
+    loop->num_ready = 0;
+    loop->stats.waits++;
+    if (loop->backend->wait(loop, timeout) < 0) {
+        return -1;
+    }
+
+    int n = 0;
+    for (int i = 0; i < loop->num_ready; i++) {
+        struct evloop_event *ev = &loop->ready[i];
+        if (ev->fd >= loop->num_watches) {
+            continue;
+        }
+        // an earlier callback in the batch may have removed or replaced it
+        struct evloop_watch *w = &loop->watches[ev->fd];
+        if (!w->active || w->gen != ev->gen) {
+            continue;
+        }
+        int events = ev->events & (w->events | EVLOOP_HUP);
+        if (events != 0) {
+            w->cb(loop, ev->fd, events, w->arg);
+            n++;
+        }
+    }
+    loop->stats.events += n;
+
+    evloop_timer_advance(loop, evloop_now(loop));
+    return n;
+}
+
+// run until evloop_stop, which callbacks and signal handlers may call
+int evloop_run(struct evloop *loop) {
+    loop->stopped = 0;
+    while (!loop->stopped) {
+        if (evloop_run_once(loop, -1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void evloop_stop(struct evloop *loop) { loop->stopped = 1; }
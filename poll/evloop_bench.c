@@ -0,0 +1,317 @@
+#include "evloop.c"
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// drives thousands of pipes, fifos or socketpairs through each event loop
+// backend and reports dispatch throughput and wakeup latency
+
+#define LATENCY_SAMPLES 2000
+
+enum bench_kind { KIND_PIPE, KIND_FIFO, KIND_SOCKETPAIR, KIND_COUNT };
+
+const char *bench_kind_names[] = {"pipe", "fifo", "socketpair"};
+
+struct bench_channel {
+    int rfd;
+    int wfd;
+};
+
+struct bench {
+    struct bench_channel *channels;
+    int num_channels;
+    uint64_t events; // callbacks run so far
+
+    // latency, one sample in flight at a time
+    uint64_t *samples;
+    int num_samples;
+    int ack;
+};
+
+uint64_t scramble(uint64_t x) {
+    x ^= x >> 31;
+    x *= 0x7fb5d329728ea185ULL;
+    x ^= x >> 27;
+    x *= 0x81dadef4bc2dd44dULL;
+    x ^= x >> 33;
+    return x;
+}
+
+void set_nonblock(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+int channel_open(enum bench_kind kind, int i, struct bench_channel *c) {
+    int fds[2];
+    switch (kind) {
+    case KIND_PIPE:
+        if (pipe(fds) < 0) {
+            perror("pipe");
+            return -1;
+        }
+        c->rfd = fds[0];
+        c->wfd = fds[1];
+        break;
+    case KIND_SOCKETPAIR:
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("socketpair");
+            return -1;
+        }
+        c->rfd = fds[0];
+        c->wfd = fds[1];
+        break;
+    case KIND_FIFO: {
+        // the read end first, a non-blocking writer can't open without one
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/evloop_bench.%d.%d", getpid(), i);
+        if (mkfifo(path, S_IRUSR | S_IWUSR) < 0) {
+            perror("mkfifo");
+            return -1;
+        }
+        c->rfd = open(path, O_RDONLY | O_NONBLOCK);
+        c->wfd = open(path, O_WRONLY | O_NONBLOCK);
+        unlink(path);
+        if (c->rfd < 0 || c->wfd < 0) {
+            perror("open fifo");
+            return -1;
+        }
+        break;
+    }
+    default:
+        return -1;
+    }
+    set_nonblock(c->rfd);
+    set_nonblock(c->wfd);
+    return 0;
+}
+
+// count an event and drain the channel, as edge triggered backends need
+void on_ready(struct evloop *loop, int fd, int events, void *arg) {
+    struct bench *b = arg;
+    char buf[256];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    b->events++;
+}
+
+// every round writes a byte to active channels, spread over the set, and
+// runs the loop until each has been dispatched
+int bench_throughput(
+    struct evloop *loop, struct bench *b, int active, int rounds,
+    double *events_per_sec) {
+    uint64_t start = evloop_now_ns();
+    uint64_t expect = b->events;
+    for (int r = 0; r < rounds; r++) {
+        int first = scramble(r) % b->num_channels;
+        for (int i = 0; i < active; i++) {
+            int c = (first + (uint64_t)i * b->num_channels / active) %
+                    b->num_channels;
+            if (write(b->channels[c].wfd, "x", 1) != 1) {
+                perror("write");
+                return -1;
+            }
+        }
+        expect += active;
+        while (b->events < expect) {
+            if (evloop_run_once(loop, 1000) <= 0) {
+                printf(
+                    "%s: %llu of %llu events arrived\n", loop->backend->name,
+                    (unsigned long long)b->events,
+                    (unsigned long long)expect);
+                return -1;
+            }
+        }
+    }
+    double secs = (evloop_now_ns() - start) / 1e9;
+    *events_per_sec = (double)active * rounds / secs;
+    return 0;
+}
+
+void on_timestamp(struct evloop *loop, int fd, int events, void *arg) {
+    struct bench *b = arg;
+    uint64_t sent;
+    while (read(fd, &sent, sizeof(sent)) == sizeof(sent)) {
+        b->samples[b->num_samples++] = evloop_now_ns() - sent;
+        __atomic_store_n(&b->ack, 1, __ATOMIC_RELEASE);
+        if (b->num_samples == LATENCY_SAMPLES) {
+            evloop_stop(loop);
+        }
+    }
+}
+
+// sends a timestamp down a random channel once the last one was read, so
+// every sample times a wakeup of an idle loop
+void *latency_writer(void *arg) {
+    struct bench *b = arg;
+    for (int i = 0; i < LATENCY_SAMPLES; i++) {
+        struct bench_channel *c =
+            &b->channels[scramble(i + 1) % b->num_channels];
+        __atomic_store_n(&b->ack, 0, __ATOMIC_RELAXED);
+        usleep(100);
+        uint64_t now = evloop_now_ns();
+        if (write(c->wfd, &now, sizeof(now)) != sizeof(now)) {
+            perror("write");
+            return NULL;
+        }
+        while (!__atomic_load_n(&b->ack, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int bench_latency(
+    struct evloop *loop, struct bench *b, double *p50, double *p99) {
+    for (int i = 0; i < b->num_channels; i++) {
+        evloop_del(loop, b->channels[i].rfd);
+        evloop_add(loop, b->channels[i].rfd, EVLOOP_READ, on_timestamp, b);
+    }
+    b->num_samples = 0;
+
+    pthread_t writer;
+    pthread_create(&writer, NULL, latency_writer, b);
+    int ret = evloop_run(loop);
+    pthread_join(writer, NULL);
+    if (ret < 0) {
+        return -1;
+    }
+
+    qsort(b->samples, b->num_samples, sizeof(uint64_t), cmp_u64);
+    *p50 = b->samples[b->num_samples / 2] / 1e3;
+    *p99 = b->samples[b->num_samples * 99 / 100] / 1e3;
+    return 0;
+}
+
+int bench_backend(
+    const struct evloop_backend *backend, enum bench_kind kind,
+    int num_channels, int rounds) {
+    struct bench b = {
+        .num_channels = num_channels,
+        .samples = malloc(LATENCY_SAMPLES * sizeof(uint64_t)),
+    };
+    b.channels = malloc(num_channels * sizeof(struct bench_channel));
+    for (int i = 0; i < num_channels; i++) {
+        if (channel_open(kind, i, &b.channels[i]) < 0) {
+            printf("opened %d of %d channels\n", i, num_channels);
+            return 1;
+        }
+    }
+
+    struct evloop *loop = evloop_create(backend);
+    const char *name = loop->backend->name;
+    for (int i = 0; i < num_channels; i++) {
+        evloop_add(loop, b.channels[i].rfd, EVLOOP_READ, on_ready, &b);
+    }
+
+    // every channel ready in every round, then a sparse 1% of them
+    double all, sparse, p50, p99;
+    int few = num_channels / 100 > 0 ? num_channels / 100 : 1;
+    if (bench_throughput(loop, &b, num_channels, rounds, &all) < 0 ||
+        bench_throughput(loop, &b, few, rounds * 10, &sparse) < 0 ||
+        bench_latency(loop, &b, &p50, &p99) < 0) {
+        return 1;
+    }
+    printf(
+        "%-9s %-10s %6d fds %11.0f ev/s all %11.0f ev/s 1%% "
+        "%8.1f us p50 %8.1f us p99\n",
+        name, bench_kind_names[kind], num_channels, all, sparse, p50, p99);
+
+    for (int i = 0; i < num_channels; i++) {
+        evloop_del(loop, b.channels[i].rfd);
+        close(b.channels[i].rfd);
+        close(b.channels[i].wfd);
+    }
+    evloop_destroy(loop);
+    free(b.channels);
+    free(b.samples);
+    return 0;
+}
+
+void usage(const char *prog) {
+    printf(
+        "usage: %s [-n channels] [-r rounds] [-k pipe|fifo|socketpair] "
+        "[-b backend]\n",
+        prog);
+}
+
+int main(int argc, char *argv[]) {
+    int num_channels = 10000;
+    int rounds = 20;
+    int kind = -1;
+    const struct evloop_backend *backend = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:k:b:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            num_channels = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'k':
+            for (kind = KIND_COUNT - 1; kind >= 0; kind--) {
+                if (strcmp(optarg, bench_kind_names[kind]) == 0) {
+                    break;
+                }
+            }
+            if (kind < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            backend = evloop_backend_find(optarg);
+            if (backend == NULL) {
+                printf("unknown backend %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (num_channels < 1 || rounds < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // two fds a channel plus headroom
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)num_channels * 2 + 64) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < (rlim_t)num_channels * 2 + 64) {
+            num_channels = (rl.rlim_cur - 64) / 2;
+            printf("fd limit allows %d channels\n", num_channels);
+        }
+    }
+
+    int ret = 0;
+    for (int k = 0; k < KIND_COUNT; k++) {
+        if (kind >= 0 && k != kind) {
+            continue;
+        }
+        for (int i = 0; evloop_backends[i] != NULL; i++) {
+            if (backend != NULL && evloop_backends[i] != backend) {
+                continue;
+            }
+            ret |= bench_backend(evloop_backends[i], k, num_channels, rounds);
+        }
+    }
+    return ret;
+}
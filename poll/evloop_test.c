@@ -0,0 +1,309 @@
+#include "evloop.c"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct fd_check {
+    int *calls; // callbacks seen, by fd
+    int *last_events;
+    int pair[2]; // whichever of these runs first removes the other
+    int pair_armed;
+};
+
+void fd_check_cb(struct evloop *loop, int fd, int events, void *arg) {
+    struct fd_check *check = arg;
+    check->calls[fd]++;
+    check->last_events[fd] = events;
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    if (check->pair_armed) {
+        if (fd == check->pair[0]) {
+            evloop_del(loop, check->pair[1]);
+            check->pair_armed = 0;
+        } else if (fd == check->pair[1]) {
+            evloop_del(loop, check->pair[0]);
+            check->pair_armed = 0;
+        }
+    }
+}
+
+int test_fds(const struct evloop_backend *backend, int num_pipes) {
+    struct evloop *loop = evloop_create(backend);
+    const char *name = loop->backend->name;
+    int (*pipes)[2] = malloc(num_pipes * sizeof(int[2]));
+    struct fd_check check = {0};
+    int max_fd = 0;
+
+    for (int i = 0; i < num_pipes; i++) {
+        if (pipe(pipes[i]) < 0) {
+            perror("pipe");
+            return 1;
+        }
+        fcntl(pipes[i][0], F_SETFL, O_NONBLOCK);
+        fcntl(pipes[i][1], F_SETFL, O_NONBLOCK);
+        max_fd = pipes[i][1] > max_fd ? pipes[i][1] : max_fd;
+    }
+    check.calls = calloc(max_fd + 1, sizeof(int));
+    check.last_events = calloc(max_fd + 1, sizeof(int));
+    for (int i = 0; i < num_pipes; i++) {
+        evloop_add(loop, pipes[i][0], EVLOOP_READ, fd_check_cb, &check);
+    }
+
+    // nothing written, nothing ready
+    if (evloop_run_once(loop, 0) != 0) {
+        printf("%s: callbacks ran with nothing ready\n", name);
+        return 1;
+    }
+
+    // every third pipe gets a byte, and only those are reported
+    for (int i = 0; i < num_pipes; i += 3) {
+        write(pipes[i][1], "x", 1);
+    }
+    int expect = (num_pipes + 2) / 3;
+    int seen = 0;
+    while (seen < expect) {
+        int n = evloop_run_once(loop, 1000);
+        if (n <= 0) {
+            printf("%s: %d of %d ready pipes reported\n", name, seen, expect);
+            return 1;
+        }
+        seen += n;
+    }
+    for (int i = 0; i < num_pipes; i++) {
+        int want = i % 3 == 0 ? 1 : 0;
+        if (check.calls[pipes[i][0]] != want) {
+            printf(
+                "%s: pipe %d reported %d times, expected %d\n", name, i,
+                check.calls[pipes[i][0]], want);
+            return 1;
+        }
+        if (want && check.last_events[pipes[i][0]] != EVLOOP_READ) {
+            printf(
+                "%s: pipe %d reported events %d\n", name, i,
+                check.last_events[pipes[i][0]]);
+            return 1;
+        }
+    }
+
+    // drained, so nothing is reported twice
+    if (evloop_run_once(loop, 0) != 0) {
+        printf("%s: drained pipes reported again\n", name);
+        return 1;
+    }
+
+    // two pipes ready at once and whichever runs first removes the other,
+    // so exactly one callback runs
+    memset(check.calls, 0, (max_fd + 1) * sizeof(int));
+    write(pipes[0][1], "x", 1);
+    write(pipes[1][1], "x", 1);
+    check.pair[0] = pipes[0][0];
+    check.pair[1] = pipes[1][0];
+    check.pair_armed = 1;
+    int n = evloop_run_once(loop, 1000);
+    if (n != 1 || check.calls[pipes[0][0]] + check.calls[pipes[1][0]] != 1) {
+        printf("%s: event ran for a watch removed in the same batch\n", name);
+        return 1;
+    }
+    // the removed one still has its byte and is reported once watched again
+    int removed = check.calls[pipes[0][0]] ? pipes[1][0] : pipes[0][0];
+    evloop_add(loop, removed, EVLOOP_READ, fd_check_cb, &check);
+    if (evloop_run_once(loop, 1000) != 1 || check.calls[removed] != 1) {
+        printf("%s: ready fd not reported when watched again\n", name);
+        return 1;
+    }
+
+    // a write end only reports once asked for write readiness
+    memset(check.calls, 0, (max_fd + 1) * sizeof(int));
+    int wfd = pipes[2][1];
+    evloop_add(loop, wfd, 0, fd_check_cb, &check);
+    evloop_run_once(loop, 0);
+    if (check.calls[wfd] != 0) {
+        printf("%s: write end reported with no interest\n", name);
+        return 1;
+    }
+    evloop_mod(loop, wfd, EVLOOP_WRITE);
+    if (evloop_run_once(loop, 1000) != 1 ||
+        check.last_events[wfd] != EVLOOP_WRITE) {
+        printf("%s: write readiness not reported after mod\n", name);
+        return 1;
+    }
+    evloop_del(loop, wfd);
+
+    // closing the write end hangs up the read end
+    evloop_del(loop, pipes[3][0]);
+    evloop_add(loop, pipes[3][0], EVLOOP_READ, fd_check_cb, &check);
+    close(pipes[3][1]);
+    pipes[3][1] = -1;
+    check.last_events[pipes[3][0]] = 0;
+    while (evloop_run_once(loop, 1000) > 0 &&
+           !(check.last_events[pipes[3][0]] & EVLOOP_HUP)) {
+    }
+    if (!(check.last_events[pipes[3][0]] & EVLOOP_HUP)) {
+        printf("%s: hangup not reported\n", name);
+        return 1;
+    }
+
+    for (int i = 0; i < num_pipes; i++) {
+        evloop_del(loop, pipes[i][0]);
+        close(pipes[i][0]);
+        if (pipes[i][1] >= 0) {
+            close(pipes[i][1]);
+        }
+    }
+    free(pipes);
+    free(check.calls);
+    free(check.last_events);
+    evloop_destroy(loop);
+    return 0;
+}
+
+struct timer_check {
+    struct evloop_timer timer;
+    uint64_t due;
+    uint64_t fired; // tick it fired on, 0 if not yet
+};
+
+void timer_check_cb(struct evloop *loop, struct evloop_timer *t, void *arg) {
+    struct timer_check *check = arg;
+    check->fired = loop->tick;
+}
+
+// move the loop's clock forward without sleeping
+void clock_jump(struct evloop *loop, uint64_t ms) {
+    loop->start_ns -= ms * 1000000;
+}
+
+int test_timers(int num_timers) {
+    struct evloop *loop = evloop_create(&evloop_poll);
+    struct timer_check *checks =
+        calloc(num_timers, sizeof(struct timer_check));
+    uint64_t max_due = 0;
+
+    // delays on every level of the wheel and a few past its span
+    srand(7);
+    for (int i = 0; i < num_timers; i++) {
+        uint64_t ms;
+        switch (i % 5) {
+        case 0:
+            ms = rand() % 64;
+            break;
+        case 1:
+            ms = rand() % 4096;
+            break;
+        case 2:
+            ms = rand() % 262144;
+            break;
+        case 3:
+            ms = rand() % EVLOOP_WHEEL_SPAN;
+            break;
+        default:
+            ms = EVLOOP_WHEEL_SPAN + rand() % 100000;
+        }
+        evloop_timer_init(&checks[i].timer, timer_check_cb, &checks[i]);
+        evloop_timer_start(loop, &checks[i].timer, ms);
+        checks[i].due = checks[i].timer.expires;
+        max_due = checks[i].due > max_due ? checks[i].due : max_due;
+    }
+    // every other timer of the first ten is stopped again
+    for (int i = 0; i < num_timers && i < 10; i += 2) {
+        evloop_timer_stop(loop, &checks[i].timer);
+    }
+
+    // the loop never sleeps past the next timer
+    uint64_t next_due = UINT64_MAX;
+    for (int i = 0; i < num_timers; i++) {
+        if (checks[i].timer.pending && checks[i].due < next_due) {
+            next_due = checks[i].due;
+        }
+    }
+    int timeout = evloop_timer_timeout(loop);
+    uint64_t wake = evloop_now(loop) + timeout;
+    if (timeout < 0 || (timeout > 0 && wake > next_due)) {
+        printf(
+            "timer timeout %d sleeps past tick %llu\n", timeout,
+            (unsigned long long)next_due);
+        return 1;
+    }
+
+    while (loop->tick < max_due) {
+        clock_jump(loop, 1 + rand() % 5000);
+        evloop_timer_advance(loop, evloop_now(loop));
+    }
+
+    for (int i = 0; i < num_timers; i++) {
+        int stopped = i < 10 && i % 2 == 0;
+        if (stopped ? checks[i].fired != 0 : checks[i].fired != checks[i].due) {
+            printf(
+                "timer %d due on tick %llu fired on %llu\n", i,
+                (unsigned long long)checks[i].due,
+                (unsigned long long)checks[i].fired);
+            return 1;
+        }
+    }
+    if (loop->num_timers != 0 || loop->occupied[0] || loop->occupied[1] ||
+        loop->occupied[2] || loop->occupied[3]) {
+        printf("timers left on the wheel\n");
+        return 1;
+    }
+
+    free(checks);
+    evloop_destroy(loop);
+    return 0;
+}
+
+struct periodic {
+    struct evloop_timer timer;
+    int count;
+};
+
+void periodic_cb(struct evloop *loop, struct evloop_timer *t, void *arg) {
+    struct periodic *p = arg;
+    if (++p->count == 5) {
+        evloop_stop(loop);
+    } else {
+        evloop_timer_start(loop, t, 10);
+    }
+}
+
+// a timer restarting itself drives evloop_run until it stops the loop
+int test_run(const struct evloop_backend *backend) {
+    struct evloop *loop = evloop_create(backend);
+    struct periodic p = {0};
+    evloop_timer_init(&p.timer, periodic_cb, &p);
+    evloop_timer_start(loop, &p.timer, 10);
+
+    uint64_t start = evloop_now_ns();
+    if (evloop_run(loop) < 0) {
+        return 1;
+    }
+    uint64_t ms = (evloop_now_ns() - start) / 1000000;
+    // ticks are whole milliseconds, so allow one short
+    if (p.count != 5 || ms < 49) {
+        printf(
+            "%s: periodic timer ran %d times in %llu ms\n",
+            loop->backend->name, p.count, (unsigned long long)ms);
+        return 1;
+    }
+    evloop_destroy(loop);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int ret = test_timers(100000);
+    if (ret != 0) {
+        return ret;
+    }
+    for (int i = 0; evloop_backends[i] != NULL; i++) {
+        ret = test_fds(evloop_backends[i], 1000);
+        if (ret != 0) {
+            return ret;
+        }
+        ret = test_run(evloop_backends[i]);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
@@ -1,5 +1,5 @@
+#include "evloop.c"
 #include <fcntl.h>
-#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <sys/stat.h>
@@ -11,7 +11,8 @@ int setup_fifo(const char *fifo_name) {
         return -1;
     }
 
-    int fd = open(fifo_name, O_RDWR);
+    // O_RDWR keeps a writer open so the fifo never reads as hung up
+    int fd = open(fifo_name, O_RDWR | O_NONBLOCK);
     if (fd == -1) {
         printf("error opening %s\n", fifo_name);
     }
@@ -19,11 +20,47 @@ int setup_fifo(const char *fifo_name) {
     return fd;
 }
 
-int should_poll = 1;
+struct evloop *loop;
+int got_something;
 
-void handle_interrupt(int s) { should_poll = 0; }
+void handle_interrupt(int s) { evloop_stop(loop); }
+
+void on_fifo(struct evloop *loop, int fd, int events, void *arg) {
+    const char *name = arg;
+    char buf[256];
+    // read until the fifo is drained, edge triggered backends won't say
+    // it's ready again until more is written
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("read");
+                evloop_del(loop, fd);
+            }
+            break;
+        }
+        buf[n] = '\0';
+        printf("got from %s: %s\n", name, buf);
+        got_something = 1;
+    }
+}
+
+void on_idle(struct evloop *loop, struct evloop_timer *timer, void *arg) {
+    if (!got_something) {
+        printf("nothing ever happens.\n");
+    }
+    got_something = 0;
+    evloop_timer_start(loop, timer, 1000);
+}
 
 int main(int argc, char *argv[]) {
+    const struct evloop_backend *backend = NULL;
+    if (argc > 1 && (backend = evloop_backend_find(argv[1])) == NULL) {
+        printf("unknown backend %s\n", argv[1]);
+        return 1;
+    }
+
+    loop = evloop_create(backend);
     signal(SIGINT, handle_interrupt);
 
     int fda = setup_fifo("a.fifo");
@@ -33,36 +70,22 @@ int main(int argc, char *argv[]) {
         _exit(1);
     }
 
-    struct pollfd fds[2] = {0};
-    fds[0].fd = fda;
-    fds[0].events = POLLIN;
-    fds[1].fd = fdb;
-    fds[1].events = POLLIN;
-
-    printf("waiting for something to happen...\n");
-    while (should_poll) {
-        int ready = poll(fds, 2, 1000);
+    evloop_add(loop, fda, EVLOOP_READ, on_fifo, "a.fifo");
+    evloop_add(loop, fdb, EVLOOP_READ, on_fifo, "b.fifo");
 
-        if (ready == -1) {
-            perror("poll error");
-            break;
-        } else if (ready == 0) {
-            printf("nothing ever happens.\n");
-            continue;
-        }
+    struct evloop_timer idle;
+    evloop_timer_init(&idle, on_idle, NULL);
+    evloop_timer_start(loop, &idle, 1000);
 
-        char buf[256];
-
-        for (int i = 0; i < 2; i++) {
-            if (fds[i].revents & POLLIN) {
-                int n = read(fds[i].fd, &buf, sizeof(buf));
-                buf[n] = '\0';
-                printf("got from fd %d: %s\n", i, buf);
-            }
-        }
-    }
+    printf("waiting for something to happen (%s)...\n", loop->backend->name);
+    int ret = evloop_run(loop);
 
+    evloop_del(loop, fda);
+    evloop_del(loop, fdb);
+    close(fda);
+    close(fdb);
+    evloop_destroy(loop);
     unlink("a.fifo");
     unlink("b.fifo");
-    return 0;
+    return ret < 0 ? 1 : 0;
 }
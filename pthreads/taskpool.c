@@ -0,0 +1,588 @@
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// a work-stealing task pool. every worker thread owns a Chase-Lev deque: it
+// pushes and pops its own tasks at the bottom without locking, while idle
+// workers steal from the top. tasks spawned from outside the pool go on a
+// mutex-guarded injection list. a worker that finds no work anywhere parks
+// on a futex until a spawn wakes it.
+//
+// tasks are joined for their result. a worker joining a task runs other
+// tasks until it is done, so tasks can spawn and join subtasks freely.
+//
+// workers can be pinned to CPUs, filling one NUMA node before the next, and
+// then steal from workers on their own node first. after fork the child has
+// none of the workers, so spawns there run the task on the spot.
+
+typedef void *(*taskpool_fn)(void *arg);
+
+#define TASKPOOL_PENDING 0
+#define TASKPOOL_DONE 1
+#define TASKPOOL_WAITED 2 // pending, with a joiner asleep on it
+
+// owned by the caller from spawn until join returns
+struct taskpool_task {
+    taskpool_fn fn;
+    void *arg;
+    void *result;
+    int state;                  // TASKPOOL_*, a futex word
+    struct taskpool_task *next; // on the injection list
+};
+
+// a deque's ring of slots. a full one is replaced by one twice the size,
+// but thieves may still be reading it, so it is only retired.
+struct taskpool_array {
+    int64_t size; // a power of two
+    struct taskpool_array *retired;
+    struct taskpool_task *tasks[];
+};
+
+struct taskpool_deque {
+    _Alignas(64) int64_t top; // thieves take from here
+    _Alignas(64) int64_t bottom; // the owner pushes and pops here
+    struct taskpool_array *array;
+};
+
+struct taskpool_stats {
+    uint64_t executed;
+    uint64_t stolen; // tasks taken from other workers
+    uint64_t parked; // times a worker went to sleep
+};
+
+struct taskpool_worker {
+    struct taskpool_deque deque;
+    _Alignas(64) struct taskpool *pool;
+    pthread_t thread;
+    int index;
+    int cpu;  // pinned to, -1 for none
+    int node; // NUMA node of cpu
+    uint64_t rng;
+    struct taskpool_stats stats; // written by the worker only
+};
+
+struct taskpool_options {
+    int num_threads; // 0 for one per CPU this process may run on
+    int pin;         // pin workers to CPUs, one NUMA node at a time
+};
+
+struct taskpool {
+    struct taskpool_worker *workers;
+    int num_workers;
+    int forks; // taskpool_forks when the workers were started
+
+    pthread_mutex_t lock; // guards the injection list
+    struct taskpool_task *inject_head;
+    struct taskpool_task *inject_tail;
+    int num_injected; // read without the lock to skip empty lists
+
+    int sleepers; // workers parked or about to park
+    int wake;     // futex word, bumped to wake them
+    int stopping;
+};
+
+// the worker running on this thread, NULL outside any pool
+__thread struct taskpool_worker *taskpool_self;
+
+// bumped in the child after every fork
+int taskpool_forks;
+pthread_once_t taskpool_once = PTHREAD_ONCE_INIT;
+
+void taskpool_after_fork(void) { taskpool_forks++; }
+
+void taskpool_init_once(void) {
+    pthread_atfork(NULL, NULL, taskpool_after_fork);
+}
+
+void taskpool_futex_wait(int *addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+void taskpool_futex_wake(int *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+// bump a counter only its own worker writes
+void taskpool_count(uint64_t *counter) {
+    __atomic_store_n(
+        counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1,
+        __ATOMIC_RELAXED);
+}
+
+struct taskpool_array *
+taskpool_array_new(int64_t size, struct taskpool_array *retired) {
+    struct taskpool_array *a =
+        malloc(sizeof(*a) + size * sizeof(struct taskpool_task *));
+    a->size = size;
+    a->retired = retired;
+    return a;
+}
+
+// push at the bottom. only the owner calls this.
+void taskpool_deque_push(struct taskpool_deque *d, struct taskpool_task *t) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    struct taskpool_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    if (b - top > a->size - 1) {
+        struct taskpool_array *bigger = taskpool_array_new(2 * a->size, a);
+        for (int64_t i = top; i < b; i++) {
+            bigger->tasks[i & (bigger->size - 1)] = __atomic_load_n(
+                &a->tasks[i & (a->size - 1)], __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&d->array, bigger, __ATOMIC_RELEASE);
+        a = bigger;
+    }
+    __atomic_store_n(&a->tasks[b & (a->size - 1)], t, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+// pop the newest task from the bottom, or NULL. only the owner calls this.
+// the owner and a thief race for the last task, and the top decides.
+struct taskpool_task *taskpool_deque_take(struct taskpool_deque *d) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    struct taskpool_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b, __ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    if (top > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    struct taskpool_task *t =
+        __atomic_load_n(&a->tasks[b & (a->size - 1)], __ATOMIC_RELAXED);
+    if (top == b) {
+        if (!__atomic_compare_exchange_n(
+                &d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST,
+                __ATOMIC_RELAXED)) {
+            t = NULL;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return t;
+}
+
+// take the oldest task from the top. returns 1 with *t set, 0 if the deque
+// is empty, -1 if another thief or the owner got there first.
+int taskpool_deque_steal(struct taskpool_deque *d, struct taskpool_task **t) {
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+    if (top >= b) {
+        return 0;
+    }
+    struct taskpool_array *a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    *t = __atomic_load_n(&a->tasks[top & (a->size - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(
+            &d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    return 1;
+}
+
+struct taskpool_task *taskpool_inject_pop(struct taskpool *pool) {
+    if (__atomic_load_n(&pool->num_injected, __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->lock);
+    struct taskpool_task *t = pool->inject_head;
+    if (t != NULL) {
+        pool->inject_head = t->next;
+        if (pool->inject_head == NULL) {
+            pool->inject_tail = NULL;
+        }
+        __atomic_store_n(
+            &pool->num_injected, pool->num_injected - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return t;
+}
+
+// wake a parked worker if there is one. the fence orders the caller's push
+// before the look at sleepers, pairing with the one taskpool_park makes.
+void taskpool_notify(struct taskpool *pool) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_RELAXED) > 0) {
+        __atomic_fetch_add(&pool->wake, 1, __ATOMIC_SEQ_CST);
+        taskpool_futex_wake(&pool->wake, 1);
+    }
+}
+
+// visit every other worker once from a random start, those on the same
+// NUMA node in the first pass and the rest in the second
+struct taskpool_task *taskpool_steal(struct taskpool_worker *w) {
+    struct taskpool *pool = w->pool;
+    int n = pool->num_workers;
+    w->rng = w->rng * 6364136223846793005ULL + 1442695040888963407ULL;
+    int start = (w->rng >> 33) % n;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < n; i++) {
+            struct taskpool_worker *victim = &pool->workers[(start + i) % n];
+            if (victim == w || (victim->node == w->node) != (pass == 0)) {
+                continue;
+            }
+            struct taskpool_task *t;
+            int ret;
+            while ((ret = taskpool_deque_steal(&victim->deque, &t)) < 0) {
+            }
+            if (ret > 0) {
+                taskpool_count(&w->stats.stolen);
+                // there may be more where that came from
+                taskpool_notify(pool);
+                return t;
+            }
+        }
+    }
+    return NULL;
+}
+
+// the next task for w: its own newest, then injected ones, then stolen
+struct taskpool_task *taskpool_find(struct taskpool_worker *w) {
+    struct taskpool_task *t = taskpool_deque_take(&w->deque);
+    if (t == NULL) {
+        t = taskpool_inject_pop(w->pool);
+    }
+    if (t == NULL && w->pool->num_workers > 1) {
+        t = taskpool_steal(w);
+    }
+    return t;
+}
+
+void taskpool_run(struct taskpool_task *t) {
+    t->result = t->fn(t->arg);
+    if (__atomic_exchange_n(&t->state, TASKPOOL_DONE, __ATOMIC_ACQ_REL) ==
+        TASKPOOL_WAITED) {
+        taskpool_futex_wake(&t->state, INT_MAX);
+    }
+}
+
+void taskpool_execute(struct taskpool_worker *w, struct taskpool_task *t) {
+    taskpool_run(t);
+    taskpool_count(&w->stats.executed);
+}
+
+// sleep until a spawn. the worker counts itself a sleeper before one last
+// look for work, so a spawner either finds it to wake or has its task
+// found by that look.
+void taskpool_park(struct taskpool_worker *w) {
+    struct taskpool *pool = w->pool;
+    __atomic_fetch_add(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    int wake = __atomic_load_n(&pool->wake, __ATOMIC_SEQ_CST);
+    struct taskpool_task *t = taskpool_find(w);
+    if (t == NULL && !__atomic_load_n(&pool->stopping, __ATOMIC_SEQ_CST)) {
+        taskpool_count(&w->stats.parked);
+        taskpool_futex_wait(&pool->wake, wake);
+    }
+    __atomic_fetch_sub(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    if (t != NULL) {
+        taskpool_execute(w, t);
+    }
+}
+
+void taskpool_pin(int cpu) {
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {0};
+    int bits = 8 * sizeof(unsigned long);
+    mask[cpu / bits] |= 1UL << (cpu % bits);
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0) {
+        perror("pin worker");
+    }
+}
+
+void *taskpool_worker_main(void *arg) {
+    struct taskpool_worker *w = arg;
+    struct taskpool *pool = w->pool;
+    taskpool_self = w;
+    if (w->cpu >= 0) {
+        taskpool_pin(w->cpu);
+    }
+    // first touched here, so on the worker's own node once pinned
+    __atomic_store_n(
+        &w->deque.array, taskpool_array_new(256, NULL), __ATOMIC_RELEASE);
+
+    for (;;) {
+        struct taskpool_task *t = taskpool_find(w);
+        if (t != NULL) {
+            taskpool_execute(w, t);
+            continue;
+        }
+        if (__atomic_load_n(&pool->stopping, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+        taskpool_park(w);
+    }
+    return NULL;
+}
+
+// parse a cpulist like "0-3,8-11" into set
+void taskpool_parse_cpus(const char *list, uint8_t *set, int max) {
+    while (*list != '\0' && *list != '\n') {
+        char *end;
+        long lo = strtol(list, &end, 10);
+        long hi = lo;
+        if (end == list) {
+            return;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            hi = strtol(list, &end, 10);
+        }
+        for (long cpu = lo; cpu <= hi && cpu < max; cpu++) {
+            set[cpu] = 1;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+// the CPUs this process may run on, grouped by NUMA node, with the node of
+// each. returns how many there are.
+int taskpool_cpus(int *cpus, int *nodes, int max) {
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+    int bits = 8 * sizeof(unsigned long);
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask) < 0) {
+        memset(mask, 0xff, sizeof(mask));
+    }
+    uint8_t *taken = calloc(max, 1);
+
+    int n = 0;
+    char path[64];
+    char buf[1024];
+    for (int node = 0; node < 1024; node++) {
+        snprintf(
+            path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+            node);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        uint8_t *set = calloc(max, 1);
+        if (fgets(buf, sizeof(buf), f) != NULL) {
+            taskpool_parse_cpus(buf, set, max);
+        }
+        fclose(f);
+        for (int cpu = 0; cpu < max && cpu < 1024; cpu++) {
+            if (set[cpu] && !taken[cpu] &&
+                (mask[cpu / bits] & (1UL << (cpu % bits)))) {
+                taken[cpu] = 1;
+                cpus[n] = cpu;
+                nodes[n] = node;
+                n++;
+            }
+        }
+        free(set);
+    }
+
+    // no NUMA information, so one node of everything allowed
+    if (n == 0) {
+        for (int cpu = 0; cpu < max && cpu < 1024; cpu++) {
+            if (mask[cpu / bits] & (1UL << (cpu % bits))) {
+                cpus[n] = cpu;
+                nodes[n] = 0;
+                n++;
+            }
+        }
+    }
+    free(taken);
+    return n;
+}
+
+// start a pool. opts may be NULL for the defaults.
+struct taskpool *taskpool_create(const struct taskpool_options *opts) {
+    pthread_once(&taskpool_once, taskpool_init_once);
+
+    int cpus[1024], nodes[1024];
+    int num_cpus = taskpool_cpus(cpus, nodes, 1024);
+    int num_threads = opts != NULL ? opts->num_threads : 0;
+    if (num_threads <= 0) {
+        num_threads = num_cpus > 0 ? num_cpus : 1;
+    }
+
+    struct taskpool *pool = calloc(1, sizeof(struct taskpool));
+    pool->num_workers = num_threads;
+    pool->forks = taskpool_forks;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->workers =
+        aligned_alloc(64, num_threads * sizeof(struct taskpool_worker));
+    memset(pool->workers, 0, num_threads * sizeof(struct taskpool_worker));
+
+    for (int i = 0; i < num_threads; i++) {
+        struct taskpool_worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        w->cpu = -1;
+        w->rng = i + 1;
+        if (opts != NULL && opts->pin && num_cpus > 0) {
+            w->cpu = cpus[i % num_cpus];
+            w->node = nodes[i % num_cpus];
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        struct taskpool_worker *w = &pool->workers[i];
+        if (pthread_create(&w->thread, NULL, taskpool_worker_main, w) != 0) {
+            perror("start worker");
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+// stop the workers and free the pool. every task must have been joined.
+void taskpool_destroy(struct taskpool *pool) {
+    __atomic_store_n(&pool->stopping, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&pool->wake, 1, __ATOMIC_SEQ_CST);
+    taskpool_futex_wake(&pool->wake, INT_MAX);
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < pool->num_workers; i++) {
+        struct taskpool_array *a = pool->workers[i].deque.array;
+        while (a != NULL) {
+            struct taskpool_array *retired = a->retired;
+            free(a);
+            a = retired;
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+// queue fn(arg) on the pool. t stays the caller's and must be joined.
+// a worker's spawns go on its own deque, anyone else's are injected.
+void taskpool_spawn(
+    struct taskpool *pool, struct taskpool_task *t, taskpool_fn fn,
+    void *arg) {
+    t->fn = fn;
+    t->arg = arg;
+    t->result = NULL;
+    t->state = TASKPOOL_PENDING;
+    t->next = NULL;
+
+    // the workers didn't survive a fork
+    if (pool->forks != taskpool_forks) {
+        taskpool_run(t);
+        return;
+    }
+
+    struct taskpool_worker *w = taskpool_self;
+    if (w != NULL && w->pool == pool) {
+        taskpool_deque_push(&w->deque, t);
+    } else {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->inject_tail != NULL) {
+            pool->inject_tail->next = t;
+        } else {
+            pool->inject_head = t;
+        }
+        pool->inject_tail = t;
+        __atomic_store_n(
+            &pool->num_injected, pool->num_injected + 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    taskpool_notify(pool);
+}
+
+// wait for t and return what it returned. a worker runs other tasks in
+// the meantime, and only sleeps if there are none and t is still running.
+void *taskpool_join(struct taskpool *pool, struct taskpool_task *t) {
+    struct taskpool_worker *w = taskpool_self;
+    if (w != NULL && w->pool != pool) {
+        w = NULL;
+    }
+
+    int idle = 0;
+    while (__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) != TASKPOOL_DONE) {
+        if (w != NULL) {
+            struct taskpool_task *other = taskpool_find(w);
+            if (other != NULL) {
+                taskpool_execute(w, other);
+                idle = 0;
+                continue;
+            }
+            // t is running elsewhere and may yet spawn work to help with
+            if (++idle < 64) {
+                sched_yield();
+                continue;
+            }
+        }
+        int pending = TASKPOOL_PENDING;
+        if (__atomic_compare_exchange_n(
+                &t->state, &pending, TASKPOOL_WAITED, 0, __ATOMIC_ACQ_REL,
+                __ATOMIC_ACQUIRE) ||
+            pending == TASKPOOL_WAITED) {
+            taskpool_futex_wait(&t->state, TASKPOOL_WAITED);
+        }
+    }
+    return t->result;
+}
+
+typedef void (*taskpool_range_fn)(void *ctx, int64_t lo, int64_t hi);
+
+struct taskpool_range {
+    struct taskpool *pool;
+    taskpool_range_fn fn;
+    void *ctx;
+    int64_t lo;
+    int64_t hi;
+    int64_t grain;
+};
+
+// halve the range until it is no more than grain, handing the upper halves
+// out for stealing
+void *taskpool_range_run(void *arg) {
+    struct taskpool_range *r = arg;
+    if (r->hi - r->lo <= r->grain) {
+        r->fn(r->ctx, r->lo, r->hi);
+        return NULL;
+    }
+    struct taskpool_range upper = *r;
+    struct taskpool_range lower = *r;
+    upper.lo = lower.hi = r->lo + (r->hi - r->lo) / 2;
+    struct taskpool_task t;
+    taskpool_spawn(r->pool, &t, taskpool_range_run, &upper);
+    taskpool_range_run(&lower);
+    taskpool_join(r->pool, &t);
+    return NULL;
+}
+
+// call fn over [lo, hi) in pieces of at most grain indices, in parallel,
+// and return once every piece is done
+void taskpool_for(
+    struct taskpool *pool, int64_t lo, int64_t hi, int64_t grain,
+    taskpool_range_fn fn, void *ctx) {
+    struct taskpool_range r = {
+        .pool = pool,
+        .fn = fn,
+        .ctx = ctx,
+        .lo = lo,
+        .hi = hi,
+        .grain = grain > 0 ? grain : 1,
+    };
+    if (hi <= lo) {
+        return;
+    }
+    struct taskpool_worker *w = taskpool_self;
+    if (w != NULL && w->pool == pool) {
+        taskpool_range_run(&r);
+        return;
+    }
+    // split on the workers rather than injecting every half from here
+    struct taskpool_task t;
+    taskpool_spawn(pool, &t, taskpool_range_run, &r);
+    taskpool_join(pool, &t);
+}
+
+// totals over every worker, a moving target while the pool is busy
+void taskpool_get_stats(struct taskpool *pool, struct taskpool_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < pool->num_workers; i++) {
+        struct taskpool_stats *s = &pool->workers[i].stats;
+        stats->executed += __atomic_load_n(&s->executed, __ATOMIC_RELAXED);
+        stats->stolen += __atomic_load_n(&s->stolen, __ATOMIC_RELAXED);
+        stats->parked += __atomic_load_n(&s->parked, __ATOMIC_RELAXED);
+    }
+}
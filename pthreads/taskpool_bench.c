@@ -0,0 +1,243 @@
+#include "taskpool.c"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// runs many tiny tasks through a single mutex-guarded queue, as in
+// pthreads.c, and through the work-stealing pool, and reports tasks/s
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int work_iters = 100; // per task
+
+// a little arithmetic the compiler can't drop
+uint64_t spin(uint64_t x) {
+    for (int i = 0; i < work_iters; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+    return x;
+}
+
+uint64_t sink;
+
+// the pthreads.c approach: one lock around a shared queue of task indices
+// and a count of tasks finished
+struct mutex_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t finished;
+    int64_t next;  // next task to hand out
+    int64_t total; // tasks queued so far
+    int64_t done;
+    int stopping;
+};
+
+void *mutex_worker(void *arg) {
+    struct mutex_queue *q = arg;
+    uint64_t acc = 0;
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->next == q->total && !q->stopping) {
+            pthread_cond_wait(&q->ready, &q->lock);
+        }
+        if (q->next == q->total) {
+            break;
+        }
+        int64_t task = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        acc += spin(task + 1);
+        pthread_mutex_lock(&q->lock);
+        if (++q->done == q->total) {
+            pthread_cond_signal(&q->finished);
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    __atomic_fetch_add(&sink, acc, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+double bench_mutex(int num_threads, int64_t num_tasks) {
+    struct mutex_queue q = {0};
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.ready, NULL);
+    pthread_cond_init(&q.finished, NULL);
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, mutex_worker, &q);
+    }
+
+    uint64_t start = now_ns();
+    for (int64_t i = 0; i < num_tasks; i++) {
+        pthread_mutex_lock(&q.lock);
+        q.total++;
+        pthread_cond_signal(&q.ready);
+        pthread_mutex_unlock(&q.lock);
+    }
+    pthread_mutex_lock(&q.lock);
+    while (q.done < num_tasks) {
+        pthread_cond_wait(&q.finished, &q.lock);
+    }
+    q.stopping = 1;
+    pthread_cond_broadcast(&q.ready);
+    pthread_mutex_unlock(&q.lock);
+    double secs = (now_ns() - start) / 1e9;
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return num_tasks / secs;
+}
+
+void *spin_task(void *arg) {
+    __atomic_fetch_add(&sink, spin((uintptr_t)arg + 1), __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// every task spawned from outside the pool, so through the injection list
+double bench_inject(struct taskpool *pool, int64_t num_tasks) {
+    int batch = 4096;
+    struct taskpool_task *tasks = malloc(batch * sizeof(struct taskpool_task));
+    uint64_t start = now_ns();
+    for (int64_t i = 0; i < num_tasks; i += batch) {
+        int n = num_tasks - i < batch ? num_tasks - i : batch;
+        for (int j = 0; j < n; j++) {
+            taskpool_spawn(pool, &tasks[j], spin_task, (void *)(i + j));
+        }
+        for (int j = 0; j < n; j++) {
+            taskpool_join(pool, &tasks[j]);
+        }
+    }
+    double secs = (now_ns() - start) / 1e9;
+    free(tasks);
+    return num_tasks / secs;
+}
+
+void spin_range(void *ctx, int64_t lo, int64_t hi) {
+    uint64_t acc = 0;
+    for (int64_t i = lo; i < hi; i++) {
+        acc += spin(i + 1);
+    }
+    __atomic_fetch_add(&sink, acc, __ATOMIC_RELAXED);
+}
+
+// one task per index, split recursively across the deques
+double bench_for(struct taskpool *pool, int64_t num_tasks) {
+    uint64_t start = now_ns();
+    taskpool_for(pool, 0, num_tasks, 1, spin_range, NULL);
+    return num_tasks / ((now_ns() - start) / 1e9);
+}
+
+struct fib {
+    struct taskpool *pool;
+    int n;
+};
+
+// every call but the leaves spawns one child and joins it
+void *fib_task(void *arg) {
+    struct fib *f = arg;
+    if (f->n < 2) {
+        spin(f->n + 1);
+        return (void *)(intptr_t)f->n;
+    }
+    struct fib a = {f->pool, f->n - 1};
+    struct fib b = {f->pool, f->n - 2};
+    struct taskpool_task t;
+    taskpool_spawn(f->pool, &t, fib_task, &a);
+    intptr_t rb = (intptr_t)fib_task(&b);
+    intptr_t ra = (intptr_t)taskpool_join(f->pool, &t);
+    return (void *)(ra + rb);
+}
+
+double bench_fib(struct taskpool *pool, int n, int64_t *num_tasks) {
+    // fib(n) makes 2 fib(n + 1) - 1 calls
+    int64_t a = 0, b = 1;
+    for (int i = 0; i < n + 1; i++) {
+        int64_t c = a + b;
+        a = b;
+        b = c;
+    }
+    *num_tasks = 2 * a - 1;
+
+    struct fib f = {pool, n};
+    struct taskpool_task t;
+    uint64_t start = now_ns();
+    taskpool_spawn(pool, &t, fib_task, &f);
+    taskpool_join(pool, &t);
+    return *num_tasks / ((now_ns() - start) / 1e9);
+}
+
+void usage(const char *prog) {
+    printf(
+        "usage: %s [-t threads] [-n tasks] [-w work per task] [-f fib n] "
+        "[-p]\n",
+        prog);
+}
+
+int main(int argc, char *argv[]) {
+    struct taskpool_options opts = {0};
+    int64_t num_tasks = 1000000;
+    int fib_n = 25;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:w:f:ph")) != -1) {
+        switch (opt) {
+        case 't':
+            opts.num_threads = atoi(optarg);
+            break;
+        case 'n':
+            num_tasks = atoll(optarg);
+            break;
+        case 'w':
+            work_iters = atoi(optarg);
+            break;
+        case 'f':
+            fib_n = atoi(optarg);
+            break;
+        case 'p':
+            opts.pin = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (num_tasks < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct taskpool *pool = taskpool_create(&opts);
+    int num_threads = pool->num_workers;
+    printf(
+        "%d threads%s, %d iterations of work per task\n", num_threads,
+        opts.pin ? " pinned" : "", work_iters);
+
+    int64_t fib_tasks;
+    double mutex = bench_mutex(num_threads, num_tasks);
+    double inject = bench_inject(pool, num_tasks);
+    double each = bench_for(pool, num_tasks);
+    double fib = bench_fib(pool, fib_n, &fib_tasks);
+
+    struct taskpool_stats stats;
+    taskpool_get_stats(pool, &stats);
+    printf("%-24s %12.0f tasks/s\n", "mutex queue", mutex);
+    printf("%-24s %12.0f tasks/s\n", "pool, spawned outside", inject);
+    printf("%-24s %12.0f tasks/s\n", "pool, parallel for", each);
+    printf(
+        "%-24s %12.0f tasks/s (%lld tasks)\n", "pool, fork-join fib", fib,
+        (long long)fib_tasks);
+    printf(
+        "pool ran %llu tasks, %llu stolen, parked %llu times\n",
+        (unsigned long long)stats.executed, (unsigned long long)stats.stolen,
+        (unsigned long long)stats.parked);
+    taskpool_destroy(pool);
+    return 0;
+}
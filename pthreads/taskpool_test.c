@@ -0,0 +1,229 @@
+#include "taskpool.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+
+struct fib {
+    struct taskpool *pool;
+    int n;
+    long result;
+};
+
+// spawn one half and compute the other, so joins nest deeply
+void *fib_task(void *arg) {
+    struct fib *f = arg;
+    if (f->n < 2) {
+        f->result = f->n;
+        return f;
+    }
+    struct fib a = {f->pool, f->n - 1, 0};
+    struct fib b = {f->pool, f->n - 2, 0};
+    struct taskpool_task t;
+    taskpool_spawn(f->pool, &t, fib_task, &a);
+    fib_task(&b);
+    if (taskpool_join(f->pool, &t) != &a) {
+        printf("join returned the wrong result\n");
+        exit(1);
+    }
+    f->result = a.result + b.result;
+    return f;
+}
+
+int test_fib(struct taskpool *pool, int n, long want) {
+    struct fib f = {pool, n, 0};
+    struct taskpool_task t;
+    taskpool_spawn(pool, &t, fib_task, &f);
+    taskpool_join(pool, &t);
+    if (f.result != want) {
+        printf("fib(%d) = %ld, expected %ld\n", n, f.result, want);
+        return 1;
+    }
+    return 0;
+}
+
+void count_range(void *ctx, int64_t lo, int64_t hi) {
+    int *counts = ctx;
+    for (int64_t i = lo; i < hi; i++) {
+        __atomic_fetch_add(&counts[i], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// every index visited exactly once, whatever the grain
+int test_for(struct taskpool *pool, int n) {
+    int *counts = calloc(n, sizeof(int));
+    int grains[] = {1, 7, 1000, n};
+    for (int g = 0; g < 4; g++) {
+        memset(counts, 0, n * sizeof(int));
+        taskpool_for(pool, 0, n, grains[g], count_range, counts);
+        for (int i = 0; i < n; i++) {
+            if (counts[i] != 1) {
+                printf(
+                    "grain %d: index %d visited %d times\n", grains[g], i,
+                    counts[i]);
+                return 1;
+            }
+        }
+    }
+    // an empty range calls nothing
+    taskpool_for(pool, 5, 5, 1, count_range, NULL);
+    free(counts);
+    return 0;
+}
+
+void *square_task(void *arg) {
+    intptr_t x = (intptr_t)arg;
+    return (void *)(x * x);
+}
+
+// many more tasks than a deque starts with, pushed before any is joined
+void *spawn_many_task(void *arg) {
+    struct taskpool *pool = arg;
+    int n = 10000;
+    struct taskpool_task *tasks = malloc(n * sizeof(struct taskpool_task));
+    for (int i = 0; i < n; i++) {
+        taskpool_spawn(pool, &tasks[i], square_task, (void *)(intptr_t)i);
+    }
+    intptr_t bad = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        intptr_t r = (intptr_t)taskpool_join(pool, &tasks[i]);
+        bad += r != (intptr_t)i * i;
+    }
+    free(tasks);
+    return (void *)bad;
+}
+
+int test_spawn_many(struct taskpool *pool) {
+    struct taskpool_task t;
+    taskpool_spawn(pool, &t, spawn_many_task, pool);
+    if (taskpool_join(pool, &t) != NULL) {
+        printf("tasks spawned in bulk returned the wrong results\n");
+        return 1;
+    }
+    return 0;
+}
+
+struct injector {
+    struct taskpool *pool;
+    int bad;
+};
+
+void *inject_thread(void *arg) {
+    struct injector *inj = arg;
+    struct taskpool_task tasks[64];
+    for (int round = 0; round < 100; round++) {
+        for (int i = 0; i < 64; i++) {
+            taskpool_spawn(
+                inj->pool, &tasks[i], square_task, (void *)(intptr_t)i);
+        }
+        for (int i = 0; i < 64; i++) {
+            if ((intptr_t)taskpool_join(inj->pool, &tasks[i]) != i * i) {
+                inj->bad++;
+            }
+        }
+    }
+    return NULL;
+}
+
+// threads outside the pool spawning and joining at once
+int test_inject(struct taskpool *pool, int num_threads) {
+    pthread_t threads[16];
+    struct injector injectors[16];
+    for (int i = 0; i < num_threads; i++) {
+        injectors[i].pool = pool;
+        injectors[i].bad = 0;
+        pthread_create(&threads[i], NULL, inject_thread, &injectors[i]);
+    }
+    int bad = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        bad += injectors[i].bad;
+    }
+    if (bad > 0) {
+        printf("%d injected tasks returned the wrong result\n", bad);
+        return 1;
+    }
+    return 0;
+}
+
+// idle workers park, and the next spawn still gets run
+int test_park(struct taskpool *pool) {
+    struct timespec pause = {0, 10 * 1000000};
+    nanosleep(&pause, NULL);
+    struct taskpool_stats before;
+    taskpool_get_stats(pool, &before);
+    if (before.parked == 0) {
+        printf("idle workers never parked\n");
+        return 1;
+    }
+    for (int i = 0; i < 100; i++) {
+        struct taskpool_task t;
+        taskpool_spawn(pool, &t, square_task, (void *)3);
+        if ((intptr_t)taskpool_join(pool, &t) != 9) {
+            printf("task after parking returned the wrong result\n");
+            return 1;
+        }
+        if (i % 10 == 0) {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return 0;
+}
+
+// the child of a fork has no workers, so its tasks run on the spot
+int test_fork(struct taskpool *pool) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(test_fib(pool, 15, 610));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("tasks failed after fork\n");
+        return 1;
+    }
+    return 0;
+}
+
+int test_pool(int num_threads, int pin) {
+    struct taskpool_options opts = {.num_threads = num_threads, .pin = pin};
+    struct taskpool *pool = taskpool_create(&opts);
+
+    int ret = test_fib(pool, 25, 75025);
+    if (ret == 0) {
+        ret = test_for(pool, 100000);
+    }
+    if (ret == 0) {
+        ret = test_spawn_many(pool);
+    }
+    if (ret == 0) {
+        ret = test_inject(pool, 4);
+    }
+    if (ret == 0) {
+        ret = test_park(pool);
+    }
+    if (ret == 0) {
+        ret = test_fork(pool);
+    }
+
+    struct taskpool_stats stats;
+    taskpool_get_stats(pool, &stats);
+    if (ret == 0 && num_threads > 1 && stats.stolen == 0) {
+        printf("%d workers never stole a task\n", num_threads);
+        ret = 1;
+    }
+    taskpool_destroy(pool);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    int ret = test_pool(1, 0);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = test_pool(4, 0);
+    if (ret != 0) {
+        return ret;
+    }
+    return test_pool(4, 1);
+}